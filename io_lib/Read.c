@@ -210,13 +210,27 @@ Read *read_reading(char *fn, int format) {
  *   NULLRead for failure
  */
 Read *mfread_reading(mFILE *fp, char *fn, int format) {
+    int method = 0;
+    Read *read = mfread_reading_method(fp, fn, format, &method);
+
+    set_compression_method(method);
+    return read;
+}
+
+/*
+ * As mfread_reading, but the compression method of the input (see
+ * compress.h) is returned in *method instead of being recorded as the
+ * last used compression method. This makes it safe to use from several
+ * threads at once.
+ */
+Read *mfread_reading_method(mFILE *fp, char *fn, int format, int *method) {
     Read *read;
     mFILE *newfp;
 
     if (!fn)
 	fn = "(unknown)";
 
-    newfp = freopen_compressed(fp, NULL);
+    newfp = freopen_compressed_method(fp, method);
     if (newfp != fp) {
 	fp = newfp;
     } else {
@@ -342,6 +356,14 @@ Read *fread_reading(FILE *fp, char *fn, int format) {
  *  -1 for failure
  */
 int mfwrite_reading(mFILE *fp, Read *read, int format) {
+    return mfwrite_reading_method(fp, read, format, get_compression_method());
+}
+
+/*
+ * As mfwrite_reading, but compressing the output with 'method' (see
+ * compress.h) instead of the last used compression method.
+ */
+int mfwrite_reading_method(mFILE *fp, Read *read, int format, int method) {
     int r = -1;
     int no_compress = 0;
 
@@ -446,7 +468,7 @@ int mfwrite_reading(mFILE *fp, Read *read, int format) {
 
     mftruncate(fp, -1);
     if (r == 0 && !no_compress) {
-	fcompress_file(fp);
+	fcompress_file_method(fp, method);
     }
     mfflush(fp);
 
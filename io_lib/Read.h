@@ -227,6 +227,7 @@ typedef struct
 Read *read_reading(char *fn, int format);
 Read *fread_reading(FILE *fp, char *fn, int format);
 Read *mfread_reading(mFILE *fp, char *fn, int format);
+Read *mfread_reading_method(mFILE *fp, char *fn, int format, int *method);
 
 
 /*
@@ -240,6 +241,7 @@ Read *mfread_reading(mFILE *fp, char *fn, int format);
 int write_reading(char *fn, Read *read, int format);
 int fwrite_reading(FILE *fp, Read *read, int format);
 int mfwrite_reading(mFILE *fp, Read *read, int format);
+int mfwrite_reading_method(mFILE *fp, Read *read, int format, int method);
 
 
 /* ----- Utility routines ----- */
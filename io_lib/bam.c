@@ -61,6 +61,8 @@
 #include "io_lib/thread_pool.h"
 #include "io_lib/crc32.h"
 #include "io_lib/bgzip.h"
+#include "io_lib/hash_table.h"
+#include "io_lib/mFILE.h"
 
 // On later gcc releases the ALLOW_UAC code causes the vectorizor to
 // use aligned SIMD instructions on unaligned memory access.  This is due
@@ -129,8 +131,11 @@ typedef uint32_t uint32_u;
 
 static int bam_more_input(bam_file_t *b);
 static int bam_uncompress_input(bam_file_t *b);
+static void bgzf_decode_job_free(void *job);
 static int reg2bin(int start, int end);
 static int bgzf_block_write(bam_file_t *bf, int level, const void *buf, size_t count);
+static int bam_index_save(bam_index_t *idx, SAM_hdr *h);
+static void bam_index_destroy(bam_index_t *idx);
 static int bgzf_write(bam_file_t *bf, int level, const void *buf, size_t count);
 static int bgzf_write_mt(bam_file_t *bf, int level, const void *buf, size_t count);
 #ifdef USE_MT
@@ -439,11 +444,18 @@ static void bam_file_init(bam_file_t *b) {
     b->eof      = 0;
     b->nd_jobs    = 0;
     b->ne_jobs    = 0;
+    b->djob       = NULL;
+    pthread_mutex_init(&b->dlock, NULL);
+    pthread_cond_init(&b->dcond, NULL);
+    b->dbound.valid = 0;
+    b->dseq_next  = 0;
+    b->dseq_done  = 0;
     b->idx = NULL;
     b->current_block = 0;
     b->bgbuf_p = b->bgbuf;
     b->bgbuf_sz = 0;
     b->idx_fn = NULL;
+    b->bidx = NULL;
 }
 
 /*! Opens a SAM or BAM file.
@@ -627,6 +639,13 @@ int bam_close(bam_file_t *b) {
     if (b->fp)
 	r = fclose(b->fp);
 
+    if (b->bidx) {
+	/* All BGZF blocks are written now, so offsets are known */
+	if ((b->mode & O_WRONLY) && bam_index_save(b->bidx, b->header))
+	    r = -1;
+	bam_index_destroy(b->bidx);
+    }
+
     if (b->idx) {
 	if ((b->mode == O_RDONLY) && b->idx_fn) {
 	    gzi_index_dump(b->idx, b->idx_fn, NULL);
@@ -655,6 +674,10 @@ int bam_close(bam_file_t *b) {
     if (b->dqueue)
 	t_results_queue_destroy(b->dqueue);
 
+    bgzf_decode_job_free(b->djob);
+    pthread_mutex_destroy(&b->dlock);
+    pthread_cond_destroy(&b->dcond);
+
     free(b);
 
     return r;
@@ -690,18 +713,39 @@ typedef struct {
     unsigned char uncomp[Z_BUFF_SIZE];
     size_t comp_sz, uncomp_sz;
     int ignore_chksum;
+
+    /* Records parsed from uncomp by the decoding thread */
+    bam_file_t *b;
+    int seq;                 /* job number, for passing on bam_boundary_t */
+    bam_seq_t **recs;
+    int nrec, rec_idx;
+    size_t rec_off;          /* offset of recs[rec_idx] in uncomp */
 } bgzf_decode_job;
-static bgzf_decode_job *last_job = NULL;
+
+static void bgzf_decode_job_free(void *job) {
+    bgzf_decode_job *j = (bgzf_decode_job *)job;
+    int i;
+
+    if (!j)
+	return;
+
+    for (i = j->rec_idx; i < j->nrec; i++)
+	free(j->recs[i]);
+    free(j->recs);
+    free(j);
+}
 
 
 /*
  * Uncompresses a single zlib buffer.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
  */
 #ifdef HAVE_LIBDEFLATE
-void *bgzf_decode_thread(void *arg) {
-    bgzf_decode_job *j = (bgzf_decode_job *)arg;
+static int bgzf_inflate_job(bgzf_decode_job *j) {
     struct libdeflate_decompressor *z = libdeflate_alloc_decompressor();
-    if (!z) return NULL;
+    if (!z) return -1;
 
     int err = libdeflate_deflate_decompress(z, j->comp, j->comp_sz,
 					    j->uncomp, Z_BUFF_SIZE, &j->uncomp_sz);
@@ -709,7 +753,7 @@ void *bgzf_decode_thread(void *arg) {
     libdeflate_free_decompressor(z);
     if (err != LIBDEFLATE_SUCCESS) {
 	fprintf(stderr, "Libdeflate returned error code %d\n", err);
-	return NULL;
+	return -1;
     }
 
     if (!j->ignore_chksum) {
@@ -720,15 +764,14 @@ void *bgzf_decode_thread(void *arg) {
 	if (crc1 != crc2) {
 	    fprintf(stderr, "Invalid CRC in Deflate stream: %08x vs %08x\n",
 		    crc1, crc2);
-	    return NULL;
+	    return -1;
 	}
     }
 
-    return j;
+    return 0;
 }
 #else
-void *bgzf_decode_thread(void *arg) {
-    bgzf_decode_job *j = (bgzf_decode_job *)arg;
+static int bgzf_inflate_job(bgzf_decode_job *j) {
     int err;
     z_stream s;
 
@@ -747,7 +790,7 @@ void *bgzf_decode_thread(void *arg) {
 
     if (err != Z_STREAM_END) {
 	fprintf(stderr, "Inflate returned error code %d\n", err);
-	return NULL;
+	return -1;
     }
 
     if (!j->ignore_chksum) {
@@ -758,15 +801,189 @@ void *bgzf_decode_thread(void *arg) {
 	if (crc1 != crc2) {
 	    fprintf(stderr, "Invalid CRC in Deflate stream: %08x vs %08x\n",
 		    crc1, crc2);
-	    return NULL;
+	    return -1;
 	}
     }
 
     j->uncomp_sz  = s.total_out;
 
-    return j;
+    return 0;
+}
+#endif
+
+/*
+ * Steps through the record lengths in a decoded block, starting from
+ * the boundary left by the previous block, and updates bnd to the
+ * boundary for the next block.
+ *
+ * Returns the number of whole records in the block, starting at *first.
+ */
+static int bam_boundary_walk(bam_boundary_t *bnd, const unsigned char *data,
+			     size_t size, size_t *first) {
+    size_t pos = 0;
+    int32_t len;
+    int nrec = 0;
+
+    *first = size;
+    if (!bnd->valid)
+	return 0;
+
+    /* A record length split over the previous block and this one */
+    if (bnd->nlen) {
+	while (bnd->nlen < 4 && pos < size)
+	    bnd->len[bnd->nlen++] = data[pos++];
+	if (bnd->nlen < 4)
+	    return 0;
+	memcpy(&len, bnd->len, 4);
+	len = le_int4(len);
+	if (len < 33) {
+	    bnd->valid = 0;
+	    return 0;
+	}
+	bnd->nlen = 0;
+	bnd->skip = len;
+    }
+
+    /* The remainder of a record started in an earlier block */
+    if (bnd->skip >= size - pos) {
+	bnd->skip -= size - pos;
+	return 0;
+    }
+    pos += bnd->skip;
+    bnd->skip = 0;
+    *first = pos;
+
+    while (size - pos >= 4) {
+	memcpy(&len, data + pos, 4);
+	len = le_int4(len);
+	if (len < 33) {
+	    bnd->valid = 0;
+	    return nrec;
+	}
+	if (len > size - pos - 4) {
+	    bnd->skip = len - (size - pos - 4);
+	    return nrec;
+	}
+	pos += len + 4;
+	nrec++;
+    }
+
+    bnd->nlen = size - pos;
+    memcpy(bnd->len, data + pos, bnd->nlen);
+    return nrec;
+}
+
+/*
+ * Fills out the fixed fields of a bam_seq_t from the raw little-endian
+ * record already copied into bs->ref onwards.
+ */
+static void bam_decode_fixed(bam_seq_t *bs, int32_t blk_size) {
+    uint32_t i32;
+
+    bs->blk_size  = blk_size;
+    bs->ref       = le_int4(bs->ref);
+    bs->pos       = le_int4(bs->pos_32);
+
+    // order of bit-fields in struct is platform specific, so manually decode
+    i32           = le_int4(bs->bin_packed);
+    bs->bin      = i32 >> 16;
+    bs->map_qual = (i32 >> 8) & 0xff;
+    bs->name_len = i32 & 0xff;
+
+    i32           = le_int4(bs->flag_packed);
+    bs->flag      = i32 >> 16;
+    bs->cigar_len = i32 & 0xffff;
+
+    bs->len       = le_int4(bs->len);
+    bs->mate_ref  = le_int4(bs->mate_ref);
+    bs->mate_pos  = le_int4(bs->mate_pos_32);
+    bs->ins_size  = le_int4(bs->ins_size_32);
 }
+
+/*
+ * Finds the whole BAM records in a decoded block and, where the
+ * bam_seq_t layout allows it, parses them into j->recs so bam_get_seq
+ * only needs to hand them out.
+ *
+ * Jobs take turns, in the order they were issued, to find their first
+ * record from the boundary left by the previous job.
+ */
+static void bam_parse_job(bgzf_decode_job *j, int ok) {
+    bam_file_t *b = j->b;
+    size_t pos;
+    int n;
+
+    pthread_mutex_lock(&b->dlock);
+    while (b->dseq_done != j->seq)
+	pthread_cond_wait(&b->dcond, &b->dlock);
+    if (ok) {
+	n = bam_boundary_walk(&b->dbound, j->uncomp, j->uncomp_sz, &pos);
+    } else {
+	b->dbound.valid = 0;
+	n = 0;
+    }
+    b->dseq_done++;
+    pthread_cond_broadcast(&b->dcond);
+    pthread_mutex_unlock(&b->dlock);
+
+#ifdef ALLOW_UAC
+    if (n && (j->recs = malloc(n * sizeof(*j->recs)))) {
+	int i;
+
+	j->rec_off = pos;
+	for (i = 0; i < n; i++) {
+	    int32_t blk_size;
+	    bam_seq_t *bs;
+
+	    memcpy(&blk_size, j->uncomp + pos, 4);
+	    blk_size = le_int4(blk_size);
+
+	    /* 44 extra is for bs->alloc to bs->cigar_len plus next_len */
+	    if (!(bs = malloc(blk_size+44)))
+		break;
+	    bs->alloc = blk_size+44;
+	    memcpy(&bs->ref, j->uncomp + pos + 4, blk_size);
+	    ((char *)(&bs->ref))[blk_size] = 0;
+	    bam_decode_fixed(bs, blk_size);
+
+	    if (10 == be_int4(10)) {
+		int k, cigar_len = bam_cigar_len(bs);
+		uint32_t *cigar = bam_cigar(bs);
+		for (k = 0; k < cigar_len; k++) {
+		    cigar[k] = le_int4(cigar[k]);
+		}
+	    }
+
+	    j->recs[i] = bs;
+	    pos += blk_size + 4;
+	}
+	j->nrec = i;
+    }
 #endif
+}
+
+void *bgzf_decode_thread(void *arg) {
+    bgzf_decode_job *j = (bgzf_decode_job *)arg;
+    int ok = bgzf_inflate_job(j) == 0;
+
+    if (j->b)
+	bam_parse_job(j, ok);
+
+    return ok ? j : NULL;
+}
+
+/*
+ * Sets the record boundary the first decoding job starts from, given
+ * whatever is left of the block already decoded on this thread.
+ */
+static void bam_boundary_init(bam_file_t *b) {
+    size_t first;
+
+    b->dbound.valid = b->bam && b->gzip;
+    b->dbound.skip  = b->next_len > 0 ? b->next_len : 0;
+    b->dbound.nlen  = 0;
+    bam_boundary_walk(&b->dbound, b->uncomp_p, b->uncomp_sz, &first);
+}
 
 /*
  * Converts compressed input to the uncompressed output buffer
@@ -886,6 +1103,10 @@ static int bam_uncompress_input(bam_file_t *b) {
 		memcpy(j->comp, b->comp_p, bsize+8);
 		j->comp_sz = bsize;
 		j->ignore_chksum = b->ignore_chksum;
+		j->b = b;
+		j->seq = b->dseq_next++;
+		j->recs = NULL;
+		j->nrec = j->rec_idx = 0;
 
 		b->comp_p  += bsize + 8; // crc & isize
 		b->comp_sz -= bsize + 8; // crc & isize
@@ -928,15 +1149,9 @@ static int bam_uncompress_input(bam_file_t *b) {
 
 	j = (bgzf_decode_job *)res->data;
 
-#if 0
-	memcpy(b->uncomp, j->uncomp, j->uncomp_sz);
-	b->uncomp_p = b->uncomp;
-#else
-	if (last_job)
-	    free(last_job);
-	last_job = j;
+	bgzf_decode_job_free(b->djob);
+	b->djob = j;
 	b->uncomp_p = j->uncomp;
-#endif
 	b->uncomp_sz = j->uncomp_sz;
 	t_pool_delete_result(res, 0);
 	if (b->idx){
@@ -1124,6 +1339,107 @@ static int bam_uncompress_input(bam_file_t *b) {
 
 }
 
+/*
+ * Sequence and quality conversion kernels, shared by the SAM parser,
+ * the SAM writer and the CRAM encoder and decoder.
+ */
+
+/*
+ * ASCII base to 4-bit code.
+ *
+ * cp = "=ACMGRSVTWYHKDBN";
+ * memset(L, 15, 256);
+ * for (i = 0; i < 16; i++) {
+ *     L[cp[i]] = L[tolower(cp[i])] = i;
+ * }
+ */
+static const unsigned char base2code[256] = {
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 00 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 10 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 20 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15, 0,15,15, /* 30 */
+    15, 1,14, 2,13,15,15, 4, 11,15,15,12,15, 3,15,15, /* 40 */
+    15,15, 5, 6, 8,15, 7, 9, 15,10,15,15,15,15,15,15, /* 50 */
+    15, 1,14, 2,13,15,15, 4, 11,15,15,12,15, 3,15,15, /* 60 */
+    15,15, 5, 6, 8,15, 7, 9, 15,10,15,15,15,15,15,15, /* 70 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 80 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 90 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* a0 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* b0 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* c0 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* d0 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* e0 */
+    15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15};/* f0 */
+
+/*
+ * Packed byte (two 4-bit codes) to a pair of ASCII bases.  Stored as
+ * chars rather than uint16_t so it is independent of byte order.
+ */
+static const char code2base[512] =
+	"===A=C=M=G=R=S=V=T=W=Y=H=K=D=B=N"
+	"A=AAACAMAGARASAVATAWAYAHAKADABAN"
+	"C=CACCCMCGCRCSCVCTCWCYCHCKCDCBCN"
+	"M=MAMCMMMGMRMSMVMTMWMYMHMKMDMBMN"
+	"G=GAGCGMGGGRGSGVGTGWGYGHGKGDGBGN"
+	"R=RARCRMRGRRRSRVRTRWRYRHRKRDRBRN"
+	"S=SASCSMSGSRSSSVSTSWSYSHSKSDSBSN"
+	"V=VAVCVMVGVRVSVVVTVWVYVHVKVDVBVN"
+	"T=TATCTMTGTRTSTVTTTWTYTHTKTDTBTN"
+	"W=WAWCWMWGWRWSWVWTWWWYWHWKWDWBWN"
+	"Y=YAYCYMYGYRYSYVYTYWYYYHYKYDYBYN"
+	"H=HAHCHMHGHRHSHVHTHWHYHHHKHDHBHN"
+	"K=KAKCKMKGKRKSKVKTKWKYKHKKKDKBKN"
+	"D=DADCDMDGDRDSDVDTDWDYDHDKDDDBDN"
+	"B=BABCBMBGBRBSBVBTBWBYBHBKBDBBBN"
+	"N=NANCNMNGNRNSNVNTNWNYNHNKNDNBNN";
+
+void bam_seq_pack(unsigned char *out, const char *seq, int len) {
+    const unsigned char *in = (const unsigned char *)seq;
+    int i;
+
+    for (i = 0; i+8 <= len; i += 8, in += 8, out += 4) {
+	out[0] = (base2code[in[0]]<<4) | base2code[in[1]];
+	out[1] = (base2code[in[2]]<<4) | base2code[in[3]];
+	out[2] = (base2code[in[4]]<<4) | base2code[in[5]];
+	out[3] = (base2code[in[6]]<<4) | base2code[in[7]];
+    }
+    for (; i+2 <= len; i += 2, in += 2)
+	*out++ = (base2code[in[0]]<<4) | base2code[in[1]];
+    if (i < len)
+	*out = base2code[in[0]]<<4;
+}
+
+void bam_seq_unpack(char *out, const unsigned char *in, int len) {
+    int i;
+
+    for (i = 0; i+8 <= len; i += 8, in += 4, out += 8) {
+	memcpy(out+0, &code2base[in[0]*2], 2);
+	memcpy(out+2, &code2base[in[1]*2], 2);
+	memcpy(out+4, &code2base[in[2]*2], 2);
+	memcpy(out+6, &code2base[in[3]*2], 2);
+    }
+    for (; i+2 <= len; i += 2, out += 2)
+	memcpy(out, &code2base[*in++ * 2], 2);
+    if (i < len)
+	*out = code2base[*in * 2];
+}
+
+void bam_qual_to_ascii(char *out, const unsigned char *in, int len) {
+    int i;
+
+    // 8 at a time, masking the top bit of each byte so the addition
+    // never carries into its neighbour.
+    for (i = 0; i+8 <= len; i += 8) {
+	uint64_t w;
+	memcpy(&w, in+i, 8);
+	w = ((w & 0x7f7f7f7f7f7f7f7fULL) + 0x2121212121212121ULL)
+	    ^ (w & 0x8080808080808080ULL);
+	memcpy(out+i, &w, 8);
+    }
+    for (; i < len; i++)
+	out[i] = in[i] + '!';
+}
+
 #ifdef ALLOW_UAC
 #if SIZEOF_LONG == 8 && ULONG_MAX != 0xffffffff
 #define COPY_CPF_TO_CPTM(n)				\
@@ -1234,23 +1550,6 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
     int64_t start, end;
     SAM_hdr *sh = b->header;
 
-    static const char lookup[256] = {
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 00 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 10 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 20 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15, 0,15,15, /* 30 */
-	15, 1,14, 2,13,15,15, 4, 11,15,15,12,15, 3,15,15, /* 40 */
-	15,15, 5, 6, 8,15, 7, 9, 15,10,15,15,15,15,15,15, /* 50 */
-	15, 1,14, 2,13,15,15, 4, 11,15,15,12,15, 3,15,15, /* 60 */
-	15,15, 5, 6, 8,15, 7, 9, 15,10,15,15,15,15,15,15, /* 70 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 80 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 90 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* a0 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* b0 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* c0 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* d0 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* e0 */
-	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15};/* f0 */
 
     /* Fetch a single line */
     if ((used_l = bam_get_line(b, &b->sam_str, &b->alloc_l)) <= 0) {
@@ -1461,25 +1760,10 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
 	cpf++;
 	bs->len = 0;
     } else {
-	while (cpf[0] > '\t' && cpf[1] > '\t') {
-	    /* 9% of cpu time is here */
-	    *cpt++ = (lookup[cpf[0]]<<4) | lookup[cpf[1]];
-	    cpf+=2;
-	}
-
-	if (*cpf > '\t')
-	    *cpt++ = lookup[*cpf++]<<4;
-
-//	while (*cpf > '\t') {
-//	    *cpt = lookup[*cpf]<<4;
-//	    if (*++cpf <= '\t') {
-//		cpt++;
-//		break;
-//	    }
-//	    *cpt++ |= lookup[*cpf];
-//	    cpf++;
-//	}
+	CPF_SKIP();
 	bs->len = cpf-cp;
+	bam_seq_pack(cpt, (char *)cp, bs->len);
+	cpt += (bs->len+1)/2;
     }
     if (!*cpf++) return -1;
 
@@ -1653,23 +1937,66 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
  *        -1 on error
  */
 #ifdef ALLOW_UAC
+/*
+ * Hands out the next record parsed by the decoding thread, provided
+ * the stream is positioned at it.
+ *
+ * Returns 1 if *bsp was replaced by a parsed record;
+ *         0 otherwise
+ */
+static int bam_next_parsed(bam_file_t *b, bam_seq_t **bsp) {
+    bgzf_decode_job *j = (bgzf_decode_job *)b->djob;
+    unsigned char *next;
+    bam_seq_t *bs;
+    ptrdiff_t pos;
+
+    /* The previous record may have read ahead this one's length */
+    pos = b->uncomp_p - j->uncomp - (b->next_len > 0 ? 4 : 0);
+    if (pos < 0)
+	return 0;
+
+    /* Skip any records already read the slow way */
+    while (j->rec_idx < j->nrec && j->rec_off < pos) {
+	bs = j->recs[j->rec_idx++];
+	j->rec_off += bs->blk_size + 4;
+	free(bs);
+    }
+
+    if (j->rec_idx >= j->nrec || j->rec_off != pos)
+	return 0;
+
+    bs = j->recs[j->rec_idx++];
+    free(*bsp);
+    *bsp = bs;
+
+    j->rec_off += bs->blk_size + 4;
+    next = j->uncomp + j->rec_off;
+    b->uncomp_sz -= next - b->uncomp_p;
+    b->uncomp_p = next;
+    b->next_len = 0;
+
+    return 1;
+}
+
 int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
     int32_t blk_size, blk_ret;
     bam_seq_t *bs;
-    uint32_t i32;
 
     b->line++;
 
     if (!b->bam)
 	return sam_next_seq(b, bsp);
 
+    if (b->djob && bam_next_parsed(b, bsp))
+	return 1;
+
     if (b->next_len > 0) {
 	blk_size = b->next_len;
     } else {
 	if (4 != bam_read(b, &blk_size, 4))
 	    return 0;
 	blk_size = le_int4(blk_size);
-	if (blk_size < 36) /* Minimum valid BAM record size */
+	if (blk_size < 33) /* 32 fixed bytes plus read name nul */
 	    return -1;
     }
 
@@ -1699,24 +2026,7 @@ int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
     }
     b->next_len = le_int4(b->next_len);
 
-    bs->blk_size  = blk_size;
-    bs->ref       = le_int4(bs->ref);
-    bs->pos       = le_int4(bs->pos_32);
-
-    // order of bit-fields in struct is platform specific, so manually decode
-    i32           = le_int4(bs->bin_packed);
-    bs->bin      = i32 >> 16;
-    bs->map_qual = (i32 >> 8) & 0xff;
-    bs->name_len = i32 & 0xff;
-
-    i32           = le_int4(bs->flag_packed);
-    bs->flag      = i32 >> 16;
-    bs->cigar_len = i32 & 0xffff;
-
-    bs->len       = le_int4(bs->len);
-    bs->mate_ref  = le_int4(bs->mate_ref);
-    bs->mate_pos  = le_int4(bs->mate_pos_32);
-    bs->ins_size  = le_int4(bs->ins_size_32);
+    bam_decode_fixed(bs, blk_size);
 
     if (10 == be_int4(10)) {
 	int i, cigar_len = bam_cigar_len(bs);
@@ -1734,7 +2044,6 @@ int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
 int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
     int32_t blk_size, blk_ret;
     bam_seq_t *bs;
-    uint32_t i32;
 
     b->line++;
 
@@ -1747,7 +2056,7 @@ int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
 	if (4 != bam_read(b, &blk_size, 4))
 	    return 0;
 	blk_size = le_int4(blk_size);
-	if (blk_size < 36) /* Minimum valid BAM record size */
+	if (blk_size < 33) /* 32 fixed bytes plus read name nul */
 	    return -1;
     }
 
@@ -1767,24 +2076,7 @@ int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
     if (blk_ret != 32)
 	return -1;
 
-    bs->blk_size  = blk_size;
-    bs->ref       = le_int4(bs->ref);
-    bs->pos       = le_int4(bs->pos_32);
-
-    // order of bit-fields in struct is platform specific, so manually decode
-    i32           = le_int4(bs->bin_packed);
-    bs->bin      = i32 >> 16;
-    bs->map_qual = (i32 >> 8) & 0xff;
-    bs->name_len = i32 & 0xff;
-
-    i32           = le_int4(bs->flag_packed);
-    bs->flag      = i32 >> 16;
-    bs->cigar_len = i32 & 0xffff;
-
-    bs->len       = le_int4(bs->len);
-    bs->mate_ref  = le_int4(bs->mate_ref);
-    bs->mate_pos  = le_int4(bs->mate_pos_32);
-    bs->ins_size  = le_int4(bs->ins_size_32);
+    bam_decode_fixed(bs, blk_size);
 
     /* Name */
     if (bam_read(b, &bs->data, bam_name_len(bs)) != bam_name_len(bs))
@@ -2168,32 +2460,6 @@ int bam_construct_seq(bam_seq_t **b, size_t extra_len,
     int i;
     uint32_t *ip;
 
-    /*
-     * cp = "=ACMGRSVTWYHKDBN";
-     * memset(L, 15, 256);
-     * for (i = 0; i < 16; i++) {
-     *     L[cp[i]] = L[tolower(cp[i])] = i;
-     * }
-     */
-    static const char L[256] = {
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15, 0,15,15,
-	15, 1,14, 2,13,15,15, 4,11,15,15,12,15, 3,15,15,
-	15,15, 5, 6, 8,15, 7, 9,15,10,15,15,15,15,15,15,
-	15, 1,14, 2,13,15,15, 4,11,15,15,12,15, 3,15,15,
-	15,15, 5, 6, 8,15, 7, 9,15,10,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-	15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15
-    };
-
     /* Sanity checks */
     if (NULL == b) return -1;
     if (len < 0) return -1;  /* not sure why the spec has it as an int */
@@ -2258,11 +2524,8 @@ int bam_construct_seq(bam_seq_t **b, size_t extra_len,
     }
 
     /* Seq */
-    for (i = 0; i < len-1; i += 2) {
-	*cp++ = (L[(uc)seq[i]]<<4) + L[(uc)seq[i+1]];
-    }
-    if (i < len)
-	*cp++ = L[(uc)seq[i]]<<4;
+    bam_seq_pack((unsigned char *)cp, seq, len);
+    cp += (len+1)/2;
 
     /* Qual */
     if (qual) {
@@ -3124,8 +3387,535 @@ static int bgzf_encode(int level,
 }
 #endif
 
+/* ----------------------------------------------------------------------
+ * BAI and CSI indices, built as the BAM file is written.
+ *
+ * Records are indexed by their offset in the uncompressed stream. The
+ * compressed offsets are only known once each BGZF block has reached
+ * the file, which for the threaded encoder is some time after the
+ * record was added. So we log the block sizes as they are written and
+ * convert to virtual offsets when the index is saved on close.
+ */
+
+#define BIDX_UNSET ((uint64_t)-1)
+
+typedef struct {
+    uint64_t beg, end;
+} bidx_chunk;
+
+typedef struct {
+    uint32_t bin;
+    int nchunk, achunk;
+    bidx_chunk *chunk;
+} bidx_bin;
+
+typedef struct {
+    int nbin, abin;
+    bidx_bin *bin;
+    HashTable *h;          /* bin number to bin[] index */
+    int nlin, alin;
+    uint64_t *lin;         /* linear index, one per 1<<min_shift window */
+    uint64_t off_beg, off_end;
+    uint64_t n_mapped, n_unmapped;
+} bidx_ref;
+
+struct bam_index {
+    char *fn;              /* opened only once the index is complete */
+    int failed;            /* set if a record could not be indexed */
+    int csi, min_shift, depth;
+    int nref;
+    bidx_ref *ref;         /* NULL until the first record */
+
+    /* Current reference and bin being accumulated */
+    int last_ref;
+    int64_t last_pos;
+    int save_bin;
+    uint64_t save_off, last_off;
+    uint64_t n_no_coor;
+
+    /* Uncompressed bytes handed to the BGZF writer */
+    uint64_t upos;
+
+    /* BGZF blocks written so far, as uncompressed and compressed starts */
+    int nblk, ablk;
+    uint64_t *ublk, *cblk;
+    uint64_t usize, csize;
+};
+
+/*
+ * Creates an index to be written to fn on close. A ".csi" suffix
+ * selects CSI, otherwise we write BAI.  The file itself is not created
+ * until bam_index_save, so a failed run leaves nothing behind.
+ *
+ * Returns the index on success
+ *         NULL on failure
+ */
+static bam_index_t *bam_index_create(const char *fn) {
+    bam_index_t *idx;
+    size_t l = strlen(fn);
+
+    if (!(idx = calloc(1, sizeof(*idx))))
+	return NULL;
+
+    if (!(idx->fn = strdup(fn))) {
+	free(idx);
+	return NULL;
+    }
+
+    idx->csi = l >= 4 && strcmp(fn+l-4, ".csi") == 0;
+    idx->min_shift = 14;
+    idx->depth = 5;
+    idx->last_ref = -1;
+    idx->save_bin = -1;
+
+    return idx;
+}
+
+static void bam_index_destroy(bam_index_t *idx) {
+    int i, j;
+
+    if (!idx)
+	return;
+
+    for (i = 0; idx->ref && i < idx->nref; i++) {
+	bidx_ref *r = &idx->ref[i];
+	for (j = 0; j < r->nbin; j++)
+	    free(r->bin[j].chunk);
+	free(r->bin);
+	free(r->lin);
+	if (r->h)
+	    HashTableDestroy(r->h, 0);
+    }
+    free(idx->ref);
+    free(idx->ublk);
+    free(idx->cblk);
+    free(idx->fn);
+    free(idx);
+}
+
+/*
+ * Sizes the per-reference data from the header. CSI grows its depth to
+ * cover the longest reference, while BAI is limited to 512Mb.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int bam_index_init_refs(bam_index_t *idx, SAM_hdr *h) {
+    int64_t max_len = 0;
+    int i;
+
+    for (i = 0; i < h->nref; i++)
+	if (max_len < h->ref[i].len)
+	    max_len = h->ref[i].len;
+
+    if (idx->csi) {
+	while (max_len > ((int64_t)1 << (idx->min_shift + 3*idx->depth)))
+	    idx->depth++;
+    } else if (max_len > ((int64_t)1 << 29)) {
+	fprintf(stderr, "Reference too long for a BAI index; use .csi\n");
+	return -1;
+    }
+
+    idx->nref = h->nref;
+    if (!(idx->ref = calloc(idx->nref ? idx->nref : 1, sizeof(*idx->ref))))
+	return -1;
+
+    return 0;
+}
+
+/* Computes the bin for a 0-based half-open region, as per reg2bin() */
+static int bidx_reg2bin(int64_t beg, int64_t end, int min_shift, int depth) {
+    int l, s = min_shift, t = ((1 << depth*3) - 1) / 7;
+
+    for (end--, l = depth; l > 0; l--, s += 3, t -= 1 << l*3)
+	if (beg >> s == end >> s)
+	    return t + (beg >> s);
+
+    return 0;
+}
+
+/* The first linear index window covered by a bin */
+static int64_t bidx_bin_window(uint32_t bin, int depth) {
+    int l = 0;
+
+    while (l < depth && bin >= ((1U << 3*(l+1)) - 1) / 7)
+	l++;
+
+    return (int64_t)(bin - ((1U << 3*l) - 1) / 7) << 3*(depth-l);
+}
+
+static int bidx_add_chunk(bidx_ref *r, uint32_t bin,
+			  uint64_t beg, uint64_t end) {
+    HashItem *hi;
+    bidx_bin *b;
+
+    if (!r->h && !(r->h = HashTableCreate(64, HASH_DYNAMIC_SIZE |
+					  HASH_NONVOLATILE_KEYS |
+					  HASH_INT_KEYS)))
+	return -1;
+
+    if ((hi = HashTableSearch(r->h, (char *)(size_t)bin, 4))) {
+	b = &r->bin[hi->data.i];
+    } else {
+	HashData hd;
+
+	if (r->nbin == r->abin) {
+	    int n = r->abin ? r->abin*2 : 16;
+	    bidx_bin *tmp = realloc(r->bin, n * sizeof(*tmp));
+	    if (!tmp)
+		return -1;
+	    r->bin = tmp;
+	    r->abin = n;
+	}
+	hd.i = r->nbin;
+	if (!HashTableAdd(r->h, (char *)(size_t)bin, 4, hd, NULL))
+	    return -1;
+	b = &r->bin[r->nbin++];
+	b->bin = bin;
+	b->nchunk = b->achunk = 0;
+	b->chunk = NULL;
+    }
+
+    if (b->nchunk == b->achunk) {
+	int n = b->achunk ? b->achunk*2 : 4;
+	bidx_chunk *tmp = realloc(b->chunk, n * sizeof(*tmp));
+	if (!tmp)
+	    return -1;
+	b->chunk = tmp;
+	b->achunk = n;
+    }
+    b->chunk[b->nchunk].beg = beg;
+    b->chunk[b->nchunk].end = end;
+    b->nchunk++;
+
+    return 0;
+}
+
+/* Closes off the bin and reference currently being accumulated */
+static int bidx_finish_ref(bam_index_t *idx) {
+    bidx_ref *r;
+
+    if (idx->last_ref < 0 || idx->last_ref >= idx->nref)
+	return 0;
+
+    r = &idx->ref[idx->last_ref];
+    if (idx->save_bin >= 0 &&
+	bidx_add_chunk(r, idx->save_bin, idx->save_off, idx->last_off))
+	return -1;
+    r->off_end = idx->last_off;
+    idx->save_bin = -1;
+
+    return 0;
+}
+
+/* Returns the reference end (exclusive) of a record */
+static int64_t bam_ref_end(bam_seq_t *b) {
+    uint32_t *cig = bam_cigar(b);
+    int i, n = bam_cigar_len(b);
+    int64_t end = bam_pos(b);
+
+    for (i = 0; i < n; i++) {
+	switch (cig[i] & BAM_CIGAR_MASK) {
+	case BAM_CMATCH:
+	case BAM_CDEL:
+	case BAM_CREF_SKIP:
+	case BAM_CBASE_MATCH:
+	case BAM_CBASE_MISMATCH:
+	    end += cig[i] >> BAM_CIGAR_SHIFT;
+	}
+    }
+
+    return end;
+}
+
+/*
+ * Adds a record just written to fp, starting at uncompressed offset
+ * ubeg, to the index. Records must be in coordinate order.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int bam_index_push(bam_file_t *fp, bam_seq_t *b, uint64_t ubeg) {
+    bam_index_t *idx = fp->bidx;
+    uint64_t uend = idx->upos + (fp->uncomp_p - fp->uncomp);
+    int mapped = !(bam_flag(b) & BAM_FUNMAP);
+    int ref = bam_ref(b), bin;
+    int64_t beg = bam_pos(b), end, w;
+    bidx_ref *r;
+
+    if (!idx->ref && bam_index_init_refs(idx, fp->header))
+	return -1;
+
+    /* Unplaced reads go last and are only counted */
+    if (ref < 0 || beg < 0) {
+	if (bidx_finish_ref(idx))
+	    return -1;
+	idx->last_ref = idx->nref;
+	idx->n_no_coor++;
+	return 0;
+    }
+
+    if (ref != idx->last_ref) {
+	if (ref < idx->last_ref || ref >= idx->nref)
+	    goto unsorted;
+	if (bidx_finish_ref(idx))
+	    return -1;
+	idx->last_ref = ref;
+	idx->ref[ref].off_beg = ubeg;
+    } else if (beg < idx->last_pos) {
+	goto unsorted;
+    }
+    idx->last_pos = beg;
+    r = &idx->ref[ref];
+
+    end = mapped ? bam_ref_end(b) : beg;
+    if (end <= beg)
+	end = beg+1;
+    bin = bidx_reg2bin(beg, end, idx->min_shift, idx->depth);
+
+    /* Linear index: first record overlapping each window */
+    w = (end-1) >> idx->min_shift;
+    if (w >= r->alin) {
+	int n = r->alin ? r->alin : 64;
+	uint64_t *tmp;
+	while (n <= w)
+	    n *= 2;
+	if (!(tmp = realloc(r->lin, n * sizeof(*tmp))))
+	    return -1;
+	memset(tmp + r->alin, 0xff, (n - r->alin) * sizeof(*tmp));
+	r->lin = tmp;
+	r->alin = n;
+    }
+    if (r->nlin <= w)
+	r->nlin = w+1;
+    for (w = beg >> idx->min_shift; w <= (end-1) >> idx->min_shift; w++)
+	if (r->lin[w] == BIDX_UNSET)
+	    r->lin[w] = ubeg;
+
+    if (bin != idx->save_bin) {
+	if (idx->save_bin >= 0 &&
+	    bidx_add_chunk(r, idx->save_bin, idx->save_off, idx->last_off))
+	    return -1;
+	idx->save_bin = bin;
+	idx->save_off = ubeg;
+    }
+
+    if (mapped)
+	r->n_mapped++;
+    else
+	r->n_unmapped++;
+    idx->last_off = uend;
+
+    return 0;
+
+ unsorted:
+    fprintf(stderr, "Cannot index BAM: records are not coordinate sorted\n");
+    return -1;
+}
+
+/* Logs a BGZF block of usize bytes compressing to csize bytes */
+static int bam_index_block(bam_index_t *idx, uint32_t usize, uint32_t csize) {
+    if (idx->nblk == idx->ablk) {
+	int n = idx->ablk ? idx->ablk*2 : 1024;
+	uint64_t *u = realloc(idx->ublk, n * sizeof(*u));
+	if (!u)
+	    return -1;
+	idx->ublk = u;
+	if (!(u = realloc(idx->cblk, n * sizeof(*u))))
+	    return -1;
+	idx->cblk = u;
+	idx->ablk = n;
+    }
+
+    idx->ublk[idx->nblk] = idx->usize;
+    idx->cblk[idx->nblk] = idx->csize;
+    idx->nblk++;
+    idx->usize += usize;
+    idx->csize += csize;
+
+    return 0;
+}
+
+/* Converts an uncompressed offset to a BGZF virtual offset */
+static uint64_t bidx_voff(bam_index_t *idx, uint64_t u) {
+    int lo = 0, hi = idx->nblk;
+
+    if (u >= idx->usize)
+	return idx->csize << 16;
+
+    /* Last block starting at or before u; skips empty blocks */
+    while (hi - lo > 1) {
+	int mid = (lo + hi) / 2;
+	if (idx->ublk[mid] <= u)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+
+    return (idx->cblk[lo] << 16) | (u - idx->ublk[lo]);
+}
+
+static void bidx_put32(mFILE *mf, uint32_t v) {
+    unsigned char buf[4], *cp = buf;
+    STORE_UINT32(cp, v);
+    mfwrite(buf, 1, 4, mf);
+}
+
+static void bidx_put64(mFILE *mf, uint64_t v) {
+    unsigned char buf[8], *cp = buf;
+    STORE_UINT64(cp, v);
+    mfwrite(buf, 1, 8, mf);
+}
+
+/*
+ * Serialises one reference. Chunks are converted to virtual offsets and
+ * merged where they touch the same BGZF block.
+ */
+static void bidx_put_ref(bam_index_t *idx, bidx_ref *r, mFILE *mf) {
+    int i, j, k;
+    uint64_t off;
+
+    /* Fill in the linear index gaps */
+    off = bidx_voff(idx, r->off_beg);
+    for (i = 0; i < r->nlin; i++) {
+	if (r->lin[i] == BIDX_UNSET)
+	    r->lin[i] = off;
+	else
+	    r->lin[i] = off = bidx_voff(idx, r->lin[i]);
+    }
+
+    bidx_put32(mf, r->nbin + (r->nbin > 0));
+    for (i = 0; i < r->nbin; i++) {
+	bidx_bin *b = &r->bin[i];
+
+	for (j = 0, k = -1; j < b->nchunk; j++) {
+	    uint64_t beg = bidx_voff(idx, b->chunk[j].beg);
+	    uint64_t end = bidx_voff(idx, b->chunk[j].end);
+	    if (k >= 0 && b->chunk[k].end >> 16 >= beg >> 16) {
+		if (b->chunk[k].end < end)
+		    b->chunk[k].end = end;
+	    } else {
+		k++;
+		b->chunk[k].beg = beg;
+		b->chunk[k].end = end;
+	    }
+	}
+	b->nchunk = k+1;
+
+	bidx_put32(mf, b->bin);
+	if (idx->csi) {
+	    int64_t w = bidx_bin_window(b->bin, idx->depth);
+	    bidx_put64(mf, w < r->nlin ? r->lin[w] : 0);
+	}
+	bidx_put32(mf, b->nchunk);
+	for (j = 0; j < b->nchunk; j++) {
+	    bidx_put64(mf, b->chunk[j].beg);
+	    bidx_put64(mf, b->chunk[j].end);
+	}
+    }
+
+    /* Pseudo-bin with the reference offset range and read counts */
+    if (r->nbin) {
+	bidx_put32(mf, idx->csi
+		   ? ((1U << 3*(idx->depth+1)) - 1) / 7 + 1
+		   : 37450);
+	if (idx->csi)
+	    bidx_put64(mf, 0);
+	bidx_put32(mf, 2);
+	bidx_put64(mf, bidx_voff(idx, r->off_beg));
+	bidx_put64(mf, bidx_voff(idx, r->off_end));
+	bidx_put64(mf, r->n_mapped);
+	bidx_put64(mf, r->n_unmapped);
+    }
+
+    if (!idx->csi) {
+	bidx_put32(mf, r->nlin);
+	for (i = 0; i < r->nlin; i++)
+	    bidx_put64(mf, r->lin[i]);
+    }
+}
+
+/*
+ * Writes the index. This must follow the last BGZF block being written.
+ * CSI files are themselves BGZF compressed.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int bam_index_save(bam_index_t *idx, SAM_hdr *h) {
+    mFILE *mf;
+    FILE *fp;
+    char *data;
+    size_t size;
+    int i, r = 0;
+
+    if (idx->failed)
+	return -1;
+    if (!idx->ref && bam_index_init_refs(idx, h))
+	return -1;
+    if (bidx_finish_ref(idx))
+	return -1;
+
+    if (!(mf = mfcreate(NULL, 0)))
+	return -1;
+
+    if (idx->csi) {
+	mfwrite("CSI\1", 1, 4, mf);
+	bidx_put32(mf, idx->min_shift);
+	bidx_put32(mf, idx->depth);
+	bidx_put32(mf, 0); // l_aux
+    } else {
+	mfwrite("BAI\1", 1, 4, mf);
+    }
+    bidx_put32(mf, idx->nref);
+    for (i = 0; i < idx->nref; i++)
+	bidx_put_ref(idx, &idx->ref[i], mf);
+    bidx_put64(mf, idx->n_no_coor);
+
+    if (!(data = mfsteal(mf, &size)))
+	return -1;
+
+    if (!(fp = fopen(idx->fn, "wb"))) {
+	perror(idx->fn);
+	free(data);
+	return -1;
+    }
+
+    if (idx->csi) {
+	unsigned char blk[Z_BUFF_SIZE+4];
+	size_t i;
+
+	for (i = 0; r == 0 && i < size; i += BGZF_BUFF_SIZE) {
+	    uint32_t in_sz = MIN(BGZF_BUFF_SIZE, size - i), out_sz;
+	    if (bgzf_encode(Z_DEFAULT_COMPRESSION, data + i, in_sz,
+			    blk, &out_sz) ||
+		out_sz != fwrite(blk, 1, out_sz, fp))
+		r = -1;
+	}
+	if (r == 0 && 28 != fwrite(EOF_BLOCK, 1, 28, fp))
+	    r = -1;
+    } else {
+	if (size != fwrite(data, 1, size, fp))
+	    r = -1;
+    }
+    free(data);
+
+    if (fclose(fp))
+	r = -1;
+
+    if (r) {
+	fprintf(stderr, "Failed to write BAM index\n");
+	unlink(idx->fn);
+    }
+
+    return r;
+}
+
 static int bgzf_block_write(bam_file_t *bf, int level,
 			    const void *buf, size_t count) {
+    if (bf->bidx)
+	bf->bidx->upos += count;
+
     if (!bf->idx)
 	return BGZF_WRITE(bf, level, buf, count);
 
@@ -3172,6 +3962,9 @@ static int bgzf_write(bam_file_t *bf, int level, const void *buf, size_t count)
     if (len != fwrite(blk, 1, len, bf->fp))
 	return -1;
 
+    if (bf->bidx && bam_index_block(bf->bidx, count, len))
+	return -1;
+
     return 0;
 }
 
@@ -3207,6 +4000,8 @@ static int bgzf_write_mt(bam_file_t *bf, int level, const void *buf,
 	j = (bgzf_encode_job *)r->data;
 	if (j->out_sz != fwrite(j->out, 1, j->out_sz, bf->fp))
 	    return -1;
+	if (bf->bidx && bam_index_block(bf->bidx, j->in_sz, j->out_sz))
+	    return -1;
 	t_pool_delete_result(r, 1);
     }
 
@@ -3227,6 +4022,8 @@ static int bgzf_flush_mt(bam_file_t *bf) {
 	j = (bgzf_encode_job *)r->data;
 	if (j->out_sz != fwrite(j->out, 1, j->out_sz, bf->fp))
 	    return -1;
+	if (bf->bidx && bam_index_block(bf->bidx, j->in_sz, j->out_sz))
+	    return -1;
 	t_pool_delete_result(r, 1);
     }
 
@@ -3248,64 +4045,6 @@ int bam_put_seq(bam_file_t *fp, bam_seq_t *b) {
     char *auxh, aux_key[3], type;
     bam_aux_t val;
 
-    /*
-     * Thread safe version of:
-     *
-     *   static int init_done = 0;
-     *   static uint16_t code2base[256];
-     *   
-     *   if (!init_done) {
-     *       int i;
-     *       char c[2];
-     *       uint16_t s;
-     *       for (i = 0; i < 256; i++) {
-     *           c[0] = "=ACMGRSVTWYHKDBN"[i >> 4];
-     *           c[1] = "=ACMGRSVTWYHKDBN"[i & 15];
-     *           s = *(uint16_t *)c;
-     *           code2base[i] = s;
-     *	     
-     *           //printf("%5d,%c", code2base[i],i%8==7?'\n':' ');
-     *       }
-     *       init_done = 1;
-     *   }
-     */
-#ifdef ALLOW_UAC
-    static const uint16_t code2base[256] = {
-	15677, 16701, 17213, 19773, 18237, 21053, 21309, 22077,
-	21565, 22333, 22845, 18493, 19261, 17469, 16957, 20029,
-	15681, 16705, 17217, 19777, 18241, 21057, 21313, 22081,
-	21569, 22337, 22849, 18497, 19265, 17473, 16961, 20033,
-	15683, 16707, 17219, 19779, 18243, 21059, 21315, 22083,
-	21571, 22339, 22851, 18499, 19267, 17475, 16963, 20035,
-	15693, 16717, 17229, 19789, 18253, 21069, 21325, 22093,
-	21581, 22349, 22861, 18509, 19277, 17485, 16973, 20045,
-	15687, 16711, 17223, 19783, 18247, 21063, 21319, 22087,
-	21575, 22343, 22855, 18503, 19271, 17479, 16967, 20039,
-	15698, 16722, 17234, 19794, 18258, 21074, 21330, 22098,
-	21586, 22354, 22866, 18514, 19282, 17490, 16978, 20050,
-	15699, 16723, 17235, 19795, 18259, 21075, 21331, 22099,
-	21587, 22355, 22867, 18515, 19283, 17491, 16979, 20051,
-	15702, 16726, 17238, 19798, 18262, 21078, 21334, 22102,
-	21590, 22358, 22870, 18518, 19286, 17494, 16982, 20054,
-	15700, 16724, 17236, 19796, 18260, 21076, 21332, 22100,
-	21588, 22356, 22868, 18516, 19284, 17492, 16980, 20052,
-	15703, 16727, 17239, 19799, 18263, 21079, 21335, 22103,
-	21591, 22359, 22871, 18519, 19287, 17495, 16983, 20055,
-	15705, 16729, 17241, 19801, 18265, 21081, 21337, 22105,
-	21593, 22361, 22873, 18521, 19289, 17497, 16985, 20057,
-	15688, 16712, 17224, 19784, 18248, 21064, 21320, 22088,
-	21576, 22344, 22856, 18504, 19272, 17480, 16968, 20040,
-	15691, 16715, 17227, 19787, 18251, 21067, 21323, 22091,
-	21579, 22347, 22859, 18507, 19275, 17483, 16971, 20043,
-	15684, 16708, 17220, 19780, 18244, 21060, 21316, 22084,
-	21572, 22340, 22852, 18500, 19268, 17476, 16964, 20036,
-	15682, 16706, 17218, 19778, 18242, 21058, 21314, 22082,
-	21570, 22338, 22850, 18498, 19266, 17474, 16962, 20034,
-	15694, 16718, 17230, 19790, 18254, 21070, 21326, 22094,
-	21582, 22350, 22862, 18510, 19278, 17486, 16974, 20046
-    };
-#endif
-
     if (!fp->binary) {
 	/* SAM */
 	unsigned char *end = fp->uncomp + BGZF_BUFF_SIZE, *dat;
@@ -3421,34 +4160,16 @@ int bam_put_seq(bam_file_t *fp, bam_seq_t *b) {
 	//	}
 	if (b->len != 0) {
 	    if (end - fp->uncomp_p < b->len + 3) BF_FLUSH();
-	    if (end - fp->uncomp_p < b->len + 3) {
-		/* Extra long seqs need more regular checks */
-		for (i = 0; i < b->len-1; i+=2) {
-		    if (end - fp->uncomp_p < 3) BF_FLUSH();
-		    *fp->uncomp_p++ = "=ACMGRSVTWYHKDBN"[*dat >> 4];
-		    *fp->uncomp_p++ = "=ACMGRSVTWYHKDBN"[*dat++ & 15];
+	    /* Extra long seqs are converted a buffer full at a time */
+	    for (i = 0; i < b->len; ) {
+		int l = MIN(b->len - i, (end - fp->uncomp_p - 2) & ~1);
+		if (l <= 0) {
+		    BF_FLUSH();
+		    continue;
 		}
-		if (i < b->len) {
-		    if (end - fp->uncomp_p < 3) BF_FLUSH();
-		    *fp->uncomp_p++ = "=ACMGRSVTWYHKDBN"[*dat >> 4];
-		}
-	    } else {
-		unsigned char *cp = fp->uncomp_p;
-		int n = b->len & ~1;
-		for (i = 0; i < n; i+=2) {
-#ifdef ALLOW_UAC
-		    *(int16_u *)cp = le_int2(code2base[*dat++]);
-		    cp += 2;
-#else
-		    cp[0] = "=ACMGRSVTWYHKDBN"[*dat >> 4];
-		    cp[1] = "=ACMGRSVTWYHKDBN"[*dat++ & 15];
-		    cp += 2;
-#endif
-		}
-		if (i < b->len) {
-		    *cp++ = "=ACMGRSVTWYHKDBN"[*dat >> 4];
-		}
-		fp->uncomp_p = cp;
+		bam_seq_unpack((char *)fp->uncomp_p, dat + i/2, l);
+		fp->uncomp_p += l;
+		i += l;
 	    }
 	} else {
 	    if (end - fp->uncomp_p < 2) BF_FLUSH();
@@ -3476,37 +4197,23 @@ int bam_put_seq(bam_file_t *fp, bam_seq_t *b) {
 		dat += b->len;
 	    } else {
 		if (end - fp->uncomp_p < b->len + 3) BF_FLUSH();
-		if (end - fp->uncomp_p < b->len + 3 ||
-		    fp->binning == BINNING_ILLUMINA) {
-
-		    /* Long seqs */
-		    if (fp->binning == BINNING_ILLUMINA) {
-			for (i = 0; i < b->len; i++) {
-			    if (end - fp->uncomp_p < 3) BF_FLUSH();
-			    *fp->uncomp_p++ = illumina_bin_33[(uc)*dat++];
-			}
-		    } else {
-			for (i = 0; i < b->len; i++) {
-			    if (end - fp->uncomp_p < 3) BF_FLUSH();
-			    *fp->uncomp_p++ = *dat++ + '!';
-			}
+		if (fp->binning == BINNING_ILLUMINA) {
+		    for (i = 0; i < b->len; i++) {
+			if (end - fp->uncomp_p < 3) BF_FLUSH();
+			*fp->uncomp_p++ = illumina_bin_33[(uc)*dat++];
 		    }
 		} else {
-		    unsigned char *cp = fp->uncomp_p;
-		    i = 0;
-#ifdef ALLOW_UAC
-		    int n = b->len & ~3;
-		    for (; i < n; i+=4) {
-			//*cp++ = *dat++ + '!';
-			*(uint32_u *)cp = *(uint32_u *)dat + 0x21212121;
-			cp  += 4;
-			dat += 4;
-		    }
-#endif
-		    for (; i < b->len; i++) {
-			*cp++ = *dat++ + '!';
+		    for (i = 0; i < b->len; ) {
+			int l = MIN(b->len - i, end - fp->uncomp_p - 2);
+			if (l <= 0) {
+			    BF_FLUSH();
+			    continue;
+			}
+			bam_qual_to_ascii((char *)fp->uncomp_p, dat, l);
+			fp->uncomp_p += l;
+			dat += l;
+			i += l;
 		    }
-		    fp->uncomp_p = cp;
 		}
 	    }
 	} else {
@@ -3690,6 +4397,7 @@ int bam_put_seq(bam_file_t *fp, bam_seq_t *b) {
 	unsigned char *end = fp->uncomp + BGZF_BUFF_SIZE, *ptr;
 	size_t to_write;
 	uint32_t i32;
+	uint64_t ubeg = fp->bidx ? fp->bidx->upos+(fp->uncomp_p-fp->uncomp) : 0;
 #ifndef ALLOW_UAC
 	int name_len = bam_name_len(b);
 #endif
@@ -3801,6 +4509,11 @@ int bam_put_seq(bam_file_t *fp, bam_seq_t *b) {
 	i32          = b->flag_packed;
 	b->flag      = i32 >> 16;
 	b->cigar_len = i32 & 0xffff;
+
+	if (fp->bidx && bam_index_push(fp, b, ubeg)) {
+	    fp->bidx->failed = 1;
+	    return -1;
+	}
     }
 
     return 0;
@@ -3906,6 +4619,7 @@ int bam_set_voption(bam_file_t *fd, enum bam_option opt, va_list args) {
 	fd->pool = va_arg(args, t_pool *);
 	fd->equeue = t_results_queue_init();
 	fd->dqueue = t_results_queue_init();
+	bam_boundary_init(fd);
 	break;
 
     case BAM_OPT_BINNING:
@@ -3921,6 +4635,19 @@ int bam_set_voption(bam_file_t *fd, enum bam_option opt, va_list args) {
     case BAM_OPT_OUTPUT_BGZIP_IDX:
         fd->idx_fn =  va_arg(args, char *);
 	break;
+
+    case BAM_OPT_WRITE_INDEX: {
+	char *fn = va_arg(args, char *);
+	if (!(fd->mode & O_WRONLY) || !fd->binary) {
+	    fprintf(stderr,
+		    "Indexing is only supported when writing BAM or CRAM\n");
+	    return -1;
+	}
+	bam_index_destroy(fd->bidx);
+	if (!(fd->bidx = bam_index_create(fn)))
+	    return -1;
+	break;
+    }
     }
 
     return 0;
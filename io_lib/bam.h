@@ -142,6 +142,20 @@ typedef struct {
  */
 #define Z_BUFF_SIZE 65536    /* Max size of a zlib block */
 #define BGZF_BUFF_SIZE 65273 // 65535 - MIN_LOOKAHEAD to avoid fill_window()
+
+typedef struct bam_index bam_index_t;
+
+/*
+ * Where the BAM record stream stands at the end of a decoded block, so
+ * the next block's decoding job can find its first whole record.
+ */
+typedef struct {
+    int valid;               /* 0 if record boundaries are unknown */
+    int32_t skip;            /* bytes of a record to skip at block start */
+    int nlen;                /* bytes of a record length already seen */
+    unsigned char len[4];
+} bam_boundary_t;
+
 typedef struct {
     FILE *fp;
 
@@ -198,6 +212,15 @@ typedef struct {
     int eof;
     int nd_jobs, ne_jobs;
 
+    /* Current decoded block, and records parsed from it by the job */
+    void *djob;
+
+    /* Record boundaries passed from one decoding job to the next */
+    pthread_mutex_t dlock;
+    pthread_cond_t dcond;
+    bam_boundary_t dbound;
+    int dseq_next, dseq_done;
+
     /* Quality binning */
     enum quality_binning binning;
 
@@ -211,6 +234,9 @@ typedef struct {
     unsigned char bgbuf[Z_BUFF_SIZE];
     unsigned char *bgbuf_p;
     size_t bgbuf_sz;
+
+    /* BAI or CSI index built while writing, see BAM_OPT_WRITE_INDEX */
+    bam_index_t *bidx;
 } bam_file_t;
 
 /* BAM flags */
@@ -666,6 +692,30 @@ int bam_aux_iter(bam_seq_t *b, char **iter_handle,
 #define bam_seqi(s, i) ((s)[(i)/2] >> 4*(1-(i)%2) & 0xf)
 #define bam_nt16_rev_table "=ACMGRSVTWYHKDBN"
 
+/*! Packs an ASCII sequence into BAM's 4-bit encoding.
+ *
+ * @param out Output buffer of at least (len+1)/2 bytes.
+ * @param seq ASCII bases; unrecognised characters become N.
+ * @param len Number of bases.
+ */
+void bam_seq_pack(unsigned char *out, const char *seq, int len);
+
+/*! Unpacks a BAM 4-bit encoded sequence to ASCII.
+ *
+ * @param out Output buffer of at least len bytes; not nul terminated.
+ * @param in  Packed sequence.
+ * @param len Number of bases.
+ */
+void bam_seq_unpack(char *out, const unsigned char *in, int len);
+
+/*! Converts binary quality values to SAM's phred+33 ASCII.
+ *
+ * @param out Output buffer of at least len bytes; not nul terminated.
+ * @param in  Binary quality values.
+ * @param len Number of values.
+ */
+void bam_qual_to_ascii(char *out, const unsigned char *in, int len);
+
 /* Output code */
 
 /*! Writes a single bam sequence object.
@@ -746,7 +796,8 @@ enum bam_option {
     BAM_OPT_BINNING,
     BAM_OPT_IGNORE_CHKSUM,
     BAM_OPT_WITH_BGZIP_IDX,
-    BAM_OPT_OUTPUT_BGZIP_IDX
+    BAM_OPT_OUTPUT_BGZIP_IDX,
+    BAM_OPT_WRITE_INDEX
 };
 
 /*! Sets options on the bam_file_t.
@@ -58,6 +58,8 @@
 #include <zlib.h>
 #include "io_lib/bgzip.h"
 #include "io_lib/os.h"
+#include "io_lib/thread_pool.h"
+#include "io_lib/misc.h"
 
 /* ----------------------------------------------------------------------
  * bgzip .gzi index support
@@ -331,20 +333,302 @@ uint64_t gzi_load(FILE *fp, gzi *idx, uint64_t ustart, uint64_t uend, char *out)
  * A FILE* wrapper that can read and seek either into uncompressed or
  * bgzip compressed files.
  *
- * Note, this is crude and not at all good at handling small reads efficiently
- * due to no cachine and pointless seeks!  It got bolted on without
- * the necessary redesigns.
+ * Compressed files are read a block at a time, as listed in the .gzi
+ * index. Blocks only partially covered by a read are kept in a small
+ * LRU cache, so runs of small reads and seeks within the same region
+ * (eg load_ref_portion on neighbouring slices) inflate each block once.
+ * Whole blocks are inflated directly into the caller's buffer, spread
+ * over a private thread pool when bzi_set_threads has been used.
  */
+#define BZI_CACHE_SIZE  32   /* decompressed blocks held per bzi_FILE */
+#define BZI_BLOCK_MAX   65536
+#define BZI_RUN_MAX     256  /* max blocks read in a single fread */
+#define BZI_JOB_BLOCKS  16   /* blocks per thread pool job */
+
+typedef struct {
+    uint64_t blk;	/* gzi index entry number */
+    uint64_t used;	/* LRU stamp; 0 => unused */
+    uint32_t len;
+    unsigned char *data;
+} bzi_block;
+
 struct bzi_FILE {
     FILE *fp;
     gzi  *idx;
     uint64_t pos;
+    bzi_block cache[BZI_CACHE_SIZE];
+    uint64_t stamp;
+    int nthreads;
+    t_pool *pool;
+    t_results_queue *q;
 };
 
+/*
+ * Inflates one or more concatenated gzip members in comp into out.
+ * Returns the uncompressed size on success;
+ *        -1 on failure
+ */
+static int64_t bzi_inflate(z_stream *z, unsigned char *comp, size_t csz,
+			   unsigned char *out, size_t usz) {
+    int err;
+
+    if (inflateReset(z) != Z_OK)
+	return -1;
+
+    z->next_in   = comp;
+    z->avail_in  = csz;
+    z->next_out  = out;
+    z->avail_out = usz;
+
+    do {
+	err = inflate(z, Z_FINISH);
+	if (err == Z_STREAM_END && z->avail_in)
+	    inflateReset(z);
+    } while (err == Z_STREAM_END && z->avail_in && z->avail_out);
+
+    if (err != Z_STREAM_END && err != Z_OK && err != Z_BUF_ERROR) {
+	fprintf(stderr, "Zlib err: %s\n", z->msg ? z->msg : "inflate");
+	return -1;
+    }
+
+    return usz - z->avail_out;
+}
+
+static int bzi_inflate_init(z_stream *z) {
+    memset(z, 0, sizeof(*z));
+    if (inflateInit2(z, 31) != Z_OK) {
+	fprintf(stderr, "Zlib err: %s\n", z->msg ? z->msg : "inflateInit");
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * Returns the gzi index entry for the block holding uncompressed
+ * offset uoff.
+ */
+static uint64_t bzi_block_of(gzi *idx, uint64_t uoff) {
+    uint64_t lo = 0, hi = idx->n, x;
+
+    while (lo < hi) {
+	x = (lo + hi + 1)/2;
+	if (idx->u_off[x] > uoff)
+	    hi = x-1;
+	else
+	    lo = x;
+    }
+
+    return lo;
+}
+
+/*
+ * Reads the compressed data for blocks b to b+n-1 into a malloced buffer.
+ * The final block has no following index entry, so its size comes from
+ * the end of the file.
+ *
+ * Returns the buffer on success, with its size in *csz;
+ *         NULL on failure
+ */
+static unsigned char *bzi_read_blocks(bzi_FILE *zp, uint64_t b, uint64_t n,
+				      size_t *csz) {
+    off_t start = zp->idx->c_off[b], end;
+    unsigned char *comp;
+
+    if (b+n <= zp->idx->n) {
+	end = zp->idx->c_off[b+n];
+    } else {
+	if (fseeko(zp->fp, 0, SEEK_END) < 0 || (end = ftello(zp->fp)) < 0)
+	    return NULL;
+    }
+    if (end < start)
+	return NULL;
+
+    *csz = end - start;
+    if (!(comp = malloc(*csz ? *csz : 1)))
+	return NULL;
+
+    if (fseeko(zp->fp, start, SEEK_SET) < 0 ||
+	*csz != fread(comp, 1, *csz, zp->fp)) {
+	free(comp);
+	return NULL;
+    }
+
+    return comp;
+}
+
+/*
+ * Returns the cached decompressed contents of block b, loading it
+ * into the least recently used cache slot if not already present.
+ *
+ * Returns bzi_block pointer on success;
+ *         NULL on failure
+ */
+static bzi_block *bzi_cache_get(bzi_FILE *zp, uint64_t b) {
+    bzi_block *c = NULL;
+    unsigned char *comp;
+    size_t csz;
+    int64_t len;
+    z_stream z;
+    int i;
+
+    for (i = 0; i < BZI_CACHE_SIZE; i++) {
+	if (zp->cache[i].used && zp->cache[i].blk == b) {
+	    zp->cache[i].used = ++zp->stamp;
+	    return &zp->cache[i];
+	}
+	if (!c || zp->cache[i].used < c->used)
+	    c = &zp->cache[i];
+    }
+
+    c->used = 0;
+    if (!c->data && !(c->data = malloc(BZI_BLOCK_MAX)))
+	return NULL;
+
+    if (!(comp = bzi_read_blocks(zp, b, 1, &csz)))
+	return NULL;
+
+    if (bzi_inflate_init(&z) < 0) {
+	free(comp);
+	return NULL;
+    }
+    len = bzi_inflate(&z, comp, csz, c->data,
+		      b < zp->idx->n
+		      ? zp->idx->u_off[b+1] - zp->idx->u_off[b]
+		      : BZI_BLOCK_MAX);
+    inflateEnd(&z);
+    free(comp);
+    if (len < 0)
+	return NULL;
+
+    c->blk  = b;
+    c->len  = len;
+    c->used = ++zp->stamp;
+
+    return c;
+}
+
+static int bzi_cached(bzi_FILE *zp, uint64_t b) {
+    int i;
+
+    for (i = 0; i < BZI_CACHE_SIZE; i++)
+	if (zp->cache[i].used && zp->cache[i].blk == b)
+	    return 1;
+
+    return 0;
+}
+
+/* A batch of whole blocks to inflate, possibly on a worker thread */
+typedef struct {
+    gzi *idx;
+    uint64_t b, n;		/* blocks b to b+n-1 */
+    unsigned char *comp;	/* compressed data, starting at block b */
+    unsigned char *out;		/* uncompressed data, starting at block b */
+    int ret;
+} bzi_job;
+
+static void *bzi_inflate_job(void *arg) {
+    bzi_job *j = (bzi_job *)arg;
+    uint64_t c0 = j->idx->c_off[j->b], u0 = j->idx->u_off[j->b], i;
+    z_stream z;
+
+    j->ret = -1;
+    if (bzi_inflate_init(&z) < 0)
+	return j;
+
+    for (i = j->b; i < j->b + j->n; i++) {
+	size_t csz = j->idx->c_off[i+1] - j->idx->c_off[i];
+	size_t usz = j->idx->u_off[i+1] - j->idx->u_off[i];
+	if (usz != bzi_inflate(&z, j->comp + j->idx->c_off[i] - c0, csz,
+			       j->out + j->idx->u_off[i] - u0, usz)) {
+	    inflateEnd(&z);
+	    return j;
+	}
+    }
+
+    inflateEnd(&z);
+    j->ret = 0;
+    return j;
+}
+
+/*
+ * Inflates whole blocks b to b+n-1 directly into out. These must all
+ * have a following index entry, so their uncompressed sizes are known.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+static int bzi_inflate_run(bzi_FILE *zp, uint64_t b, uint64_t n,
+			   unsigned char *out) {
+    unsigned char *comp;
+    bzi_job *jobs;
+    uint64_t i, njobs = (n + BZI_JOB_BLOCKS-1) / BZI_JOB_BLOCKS;
+    size_t csz;
+    int ret = 0;
+
+    if (!(comp = bzi_read_blocks(zp, b, n, &csz)))
+	return -1;
+
+    if (!(jobs = malloc(njobs * sizeof(*jobs)))) {
+	free(comp);
+	return -1;
+    }
+
+    for (i = 0; i < njobs; i++) {
+	jobs[i].idx  = zp->idx;
+	jobs[i].b    = b + i*BZI_JOB_BLOCKS;
+	jobs[i].n    = MIN(BZI_JOB_BLOCKS, n - i*BZI_JOB_BLOCKS);
+	jobs[i].comp = comp + zp->idx->c_off[jobs[i].b] - zp->idx->c_off[b];
+	jobs[i].out  = out  + zp->idx->u_off[jobs[i].b] - zp->idx->u_off[b];
+    }
+
+    if (njobs > 1 && zp->nthreads > 1 && !zp->pool) {
+	if ((zp->pool = t_pool_init(zp->nthreads*2, zp->nthreads)))
+	    zp->q = t_results_queue_init();
+    }
+
+    if (njobs > 1 && zp->pool && zp->q) {
+	t_pool_result *r;
+	uint64_t ndone = 0;
+
+	for (i = 0; i < njobs; i++) {
+	    if (t_pool_dispatch(zp->pool, zp->q, bzi_inflate_job, &jobs[i])
+		< 0) {
+		ret = -1;
+		break;
+	    }
+	}
+	while (ndone < i && (r = t_pool_next_result_wait(zp->q))) {
+	    if (((bzi_job *)r->data)->ret < 0)
+		ret = -1;
+	    t_pool_delete_result(r, 0);
+	    ndone++;
+	}
+    } else {
+	for (i = 0; i < njobs && ret == 0; i++)
+	    ret = ((bzi_job *)bzi_inflate_job(&jobs[i]))->ret;
+    }
+
+    free(jobs);
+    free(comp);
+    return ret;
+}
+
 void bzi_close(bzi_FILE *zp) {
+    int i;
+
     if (!zp)
 	return;
 
+    if (zp->pool) {
+	t_pool_flush(zp->pool);
+	t_pool_destroy(zp->pool, 0);
+    }
+    if (zp->q)
+	t_results_queue_destroy(zp->q);
+
+    for (i = 0; i < BZI_CACHE_SIZE; i++)
+	free(zp->cache[i].data);
+
     if (zp->fp) fclose(zp->fp);
     gzi_index_free(zp->idx);
     free(zp);
@@ -368,17 +652,55 @@ bzi_FILE *bzi_open(const char *path, const char *mode) {
     return NULL;
 }
 
-// NOTE: every read is new seek + load.  Not intended for use on 
-// lots of small reads.
+/*
+ * Sets the number of threads used to inflate large reads from a
+ * bgzipped file. The pool is private to zp and created on first use.
+ */
+void bzi_set_threads(bzi_FILE *zp, int nthreads) {
+    if (zp)
+	zp->nthreads = nthreads;
+}
+
 size_t bzi_read(void *ptr, size_t size, size_t nmemb, bzi_FILE *zp) {
-    if (!zp->idx) {
+    unsigned char *out = (unsigned char *)ptr;
+    size_t len = size*nmemb, done = 0;
+    gzi *idx = zp->idx;
+
+    if (!idx)
 	return fread(ptr, size, nmemb, zp->fp);
-    } else {
-	uint64_t n = gzi_load(zp->fp, zp->idx,
-			      zp->pos, zp->pos + size*nmemb -1, ptr);
-	zp->pos += n;
-	return n;
+
+    while (done < len) {
+	uint64_t b = bzi_block_of(idx, zp->pos), n = 0;
+	uint64_t off = zp->pos - idx->u_off[b];
+	bzi_block *c;
+	size_t l;
+
+	// A run of whole, uncached blocks goes straight to the output
+	if (off == 0) {
+	    while (n < BZI_RUN_MAX && b+n < idx->n &&
+		   idx->u_off[b+n+1] - zp->pos <= len - done &&
+		   !bzi_cached(zp, b+n))
+		n++;
+	}
+	if (n) {
+	    if (bzi_inflate_run(zp, b, n, out + done) < 0)
+		break;
+	    l = idx->u_off[b+n] - zp->pos;
+	    done += l;
+	    zp->pos += l;
+	    continue;
+	}
+
+	// Otherwise copy from the cached block
+	if (!(c = bzi_cache_get(zp, b)) || off >= c->len)
+	    break;
+	l = MIN(c->len - off, len - done);
+	memcpy(out + done, c->data + off, l);
+	done += l;
+	zp->pos += l;
     }
+
+    return size ? done / size : 0;
 }
 
 int bzi_seek(bzi_FILE *zp, off_t offset, int whence) {
@@ -392,6 +714,7 @@ int bzi_seek(bzi_FILE *zp, off_t offset, int whence) {
 	    
 	case SEEK_CUR:
 	    zp->pos += offset;
+	    break;
 
 	default:
 	    // SEEK_END not supported
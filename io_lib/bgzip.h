@@ -54,5 +54,6 @@ bzi_FILE *bzi_open(const char *path, const char *mode);
 void bzi_close(bzi_FILE *zp);
 size_t bzi_read(void *ptr, size_t size, size_t nmemb, bzi_FILE *zp);
 int bzi_seek(bzi_FILE *zp, off_t offset, int whence);
+void bzi_set_threads(bzi_FILE *zp, int nthreads);
 
 #endif /* _BGZIP_H_ */
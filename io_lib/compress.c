@@ -497,11 +497,20 @@ int compress_file(char *file) {
  * When compression_used is 0 no compression is done.
  */
 int fcompress_file(mFILE *fp) {
+    return fcompress_file_method(fp, compression_used);
+}
+
+/*
+ * As fcompress_file, but using 'method' rather than the last used
+ * compression method. This is for callers, such as threads converting
+ * many files at once, that track the method of each file themselves.
+ */
+int fcompress_file_method(mFILE *fp, int method) {
     size_t size;
     char *data;
 
     /* Do nothing unless requested */
-    if (compression_used == 0)
+    if (method <= 0 || method > (int)(sizeof(magics)/sizeof(*magics)))
 	return 0;
 
 #ifdef HAVE_ZLIB
@@ -509,7 +518,7 @@ int fcompress_file(mFILE *fp) {
      * If zlib is used then we use it to implement gzip internally, thus
      * saving starting up a separate process. This is substantially faster.
      */
-    if (compression_used == 2) {
+    if (method == 2) {
 	data = memgzip(fp->data, fp->size, &size);
     } else
 #endif
@@ -519,7 +528,7 @@ int fcompress_file(mFILE *fp) {
 	 * We have to pipe the data via an external tool, avoiding temporary
 	 * files for speed.
 	 */
-	data = pipe_into(magics[compression_used-1].compress,
+	data = pipe_into(magics[method-1].compress,
 			 fp->data, fp->size, &size);
 #else
 	return -1;
@@ -584,6 +593,26 @@ mFILE *fopen_compressed(char *file, mFILE **ofp) {
     return NULL;
 }
 
+/*
+ * Returns the compression method of the data in 'fp', as identified by
+ * its magic number, or 0 if it is not compressed. Unlike
+ * freopen_compressed this does not change the last used method.
+ */
+int detect_compression_method(mFILE *fp) {
+    int num_magics = sizeof(magics) / sizeof(*magics);
+    unsigned char mg[3] = {0};
+    int i;
+
+    mfread(mg, 1, 3, fp);
+    mrewind(fp);
+    for (i = 0; i < num_magics; i++) {
+	if (0 == memcmp(mg, magics[i].magic, magics[i].magicl))
+	    return i+1;
+    }
+
+    return 0;
+}
+
 /*
  * Returns a file pointer of an uncompressed copy of 'fp'.
  * This may be the input fp or it may be a new fp.
@@ -592,28 +621,34 @@ mFILE *fopen_compressed(char *file, mFILE **ofp) {
  * differs, and if so to close that too.
  */
 mFILE *freopen_compressed(mFILE *fp, mFILE **ofp) {
-    int num_magics = sizeof(magics) / sizeof(*magics);
-    unsigned char mg[3];
-    int i;
-    char *udata;
-    size_t usize;
+    mFILE *newfp;
+    int method;
 
     if (ofp) {
 	fprintf(stderr, "ofp not supported in fopen_compressed() yet\n");
 	*ofp = NULL;
     }
 
+    if ((newfp = freopen_compressed_method(fp, &method)))
+	compression_used = method;
+
+    return newfp;
+}
+
+/*
+ * As freopen_compressed, but the compression method found is returned in
+ * *method instead of becoming the last used method. As no global state
+ * is touched this may be called from several threads at once.
+ */
+mFILE *freopen_compressed_method(mFILE *fp, int *method) {
+    int i;
+    char *udata;
+    size_t usize;
+
     /* Test that it's compressed with full magic number */
-    mfread(mg, 1, 3, fp);
-    mrewind(fp);
-    for (i = 0; i < num_magics; i++) {
-	if (0 == memcmp(mg, magics[i].magic, magics[i].magicl))
-	    break;
-    }
-    if (i == num_magics) {
-	compression_used = 0;
+    if (0 == (*method = i = detect_compression_method(fp)))
 	return fp;
-    }
+    i--;
 
 #ifdef HAVE_ZLIB
     if (i == 1) {
@@ -628,8 +663,6 @@ mFILE *freopen_compressed(mFILE *fp, mFILE **ofp) {
 #endif
     }
 
-    compression_used = i+1;
-
     return mfcreate(udata, usize);
 }
 
@@ -102,6 +102,12 @@ extern "C" {
 int compress_file(char *file);
 int fcompress_file(mFILE *fp);
 
+/*
+ * As fcompress_file, but using the given method instead of the last used
+ * compression method.
+ */
+int fcompress_file_method(mFILE *fp, int method);
+
 /*
  * Returns a file pointer of an uncompressed copy of 'file'.
  * 'file' need not exist if 'file'.ext (eg file.gz)
@@ -122,6 +128,18 @@ mFILE *fopen_compressed(char *file, mFILE **ofp);
  */
 mFILE *freopen_compressed(mFILE *fp, mFILE **ofp);
 
+/*
+ * As freopen_compressed, but returns the compression method in *method
+ * rather than setting the last used compression method.
+ */
+mFILE *freopen_compressed_method(mFILE *fp, int *method);
+
+/*
+ * Returns the compression method of the data in 'fp', or 0 if it is not
+ * compressed, without changing the last used compression method.
+ */
+int detect_compression_method(mFILE *fp);
+
 /*
  * Sets the desired compression method. The below macros relate to entries
  * in the compression magic numbers table.
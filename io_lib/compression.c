@@ -710,6 +710,16 @@ char *unxrle2(char *comp, int comp_len, int *uncomp_len) {
  * Implementation ideas taken from Jean Thierry-Mieg's CTF code.
  */
 
+/*
+ * decorrelate1 computes each delta from the input samples alone rather
+ * than carrying u1..u3 through the loop. It works in fixed size blocks
+ * copied to a local buffer (prefixed by the three previous samples, or
+ * zero at the start) with one constant expression per level, so the
+ * inner loops have no loop carried dependencies or aliasing and the
+ * compiler may vectorise them. Arithmetic is modulo 256 as before.
+ */
+#define DBLK 32
+
 /*
  * decorrelate1()
  *
@@ -729,47 +739,44 @@ char *decorrelate1(char *x_uncomp,
 		   int uncomp_len,
 		   int level,
 		   int *comp_len) {
-    int i, z;
-    int u1 = 0, u2 = 0, u3 = 0;
-    char *comp = (char *)xmalloc(uncomp_len + 2);
-    unsigned char *u_uncomp = (unsigned char *)x_uncomp;
+    int i, k;
+    char *comp;
+    unsigned char *u = (unsigned char *)x_uncomp;
 
-    if (!comp)
+    if (level < 1 || level > 3)
 	return NULL;
 
-    comp+=2;
-    switch (level) {
-    case 1:
-	for (i = 0; i < uncomp_len; i++) {
-	    z = u1;
-	    u1 = u_uncomp[i];
-	    comp[i] = u_uncomp[i] - z;
-	}
-	break;
-	
-    case 2:
-	for (i = 0; i < uncomp_len; i++) {
-	    z = 2*u1 - u2;
-	    u2 = u1;
-	    u1 = u_uncomp[i];
-	    comp[i] = u_uncomp[i] - z;
-	}
-	break;
+    if (NULL == (comp = (char *)xmalloc(uncomp_len + 2)))
+	return NULL;
 
-    case 3:
-	for (i = 0; i < uncomp_len; i++) {
-	    z = 3*u1 - 3*u2 + u3;
-	    u3 = u2;
-	    u2 = u1;
-	    u1 = u_uncomp[i];
-	    comp[i] = u_uncomp[i] - z;
+    for (i = 0; i < uncomp_len; i += DBLK) {
+	unsigned char w[DBLK+3], o[DBLK];
+	int n = uncomp_len - i < DBLK ? uncomp_len - i : DBLK;
+
+	for (k = 0; k < 3; k++)
+	    w[k] = i+k >= 3 ? u[i+k-3] : 0;
+	memcpy(w+3, u+i, n);
+	if (n < DBLK)
+	    memset(w+3+n, 0, DBLK-n);
+
+	switch (level) {
+	case 1:
+	    for (k = 0; k < DBLK; k++)
+		o[k] = w[k+3] - w[k+2];
+	    break;
+	case 2:
+	    for (k = 0; k < DBLK; k++)
+		o[k] = w[k+3] - 2*w[k+2] + w[k+1];
+	    break;
+	case 3:
+	    for (k = 0; k < DBLK; k++)
+		o[k] = w[k+3] - 3*w[k+2] + 3*w[k+1] - w[k];
+	    break;
 	}
-	break;
 
-    default:
-	return NULL;
+	memcpy(comp+2+i, o, n);
     }
-    comp-=2;
+
     comp[0] = ZTR_FORM_DELTA1;
     comp[1] = level;
 
@@ -1256,6 +1263,9 @@ char *recorrelate4(char *x_comp,
  * ---------------------------------------------------------------------------
  */
 
+/* Values per block in the 16TO8 fast paths */
+#define BLK16 16
+
 /*
  * shrink_16to8()
  *
@@ -1283,6 +1293,25 @@ char *shrink_16to8(char *x_uncomp, int uncomp_len, int *comp_len) {
 
     comp[0] = ZTR_FORM_16TO8;
     for (i = 0, j = 1; i < uncomp_len; i+=2) {
+	/*
+	 * Fast path: a block of BLK16 values that all fit in 8 bits is just
+	 * the low bytes. The test and copy are both branch free loops.
+	 */
+	if (i + 2*BLK16 <= uncomp_len) {
+	    int k, fits = 1;
+	    for (k = 0; k < 2*BLK16; k+=2) {
+		i16 = (s_uncomp[i+k] << 8) | (unsigned char)s_uncomp[i+k+1];
+		fits &= (unsigned)(i16 + 127) <= 254;
+	    }
+	    if (fits) {
+		for (k = 0; k < BLK16; k++)
+		    comp[j+k] = s_uncomp[i+2*k+1];
+		j += BLK16;
+		i += 2*BLK16-2;
+		continue;
+	    }
+	}
+
 	i16 = (s_uncomp[i] << 8) | (unsigned char)s_uncomp[i+1];
 	if (i16 >= -127 && i16 <= 127) {
 	    comp[j++] = i16;
@@ -1337,6 +1366,25 @@ char *expand_8to16(char *x_comp, int comp_len, int *uncomp_len) {
 #endif
 
     for (i = 0, j = 1; j < comp_len; i+=2) {
+	/*
+	 * Fast path: with no -128 marker in the next BLK16 bytes each is
+	 * simply sign extended to 16 bits.
+	 */
+	if (j + BLK16 <= comp_len) {
+	    int k, plain = 1;
+	    for (k = 0; k < BLK16; k++)
+		plain &= s_comp[j+k] != -128;
+	    if (plain) {
+		for (k = 0; k < BLK16; k++) {
+		    uncomp[i+2*k  ] = s_comp[j+k] < 0 ? -1 : 0;
+		    uncomp[i+2*k+1] = s_comp[j+k];
+		}
+		j += BLK16;
+		i += 2*BLK16-2;
+		continue;
+	    }
+	}
+
 	if (s_comp[j] >= 0) {
 	    uncomp[i  ] = 0;
 	    uncomp[i+1] = s_comp[j++];
@@ -1463,7 +1511,6 @@ char *expand_8to32(char *comp, int comp_len, int *uncomp_len) {
  * ZTR_FORM_FOLLOW1
  * ---------------------------------------------------------------------------
  */
-static int follow_tab[256][256];
 char *follow1(char *x_uncomp,
 	      int uncomp_len,
 	      int *comp_len) {
@@ -1473,12 +1520,17 @@ char *follow1(char *x_uncomp,
     int i, j;
     char next[256];
     int count[256];
+    /* Not static, so follow1 may be called from multiple threads */
+    int (*follow_tab)[256];
 
     if (!comp)
 	return NULL;
 
     /* Count di-freqs */
-    memset(follow_tab, 0, 256*256*sizeof(int));
+    if (NULL == (follow_tab = calloc(256, sizeof(*follow_tab)))) {
+	xfree(comp);
+	return NULL;
+    }
 #if 0
     for (i = 0; i < uncomp_len-1; i++)
 	follow_tab[u_uncomp[i]][u_uncomp[i+1]]++;
@@ -1524,6 +1576,7 @@ char *follow1(char *x_uncomp,
     }
     *comp_len = j;
 
+    free(follow_tab);
     return comp;
 }
 
@@ -1764,20 +1817,83 @@ char *cheb445uncomp(char *comp, int comp_len, int *uncomp_len)
  */
 #define CH1 150
 #define CH2 105
+
+/*
+ * The icheb predictor forms f[0..4] from the previous four samples and
+ * then coef[0..3] from f[] with fz[]. Both steps are linear, so we fold
+ * them into a single 4x4 integer matrix applied directly to the samples.
+ *
+ * frac[N] is always paired with frac[4-N], summing to 150, so f[] has range
+ * 0 to 65536*150. fz[z+0..5] sums to no more than 210 (5*42) and no less
+ * than 0. Therefore coef[l] has range 0 to 65536*150*210, which (just) fits
+ * in 31-bits, plus 1 for the sign. No step overflows, so the folded
+ * matrix gives exactly the same coef[] as the two separate steps.
+ */
+static void icheb_matrix(int m[4][4]) {
+    static const int frac[5] = {139,57,75,93,11};
+    static const int fz[20] = {42, 42, 42, 42, 42,
+				39, 24,  0,-24,-39,
+				33,-12,-42,-12, 33,
+				24,-39,  0, 39,-24};
+    int l;
+
+    for (l = 0; l < 4; l++) {
+	const int *z = &fz[l*5];
+	/* f[3], f[4] use d0;  f[2], f[3], f[4] use d1 */
+	m[l][0] = z[3]*frac[1] + z[4]*frac[0];
+	m[l][1] = z[2]*frac[2] + z[3]*frac[3] + z[4]*frac[4];
+	/* f[0], f[1], f[2] use d2;  f[0], f[1] use d3 */
+	m[l][2] = z[0]*frac[4] + z[1]*frac[3] + z[2]*frac[2];
+	m[l][3] = z[0]*frac[0] + z[1]*frac[1];
+    }
+}
+
+/*
+ * Returns the icheb prediction for the sample following d0..d3.
+ */
+static inline int icheb_predict(int m[4][4], int d0, int d1, int d2, int d3) {
+    int coef[4], l, dd, p, dfac, max = 0;
+
+    for (l = 0; l < 4; l++)
+	coef[l] = m[l][0]*d0 + m[l][1]*d1 + m[l][2]*d2 + m[l][3]*d3;
+
+    /*
+     * computing p requires at most a temporary variable of 
+     * 24.1 * coef, but coef may be a full 32-bit integer.
+     * If coef is sufficiently close to cause an integer overflow then
+     * we scale it down.
+     */
+    for (l = 0; l < 4; l++) {
+	if (max < ABS(coef[l]))
+	    max = ABS(coef[l]);
+    }
+
+    if (max > 1<<26) {
+	dfac = max / (1<<26) + 1;
+	for (l = 0; l < 4; l++)
+	    coef[l] /= dfac;
+    } else {
+	dfac = 1;
+    }
+
+    dd = (coef[3]/3)*10+coef[2];
+    p = ((((dd/3)*10-coef[3]+coef[1])/3)*5-dd+coef[0]/2)/(CH1*CH2);
+    p *= dfac;
+
+    return p < 0 ? 0 : p;
+}
+
 char *ichebcomp(char *uncomp, int uncomp_len, int *data_len)
 {
-    int i, l, z;
+    int i, m[4][4];
     int datap;
-    int frac[5] = {139,57,75,93,11};
-    int fz[20] = {42, 42, 42, 42, 42,
-		  39, 24,  0,-24,-39,
-		  33,-12,-42,-12, 33,
-		  24,-39,  0, 39,-24};
-    int dfac;
     signed short *d16 = (signed short *)uncomp;
     int nwords = uncomp_len / 2;
-    short *dptr = d16;
     signed short *data = (signed short *)malloc((nwords+1)*sizeof(short));
+    unsigned short *w;
+
+    if (!data)
+	return NULL;
 
     data[0] = le_int2(ZTR_FORM_ICHEB);
     /* Check for boundary cases */
@@ -1803,82 +1919,24 @@ char *ichebcomp(char *uncomp, int uncomp_len, int *data_len)
     data[4] = be_int2(be_int2(d16[3])-be_int2(d16[2]));
     datap = 5;
 
-    /* Loop */
-    for (i = 4; i < nwords; i++) {
-	int dd, f[5];
-	signed int coef[4];
-	signed short diff;
-	int p;
-
-	/*
-	 * FIXME: As an alternative to the range checking below, if we
-	 * scale dptr[X] such that it's never higher than 2800 then
-	 * the 32-bit arithmetic will never overflow. Practically speaking,
-	 * all observed ABI and Megabace files have vales up to 1600 only.
-	 */
-
-	/*
-	 * frac[N] is always paired with frac[4-N], summing to 1.0 - or
-	 * 150 when scaled.
-	 * Hence f[0] has range 0 to 65536*150.
-	 */
-	f[0] = ((unsigned short)be_int2(dptr[2]))*frac[4] +
-	       ((unsigned short)be_int2(dptr[3]))*frac[0];
-	f[1] = ((unsigned short)be_int2(dptr[2]))*frac[3] +
-	       ((unsigned short)be_int2(dptr[3]))*frac[1];
-	f[2] = ((unsigned short)be_int2(dptr[1]))*frac[2] +
-	       ((unsigned short)be_int2(dptr[2]))*frac[2];
-	f[3] = ((unsigned short)be_int2(dptr[0]))*frac[1] +
-	       ((unsigned short)be_int2(dptr[1]))*frac[3];
-	f[4] = ((unsigned short)be_int2(dptr[0]))*frac[0] +
-	       ((unsigned short)be_int2(dptr[1]))*frac[4];
-
-	/*
-	 * fz[z+0..5] sums to no more than 210 (5*42) and no less than 0.
-	 * Therefore coef[l] has range 0 to 65536*150*210, which (just)
-	 * fits in 31-bits, plus 1 for the sign.
-	 */
-	for (z = l = 0; l < 4; l++, z+=5)
-	    coef[l] = (f[0] * fz[z+0] +
-		       f[1] * fz[z+1] +
-		       f[2] * fz[z+2] +
-		       f[3] * fz[z+3] +
-		       f[4] * fz[z+4]);
-
-	/*
-	 * computing p requires at most a temporary variable of 
-	 * 24.1 * coef, but coef may be a full 32-bit integer.
-	 * If coef is sufficiently close to cause an integer overflow then
-	 * we scale it down.
-	 */
-	{
-	    int max = 0;
-
-	    for (l = 0; l < 4; l++) {
-		if (max < ABS(coef[l]))
-		    max = ABS(coef[l]);
-	    }
-
-    
-	    if (max > 1<<26) {
-		dfac = max / (1<<26) + 1;
-		for (l = 0; l < 4; l++)
-		    coef[l] /= dfac;
-	    } else {
-		dfac = 1;
-	    }
-	}
-
-	dd = (coef[3]/3)*10+coef[2];
-	p = ((((dd/3)*10-coef[3]+coef[1])/3)*5-dd+coef[0]/2)/(CH1*CH2);
-	p *= dfac;
+    /*
+     * Byte swap the input once up front. Each prediction then depends only
+     * on the input, not on earlier outputs.
+     */
+    if (NULL == (w = (unsigned short *)malloc(nwords * sizeof(*w)))) {
+	free(data);
+	return NULL;
+    }
+    for (i = 0; i < nwords; i++)
+	w[i] = be_int2(d16[i]);
 
-	if (p < 0) p = 0;
-	diff = be_int2(dptr[4]) - p;
+    icheb_matrix(m);
+    for (i = 4; i < nwords; i++) {
+	int p = icheb_predict(m, w[i-4], w[i-3], w[i-2], w[i-1]);
+	signed short diff = w[i] - p;
 	data[datap++] = be_int2(diff);
-
-	dptr++;
     }
+    free(w);
 
     *data_len = datap*2;
 
@@ -1887,17 +1945,15 @@ char *ichebcomp(char *uncomp, int uncomp_len, int *data_len)
 
 char *ichebuncomp(char *comp, int comp_len, int *uncomp_len)
 {
-    int i, l, z;
-    int frac[5] = {139,57,75,93,11};
-    int fz[20] = {42, 42, 42, 42, 42,
-		  39, 24,  0,-24,-39,
-		  33,-12,-42,-12, 33,
-		  24,-39,  0, 39,-24};
+    int i, m[4][4];
     signed short *d16 = (signed short *)comp;
     int nwords = comp_len / 2 - 1;
     signed short *data = (signed short *)xmalloc(comp_len);
     short *dptr = data, *dptr2 = d16;
-    int dfac;
+    unsigned short w0, w1, w2, w3;
+
+    if (!data)
+	return NULL;
 
     /* Check for boundary cases */
     if (nwords <= 4) {
@@ -1932,64 +1988,18 @@ char *ichebuncomp(char *comp, int comp_len, int *uncomp_len)
     data[3] = be_int2(be_int2(d16[4])+be_int2(data[2]));
     dptr2 += 5;
 
-    /* Loop */
+    /* Loop, keeping the last four (native endian) samples in registers */
+    icheb_matrix(m);
+    w0 = be_int2(dptr[0]);
+    w1 = be_int2(dptr[1]);
+    w2 = be_int2(dptr[2]);
+    w3 = be_int2(dptr[3]);
     for (i = 4; i < nwords; i++) {
-	int dd, coef[5], f[5];
-	signed short diff;
-	int p;
-	    
-	f[0] = ((unsigned short)be_int2(dptr[2]))*frac[4] +
-	       ((unsigned short)be_int2(dptr[3]))*frac[0];
-	f[1] = ((unsigned short)be_int2(dptr[2]))*frac[3] +
-	       ((unsigned short)be_int2(dptr[3]))*frac[1];
-	f[2] = ((unsigned short)be_int2(dptr[1]))*frac[2] +
-	       ((unsigned short)be_int2(dptr[2]))*frac[2];
-	f[3] = ((unsigned short)be_int2(dptr[0]))*frac[1] +
-	       ((unsigned short)be_int2(dptr[1]))*frac[3];
-	f[4] = ((unsigned short)be_int2(dptr[0]))*frac[0] +
-	       ((unsigned short)be_int2(dptr[1]))*frac[4];
-    
-	for (z = l = 0; l < 4; l++, z+=5)
-	    coef[l] = f[0] * fz[z+0] +
-		      f[1] * fz[z+1] +
-		      f[2] * fz[z+2] +
-		      f[3] * fz[z+3] +
-		      f[4] * fz[z+4];
+	int p = icheb_predict(m, w0, w1, w2, w3);
+	signed short diff = be_int2(dptr2[i-4]) + p;
 
-	/*
-	 * computing p requires at most a temporary variable of 
-	 * 24.1 * coef, but coef may be a full 32-bit integer.
-	 * If coef is sufficiently close to cause an integer overflow then
-	 * we scale it down.
-	 */
-	{
-	    int max = 0;
-
-	    for (l = 0; l < 4; l++) {
-		if (max < ABS(coef[l]))
-		    max = ABS(coef[l]);
-	    }
-
-    
-	    if (max > 1<<26) {
-		dfac = max / (1<<26) + 1;
-		for (l = 0; l < 4; l++)
-		    coef[l] /= dfac;
-	    } else {
-		dfac = 1;
-	    }
-	}
-
-	dd = (coef[3]/3)*10+coef[2];
-	p = ((((dd/3)*10-coef[3]+coef[1])/3)*5-dd+coef[0]/2)/(CH1*CH2);
-	p *= dfac;
-
-	if (p < 0) p = 0;
-	diff = be_int2(*dptr2) + p;
-	dptr[4] = be_int2(diff);
-
-	dptr++;
-	dptr2++;
+	data[i] = be_int2(diff);
+	w0 = w1; w1 = w2; w2 = w3; w3 = diff;
     }
 
     *uncomp_len = nwords*2;
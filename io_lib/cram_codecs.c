@@ -2092,7 +2092,9 @@ int cram_codec_decoder2encoder(cram_fd *fd, cram_codec *c) {
 	// New structure, so switch.
 	// FIXME: we huffman and e_huffman structs amended, we could
 	// unify this.
-	cram_codec *t = malloc(sizeof(*t));
+	cram_codec *t = calloc(1, sizeof(*t));
+	if (!t)
+	    return -1;
 	t->codec = E_HUFFMAN;
 	t->free = cram_huffman_encode_free;
 	t->store = cram_huffman_encode_store;
@@ -2104,18 +2106,19 @@ int cram_codec_decoder2encoder(cram_fd *fd, cram_codec *c) {
 		t->e_huffman.val2code[sym+1] = j;
 	}
 
+	// The option picks the symbol size when storing the header.
 	if (c->decode == cram_huffman_decode_char0)
-	    t->encode = cram_huffman_encode_char0;
+	    t->encode = cram_huffman_encode_char0, t->e_huffman.option = E_BYTE;
 	else if (c->decode == cram_huffman_decode_char)
-	    t->encode = cram_huffman_encode_char;
+	    t->encode = cram_huffman_encode_char, t->e_huffman.option = E_BYTE;
 	else if (c->decode == cram_huffman_decode_int0)
-	    t->encode = cram_huffman_encode_int0;
+	    t->encode = cram_huffman_encode_int0, t->e_huffman.option = E_INT;
 	else if (c->decode == cram_huffman_decode_int)
-	    t->encode = cram_huffman_encode_int;
+	    t->encode = cram_huffman_encode_int, t->e_huffman.option = E_INT;
 	else if (c->decode == cram_huffman_decode_long0)
-	    t->encode = cram_huffman_encode_long0;
+	    t->encode = cram_huffman_encode_long0, t->e_huffman.option = E_LONG;
 	else if (c->decode == cram_huffman_decode_long)
-	    t->encode = cram_huffman_encode_long;
+	    t->encode = cram_huffman_encode_long, t->e_huffman.option = E_LONG;
 	else {
 	    free(t);
 	    return -1;
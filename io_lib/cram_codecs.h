@@ -183,6 +183,17 @@ static inline int cram_not_enough_bits(cram_block *blk, int nbits) {
  */
 int cram_codec_to_id(cram_codec *c, int *id2);
 
+/*
+ * Integer functions for the EXTERNAL codec, exposed so the slice decoder
+ * and encoder can recognise series they may handle in bulk.
+ */
+int cram_external_decode_int(cram_slice *slice, cram_codec *c,
+			     cram_block *in, char *out, int *out_size);
+int cram_external_decode_long(cram_slice *slice, cram_codec *c,
+			      cram_block *in, char *out, int *out_size);
+int cram_external_encode_int(cram_slice *slice, cram_codec *c,
+			     char *in, int in_size);
+
 /*
  * cram_codec structures are specialised for decoding or encoding.
  * Unfortunately this makes turning a decoder into an encoder (such as
@@ -950,7 +950,8 @@ int cram_dependent_data_series(cram_fd *fd,
 }
 
 /*
- * Checks whether an external block is used solely by a single data series.
+ * Checks whether an external block is used solely by a single data series,
+ * and not by any other series or aux tag.
  * Returns the codec type if so (EXTERNAL, BYTE_ARRAY_LEN, BYTE_ARRAY_STOP)
  *         or 0 if not (E_NULL).
  */
@@ -982,6 +983,22 @@ static int cram_ds_unique(cram_block_compression_hdr *hdr, cram_codec *c,
 	    n_id--; // len/val in same place counts once only.
     }
 
+    /* Aux tags may share the block too */
+    for (i = 0; i < CRAM_MAP_HASH; i++) {
+	cram_map *m;
+
+	for (m = hdr->tag_encoding_map[i]; m; m = m->next) {
+	    int bnum1, bnum2;
+
+	    if (!m->codec)
+		continue;
+
+	    bnum1 = cram_codec_to_id(m->codec, &bnum2);
+	    if (bnum1 == id || bnum2 == id)
+		n_id++;
+	}
+    }
+
     return n_id == 1 ? e_type : 0;
 }
 
@@ -1023,6 +1040,146 @@ void cram_decode_estimate_sizes(cram_block_compression_hdr *hdr, cram_slice *s,
 }
 
 
+/*
+ * Integer data series which may be decoded in bulk by cram_decode_columns.
+ * Every use of these in the slice decoder goes via cram_ds_decode.
+ */
+static const struct {
+    int id;
+    uint32_t ds;
+} cram_column_ds[] = {
+    {DS_BF, CRAM_BF}, {DS_CF, CRAM_CF}, {DS_RI, CRAM_RI}, {DS_RL, CRAM_RL},
+    {DS_AP, CRAM_AP}, {DS_RG, CRAM_RG}, {DS_MF, CRAM_MF}, {DS_NS, CRAM_NS},
+    {DS_NF, CRAM_NF}, {DS_NP, CRAM_NP}, {DS_TS, CRAM_TS}, {DS_TL, CRAM_TL},
+    {DS_FN, CRAM_FN}, {DS_FP, CRAM_FP}, {DS_MQ, CRAM_MQ}, {DS_RS, CRAM_RS},
+    {DS_PD, CRAM_PD}, {DS_HC, CRAM_HC}, {DS_DL, CRAM_DL},
+};
+
+/*
+ * Decodes an entire block of ITF8 values into col. Runs of
+ * single byte values, the common case for flags, lengths and deltas, are
+ * spotted 8 at a time and widened without per-value branching.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+static int cram_decode_column(cram_block *b, cram_column *col) {
+    const char *cp = (char *)b->data + b->idx;
+    const char *endp = (char *)b->data + b->uncomp_size;
+    int32_t *val;
+    int n = 0;
+
+    /* At most one value per byte */
+    if (!(val = malloc((endp - cp + 1) * sizeof(*val))))
+	return -1;
+
+    while (cp < endp) {
+	int i, l;
+
+	if (endp - cp >= 8) {
+	    uint64_t w;
+	    memcpy(&w, cp, 8);
+	    if (!(w & 0x8080808080808080ULL)) {
+		for (i = 0; i < 8; i++)
+		    val[n+i] = (uint8_t)cp[i];
+		n  += 8;
+		cp += 8;
+		continue;
+	    }
+	}
+
+	if ((l = safe_itf8_get(cp, endp, &val[n++])) <= 0) {
+	    free(val);
+	    return -1;
+	}
+	cp += l;
+    }
+
+    col->val = val;
+    col->n = n;
+    col->idx = 0;
+
+    return 0;
+}
+
+/*
+ * Columnar pre-pass for cram_decode_slice. Integer data series held with
+ * the EXTERNAL codec in a block of their own have no dependency on the
+ * order of decoding other series, so we decode all of their values for
+ * the slice in one tight loop. The record loop then just steps through
+ * the resulting arrays (see cram_ds_decode).
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+static int cram_decode_columns(cram_block_compression_hdr *hdr,
+			       cram_slice *s) {
+    int i;
+
+    cram_free_columns(s);
+
+    for (i = 0; i < sizeof(cram_column_ds)/sizeof(*cram_column_ds); i++) {
+	int id = cram_column_ds[i].id;
+	cram_codec *cd = hdr->codecs[id];
+	cram_block *b;
+
+	if (!(s->data_series & cram_column_ds[i].ds) || !cd ||
+	    cd->codec != E_EXTERNAL || cd->decode != cram_external_decode_int)
+	    continue;
+
+	if (!cram_ds_unique(hdr, cd, cd->external.content_id))
+	    continue;
+
+	b = cram_get_block_by_id(s, cd->external.content_id);
+	if (!b || b->method != RAW)
+	    continue;
+
+	if (!s->cols && !(s->cols = calloc(DS_END, sizeof(*s->cols))))
+	    return -1;
+
+	if (cram_decode_column(b, &s->cols[id]) < 0)
+	    return -1;
+    }
+
+    return 0;
+}
+
+void cram_free_columns(cram_slice *s) {
+    int i;
+
+    if (!s->cols)
+	return;
+
+    for (i = 0; i < DS_END; i++)
+	free(s->cols[i].val);
+    free(s->cols);
+    s->cols = NULL;
+}
+
+/*
+ * Decodes one value of integer data series 'id', from its pre-decoded
+ * column if it has one or via the codec otherwise.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+static inline int cram_ds_decode(cram_slice *s, cram_codec *cd, int id,
+				 cram_block *blk, char *out, int *out_size) {
+    cram_column *col;
+
+    if (!s->cols || !(col = &s->cols[id])->val)
+	return cd->decode(s, cd, blk, out, out_size);
+
+    if (col->idx >= col->n)
+	return -1;
+
+    *(int32_t *)out = col->val[col->idx++];
+    *out_size = 1;
+
+    return 0;
+}
+
+
 /* ----------------------------------------------------------------------
  * CRAM slices
  */
@@ -1335,8 +1492,8 @@ static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
     
     if (ds & CRAM_FN) {
 	if (!c->comp_hdr->codecs[DS_FN]) return -1;
-	r |= c->comp_hdr->codecs[DS_FN]->decode(s,c->comp_hdr->codecs[DS_FN],
-						blk, (char *)&fn, &out_sz);
+	r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_FN], DS_FN, blk,
+			    (char *)&fn, &out_sz);
         if (r) return r;
     } else {
 	fn = 0;
@@ -1372,10 +1529,8 @@ static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
 	    continue;
 
 	if (!c->comp_hdr->codecs[DS_FP]) return -1;
-	r |= c->comp_hdr->codecs[DS_FP]->decode(s,
-						c->comp_hdr->codecs[DS_FP],
-						blk,
-						(char *)&pos, &out_sz);
+	r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_FP], DS_FP, blk,
+			    (char *)&pos, &out_sz);
 	if (r) return r;
 	pos += prev_pos;
 
@@ -1558,9 +1713,8 @@ static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
 	    }
 	    if (ds & CRAM_DL) {
 		if (!c->comp_hdr->codecs[DS_DL]) return -1;
-		r |= c->comp_hdr->codecs[DS_DL]
-		                ->decode(s, c->comp_hdr->codecs[DS_DL], blk,
-					 (char *)&i32, &out_sz);
+		r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_DL], DS_DL, blk,
+				    (char *)&i32, &out_sz);
 		if (r) return r;
 		if (decode_md || decode_nm) {
 		    if (md_dist >= 0 && decode_md)
@@ -1788,9 +1942,8 @@ static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
 	    }
 	    if (ds & CRAM_HC) {
 		if (!c->comp_hdr->codecs[DS_HC]) return -1;
-		r |= c->comp_hdr->codecs[DS_HC]
-		                ->decode(s, c->comp_hdr->codecs[DS_HC], blk,
-					 (char *)&i32, &out_sz);
+		r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_HC], DS_HC, blk,
+				    (char *)&i32, &out_sz);
 		if (r) return r;
 		cig_op = BAM_CHARD_CLIP;
 		cig_len += i32;
@@ -1805,9 +1958,8 @@ static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
 	    }
 	    if (ds & CRAM_PD) {
 		if (!c->comp_hdr->codecs[DS_PD]) return -1;
-		r |= c->comp_hdr->codecs[DS_PD]
-		                ->decode(s, c->comp_hdr->codecs[DS_PD], blk,
-					 (char *)&i32, &out_sz);
+		r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_PD], DS_PD, blk,
+				    (char *)&i32, &out_sz);
 		if (r) return r;
 		cig_op = BAM_CPAD;
 		cig_len += i32;
@@ -1823,9 +1975,8 @@ static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
 	    }
 	    if (ds & CRAM_RS) {
 		if (!c->comp_hdr->codecs[DS_RS]) return -1;
-		r |= c->comp_hdr->codecs[DS_RS]
-		                ->decode(s, c->comp_hdr->codecs[DS_RS], blk,
-					 (char *)&i32, &out_sz);
+		r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_RS], DS_RS, blk,
+				    (char *)&i32, &out_sz);
 		if (r) return r;
 		cig_op = BAM_CREF_SKIP;
 		cig_len += i32;
@@ -1925,9 +2076,8 @@ static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
 
     if (ds & CRAM_MQ) {
 	if (!c->comp_hdr->codecs[DS_MQ]) return -1;
-	r |= c->comp_hdr->codecs[DS_MQ]
-	                ->decode(s, c->comp_hdr->codecs[DS_MQ], blk,
-				 (char *)&cr->mqual, &out_sz);
+	r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_MQ], DS_MQ, blk,
+			    (char *)&cr->mqual, &out_sz);
     } else {
 	cr->mqual = 40;
     }
@@ -2047,8 +2197,8 @@ static int cram_decode_aux(cram_container *c, cram_slice *s,
     }
 
     if (!c->comp_hdr->codecs[DS_TL]) return -1;
-    r |= c->comp_hdr->codecs[DS_TL]->decode(s, c->comp_hdr->codecs[DS_TL], blk,
-					    (char *)&TL, &out_sz);
+    r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_TL], DS_TL, blk,
+			(char *)&TL, &out_sz);
     if (r || TL < 0 || TL >= c->comp_hdr->nTL)
 	return -1;
 
@@ -2343,6 +2493,9 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
     ds = s->data_series;
     //printf("%08x\n", ds);
 
+    if (cram_decode_columns(c->comp_hdr, s) != 0)
+	return -1;
+
     blk->bit = 7; // MSB first
 
     // Study the blocks and estimate approx sizes to preallocate.
@@ -2403,6 +2556,12 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 		fprintf(stderr, "Embedded reference is too small.\n");
 		return -1;
 	    }
+
+	    // A de novo consensus is embedded without an MD5, and
+	    // MD/NM computed against it would be meaningless.
+	    if (!IS_CRAM_1_VERS(fd) &&
+		!memcmp(s->hdr->md5, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16))
+		s->decode_md = 0;
 	} else if (!c->comp_hdr->no_ref) {
 	    //// Avoid Java cramtools bug by loading entire reference seq 
 	    //s->ref = cram_get_ref(fd, s->hdr->ref_seq_id, 1, 0);
@@ -2513,9 +2672,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	out_sz = 1; /* decode 1 item */
 	if (ds & CRAM_BF) {
 	    if (!c->comp_hdr->codecs[DS_BF]) return -1;
-	    r |= c->comp_hdr->codecs[DS_BF]
-		            ->decode(s, c->comp_hdr->codecs[DS_BF], blk,
-				     (char *)&bf, &out_sz);
+	    r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_BF], DS_BF, blk,
+				(char *)&bf, &out_sz);
 	    if (r || bf < 0 ||
 		bf >= sizeof(fd->bam_flag_swap)/sizeof(*fd->bam_flag_swap))
 		return -1;
@@ -2536,9 +2694,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 		cr->cram_flags = cf;
 	    } else {
 		if (!c->comp_hdr->codecs[DS_CF]) return -1;
-		r |= c->comp_hdr->codecs[DS_CF]
-		                ->decode(s, c->comp_hdr->codecs[DS_CF], blk,
-					 (char *)&cr->cram_flags, &out_sz);
+		r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_CF], DS_CF, blk,
+				    (char *)&cr->cram_flags, &out_sz);
 		if (r) return -1;
 		cf = cr->cram_flags;
 	    }
@@ -2549,9 +2706,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	if (!IS_CRAM_1_VERS(fd) && ref_id == -2) {
 	    if (ds & CRAM_RI) {
 		if (!c->comp_hdr->codecs[DS_RI]) return -1;
-		r |= c->comp_hdr->codecs[DS_RI]
-		                ->decode(s, c->comp_hdr->codecs[DS_RI], blk,
-					 (char *)&cr->ref_id, &out_sz);
+		r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_RI], DS_RI, blk,
+				    (char *)&cr->ref_id, &out_sz);
 		if (r) return -1;
 		if ((fd->required_fields & (SAM_SEQ|SAM_TLEN))
 		    && cr->ref_id >= 0
@@ -2589,9 +2745,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 
 	if (ds & CRAM_RL) {
 	    if (!c->comp_hdr->codecs[DS_RL]) return -1;
-	    r |= c->comp_hdr->codecs[DS_RL]
-		            ->decode(s, c->comp_hdr->codecs[DS_RL], blk,
-				     (char *)&cr->len, &out_sz);
+	    r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_RL], DS_RL, blk,
+				(char *)&cr->len, &out_sz);
 	    if (r) return r;
 	    if (cr->len < 0) {
 	        fprintf(stderr, "Read has negative length\n");
@@ -2603,9 +2758,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	    if (!c->comp_hdr->codecs[DS_AP]) return -1;
 	    if (CRAM_MAJOR_VERS(fd->version) < 4) {
 		int32_t i32;
-		r |= c->comp_hdr->codecs[DS_AP]
-		                ->decode(s, c->comp_hdr->codecs[DS_AP], blk,
-					 (char *)&i32, &out_sz);
+		r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_AP], DS_AP, blk,
+				    (char *)&i32, &out_sz);
 		cr->apos = i32;
 	    } else {
 		r |= c->comp_hdr->codecs[DS_AP]
@@ -2622,9 +2776,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 		    
 	if (ds & CRAM_RG) {
 	    if (!c->comp_hdr->codecs[DS_RG]) return -1;
-	    r |= c->comp_hdr->codecs[DS_RG]
-		           ->decode(s, c->comp_hdr->codecs[DS_RG], blk,
-				    (char *)&cr->rg, &out_sz);
+	    r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_RG], DS_RG, blk,
+				(char *)&cr->rg, &out_sz);
 	    if (r) return r;
 	    if (cr->rg == unknown_rg)
 		cr->rg = -1;
@@ -2665,11 +2818,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 		    cr->mate_flags = mf;
 		} else {
 		    if (!c->comp_hdr->codecs[DS_MF]) return -1;
-		    r |= c->comp_hdr->codecs[DS_MF]
-			            ->decode(s, c->comp_hdr->codecs[DS_MF],
-					     blk,
-					     (char *)&cr->mate_flags,
-					     &out_sz);
+		    r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_MF], DS_MF, blk,
+					(char *)&cr->mate_flags, &out_sz);
 		    if (r) return r;
 		}
 	    } else {
@@ -2694,9 +2844,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 		    
 	    if (ds & CRAM_NS) {
 		if (!c->comp_hdr->codecs[DS_NS]) return -1;
-		r |= c->comp_hdr->codecs[DS_NS]
-		                ->decode(s, c->comp_hdr->codecs[DS_NS], blk,
-					 (char *)&cr->mate_ref_id, &out_sz);
+		r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_NS], DS_NS, blk,
+				    (char *)&cr->mate_ref_id, &out_sz);
 		if (r) return r;
 	    }
 
@@ -2710,9 +2859,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 		if (!c->comp_hdr->codecs[DS_NP]) return -1;
 		if (CRAM_MAJOR_VERS(fd->version) < 4) {
 		    int32_t i32;
-		    r |= c->comp_hdr->codecs[DS_NP]
-			            ->decode(s, c->comp_hdr->codecs[DS_NP], blk,
-					     (char *)&i32, &out_sz);
+		    r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_NP], DS_NP, blk,
+					(char *)&i32, &out_sz);
 		    cr->mate_pos = i32;
 		} else {
 		    r |= c->comp_hdr->codecs[DS_NP]
@@ -2726,9 +2874,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 		if (!c->comp_hdr->codecs[DS_TS]) return -1;
 		if (CRAM_MAJOR_VERS(fd->version) < 4) {
 		    int32_t i32;
-		    r |= c->comp_hdr->codecs[DS_TS]
-			->decode(s, c->comp_hdr->codecs[DS_TS], blk,
-				 (char *)&i32, &out_sz);
+		    r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_TS], DS_TS, blk,
+					(char *)&i32, &out_sz);
 		    cr->tlen = i32;
 		} else {
 		    r |= c->comp_hdr->codecs[DS_TS]
@@ -2742,9 +2889,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	} else if ((ds & CRAM_CF) && (cf & CRAM_FLAG_MATE_DOWNSTREAM)) {
 	    if (ds & CRAM_NF) {
 		if (!c->comp_hdr->codecs[DS_NF]) return -1;
-		r |= c->comp_hdr->codecs[DS_NF]
-		                ->decode(s, c->comp_hdr->codecs[DS_NF], blk,
-					 (char *)&cr->mate_line, &out_sz);
+		r |= cram_ds_decode(s, c->comp_hdr->codecs[DS_NF], DS_NF, blk,
+				    (char *)&cr->mate_line, &out_sz);
 		if (r) return r;
 		cr->mate_line += rec + 1;
 
@@ -2883,6 +3029,7 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
     r |= cram_decode_slice_xref(s, fd->required_fields);
 
     // Free the original blocks as we no longer need these.
+    cram_free_columns(s);
     {
 	int i;
 	for (i = 0; i < s->hdr->num_blocks; i++) {
@@ -3503,28 +3650,17 @@ cram_record *cram_get_seq(cram_fd *fd) {
 }
 
 /*
- * Read the next cram record and convert it to a bam_seq_t struct.
+ * Converts record rec (cr) of a decoded slice to a bam_seq_t struct.
  *
  * Returns 0 on success
- *        -1 on EOF or failure (check fd->err)
+ *        -1 on failure
  */
-int cram_get_bam_seq(cram_fd *fd, bam_seq_t **bam) {
-    cram_record *cr;
-    cram_container *c;
-    cram_slice *s;
-
-    if (!(cr = cram_get_seq(fd))) {
-	//*bam=0;
-	return -1;
-    }
-
-    c = fd->ctr;
-    s = c->slice;
-
+static int cram_slice_to_bam(cram_fd *fd, cram_slice *s, cram_record *cr,
+			     int rec, bam_seq_t **bam) {
     if (s->bl) {
-	//*bam = s->bl[s->curr_rec-1]; return 0;
+	//*bam = s->bl[rec]; return 0;
 
-	// Ideally we'd just do: *bam = s->bl[s->curr_rec-1];
+	// Ideally we'd just do: *bam = s->bl[rec];
 	// That works, but it changes the API as the bam object is
 	// no longer a malloced block of memory and cannot be
 	// freed by the caller.  (Possibly we can do *bam=0
@@ -3535,7 +3671,7 @@ int cram_get_bam_seq(cram_fd *fd, bam_seq_t **bam) {
 	// Hence instead we laboriously manage the memory and do a
 	// memcpy each time.  (This is around an extra 40% time taken
 	// in main to decode a CRAM file, harming parallel execution.)
-	int sz = s->bl[s->curr_rec-1]->alloc;
+	int sz = s->bl[rec]->alloc;
 	if (!*bam) {
 	    if (!(*bam = malloc(sz)))
 		return -1;
@@ -3545,9 +3681,331 @@ int cram_get_bam_seq(cram_fd *fd, bam_seq_t **bam) {
 		return -1;
 	    (*bam)->alloc = sz;
 	}
-	memcpy(*bam, s->bl[s->curr_rec-1], sz);
+	memcpy(*bam, s->bl[rec], sz);
 	return 0;
     }
 
-    return cram_to_bam(fd->header, fd, s, cr, s->curr_rec-1, bam) >= 0 ? 0 : -1;
+    return cram_to_bam(fd->header, fd, s, cr, rec, bam) >= 0 ? 0 : -1;
+}
+
+/*
+ * Read the next cram record and convert it to a bam_seq_t struct.
+ *
+ * Returns 0 on success
+ *        -1 on EOF or failure (check fd->err)
+ */
+int cram_get_bam_seq(cram_fd *fd, bam_seq_t **bam) {
+    cram_record *cr;
+    cram_container *c;
+    cram_slice *s;
+
+    if (fd->iter)
+	return cram_iter_next(fd->iter, bam, NULL, NULL);
+
+    if (!(cr = cram_get_seq(fd))) {
+	//*bam=0;
+	return -1;
+    }
+
+    c = fd->ctr;
+    s = c->slice;
+
+    return cram_slice_to_bam(fd, s, cr, s->curr_rec-1, bam);
+}
+
+/* ----------------------------------------------------------------------
+ * Multi-region iteration.
+ *
+ * Rather than seeking once per region, we ask the index for every slice
+ * overlapping any region and visit them in file order. Each container
+ * and slice is therefore read and decoded at most once, however many
+ * regions overlap it, and each record is reported along with all of the
+ * regions it matches.
+ */
+
+typedef struct {
+    cram_range r;
+    int n;
+} cram_iter_region;
+
+static int cram_iter_region_cmp(const void *vp1, const void *vp2) {
+    const cram_iter_region *r1 = (const cram_iter_region *)vp1;
+    const cram_iter_region *r2 = (const cram_iter_region *)vp2;
+    // Unmapped data (refid -1) is at the end of the file
+    unsigned int id1 = r1->r.refid, id2 = r2->r.refid;
+
+    if (id1 != id2)
+	return id1 < id2 ? -1 : 1;
+    if (r1->r.start != r2->r.start)
+	return r1->r.start < r2->r.start ? -1 : 1;
+    return r1->n - r2->n;
+}
+
+/*
+ * Creates an iterator over nr regions. The index must already have been
+ * loaded. Regions may be given in any order and may overlap; refid -1
+ * selects the unmapped data.
+ *
+ * Returns the iterator on success
+ *         NULL on failure
+ */
+cram_iter *cram_iter_create(cram_fd *fd, cram_range *r, int nr) {
+    cram_iter *it;
+    cram_iter_region *tmp;
+    int i;
+
+    if (!fd->index) {
+	fprintf(stderr, "Multi-region queries need a CRAM index\n");
+	return NULL;
+    }
+
+    for (i = 0; i < nr; i++) {
+	if (r[i].refid < -1) {
+	    fprintf(stderr, "Invalid reference ID in region list\n");
+	    return NULL;
+	}
+    }
+
+    if (!(it = calloc(1, sizeof(*it))))
+	return NULL;
+    it->fd = fd;
+    it->nregion = nr;
+
+    if (!(tmp = malloc((nr ? nr : 1) * sizeof(*tmp))) ||
+	!(it->region = malloc((nr ? nr : 1) * sizeof(*it->region))) ||
+	!(it->order  = malloc((nr ? nr : 1) * sizeof(*it->order))) ||
+	!(it->match  = malloc((nr ? nr : 1) * sizeof(*it->match)))) {
+	free(tmp);
+	cram_iter_destroy(it);
+	return NULL;
+    }
+
+    for (i = 0; i < nr; i++) {
+	tmp[i].r = r[i];
+	tmp[i].n = i;
+    }
+    qsort(tmp, nr, sizeof(*tmp), cram_iter_region_cmp);
+    for (i = 0; i < nr; i++) {
+	it->region[i] = tmp[i].r;
+	it->order[i]  = tmp[i].n;
+    }
+    free(tmp);
+
+    if ((it->nslice = cram_index_slices(fd, it->region, nr, &it->slice)) < 0) {
+	cram_iter_destroy(it);
+	return NULL;
+    }
+
+    return it;
+}
+
+/*
+ * Creates an iterator returning the records called name. The read name
+ * index must already have been loaded with cram_name_index_load, and
+ * only the slices it lists are decoded.
+ *
+ * Returns the iterator on success
+ *         NULL on failure
+ */
+cram_iter *cram_iter_name_create(cram_fd *fd, const char *name) {
+    cram_iter *it;
+    int i;
+
+    if (!fd->name_idx) {
+	fprintf(stderr, "Read name queries need a CRAM name index\n");
+	return NULL;
+    }
+
+    if (!(it = calloc(1, sizeof(*it))))
+	return NULL;
+    it->fd = fd;
+    it->name_len = strlen(name);
+
+    if (!(it->name = strdup(name)))
+	goto err;
+
+    it->nslice = cram_name_index_query(fd, name, &it->name_slice);
+    if (it->nslice < 0)
+	goto err;
+
+    if (!(it->slice = malloc((it->nslice ? it->nslice : 1) *
+			     sizeof(*it->slice))))
+	goto err;
+    for (i = 0; i < it->nslice; i++)
+	it->slice[i] = &it->name_slice[i];
+
+    return it;
+
+ err:
+    cram_iter_destroy(it);
+    return NULL;
+}
+
+void cram_iter_destroy(cram_iter *it) {
+    if (!it)
+	return;
+
+    if (it->s)
+	cram_free_slice(it->s);
+    if (it->c)
+	cram_free_container(it->c);
+    if (it->fd->iter == it)
+	it->fd->iter = NULL;
+
+    free(it->region);
+    free(it->order);
+    free(it->match);
+    free(it->slice);
+    free(it->name);
+    free(it->name_slice);
+    free(it);
+}
+
+/*
+ * Reads and decodes the next slice from the index list, reusing the
+ * current container if the slice belongs to it.
+ *
+ * Returns 0 on success
+ *        -1 on failure or when no slices remain (fd->eof set)
+ */
+static int cram_iter_next_slice(cram_iter *it) {
+    cram_fd *fd = it->fd;
+    cram_container *c;
+    cram_slice *s;
+    cram_index *e;
+    int j;
+
+    if (it->s) {
+	cram_free_slice(it->s);
+	it->s = NULL;
+    }
+
+    if (it->curr_slice >= it->nslice) {
+	fd->eof = 1;
+	return -1;
+    }
+    e = it->slice[it->curr_slice++];
+
+    if (!(c = it->c) || e->offset != it->slice[it->curr_slice-2]->offset) {
+	if (c) {
+	    cram_free_container(c);
+	    it->c = NULL;
+	}
+
+	if (0 != cram_seek(fd, e->offset, SEEK_SET))
+	    return -1;
+	if (!(c = it->c = cram_read_container(fd)))
+	    return -1;
+
+	if (!(c->comp_hdr_block = cram_read_block(fd)))
+	    return -1;
+	if (c->comp_hdr_block->content_type != COMPRESSION_HEADER)
+	    return -1;
+
+	c->comp_hdr = cram_decode_compression_header(fd, c->comp_hdr_block);
+	if (!c->comp_hdr)
+	    return -1;
+	if (!c->comp_hdr->AP_delta &&
+	    sam_hdr_sort_order(fd->header) != ORDER_COORD)
+	    fd->unsorted = 1;
+    }
+
+    if (0 != cram_seek(fd, e->offset + c->offset + e->slice, SEEK_SET))
+	return -1;
+    if (!(s = cram_read_slice(fd)))
+	return -1;
+
+    for (j = 0; j < c->num_landmarks; j++)
+	if (c->landmark[j] == e->slice)
+	    break;
+    s->slice_num = j+1;
+    s->curr_rec = 0;
+    s->max_rec = s->hdr->num_records;
+    s->last_apos = s->hdr->ref_seq_start;
+
+    if (cram_decode_slice(fd, c, s, fd->header) != 0) {
+	fprintf(stderr, "Failure to decode slice\n");
+	cram_free_slice(s);
+	return -1;
+    }
+
+    it->s = s;
+    return 0;
+}
+
+/*
+ * Fills out it->match with the regions overlapping cr. For name queries
+ * there are no regions, so we just check the name.
+ *
+ * Returns the number of regions matched, or 1 for a matching name.
+ */
+static int cram_iter_match(cram_iter *it, cram_record *cr) {
+    unsigned int ref = cr->ref_id;
+    int i;
+
+    it->nmatch = 0;
+
+    if (it->name)
+	return cr->name_len == it->name_len &&
+	    memcmp(BLOCK_DATA(it->s->name_blk) + cr->name,
+		   it->name, it->name_len) == 0;
+
+    // Records arrive sorted, so earlier regions can not match again
+    while (it->lo < it->nregion) {
+	cram_range *r = &it->region[it->lo];
+	if ((unsigned int)r->refid > ref ||
+	    ((unsigned int)r->refid == ref &&
+	     (r->refid == -1 || r->end >= cr->apos)))
+	    break;
+	it->lo++;
+    }
+
+    for (i = it->lo; i < it->nregion; i++) {
+	cram_range *r = &it->region[i];
+	if ((unsigned int)r->refid != ref)
+	    break;
+	if (r->refid != -1) {
+	    if (r->start > cr->aend)
+		break;
+	    if (r->end < cr->apos)
+		continue;
+	}
+	it->match[it->nmatch++] = it->order[i];
+    }
+
+    return it->nmatch;
+}
+
+/*
+ * Returns the next record overlapping any region, converted to BAM.
+ * If non-NULL, *match is set to the indices (in the order originally
+ * supplied to cram_iter_create) of the *nmatch regions it overlaps.
+ * This is valid until the next call. Name iterators match no regions.
+ *
+ * Returns 0 on success
+ *        -1 on end of regions or failure (check fd->eof)
+ */
+int cram_iter_next(cram_iter *it, bam_seq_t **bam,
+		   const int **match, int *nmatch) {
+    cram_record *cr;
+    cram_slice *s;
+
+    for (;;) {
+	if (!(s = it->s) || s->curr_rec >= s->max_rec) {
+	    if (cram_iter_next_slice(it) != 0)
+		return -1;
+	    continue;
+	}
+
+	cr = &s->crecs[s->curr_rec++];
+	if (cram_iter_match(it, cr))
+	    break;
+    }
+
+    if (match)
+	*match = it->match;
+    if (nmatch)
+	*nmatch = it->nmatch;
+
+    return cram_slice_to_bam(it->fd, s, cr, s->curr_rec-1, bam);
 }
@@ -72,6 +72,47 @@ cram_record *cram_get_seq(cram_fd *fd);
  */
 int cram_get_bam_seq(cram_fd *fd, bam_seq_t **bam);
 
+/*! Creates an iterator over a list of regions.
+ *
+ * The index must already be loaded. Regions may be in any order and
+ * may overlap; refid -1 selects the unmapped data. Each overlapping
+ * slice is decoded only once. Setting CRAM_OPT_REGIONS makes
+ * cram_get_bam_seq() use one of these internally.
+ *
+ * @return
+ * Returns the iterator on success;
+ *         NULL on failure
+ */
+cram_iter *cram_iter_create(cram_fd *fd, cram_range *r, int nr);
+
+/*! Creates an iterator over the records with a given read name.
+ *
+ * The name index must already be loaded with cram_name_index_load().
+ * Only the slices it lists as holding the name are decoded. Setting
+ * CRAM_OPT_READ_NAME makes cram_get_bam_seq() use one of these.
+ *
+ * @return
+ * Returns the iterator on success;
+ *         NULL on failure
+ */
+cram_iter *cram_iter_name_create(cram_fd *fd, const char *name);
+
+/*! Returns the next record overlapping any region, converted to BAM.
+ *
+ * If non-NULL, *match is set to the indices (in the order originally
+ * supplied to cram_iter_create) of the *nmatch regions it overlaps.
+ * This is valid until the next call. Name iterators match no regions.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on end of regions or failure (check fd->eof)
+ */
+int cram_iter_next(cram_iter *it, bam_seq_t **bam,
+		   const int **match, int *nmatch);
+
+/*! Frees an iterator created by cram_iter_create(). */
+void cram_iter_destroy(cram_iter *it);
+
 
 /* ----------------------------------------------------------------------
  * Internal functions
@@ -107,6 +148,11 @@ cram_block_slice_hdr *cram_decode_slice_header(cram_fd *fd, cram_block *b);
 int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 		      SAM_hdr *hdr);
 
+/*! INTERNAL:
+ * Frees the bulk decoded data series created by cram_decode_slice.
+ */
+void cram_free_columns(cram_slice *s);
+
 
 #ifdef __cplusplus
 }
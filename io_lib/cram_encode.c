@@ -527,6 +527,148 @@ cram_block *cram_encode_slice_header(cram_fd *fd, cram_slice *s) {
     return b;
 }
 
+/*
+ * Integer data series gathered into arrays by cram_encode_slice_read and
+ * written out in bulk by cram_encode_columns_flush.
+ */
+static const int cram_column_ds[] = {
+    DS_BF, DS_CF, DS_RI, DS_RL, DS_AP, DS_RG, DS_MF, DS_NS, DS_NF, DS_NP,
+    DS_TS, DS_TL, DS_FN, DS_FP, DS_MQ, DS_RS, DS_PD, DS_HC, DS_DL,
+};
+
+/*
+ * Sets up a column for each integer data series using the EXTERNAL
+ * codec with a block of its own. Values for these only need to stay in
+ * order with respect to themselves, so they can be gathered per record
+ * and written once the whole slice has been seen.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+static int cram_encode_columns_init(cram_block_compression_hdr *h,
+				    cram_slice *s) {
+    int i, j;
+
+    cram_free_columns(s);
+
+    for (i = 0; i < sizeof(cram_column_ds)/sizeof(*cram_column_ds); i++) {
+	int id = cram_column_ds[i];
+	cram_codec *cd = h->codecs[id];
+	cram_column *col;
+
+	if (!cd || cd->codec != E_EXTERNAL || !cd->out ||
+	    cd->encode != cram_external_encode_int)
+	    continue;
+
+	/* Check no other codec shares this block */
+	for (j = 0; j < DS_END; j++) {
+	    cram_codec *oc = h->codecs[j];
+	    if (!oc || j == id)
+		continue;
+	    if (oc->out == cd->out)
+		break;
+	    if (oc->codec == E_BYTE_ARRAY_LEN &&
+		(oc->e_byte_array_len.len_codec->out == cd->out ||
+		 oc->e_byte_array_len.val_codec->out == cd->out))
+		break;
+	}
+	if (j != DS_END)
+	    continue;
+
+	if (!s->cols && !(s->cols = calloc(DS_END, sizeof(*s->cols))))
+	    return -1;
+
+	col = &s->cols[id];
+	col->alloc = s->hdr->num_records ? s->hdr->num_records : 1;
+	if (!(col->val = malloc(col->alloc * sizeof(*col->val))))
+	    return -1;
+	col->n = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Encodes one value of integer data series 'id', appending it to the
+ * series' column if it has one or passing it to the codec otherwise.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+static inline int cram_ds_encode(cram_slice *s, cram_codec *cd, int id,
+				 char *in, int in_size) {
+    cram_column *col;
+
+    if (!s->cols || !(col = &s->cols[id])->val)
+	return cd->encode(s, cd, in, in_size);
+
+    if (col->n == col->alloc) {
+	int32_t *val = realloc(col->val, 2 * col->alloc * sizeof(*val));
+	if (!val)
+	    return -1;
+	col->val = val;
+	col->alloc *= 2;
+    }
+    col->val[col->n++] = *(int32_t *)in;
+
+    return 0;
+}
+
+/*
+ * Writes each gathered column to its external block as ITF8. Runs of
+ * values below 0x80 are checked 8 at a time and stored as single bytes
+ * without going through itf8_put.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+static int cram_encode_columns_flush(cram_block_compression_hdr *h,
+				     cram_slice *s) {
+    int id;
+
+    if (!s->cols)
+	return 0;
+
+    for (id = 0; id < DS_END; id++) {
+	cram_column *col = &s->cols[id];
+	cram_block *b = h->codecs[id] ? h->codecs[id]->out : NULL;
+	const int32_t *val = col->val;
+	unsigned char *cp, *cp_start;
+	int i, n = col->n;
+
+	if (!val || !b)
+	    continue;
+
+	// Values are written unsigned, as cram_external_encode_int does
+	BLOCK_GROW(b, (size_t)n * 5);
+	if (!b->data)
+	    return -1;
+	cp = cp_start = BLOCK_END(b);
+
+	for (i = 0; i < n; ) {
+	    if (i + 8 <= n &&
+		(uint32_t)(val[i  ] | val[i+1] | val[i+2] | val[i+3] |
+			   val[i+4] | val[i+5] | val[i+6] | val[i+7]) < 0x80) {
+		cp[0] = val[i  ]; cp[1] = val[i+1];
+		cp[2] = val[i+2]; cp[3] = val[i+3];
+		cp[4] = val[i+4]; cp[5] = val[i+5];
+		cp[6] = val[i+6]; cp[7] = val[i+7];
+		cp += 8;
+		i  += 8;
+	    } else if ((uint32_t)val[i] < 0x80) {
+		*cp++ = val[i++];
+	    } else {
+		uint32_t v = val[i++];
+		cp += itf8_put((char *)cp, v);
+	    }
+	}
+	BLOCK_SIZE(b) += cp - cp_start;
+    }
+
+    cram_free_columns(s);
+    return 0;
+}
+
 /*
  * Encodes a single read.
  *
@@ -549,15 +691,16 @@ static int cram_encode_slice_read(cram_fd *fd,
     //printf("BF=0x%x\n", cr->flags);
     //	    bf = cram_flag_swap[cr->flags];
     i32 = fd->cram_flag_swap[cr->flags & 0xfff];
-    r |= h->codecs[DS_BF]->encode(s, h->codecs[DS_BF], (char *)&i32, 1);
+    r |= cram_ds_encode(s, h->codecs[DS_BF], DS_BF, (char *)&i32, 1);
 
     i32 = cr->cram_flags & CRAM_FLAG_MASK;
-    r |= h->codecs[DS_CF]->encode(s, h->codecs[DS_CF], (char *)&i32, 1);
+    r |= cram_ds_encode(s, h->codecs[DS_CF], DS_CF, (char *)&i32, 1);
 
     if (s->hdr->ref_seq_id == -2)
-	r |= h->codecs[DS_RI]->encode(s, h->codecs[DS_RI], (char *)&cr->ref_id, 1);
+	r |= cram_ds_encode(s, h->codecs[DS_RI], DS_RI,
+			    (char *)&cr->ref_id, 1);
 
-    r |= h->codecs[DS_RL]->encode(s, h->codecs[DS_RL], (char *)&cr->len, 1);
+    r |= cram_ds_encode(s, h->codecs[DS_RL], DS_RL, (char *)&cr->len, 1);
 
     if (c->pos_sorted) {
 	if (CRAM_MAJOR_VERS(fd->version) >= 4) {
@@ -565,7 +708,7 @@ static int cram_encode_slice_read(cram_fd *fd,
 	    r |= h->codecs[DS_AP]->encode(s, h->codecs[DS_AP], (char *)&i64, 1);
 	} else {
 	    i32 = cr->apos - *last_pos;
-	    r |= h->codecs[DS_AP]->encode(s, h->codecs[DS_AP], (char *)&i32, 1);
+	    r |= cram_ds_encode(s, h->codecs[DS_AP], DS_AP, (char *)&i32, 1);
 	}
 	*last_pos = cr->apos;
     } else {
@@ -574,18 +717,18 @@ static int cram_encode_slice_read(cram_fd *fd,
 	    r |= h->codecs[DS_AP]->encode(s, h->codecs[DS_AP], (char *)&i64, 1);
 	} else {
 	    i32 = cr->apos;
-	    r |= h->codecs[DS_AP]->encode(s, h->codecs[DS_AP], (char *)&i32, 1);
+	    r |= cram_ds_encode(s, h->codecs[DS_AP], DS_AP, (char *)&i32, 1);
 	}
     }
 
-    r |= h->codecs[DS_RG]->encode(s, h->codecs[DS_RG], (char *)&cr->rg, 1);
+    r |= cram_ds_encode(s, h->codecs[DS_RG], DS_RG, (char *)&cr->rg, 1);
 
     if (cr->cram_flags & CRAM_FLAG_DETACHED) {
 	i32 = cr->mate_flags;
-	r |= h->codecs[DS_MF]->encode(s, h->codecs[DS_MF], (char *)&i32, 1);
+	r |= cram_ds_encode(s, h->codecs[DS_MF], DS_MF, (char *)&i32, 1);
 
-	r |= h->codecs[DS_NS]->encode(s, h->codecs[DS_NS],
-				      (char *)&cr->mate_ref_id, 1);
+	r |= cram_ds_encode(s, h->codecs[DS_NS], DS_NS,
+			    (char *)&cr->mate_ref_id, 1);
 
 	if (CRAM_MAJOR_VERS(fd->version) >= 4) {
 	    r |= h->codecs[DS_NP]->encode(s, h->codecs[DS_NP],
@@ -594,20 +737,18 @@ static int cram_encode_slice_read(cram_fd *fd,
 					  (char *)&cr->tlen, 1);
 	} else {
 	    i32 = cr->mate_pos;
-	    r |= h->codecs[DS_NP]->encode(s, h->codecs[DS_NP],
-					  (char *)&i32, 1);
+	    r |= cram_ds_encode(s, h->codecs[DS_NP], DS_NP, (char *)&i32, 1);
 	    i32 = cr->tlen;
-	    r |= h->codecs[DS_TS]->encode(s, h->codecs[DS_TS],
-					  (char *)&i32, 1);
+	    r |= cram_ds_encode(s, h->codecs[DS_TS], DS_TS, (char *)&i32, 1);
 	}
 
     } else if (cr->cram_flags & CRAM_FLAG_MATE_DOWNSTREAM) {
-	r |= h->codecs[DS_NF]->encode(s, h->codecs[DS_NF],
-				      (char *)&cr->mate_line, 1);
+	r |= cram_ds_encode(s, h->codecs[DS_NF], DS_NF,
+			    (char *)&cr->mate_line, 1);
     }
 
     /* Aux tags */
-    r |= h->codecs[DS_TL]->encode(s, h->codecs[DS_TL], (char *)&cr->TL, 1);
+    r |= cram_ds_encode(s, h->codecs[DS_TL], DS_TL, (char *)&cr->TL, 1);
 
     // qual
     // QS codec : Already stored in block[2].
@@ -616,15 +757,15 @@ static int cram_encode_slice_read(cram_fd *fd,
     if (!(cr->flags & BAM_FUNMAP)) {
 	int prev_pos = 0, j;
 
-	r |= h->codecs[DS_FN]->encode(s, h->codecs[DS_FN],
-				      (char *)&cr->nfeature, 1);
+	r |= cram_ds_encode(s, h->codecs[DS_FN], DS_FN,
+			    (char *)&cr->nfeature, 1);
 	for (j = 0; j < cr->nfeature; j++) {
 	    cram_feature *f = &s->features[cr->feature + j];
 
 	    uc = f->X.code;
 	    r |= h->codecs[DS_FC]->encode(s, h->codecs[DS_FC], (char *)&uc, 1);
 	    i32 = f->X.pos - prev_pos;
-	    r |= h->codecs[DS_FP]->encode(s, h->codecs[DS_FP], (char *)&i32, 1);
+	    r |= cram_ds_encode(s, h->codecs[DS_FP], DS_FP, (char *)&i32, 1);
 	    prev_pos = f->X.pos;
 
 	    switch(f->X.code) {
@@ -669,8 +810,8 @@ static int cram_encode_slice_read(cram_fd *fd,
 		break;
 	    case 'D':
 		i32 = f->D.len;
-		r |= h->codecs[DS_DL]->encode(s, h->codecs[DS_DL],
-					      (char *)&i32, 1);
+		r |= cram_ds_encode(s, h->codecs[DS_DL], DS_DL,
+				    (char *)&i32, 1);
 		break;
 
 	    case 'B':
@@ -704,20 +845,20 @@ static int cram_encode_slice_read(cram_fd *fd,
 
 	    case 'N':
 		i32 = f->N.len;
-		r |= h->codecs[DS_RS]->encode(s, h->codecs[DS_RS],
-					      (char *)&i32, 1);
+		r |= cram_ds_encode(s, h->codecs[DS_RS], DS_RS,
+				    (char *)&i32, 1);
 		break;
 		    
 	    case 'P':
 		i32 = f->P.len;
-		r |= h->codecs[DS_PD]->encode(s, h->codecs[DS_PD],
-					      (char *)&i32, 1);
+		r |= cram_ds_encode(s, h->codecs[DS_PD], DS_PD,
+				    (char *)&i32, 1);
 		break;
 		    
 	    case 'H':
 		i32 = f->H.len;
-		r |= h->codecs[DS_HC]->encode(s, h->codecs[DS_HC],
-					      (char *)&i32, 1);
+		r |= cram_ds_encode(s, h->codecs[DS_HC], DS_HC,
+				    (char *)&i32, 1);
 		break;
 		    
 
@@ -728,8 +869,7 @@ static int cram_encode_slice_read(cram_fd *fd,
 	    }
 	}
 
-	r |= h->codecs[DS_MQ]->encode(s, h->codecs[DS_MQ],
-				      (char *)&cr->mqual, 1);
+	r |= cram_ds_encode(s, h->codecs[DS_MQ], DS_MQ, (char *)&cr->mqual, 1);
     } else {
 	char *seq = (char *)BLOCK_DATA(s->seqs_blk) + cr->seq;
 	if (cr->len)
@@ -954,7 +1094,13 @@ static int cram_encode_slice(cram_fd *fd, cram_container *c,
     int embed_ref;
     enum cram_DS_ID id;
 
-    embed_ref = fd->embed_ref && s->hdr->ref_seq_id != -1 ? 1 : 0;
+    embed_ref = (fd->embed_ref || c->cons) && s->hdr->ref_seq_id != -1 ? 1 : 0;
+
+    // Nothing to embed, so also nothing for the decoder to check
+    if (embed_ref && s->hdr->ref_seq_span <= 0) {
+	embed_ref = 0;
+	memset(s->hdr->md5, 0, 16);
+    }
 
     /*
      * Slice external blocks:
@@ -989,8 +1135,8 @@ static int cram_encode_slice(cram_fd *fd, cram_container *c,
 	    return -1;
 	s->ref_id = DS_ref; // needed?
 	BLOCK_APPEND(s->block[DS_ref],
-		     c->ref + c->first_base - c->ref_start,
-		     c->last_base - c->first_base + 1);
+		     c->ref + s->hdr->ref_seq_start - c->ref_start,
+		     s->hdr->ref_seq_span);
     }
 
     /*
@@ -1058,6 +1204,9 @@ static int cram_encode_slice(cram_fd *fd, cram_container *c,
     }
 
     /* Encode reads */
+    if (cram_encode_columns_init(h, s) == -1)
+	return -1;
+
     last_pos = s->hdr->ref_seq_start;
     for (rec = 0; rec < s->hdr->num_records; rec++) {
 	cram_record *cr = &s->crecs[rec];
@@ -1065,6 +1214,9 @@ static int cram_encode_slice(cram_fd *fd, cram_container *c,
 	    return -1;
     }
 
+    if (cram_encode_columns_flush(h, s) == -1)
+	return -1;
+
     s->block[0]->uncomp_size = s->block[0]->byte + (s->block[0]->bit < 7);
     s->block[0]->comp_size = s->block[0]->uncomp_size;
 
@@ -1296,6 +1448,131 @@ int add_read_names(cram_fd *fd, cram_container *c, cram_slice *s,
 }
 
 
+/*
+ * Builds a de novo consensus for a single reference container from the
+ * aligned bases of its own reads.  This is used in place of an external
+ * reference when fd->no_ref and fd->embed_cons are set, and gets embedded
+ * in each slice in the same manner as embed_ref.
+ *
+ * On success c->cons and c->ref hold the consensus covering c->ref_start
+ * to c->ref_end inclusive.  Where the reads average under one fold depth
+ * there is nothing to gain, so c->cons is left as NULL.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_build_consensus(cram_fd *fd, cram_container *c) {
+    int64_t start = INT64_MAX, end = INT64_MIN, nbases = 0, span, x;
+    uint8_t (*cnt)[4];
+    int r, i, k;
+
+    /* Find the region spanned, matching the slice ref_seq_start/span */
+    for (r = 0; r < c->curr_c_rec; r++) {
+	bam_seq_t *b = c->bams[r];
+	uint32_t *cig = (uint32_t *)bam_cigar(b);
+	int64_t apos = bam_pos(b)+1, aend = apos;
+
+	if (!(bam_flag(b) & BAM_FUNMAP)) {
+	    for (i = 0; i < bam_cigar_len(b); i++) {
+		uint32_t cig_len = cig[i] >> BAM_CIGAR_SHIFT;
+		switch (cig[i] & BAM_CIGAR_MASK) {
+		case BAM_CMATCH:
+		case BAM_CBASE_MATCH:
+		case BAM_CBASE_MISMATCH:
+		    if (bam_seq_len(b))
+			nbases += cig_len;
+		    /* fall through */
+		case BAM_CDEL:
+		case BAM_CREF_SKIP:
+		    aend += cig_len;
+		    break;
+		default:
+		    break;
+		}
+	    }
+	    aend--;
+	}
+
+	if (start > apos)
+	    start = apos;
+	if (end < MAX(apos, aend))
+	    end = MAX(apos, aend);
+    }
+
+    /* As with a real reference, bases beyond the @SQ length are explicit */
+    if (c->ref_id < fd->header->nref && fd->header->ref[c->ref_id].len > 0 &&
+	end > fd->header->ref[c->ref_id].len)
+	end = fd->header->ref[c->ref_id].len;
+
+    span = end - start + 1;
+    if (span <= 0 || nbases < span)
+	return 0;
+
+    if (!(cnt = calloc(span, sizeof(*cnt))))
+	return -1;
+    if (!(c->cons = malloc(span))) {
+	free(cnt);
+	return -1;
+    }
+
+    /* Base counts per position; 255 is plenty to pick a winner */
+    for (r = 0; r < c->curr_c_rec; r++) {
+	bam_seq_t *b = c->bams[r];
+	uint32_t *cig = (uint32_t *)bam_cigar(b);
+	unsigned char *seq = (unsigned char *)bam_seq(b);
+	int64_t apos = bam_pos(b)+1 - start, spos = 0;
+
+	if ((bam_flag(b) & BAM_FUNMAP) || !bam_seq_len(b))
+	    continue;
+
+	for (i = 0; i < bam_cigar_len(b); i++) {
+	    uint32_t l, cig_len = cig[i] >> BAM_CIGAR_SHIFT;
+	    switch (cig[i] & BAM_CIGAR_MASK) {
+	    case BAM_CMATCH:
+	    case BAM_CBASE_MATCH:
+	    case BAM_CBASE_MISMATCH:
+		for (l = 0; l < cig_len && spos < bam_seq_len(b);
+		     l++, spos++, apos++) {
+		    int base = (seq[spos>>1] >> ((~spos&1)<<2)) & 15;
+		    k = fd->L2[(uc)bam_nt16_rev_table[base]];
+		    if (k < 4 && apos < span && cnt[apos][k] < 255)
+			cnt[apos][k]++;
+		}
+		apos += cig_len - l;
+		break;
+
+	    case BAM_CINS:
+	    case BAM_CSOFT_CLIP:
+		spos += cig_len;
+		break;
+
+	    case BAM_CDEL:
+	    case BAM_CREF_SKIP:
+		apos += cig_len;
+		break;
+
+	    default:
+		break;
+	    }
+	}
+    }
+
+    for (x = 0; x < span; x++) {
+	int best = 0;
+	for (k = 1; k < 4; k++)
+	    if (cnt[x][best] < cnt[x][k])
+		best = k;
+	c->cons[x] = cnt[x][best] ? "ACGT"[best] : 'N';
+    }
+    free(cnt);
+
+    c->ref       = c->cons;
+    c->ref_start = start;
+    c->ref_end   = end;
+
+    return 0;
+}
+
 /*
  * Encodes all slices in a container into blocks.
  * Returns 0 on success
@@ -1344,6 +1621,10 @@ int cram_encode_container(cram_fd *fd, cram_container *c) {
 	c->ref_id = bam_ref(c->bams[0]);
 	cram_ref_incr(fd->refs, c->ref_id);
 	c->ref_seq_id = c->ref_id;
+
+	if (fd->embed_cons && !c->multi_seq && c->ref_id >= 0)
+	    if (cram_build_consensus(fd, c) != 0)
+		return -1;
     }
 
     /* Turn bams into cram_records and gather basic stats */
@@ -2500,6 +2781,7 @@ static int process_one_read(cram_fd *fd, cram_container *c,
     int i, fake_qual = -1;
     char *cp, *rg;
     char *ref, *seq, *qual;
+    int no_ref = fd->no_ref && !c->cons;
 
     // FIXME: multi-ref containers
 
@@ -2535,7 +2817,7 @@ static int process_one_read(cram_fd *fd, cram_container *c,
 
     // Non reference based encoding means storing the bases verbatim as features, which in
     // turn means every base also has a quality already stored.
-    if (!fd->no_ref || CRAM_MAJOR_VERS(fd->version) >= 3)
+    if (!no_ref || CRAM_MAJOR_VERS(fd->version) >= 3)
 	cr->cram_flags |= CRAM_FLAG_PRESERVE_QUAL_SCORES;
 
     if (cr->len <= 0 && CRAM_MAJOR_VERS(fd->version) >= 3)
@@ -2567,58 +2849,8 @@ static int process_one_read(cram_fd *fd, cram_container *c,
     BLOCK_GROW(s->qual_blk, cr->len);
     seq = cp = (char *)BLOCK_END(s->seqs_blk);
 
-    // Convert seq 2 bases at a time for speed.
-    {
-#ifdef ALLOW_UAC
-	static const uint16_t code2base[256] = {
-	    15677, 16701, 17213, 19773, 18237, 21053, 21309, 22077,
-	    21565, 22333, 22845, 18493, 19261, 17469, 16957, 20029,
-	    15681, 16705, 17217, 19777, 18241, 21057, 21313, 22081,
-	    21569, 22337, 22849, 18497, 19265, 17473, 16961, 20033,
-	    15683, 16707, 17219, 19779, 18243, 21059, 21315, 22083,
-	    21571, 22339, 22851, 18499, 19267, 17475, 16963, 20035,
-	    15693, 16717, 17229, 19789, 18253, 21069, 21325, 22093,
-	    21581, 22349, 22861, 18509, 19277, 17485, 16973, 20045,
-	    15687, 16711, 17223, 19783, 18247, 21063, 21319, 22087,
-	    21575, 22343, 22855, 18503, 19271, 17479, 16967, 20039,
-	    15698, 16722, 17234, 19794, 18258, 21074, 21330, 22098,
-	    21586, 22354, 22866, 18514, 19282, 17490, 16978, 20050,
-	    15699, 16723, 17235, 19795, 18259, 21075, 21331, 22099,
-	    21587, 22355, 22867, 18515, 19283, 17491, 16979, 20051,
-	    15702, 16726, 17238, 19798, 18262, 21078, 21334, 22102,
-	    21590, 22358, 22870, 18518, 19286, 17494, 16982, 20054,
-	    15700, 16724, 17236, 19796, 18260, 21076, 21332, 22100,
-	    21588, 22356, 22868, 18516, 19284, 17492, 16980, 20052,
-	    15703, 16727, 17239, 19799, 18263, 21079, 21335, 22103,
-	    21591, 22359, 22871, 18519, 19287, 17495, 16983, 20055,
-	    15705, 16729, 17241, 19801, 18265, 21081, 21337, 22105,
-	    21593, 22361, 22873, 18521, 19289, 17497, 16985, 20057,
-	    15688, 16712, 17224, 19784, 18248, 21064, 21320, 22088,
-	    21576, 22344, 22856, 18504, 19272, 17480, 16968, 20040,
-	    15691, 16715, 17227, 19787, 18251, 21067, 21323, 22091,
-	    21579, 22347, 22859, 18507, 19275, 17483, 16971, 20043,
-	    15684, 16708, 17220, 19780, 18244, 21060, 21316, 22084,
-	    21572, 22340, 22852, 18500, 19268, 17476, 16964, 20036,
-	    15682, 16706, 17218, 19778, 18242, 21058, 21314, 22082,
-	    21570, 22338, 22850, 18498, 19266, 17474, 16962, 20034,
-	    15694, 16718, 17230, 19790, 18254, 21070, 21326, 22094,
-	    21582, 22350, 22862, 18510, 19278, 17486, 16974, 20046
-	};
-#endif
-	int l2 = cr->len & ~1;
-	unsigned char *from = (unsigned char *)bam_seq(b);
-	cp[0] = 0;
-	for (i = 0; i < l2; i += 2, from++) {
-#ifdef ALLOW_UAC
-	    *(int16_t *)&cp[i] = le_int2(code2base[*from]);
-#else
-	    cp[i+0] = bam_nt16_rev_table[*from >> 4];
-	    cp[i+1] = bam_nt16_rev_table[*from & 0xf];
-#endif
-	}
-	if (i < cr->len)
-	    cp[i] = bam_nt16_rev_table[*from >> 4];
-    }
+    cp[0] = 0;
+    bam_seq_unpack(cp, (unsigned char *)bam_seq(b), cr->len);
     BLOCK_SIZE(s->seqs_blk) += cr->len;
 
     qual = cp = (char *)bam_qual(b);
@@ -2662,11 +2894,11 @@ static int process_one_read(cram_fd *fd, cram_container *c,
 		//fprintf(stderr, "\nBAM_CMATCH\nR: %.*s\nS: %.*s\n",
 		//	cig_len, &ref[apos], cig_len, &seq[spos]);
 		l = 0;
-		if (!fd->no_ref && cr->len) {
+		if (!no_ref && cr->len) {
 		    int end = cig_len+apos < c->ref_end
 			? cig_len : c->ref_end - apos;
 		    char *sp = &seq[spos];
-		    char *rp = &ref[apos];
+		    char *rp = &ref[apos - c->ref_start + 1];
 		    char *qp = &qual[spos];
 		    if (end > cr->len) {
 			fprintf(stderr, "CIGAR and query sequence are of "
@@ -2707,7 +2939,7 @@ static int process_one_read(cram_fd *fd, cram_container *c,
 		}
 
 		if (l < cig_len && cr->len) {
-		    if (fd->no_ref) {
+		    if (no_ref) {
 			if (IS_CRAM_3_VERS(fd)) {
 			    if (cram_add_bases(fd, c, s, cr, spos,
 					       cig_len-l, &seq[spos]))
@@ -2753,7 +2985,7 @@ static int process_one_read(cram_fd *fd, cram_container *c,
 				       cr->len ? &seq[spos] : NULL,
 				       fd->version))
 		    return -1;
-		if (fd->no_ref && cr->len) {
+		if (no_ref && cr->len) {
 		    for (l = 0; l < cig_len; l++, spos++) {
 			cram_add_quality(fd, c, s, cr, spos, qual[spos]);
 		    }
@@ -2768,7 +3000,7 @@ static int process_one_read(cram_fd *fd, cram_container *c,
 				      fd->version))
 		    return -1;
 
-		if (fd->no_ref &&
+		if (no_ref &&
 		    !(cr->cram_flags & CRAM_FLAG_PRESERVE_QUAL_SCORES)) {
 		    if (cr->len) {
 			for (l = 0; l < cig_len; l++, spos++) {
@@ -2805,7 +3037,7 @@ static int process_one_read(cram_fd *fd, cram_container *c,
 	    return -1;
 	}
 	fake_qual = spos;
-	cr->aend = fd->no_ref ? apos : MIN(apos, c->ref_end);
+	cr->aend = no_ref ? apos : MIN(apos, c->ref_end);
 	cram_stats_add(c->stats[DS_FN], cr->nfeature);
     } else {
 	// Unmapped
@@ -55,6 +55,29 @@
  * earlier as it is sorted) range will be held within it. This ensures that
  * the outer list will never have containments and we can safely do a
  * binary search to find the first range which overlaps any given coordinate.
+ *
+ * Optionally this may be cached in a binary foo.cram.crai.bin file, which
+ * avoids parsing the text and growing the lists entry by entry. It holds
+ * the same nested lists flattened into one array of fixed size records,
+ * with every list stored contiguously. All values are little endian.
+ *
+ *   "CRBI"                    magic number
+ *   uint32 version            currently 1
+ *   uint32 nref               size of fd->index (number of refs + 1)
+ *   uint32 nentry             number of slice entries
+ *   uint64 cram_size          size of the CRAM file, to spot stale caches
+ *   uint64 crai_size          size of the .crai it was built from
+ *   nref   * {uint32 first, uint32 nslice}      top level list per ref
+ *   nentry * {int32 refid, start, end, nseq, slice, len,
+ *             uint32 first, uint32 nslice, int64 offset}
+ *
+ * "first" is the array index of the first entry in a list.
+ *
+ * A separate read name index, foo.cram.nai, may also be built. This is a
+ * HashFile (see hash_table.h) keyed on read name, where each item's
+ * position is the file offset of a container and its size holds the
+ * landmark of the slice within it. Names held in several slices, such as
+ * pairs in a coordinate sorted file, have one item per slice.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -75,6 +98,7 @@
 #include "io_lib/cram.h"
 #include "io_lib/os.h"
 #include "io_lib/zfio.h"
+#include "io_lib/mFILE.h"
 
 #if 0
 static void dump_index_(cram_index *e, int level) {
@@ -246,8 +270,237 @@ int cram_index_load_via_callbacks(
 }
 #endif
 
+#define CRBI_HDR_SIZE 32
+#define CRBI_REF_SIZE 8
+#define CRBI_REC_SIZE 40
+
+static uint32_t crbi_get32(const unsigned char *cp) {
+    return  (uint32_t)cp[0]        | ((uint32_t)cp[1] <<  8) |
+	   ((uint32_t)cp[2] << 16) | ((uint32_t)cp[3] << 24);
+}
+
+static uint64_t crbi_get64(const unsigned char *cp) {
+    return crbi_get32(cp) | ((uint64_t)crbi_get32(cp+4) << 32);
+}
+
+static unsigned char *crbi_put32(unsigned char *cp, uint32_t v) {
+    *cp++ = v;
+    *cp++ = v >>  8;
+    *cp++ = v >> 16;
+    *cp++ = v >> 24;
+    return cp;
+}
+
+static unsigned char *crbi_put64(unsigned char *cp, uint64_t v) {
+    return crbi_put32(crbi_put32(cp, v), v >> 32);
+}
+
 /*
- * Loads a CRAM .crai index into memory.
+ * Loads the binary fn.crai.bin cache, if present and still matching both
+ * the CRAM file and its .crai. The file is mapped and the nested lists
+ * filled out directly from it in a single allocation.
+ *
+ * Returns 0 for success
+ *        -1 for failure or when no usable cache exists
+ */
+static int cram_index_load_bin(cram_fd *fd, const char *fn) {
+    char fn2[PATH_MAX];
+    struct stat cram_sb, crai_sb, bin_sb;
+    unsigned char *cp;
+    mFILE *mf;
+    uint32_t nref, nent, i;
+    int has_crai;
+    cram_index *blk = NULL;
+
+    if (strlen(fn) > PATH_MAX-10)
+	return -1;
+
+    sprintf(fn2, "%s.crai.bin", fn);
+    if (stat(fn2, &bin_sb) != 0 || stat(fn, &cram_sb) != 0)
+	return -1;
+
+    sprintf(fn2, "%s.crai", fn);
+    has_crai = stat(fn2, &crai_sb) == 0;
+    if (has_crai && crai_sb.st_mtime > bin_sb.st_mtime)
+	return -1;
+
+    sprintf(fn2, "%s.crai.bin", fn);
+    if (!(mf = mfopen(fn2, "rbm")))
+	return -1;
+
+    cp = (unsigned char *)mf->data;
+    if (mf->size < CRBI_HDR_SIZE || memcmp(cp, "CRBI", 4) != 0 ||
+	crbi_get32(cp+4) != 1)
+	goto fail;
+
+    nref = crbi_get32(cp+8);
+    nent = crbi_get32(cp+12);
+    if (nref < 1 || nref > INT_MAX ||
+	crbi_get64(cp+16) != (uint64_t)cram_sb.st_size ||
+	(has_crai && crbi_get64(cp+24) != (uint64_t)crai_sb.st_size) ||
+	mf->size != CRBI_HDR_SIZE + (uint64_t)nref * CRBI_REF_SIZE
+	                          + (uint64_t)nent * CRBI_REC_SIZE)
+	goto fail;
+
+    if (!(fd->index = calloc(nref, sizeof(*fd->index))) ||
+	!(blk = malloc((nent ? nent : 1) * sizeof(*blk))))
+	goto fail;
+    fd->index_sz = nref;
+
+    cp += CRBI_HDR_SIZE;
+    for (i = 0; i < nref; i++, cp += CRBI_REF_SIZE) {
+	cram_index *e = &fd->index[i];
+	uint32_t first = crbi_get32(cp), n = crbi_get32(cp+4);
+
+	if (first > nent || n > nent - first)
+	    goto fail;
+	e->refid  = i-1;
+	e->start  = INT_MIN;
+	e->end    = INT_MAX;
+	e->nslice = e->nalloc = n;
+	e->e      = n ? &blk[first] : NULL;
+    }
+
+    for (i = 0; i < nent; i++, cp += CRBI_REC_SIZE) {
+	cram_index *e = &blk[i];
+	uint32_t first = crbi_get32(cp+24), n = crbi_get32(cp+28);
+
+	if (first > nent || n > nent - first || n > INT_MAX)
+	    goto fail;
+	e->refid  = (int32_t)crbi_get32(cp);
+	e->start  = (int32_t)crbi_get32(cp+4);
+	e->end    = (int32_t)crbi_get32(cp+8);
+	e->nseq   = (int32_t)crbi_get32(cp+12);
+	e->slice  = (int32_t)crbi_get32(cp+16);
+	e->len    = (int32_t)crbi_get32(cp+20);
+	e->nslice = e->nalloc = n;
+	e->e      = n ? &blk[first] : NULL;
+	e->offset = (int64_t)crbi_get64(cp+32);
+    }
+
+    fd->index_blk = blk;
+    mfclose(mf);
+    return 0;
+
+ fail:
+    free(blk);
+    free(fd->index);
+    fd->index = NULL;
+    fd->index_sz = 0;
+    mfclose(mf);
+    return -1;
+}
+
+/*
+ * Writes the currently loaded index for CRAM file fn to the binary
+ * fn.crai.bin cache, which cram_index_load will then use in preference
+ * to parsing fn.crai.
+ *
+ * Returns 0 for success
+ *        -1 for failure
+ */
+int cram_index_save_bin(cram_fd *fd, const char *fn) {
+    char fn2[PATH_MAX];
+    struct stat cram_sb, crai_sb;
+    cram_index **list = NULL, **tmp;
+    uint32_t *first = NULL, *ftmp;
+    size_t n = 0, alloc = 0, k;
+    unsigned char buf[CRBI_REC_SIZE], *cp;
+    FILE *fp = NULL;
+    int i, j, r = -1;
+
+    if (!fd->index || strlen(fn) > PATH_MAX-10)
+	return -1;
+
+    if (stat(fn, &cram_sb) != 0) {
+	perror(fn);
+	return -1;
+    }
+    sprintf(fn2, "%s.crai", fn);
+    if (stat(fn2, &crai_sb) != 0)
+	crai_sb.st_size = 0;
+
+    /*
+     * Flatten breadth first, so each list is contiguous. list[] doubles
+     * as the queue of entries whose children are still to be added.
+     */
+    for (k = 0; k < fd->index_sz + n; k++) {
+	cram_index *p = k < fd->index_sz
+	    ? &fd->index[k]
+	    : list[k - fd->index_sz];
+
+	if (fd->index_sz + n + p->nslice > alloc) {
+	    alloc = (fd->index_sz + n + p->nslice) * 2;
+	    if (!(tmp = realloc(list, alloc * sizeof(*list))))
+		goto err;
+	    list = tmp;
+	    if (!(ftmp = realloc(first, alloc * sizeof(*first))))
+		goto err;
+	    first = ftmp;
+	}
+
+	first[k] = n;
+	for (i = 0; i < p->nslice; i++)
+	    list[n++] = &p->e[i];
+    }
+
+    if (n > UINT32_MAX) {
+	fprintf(stderr, "Index too large for %s.crai.bin\n", fn);
+	goto err;
+    }
+
+    sprintf(fn2, "%s.crai.bin", fn);
+    if (!(fp = fopen(fn2, "wb"))) {
+	perror(fn2);
+	goto err;
+    }
+
+    memcpy(buf, "CRBI", 4);
+    cp = crbi_put32(buf+4, 1);
+    cp = crbi_put32(cp, fd->index_sz);
+    cp = crbi_put32(cp, n);
+    cp = crbi_put64(cp, cram_sb.st_size);
+    cp = crbi_put64(cp, crai_sb.st_size);
+    if (fwrite(buf, 1, CRBI_HDR_SIZE, fp) != CRBI_HDR_SIZE)
+	goto err;
+
+    for (j = 0; j < fd->index_sz; j++) {
+	cp = crbi_put32(buf, first[j]);
+	cp = crbi_put32(cp, fd->index[j].nslice);
+	if (fwrite(buf, 1, CRBI_REF_SIZE, fp) != CRBI_REF_SIZE)
+	    goto err;
+    }
+
+    for (k = 0; k < n; k++) {
+	cram_index *e = list[k];
+	cp = crbi_put32(buf,    e->refid);
+	cp = crbi_put32(cp,     e->start);
+	cp = crbi_put32(cp,     e->end);
+	cp = crbi_put32(cp,     e->nseq);
+	cp = crbi_put32(cp,     e->slice);
+	cp = crbi_put32(cp,     e->len);
+	cp = crbi_put32(cp,     first[k + fd->index_sz]);
+	cp = crbi_put32(cp,     e->nslice);
+	cp = crbi_put64(cp,     e->offset);
+	if (fwrite(buf, 1, CRBI_REC_SIZE, fp) != CRBI_REC_SIZE)
+	    goto err;
+    }
+
+    r = 0;
+
+ err:
+    if (fp && fclose(fp) != 0)
+	r = -1;
+    if (r)
+	fprintf(stderr, "Failed to write %s.crai.bin\n", fn);
+    free(list);
+    free(first);
+    return r;
+}
+
+/*
+ * Loads a CRAM .crai index into memory, using the binary fn.crai.bin
+ * cache instead when one is present and up to date.
  *
  * Returns 0 for success
  *        -1 for failure
@@ -261,6 +514,9 @@ int cram_index_load(cram_fd *fd, char const *fn) {
     if (fd->index)
 	return 0;
 
+    if (cram_index_load_bin(fd, fn) == 0)
+	return 0;
+
     /* copy filename */
     sprintf(fn2, "%s.crai", fn);
     
@@ -293,8 +549,14 @@ void cram_index_free(cram_fd *fd) {
     if (!fd->index)
 	return;
     
-    for (i = 0; i < fd->index_sz; i++) {
-	cram_index_free_recurse(&fd->index[i]);
+    if (fd->index_blk) {
+	// Loaded from a .crai.bin, so all lists share one allocation
+	free(fd->index_blk);
+	fd->index_blk = NULL;
+    } else {
+	for (i = 0; i < fd->index_sz; i++) {
+	    cram_index_free_recurse(&fd->index[i]);
+	}
     }
     free(fd->index);
 
@@ -373,6 +635,110 @@ cram_index *cram_index_query(cram_fd *fd, int refid, int pos,
     return e;
 }
 
+/*
+ * Appends to *list every entry in the nested containment list "from"
+ * which overlaps start..end. Within any one list level neither start
+ * nor end decrease, so we binary search for the first overlap and
+ * only descend into entries which themselves overlap.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_index_overlaps(cram_index *from, int64_t start, int64_t end,
+			       cram_index ***list, int *n, int *alloc) {
+    while (from) {
+	cram_index *next = NULL;
+	int i = 0, j = from->nslice;
+
+	while (i < j) {
+	    int k = (i+j)/2;
+	    if (from->e[k].end < start)
+		i = k+1;
+	    else
+		j = k;
+	}
+
+	for (; i < from->nslice && from->e[i].start <= end; i++) {
+	    cram_index *e = &from->e[i];
+
+	    if (*n == *alloc) {
+		int a = *alloc ? *alloc*2 : 256;
+		cram_index **tmp = realloc(*list, a * sizeof(*tmp));
+		if (!tmp)
+		    return -1;
+		*list = tmp;
+		*alloc = a;
+	    }
+	    (*list)[(*n)++] = e;
+
+	    if (!e->e)
+		continue;
+
+	    /*
+	     * Unmapped data nests every slice in the previous one, so
+	     * iterate on the final child list rather than recurse.
+	     */
+	    if (i+1 == from->nslice || from->e[i+1].start > end) {
+		next = e;
+		break;
+	    }
+	    if (cram_index_overlaps(e, start, end, list, n, alloc))
+		return -1;
+	}
+
+	from = next;
+    }
+
+    return 0;
+}
+
+static int cram_index_cmp(const void *vp1, const void *vp2) {
+    const cram_index *e1 = *(const cram_index **)vp1;
+    const cram_index *e2 = *(const cram_index **)vp2;
+
+    if (e1->offset != e2->offset)
+	return e1->offset < e2->offset ? -1 : 1;
+    return e1->slice - e2->slice;
+}
+
+/*
+ * Finds every slice overlapping any of the nr regions in r. The result
+ * is in file order with slices listed only once, even when they overlap
+ * several regions or span multiple references. *slices is set to an
+ * array of pointers into fd->index, which the caller should free.
+ *
+ * Returns the number of slices on success
+ *        -1 on failure
+ */
+int cram_index_slices(cram_fd *fd, cram_range *r, int nr,
+		      cram_index ***slices) {
+    cram_index **list = NULL;
+    int i, j, n = 0, alloc = 0;
+
+    for (i = 0; i < nr; i++) {
+	if (r[i].refid+1 < 0 || r[i].refid+1 >= fd->index_sz)
+	    continue;
+	if (cram_index_overlaps(&fd->index[r[i].refid+1],
+				r[i].start, r[i].end, &list, &n, &alloc)) {
+	    free(list);
+	    return -1;
+	}
+    }
+
+    if (n) {
+	qsort(list, n, sizeof(*list), cram_index_cmp);
+	for (i = j = 1; i < n; i++) {
+	    if (list[i]->offset != list[j-1]->offset ||
+		list[i]->slice  != list[j-1]->slice)
+		list[j++] = list[i];
+	}
+	n = j;
+    }
+
+    *slices = list;
+    return n;
+}
+
 /*
  * Seek within a cram file.
  *
@@ -440,26 +806,21 @@ int cram_seek_to_refpos(cram_fd *fd, cram_range *r) {
 }
 
 /*
- * A specialised form of cram_index_build (below) that deals with slices
- * having multiple references in this (ref_id -2). In this scenario we
- * decode the slice to look at the RI data series instead.
+ * Writes the index lines for a slice holding multiple references
+ * (ref_id -2). The slice records must already be present in s->crecs,
+ * either from decoding or because we are the encoder.
  *
  * Returns 0 on success
  *        -1 on failure
  */
-static int cram_index_build_multiref(cram_fd *fd,
-				     cram_container *c,
+static int cram_index_slice_multiref(zfp *fp,
 				     cram_slice *s,
-				     zfp *fp,
 				     off_t cpos,
 				     int32_t landmark,
 				     int sz) {
     int i, ref = -2, ref_start = 0, ref_end;
     char buf[1024];
 
-    if (0 != cram_decode_slice(fd, c, s, fd->header))
-	return -1;
-
     ref_end = INT_MIN;
     for (i = 0; i < s->hdr->num_records; i++) {
 	if (s->crecs[i].ref_id == ref) {
@@ -472,7 +833,8 @@ static int cram_index_build_multiref(cram_fd *fd,
 	    sprintf(buf, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
 		    ref, ref_start, ref_end - ref_start + 1,
 		    (int64_t)cpos, landmark, sz);
-	    zfputs(buf, fp);
+	    if (zfputs(buf, fp) < 0)
+		return -1;
 	}
 
 	ref = s->crecs[i].ref_id;
@@ -484,7 +846,79 @@ static int cram_index_build_multiref(cram_fd *fd,
 	sprintf(buf, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
 		ref, ref_start, ref_end - ref_start + 1,
 		(int64_t)cpos, landmark, sz);
-	zfputs(buf, fp);
+	if (zfputs(buf, fp) < 0)
+	    return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes the .crai line(s) for a single slice.
+ *
+ * cpos is the file offset of the container holding the slice, landmark
+ * the slice offset within the container and sz the size of the slice.
+ * Multi-reference slices need s->crecs filling out first.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_index_slice(zfp *fp, cram_slice *s, off_t cpos,
+		     int32_t landmark, int sz) {
+    char buf[1024];
+
+    if (s->hdr->ref_seq_id == -2)
+	return cram_index_slice_multiref(fp, s, cpos, landmark, sz);
+
+    sprintf(buf, "%d\t%"PRId64"\t%"PRId64"\t%"PRId64"\t%d\t%d\n",
+	    s->hdr->ref_seq_id, s->hdr->ref_seq_start,
+	    s->hdr->ref_seq_span, (int64_t)cpos, landmark, sz);
+
+    return zfputs(buf, fp) < 0 ? -1 : 0;
+}
+
+/*
+ * Adds the read names in a decoded slice to the name index, pointing at
+ * container offset cpos and slice landmark. Names repeated within the
+ * slice are only added once.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_index_slice_names(HashFile *hf, cram_slice *s, off_t cpos,
+				  int32_t landmark) {
+    char *names = (char *)BLOCK_DATA(s->name_blk);
+    int i;
+
+    for (i = 0; i < s->hdr->num_records; i++) {
+	cram_record *cr = &s->crecs[i];
+	char *name = names + cr->name;
+	HashFileItem *hfi;
+	HashItem *hi;
+	HashData hd;
+
+	// Unnamed, eg after lossy read name compression
+	if (cr->name_len < 1 || cr->name_len > 255)
+	    continue;
+
+	for (hi = HashTableSearch(hf->h, name, cr->name_len); hi;
+	     hi = HashTableNext(hi, name, cr->name_len)) {
+	    hfi = (HashFileItem *)hi->data.p;
+	    if (hfi->pos == cpos && hfi->size == landmark)
+		break;
+	}
+	if (hi)
+	    continue;
+
+	if (!(hfi = (HashFileItem *)calloc(1, sizeof(*hfi))))
+	    return -1;
+	hfi->pos  = cpos;
+	hfi->size = landmark;
+	hd.p = hfi;
+	if (!HashTableAdd(hf->h, name, cr->name_len, hd, NULL)) {
+	    free(hfi);
+	    return -1;
+	}
     }
 
     return 0;
@@ -501,12 +935,26 @@ static int cram_index_build_multiref(cram_fd *fd,
  *        -1 on failure
  */
 int cram_index_build(cram_fd *fd, const char *fn_base) {
+    return cram_index_build_names(fd, fn_base, NULL);
+}
+
+/*
+ * As cram_index_build, but if fn_names is non-NULL also writes a read
+ * name index to it. This requires decoding the read names of every
+ * slice, so is considerably slower.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_index_build_names(cram_fd *fd, const char *fn_base,
+			   const char *fn_names) {
     cram_container *c;
     off_t cpos, spos, hpos;
     zfp *fp;
     char fn_idx[PATH_MAX];
     int seekable;
     size_t len;
+    HashFile *names = NULL;
 
     if ((len=strlen(fn_base)) > PATH_MAX-6)
 	return -1;
@@ -520,6 +968,16 @@ int cram_index_build(cram_fd *fd, const char *fn_base) {
         return -1;
     }
 
+    if (fn_names) {
+	names = HashFileCreate(0, HASH_DYNAMIC_SIZE | HASH_ALLOW_DUP_KEYS |
+			       HASH_POOL_ITEMS);
+	if (!names) {
+	    zfclose(fp);
+	    return -1;
+	}
+	fd->required_fields |= SAM_QNAME;
+    }
+
     cpos = CRAM_IO_TELLO(fd);
     if (cpos >= 0) {
 	seekable = 1;
@@ -552,7 +1010,6 @@ int cram_index_build(cram_fd *fd, const char *fn_base) {
 
         // 2.0 format
         for (j = 0; j < c->num_landmarks; j++) {
-            char buf[1024];
             cram_slice *s;
             int sz;
 
@@ -564,6 +1021,7 @@ int cram_index_build(cram_fd *fd, const char *fn_base) {
 	    }
 
             if (!(s = cram_read_slice(fd))) {
+		HashFileDestroy(names);
 		zfclose(fp);
 		return -1;
 	    }
@@ -576,15 +1034,25 @@ int cram_index_build(cram_fd *fd, const char *fn_base) {
 		    : c->length - c->landmark[c->num_landmarks-1];
 	    }
 
-	    if (s->hdr->ref_seq_id == -2) {
-		cram_index_build_multiref(fd, c, s, fp,
-					  cpos, c->landmark[j], sz);
-	    } else {
-		sprintf(buf, "%d\t%"PRId64"\t%"PRId64"\t%"PRId64"\t%d\t%d\n",
-			s->hdr->ref_seq_id, s->hdr->ref_seq_start,
-			s->hdr->ref_seq_span, (int64_t)cpos,
-			c->landmark[j], sz);
-		zfputs(buf, fp);
+	    /*
+	     * Multi-ref slices need decoding to see the RI data series,
+	     * and all slices when indexing read names.
+	     */
+	    if ((s->hdr->ref_seq_id == -2 || names) &&
+		0 != cram_decode_slice(fd, c, s, fd->header)) {
+		cram_free_slice(s);
+		HashFileDestroy(names);
+		zfclose(fp);
+		return -1;
+	    }
+	    cram_index_slice(fp, s, cpos, c->landmark[j], sz);
+
+	    if (names &&
+		0 != cram_index_slice_names(names, s, cpos, c->landmark[j])) {
+		cram_free_slice(s);
+		HashFileDestroy(names);
+		zfclose(fp);
+		return -1;
 	    }
 
             cram_free_slice(s);
@@ -600,10 +1068,112 @@ int cram_index_build(cram_fd *fd, const char *fn_base) {
         cram_free_container(c);
     }
     if (fd->err) {
+	HashFileDestroy(names);
 	zfclose(fp);
 	return -1;
     }
-	
+
+    if (names) {
+	FILE *nfp;
+	int err = 0;
+
+	if (!(nfp = fopen(fn_names, "wb"))) {
+	    perror(fn_names);
+	    err = 1;
+	} else {
+	    HashFileSave(names, nfp, 0);
+	    err = ferror(nfp) | (fclose(nfp) != 0);
+	}
+	HashFileDestroy(names);
+	if (err) {
+	    zfclose(fp);
+	    return -1;
+	}
+    }
 
     return (zfclose(fp) >= 0) ? 0 : -1;
 }
+
+/*
+ * Opens the read name index fn.nai for CRAM file fn, as written by
+ * cram_index_build_names.
+ *
+ * Returns 0 for success
+ *        -1 for failure
+ */
+int cram_name_index_load(cram_fd *fd, const char *fn) {
+    char fn2[PATH_MAX];
+
+    /* Check if already loaded */
+    if (fd->name_idx)
+	return 0;
+
+    if (strlen(fn) > PATH_MAX-5)
+	return -1;
+    sprintf(fn2, "%s.nai", fn);
+
+    if (!(fd->name_idx = HashFileOpen(fn2))) {
+	fprintf(stderr, "Unable to open read name index '%s'\n", fn2);
+	return -1;
+    }
+
+    return 0;
+}
+
+static int cram_index_entry_cmp(const void *vp1, const void *vp2) {
+    const cram_index *e1 = (const cram_index *)vp1;
+    const cram_index *e2 = (const cram_index *)vp2;
+
+    if (e1->offset != e2->offset)
+	return e1->offset < e2->offset ? -1 : 1;
+    return e1->slice - e2->slice;
+}
+
+/*
+ * Looks up a read name in the name index loaded by cram_name_index_load.
+ * *slices is set to a malloced array of the slices holding the name, in
+ * file order, with only the offset and slice fields filled out.
+ *
+ * Returns the number of slices on success (0 if not found)
+ *        -1 on failure
+ */
+int cram_name_index_query(cram_fd *fd, const char *name,
+			  cram_index **slices) {
+    HashFileItem *items = NULL, *tmp;
+    cram_index *e;
+    int i, n, max = 8, len = strlen(name);
+
+    if (!fd->name_idx)
+	return -1;
+
+    if (len < 1 || len > 255) {
+	*slices = NULL;
+	return 0;
+    }
+
+    /* Repeat with a larger buffer if it may have been too small */
+    do {
+	max *= 2;
+	if (!(tmp = realloc(items, max * sizeof(*items)))) {
+	    free(items);
+	    return -1;
+	}
+	items = tmp;
+	n = HashFileQueryAll(fd->name_idx, (uint8_t *)name, len, items, max);
+    } while (n == max);
+
+    if (!(e = calloc(n ? n : 1, sizeof(*e)))) {
+	free(items);
+	return -1;
+    }
+    for (i = 0; i < n; i++) {
+	e[i].offset = items[i].pos;
+	e[i].slice  = items[i].size;
+    }
+    free(items);
+
+    qsort(e, n, sizeof(*e), cram_index_entry_cmp);
+
+    *slices = e;
+    return n;
+}
@@ -39,12 +39,24 @@ extern "C" {
 #endif
 
 /*
- * Loads a CRAM .crai index into memory.
+ * Loads a CRAM .crai index into memory, using the binary fn.crai.bin
+ * cache instead when one is present and up to date.
+ *
  * Returns 0 for success
  *        -1 for failure
  */
 int cram_index_load(cram_fd *fd, char const * fn);
 
+/*
+ * Writes the currently loaded index for CRAM file fn to the binary
+ * fn.crai.bin cache, which cram_index_load will then use in preference
+ * to parsing fn.crai.
+ *
+ * Returns 0 for success
+ *        -1 for failure
+ */
+int cram_index_save_bin(cram_fd *fd, const char *fn);
+
 #if defined(CRAM_IO_CUSTOM_BUFFERING)
 /*
  * Loads a CRAM .crai index into memory using callbacks. fn denotes the name of the cram file.
@@ -71,6 +83,18 @@ void cram_index_free(cram_fd *fd);
  */
 cram_index *cram_index_query(cram_fd *fd, int refid, int pos, cram_index *frm);
 
+/*
+ * Finds every slice overlapping any of the nr regions in r. The result
+ * is in file order with slices listed only once, even when they overlap
+ * several regions or span multiple references. *slices is set to an
+ * array of pointers into fd->index, which the caller should free.
+ *
+ * Returns the number of slices on success
+ *        -1 on failure
+ */
+int cram_index_slices(cram_fd *fd, cram_range *r, int nr,
+		      cram_index ***slices);
+
 /*
  * Skips to a container overlapping the start coordinate listed in
  * cram_range.
@@ -100,6 +124,50 @@ int cram_seek(cram_fd *fd, off_t offset, int whence);
  */
 int cram_index_build(cram_fd *fd, const char *fn_base);
 
+/*
+ * As cram_index_build, but if fn_names is non-NULL also writes a read
+ * name index to it. This requires decoding the read names of every
+ * slice, so is considerably slower.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_index_build_names(cram_fd *fd, const char *fn_base,
+			   const char *fn_names);
+
+/*
+ * Opens the read name index fn.nai for CRAM file fn, as written by
+ * cram_index_build_names.
+ *
+ * Returns 0 for success
+ *        -1 for failure
+ */
+int cram_name_index_load(cram_fd *fd, const char *fn);
+
+/*
+ * Looks up a read name in the name index loaded by cram_name_index_load.
+ * *slices is set to a malloced array of the slices holding the name, in
+ * file order, with only the offset and slice fields filled out.
+ *
+ * Returns the number of slices on success (0 if not found)
+ *        -1 on failure
+ */
+int cram_name_index_query(cram_fd *fd, const char *name,
+			  cram_index **slices);
+
+/*
+ * Writes the .crai line(s) for a single slice.
+ *
+ * cpos is the file offset of the container holding the slice, landmark
+ * the slice offset within the container and sz the size of the slice.
+ * Multi-reference slices need s->crecs filling out first.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_index_slice(zfp *fp, cram_slice *s, off_t cpos,
+		     int32_t landmark, int sz);
+
 #ifdef __cplusplus
 }
 #endif
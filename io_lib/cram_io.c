@@ -121,6 +121,14 @@
 #define TRIAL_SPAN 50
 #define NTRIALS 3
 
+/*
+ * Number of methods actually compressed with during a trial, chosen as
+ * those with the smallest predicted size.  Blocks below TRIAL_MIN_PREDICT
+ * bytes are cheap enough that we simply try everything.
+ */
+#define TRIAL_CANDIDATES 2
+#define TRIAL_MIN_PREDICT 1024
+
 /* ----------------------------------------------------------------------
  * custom buffering helper routines
  */
@@ -1935,7 +1943,77 @@ int cram_uncompress_block(cram_block *b) {
 //    return e / log(EBASE2);
 //}
 
-static char *cram_compress_by_method(cram_slice *s, char *in, size_t in_size,
+/*
+ * Cheap predictions of the compressed size of a block for each method,
+ * based on order-0 and order-1 entropy and the number of symbol runs.
+ *
+ * These are deliberately crude.  They only need to track how the data
+ * within a block type changes; the per-method discrepancy between
+ * predicted and real sizes is learnt in cram_metrics->ratio[].
+ */
+static void cram_predict_sizes(unsigned char *data, size_t len,
+			       double est[CRAM_MAX_METHOD]) {
+    unsigned int F0[256] = {0}, *F1;
+    double e0 = 0, e1 = 0, ln2 = log(2);
+    size_t i, runs = 1;
+    int j, k;
+
+    for (i = 0; i < len; i++)
+	F0[data[i]]++;
+    for (i = 1; i < len; i++)
+	runs += data[i] != data[i-1];
+
+    for (j = 0; j < 256; j++)
+	if (F0[j])
+	    e0 -= F0[j] * log((double)F0[j]/len);
+    e0 /= 8*ln2;
+
+    // Order-1 needs a 256x256 table, so skip it if we can't get one.
+    if ((F1 = calloc(256*256, sizeof(*F1)))) {
+	unsigned int T[256] = {0};
+	unsigned char last = 0;
+	for (i = 0; i < len; i++) {
+	    F1[last*256 + data[i]]++;
+	    T[last]++;
+	    last = data[i];
+	}
+	for (j = 0; j < 256; j++) {
+	    if (!T[j])
+		continue;
+	    for (k = 0; k < 256; k++)
+		if (F1[j*256+k])
+		    e1 -= F1[j*256+k] * log((double)F1[j*256+k]/T[j]);
+	}
+	e1 /= 8*ln2;
+	free(F1);
+    } else {
+	e1 = e0;
+    }
+
+    // Account for frequency tables.  Order-1 tables grow with the
+    // alphabet, so they matter most on small blocks.
+    for (k = j = 0; j < 256; j++)
+	k += F0[j] != 0;
+    e0 += 3*k;
+    e1 += 3*k*k < len ? 3*k*k : len;
+
+    double rle = (double)runs / len;
+    for (j = 0; j < CRAM_MAX_METHOD; j++)
+	est[j] = MIN(e0, e1);
+
+    est[RAW]        = len;
+    est[RANS0]      = est[RANS_PR0]   = est[RANS_PR128] = e0;
+    est[RANS1]      = est[RANS_PR1]   = est[RANS_PR129] = e1;
+    est[RANS_PR64]  = est[RANS_PR192] = e0 * rle + runs/4.0;
+    est[RANS_PR65]  = est[RANS_PR193] = e1 * rle + runs/4.0;
+
+    for (j = 0; j < CRAM_MAX_METHOD; j++)
+	if (est[j] < 1)
+	    est[j] = 1;
+}
+
+static char *cram_compress_by_method(cram_fd *fd, cram_slice *s,
+				     char *in, size_t in_size,
 				     size_t *out_size,
 				     enum cram_block_method method,
 				     int level, int strat) {
@@ -2042,7 +2120,7 @@ static char *cram_compress_by_method(cram_slice *s, char *in, size_t in_size,
 
     case NAME_TOK3: {
 	int out_len;
-	uint8_t *cp = encode_names(in, in_size, &out_len, NULL);
+	uint8_t *cp = encode_names_mt(in, in_size, &out_len, NULL, fd->pool);
 	*out_size = out_len;
 	return (char *)cp;
     }
@@ -2108,17 +2186,25 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 	if (fd->metrics_lock) pthread_mutex_lock(fd->metrics_lock);
 	if (fd->unsorted == 2)
 	    metrics->next_trial = 0; // force recheck on mode switch.
+	if (metrics->trial <= 0 && !(method & (1<<metrics->method))) {
+	    // Eg a loaded profile using codecs not valid for this version.
+	    metrics->trial = NTRIALS;
+	    metrics->revised_method = 0;
+	}
 	if (metrics->trial > 0 || --metrics->next_trial <= 0) {
 	    int m;
 	    size_t sz_best = INT_MAX;
 	    size_t sz[CRAM_MAX_METHOD] = {0};
 	    int method_best = 0;
 	    char *c_best = NULL, *c = NULL;
+	    double est[CRAM_MAX_METHOD], ratio[CRAM_MAX_METHOD];
+	    int try_method, predict;
 
-	    if (metrics->revised_method)
-		method = metrics->revised_method;
-	    else
-		metrics->revised_method = method;
+	    // A revised set may come from a profile written for another
+	    // CRAM version, so never widen beyond the methods permitted here.
+	    if (metrics->revised_method & method)
+		method &= metrics->revised_method;
+	    metrics->revised_method = method;
 
 	    if (metrics->next_trial <= 0) {
 		metrics->next_trial = TRIAL_SPAN;
@@ -2127,6 +2213,7 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 		    metrics->sz[m] /= 2;
 	    }
 
+	    memcpy(ratio, metrics->ratio, sizeof(ratio));
 	    if (fd->metrics_lock) pthread_mutex_unlock(fd->metrics_lock);
 	    
             // Compress this block using the best method
@@ -2141,7 +2228,46 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 		if (method & (1<<RANS_PR193))
 		    method = (method|(1<<RANS_PR65))&~(1<<RANS_PR193);
 	    }
+
+	    // Predict sizes and only trial the most promising methods,
+	    // plus any we have no learnt ratio for yet.
+	    try_method = method;
+	    predict = fd->trial_candidates > 0 &&
+		b->uncomp_size >= TRIAL_MIN_PREDICT;
+	    if (predict) {
+		int n;
+		cram_predict_sizes(b->data, b->uncomp_size, est);
+		try_method = 0;
+		for (m = 0; m < CRAM_MAX_METHOD; m++)
+		    if ((method & (1<<m)) && !ratio[m])
+			try_method |= 1<<m;
+
+		for (n = 0; n < fd->trial_candidates; n++) {
+		    int m_best = -1;
+		    for (m = 0; m < CRAM_MAX_METHOD; m++) {
+			if (!(method & (1<<m)) || (try_method & (1<<m)))
+			    continue;
+			if (m_best < 0 ||
+			    est[m]*ratio[m] < est[m_best]*ratio[m_best])
+			    m_best = m;
+		    }
+		    if (m_best < 0)
+			break;
+		    try_method |= 1<<m_best;
+		}
+
+		if (fd->verbose > 1)
+		    fprintf(stderr, "Block ID %d: trialling methods %x of %x\n",
+			    b->content_id, try_method, method);
+	    }
+
             for (m = 0; m < CRAM_MAX_METHOD; m++) {
+		if ((method & (1<<m)) && !(try_method & (1<<m))) {
+		    // Not worth trying; use the prediction instead
+		    sz[m] = est[m] * ratio[m];
+		    continue;
+		}
+
 		if (method & (1<<m)) {
 		    int lvl = level;
 		    switch (m) {
@@ -2152,12 +2278,17 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 		    default:       strat = 0;
 		    }
 
-		    c = cram_compress_by_method(s, (char *)b->data, b->uncomp_size,
+		    c = cram_compress_by_method(fd, s, (char *)b->data, b->uncomp_size,
 						&sz[m], m, lvl, strat);
                     if (fd->verbose > 1)
                         fprintf(stderr, "Try compression of block ID %d from %d to %d by method %s, strat %d\n",
                                 b->content_id, b->uncomp_size, (int)sz[m], cram_block_method2str(m), strat);
 
+		    if (c && predict)
+			ratio[m] = ratio[m]
+			    ? (ratio[m] + sz[m] / est[m]) / 2
+			    : sz[m] / est[m];
+
 		    if (c && sz_best > sz[m]) {
 			sz_best = sz[m];
 			method_best = m;
@@ -2184,8 +2315,11 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 
 	    // Accumulate stats for all methods tried
 	    if (fd->metrics_lock) pthread_mutex_lock(fd->metrics_lock);
-            for (m = 0; m < CRAM_MAX_METHOD; m++)
+            for (m = 0; m < CRAM_MAX_METHOD; m++) {
                 metrics->sz[m] += sz[m];
+		if (predict && (try_method & (1<<m)))
+		    metrics->ratio[m] = ratio[m];
+	    }
 
 	    // When enough trials performed, find the best on average
 	    if (--metrics->trial == 0) {
@@ -2290,7 +2424,7 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 	    method = metrics->method;
 
 	    if (fd->metrics_lock) pthread_mutex_unlock(fd->metrics_lock);
-	    comp = cram_compress_by_method(s, (char *)b->data, b->uncomp_size,
+	    comp = cram_compress_by_method(fd, s, (char *)b->data, b->uncomp_size,
 					   &comp_size, method,
 					   method == GZIP_1 ? 1 : level,
 					   strat);
@@ -2309,7 +2443,7 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 
     } else {
 	// no cached metrics, so just do zlib?
-	comp = cram_compress_by_method(s, (char *)b->data, b->uncomp_size,
+	comp = cram_compress_by_method(fd, s, (char *)b->data, b->uncomp_size,
 				       &comp_size, GZIP, level, Z_FILTERED);
 	if (!comp) {
 	    fprintf(stderr, "Compression failed!\n");
@@ -2352,6 +2486,210 @@ cram_metrics *cram_new_metrics(void) {
     return m;
 }
 
+/*
+ * Compression profiles.
+ *
+ * These record the compression methods learnt by the trials in
+ * cram_compress_block, so that a later run on similar data can start
+ * with them and skip the initial trial phase.  The format is a plain
+ * tab separated text file:
+ *
+ *   CRAM_PROFILE  1
+ *   DS   <data series id>  <method>  <strat>  <revised method mask>  [m=ratio ...]
+ *   TAG  <XXt>             <method>  <strat>  <revised method mask>  [m=ratio ...]
+ *
+ * where XX is the aux tag name and t its type as stored in the TD dictionary.
+ */
+#define CRAM_PROFILE_VERS 1
+
+static void cram_save_profile_metrics(FILE *fp, cram_metrics *m) {
+    int i;
+
+    fprintf(fp, "\t%d\t%d\t%x", m->method, m->strat, m->revised_method);
+    for (i = 0; i < CRAM_MAX_METHOD; i++)
+	if (m->ratio[i])
+	    fprintf(fp, "\t%d=%g", i, m->ratio[i]);
+    fputc('\n', fp);
+}
+
+/*
+ * Saves the learnt per data series and per aux tag compression metrics
+ * of a CRAM opened for write.  Metrics still in their first trial period
+ * are not saved.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_save_profile(cram_fd *fd, const char *fn) {
+    FILE *fp;
+    int i;
+
+    if (!(fp = fopen(fn, "w"))) {
+	perror(fn);
+	return -1;
+    }
+
+    if (fd->metrics_lock) pthread_mutex_lock(fd->metrics_lock);
+
+    fprintf(fp, "CRAM_PROFILE\t%d\n", CRAM_PROFILE_VERS);
+    for (i = 0; i < DS_END; i++) {
+	if (!fd->m[i] || fd->m[i]->trial > 0 || fd->m[i]->method == RAW)
+	    continue;
+	fprintf(fp, "DS\t%d", i);
+	cram_save_profile_metrics(fp, fd->m[i]);
+    }
+
+    if (fd->tags_used) {
+	HashIter *iter = HashTableIterCreate();
+	HashItem *hi;
+
+	while (iter && (hi = HashTableIterNext(fd->tags_used, iter))) {
+	    cram_metrics *m = (cram_metrics *)hi->data.p;
+	    if (!m || m->trial > 0 || m->method == RAW || hi->key_len != 3)
+		continue;
+	    fprintf(fp, "TAG\t%.3s", hi->key);
+	    cram_save_profile_metrics(fp, m);
+	}
+	HashTableIterDestroy(iter);
+    }
+
+    if (fd->metrics_lock) pthread_mutex_unlock(fd->metrics_lock);
+
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+/*
+ * Returns a bit field of all block compression methods permitted by the
+ * CRAM version being written, used to filter codecs out of a loaded
+ * profile.
+ */
+static int cram_version_methods(cram_fd *fd) {
+    int methods = 1<<RAW | 1<<GZIP | 1<<BZIP2 | 1<<LZMA
+	        | 1<<GZIP_RLE | 1<<GZIP_1;
+
+#ifdef HAVE_LIBBSC
+    methods |= 1<<BSC;
+#endif
+
+    if (CRAM_MAJOR_VERS(fd->version) >= 4)
+	methods |= (1<<RANS_PR0)   | (1<<RANS_PR1)
+	         | (1<<RANS_PR64)  | (1<<RANS_PR65)
+	         | (1<<RANS_PR128) | (1<<RANS_PR129)
+	         | (1<<RANS_PR192) | (1<<RANS_PR193);
+    else if (CRAM_MAJOR_VERS(fd->version) >= 3)
+	methods |= (1<<RANS0) | (1<<RANS1);
+
+    if (fd->version >= (3<<8)+1)
+	methods |= 1<<FQZ;
+
+    return methods;
+}
+
+// Parses the method fields of a profile line into m. Returns 0 on success.
+static int cram_load_profile_metrics(char *str, cram_metrics *m, int methods) {
+    int method, strat, n;
+    unsigned int revised;
+    char *cp;
+
+    if (sscanf(str, "%d %d %x%n", &method, &strat, &revised, &n) != 3)
+	return -1;
+    if (method <= RAW || method >= CRAM_MAX_METHOD)
+	return -1;
+
+    m->method = method;
+    m->strat = strat;
+    m->revised_method = revised & methods;
+
+    for (cp = str+n; *cp; cp += n) {
+	int i;
+	double r;
+	if (sscanf(cp, " %d=%lf%n", &i, &r, &n) != 2) {
+	    while (isspace(*cp))
+		cp++;
+	    if (*cp)
+		return -1;
+	    break;
+	}
+	if (i < 0 || i >= CRAM_MAX_METHOD || r < 0)
+	    return -1;
+	m->ratio[i] = r;
+    }
+
+    // Treat as if we have just completed a successful set of trials.
+    m->trial = 0;
+    m->next_trial = TRIAL_SPAN;
+    m->consistency = 1;
+
+    return 0;
+}
+
+/*
+ * Loads a compression profile written by cram_save_profile into a CRAM
+ * opened for write.  This should be called before any data is written.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_load_profile(cram_fd *fd, const char *fn) {
+    FILE *fp;
+    char line[8192];
+    int vers, lineno = 1, ret = -1, methods = cram_version_methods(fd);
+
+    if (!(fp = fopen(fn, "r"))) {
+	perror(fn);
+	return -1;
+    }
+
+    if (!fgets(line, sizeof(line), fp) ||
+	sscanf(line, "CRAM_PROFILE %d", &vers) != 1 ||
+	vers != CRAM_PROFILE_VERS) {
+	fprintf(stderr, "%s: not a CRAM compression profile\n", fn);
+	goto err;
+    }
+
+    if (fd->metrics_lock) pthread_mutex_lock(fd->metrics_lock);
+    while (fgets(line, sizeof(line), fp)) {
+	char key[4];
+	int id, n;
+
+	lineno++;
+	if (*line == '#' || *line == '\n')
+	    continue;
+
+	if (sscanf(line, "DS %d%n", &id, &n) == 1) {
+	    if (id < 0 || id >= DS_END || !fd->m[id] ||
+		cram_load_profile_metrics(line+n, fd->m[id], methods) < 0)
+		break;
+
+	} else if (sscanf(line, "TAG %3c%n", key, &n) == 1) {
+	    HashData hd;
+	    HashItem *hi;
+
+	    hd.p = NULL;
+	    if (!(hi = HashTableAdd(fd->tags_used, key, 3, hd, NULL)))
+		break;
+	    if (!hi->data.p && !(hi->data.p = cram_new_metrics()))
+		break;
+	    if (cram_load_profile_metrics(line+n, hi->data.p, methods) < 0)
+		break;
+
+	} else {
+	    break;
+	}
+    }
+    if (fd->metrics_lock) pthread_mutex_unlock(fd->metrics_lock);
+
+    if (!feof(fp)) {
+	fprintf(stderr, "%s: malformed profile at line %d\n", fn, lineno);
+	goto err;
+    }
+
+    ret = 0;
+ err:
+    fclose(fp);
+    return ret;
+}
+
 char *cram_block_method2str(enum cram_block_method m) {
     switch(m) {
     case RAW:	     return "RAW";
@@ -3201,6 +3539,7 @@ ref_entry *cram_ref_load(refs_t *r, int id) {
 
     RP("%d Loading ref %d (%d..%d)\n", gettid(), id, start, end);
 
+    bzi_set_threads(r->fp, r->nthreads);
     if (!(seq = load_ref_portion(r->fp, e, start, end))) {
 	return NULL;
     }
@@ -3415,6 +3754,7 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
 	}
     }
 
+    bzi_set_threads(fd->refs->fp, fd->refs->nthreads);
     if (!(fd->ref = load_ref_portion(fd->refs->fp, r, start, end))) {
 	pthread_mutex_unlock(&fd->refs->lock);
 	if (fd->ref_lock) pthread_mutex_unlock(fd->ref_lock);
@@ -3546,6 +3886,9 @@ void cram_free_container(cram_container *c) {
     if (c->refs_used)
 	free(c->refs_used);
 
+    if (c->cons)
+	free(c->cons);
+
     if (c->landmark)
 	free(c->landmark);
 
@@ -3787,12 +4130,19 @@ int cram_write_container(cram_fd *fd, cram_container *c) {
 // common component shared by cram_flush_container{,_mt}
 static int cram_flush_container2(cram_fd *fd, cram_container *c) {
     int i, j;
+    off_t cpos = 0;
 
     if (c->curr_slice > 0 && !c->slices)
 	return -1;
 
     //fprintf(stderr, "Writing container %d, sum %u\n", c->record_counter, sum);
 
+    /* Container offset, for indexing as we go */
+    if (fd->idx_fp && (cpos = CRAM_IO_TELLO_OUT(fd)) < 0) {
+	perror("Cannot index CRAM output");
+	return -1;
+    }
+
     /* Write the container struct itself */
     if (0 != cram_write_container(fd, c))
 	return -1;
@@ -3814,6 +4164,17 @@ static int cram_flush_container2(cram_fd *fd, cram_container *c) {
 	}
     }
 
+    /* One .crai line per slice; the encoder still holds s->crecs */
+    for (i = 0; fd->idx_fp && i < c->curr_slice; i++) {
+	int sz = i+1 < c->num_landmarks
+	    ? c->landmark[i+1] - c->landmark[i]
+	    : c->length - c->landmark[c->num_landmarks-1];
+
+	if (0 != cram_index_slice(fd->idx_fp, c->slices[i], cpos,
+				  c->landmark[i], sz))
+	    return -1;
+    }
+
     return CRAM_IO_FLUSH(fd) == 0 ? 0 : -1;
 }
 
@@ -4081,6 +4442,8 @@ void cram_free_slice(cram_slice *s) {
     if (s->features)
 	free(s->features);
 
+    cram_free_columns(s);
+
 #ifndef TN_external
     if (s->TN)
 	free(s->TN);
@@ -5044,6 +5407,7 @@ cram_fd *cram_open(const char *filename, const char *mode) {
     fd->bases_per_slice = BASES_PER_SLICE;
     fd->slices_per_container = SLICE_PER_CNT;
     fd->embed_ref = 0;
+    fd->embed_cons = 0;
     fd->no_ref = 0;
     fd->ignore_md5 = 0;
     fd->ignore_chksum = 1; // Some disagreement in the specification of these
@@ -5052,11 +5416,17 @@ cram_fd *cram_open(const char *filename, const char *mode) {
     fd->use_rans = IS_CRAM_3_VERS(fd);
     fd->use_bsc = 0;
     fd->use_lzma = 0;
+    fd->trial_candidates = TRIAL_CANDIDATES;
+    fd->profile_out = NULL;
+    fd->idx_fp = NULL;
     fd->multi_seq = 0;
     fd->unsorted   = 0;
     fd->shared_ref = 0;
 
     fd->index       = NULL;
+    fd->index_blk   = NULL;
+    fd->name_idx    = NULL;
+    fd->iter        = NULL;
     fd->own_pool    = 0;
     fd->pool        = NULL;
     fd->rqueue      = NULL;
@@ -5151,6 +5521,7 @@ cram_fd *cram_open_by_callbacks(
     fd->bases_per_slice = BASES_PER_SLICE;
     fd->slices_per_container = SLICE_PER_CNT;
     fd->embed_ref = 0;
+    fd->embed_cons = 0;
     fd->no_ref = 0;
     fd->ignore_md5 = 0;
     fd->ignore_chksum = 1; // Some disagreement in the specification of these
@@ -5159,11 +5530,17 @@ cram_fd *cram_open_by_callbacks(
     fd->use_rans = IS_CRAM_3_VERS(fd);
     fd->use_bsc = 0;
     fd->use_lzma = 0;
+    fd->trial_candidates = TRIAL_CANDIDATES;
+    fd->profile_out = NULL;
+    fd->idx_fp = NULL;
     fd->multi_seq = 0;
     fd->unsorted   = 0;
     fd->shared_ref = 0;
 
     fd->index       = NULL;
+    fd->index_blk   = NULL;
+    fd->name_idx    = NULL;
+    fd->iter        = NULL;
     fd->own_pool    = 0;
     fd->pool        = NULL;
     fd->rqueue      = NULL;
@@ -5277,17 +5654,24 @@ cram_fd *cram_openw_by_callbacks(
     fd->bases_per_slice = BASES_PER_SLICE;
     fd->slices_per_container = SLICE_PER_CNT;
     fd->embed_ref = 0;
+    fd->embed_cons = 0;
     fd->no_ref = 0;
     fd->ignore_md5 = 0;
     fd->use_bz2 = 0;
     fd->use_rans = IS_CRAM_3_VERS(fd);
     fd->use_bsc = 0;
     fd->use_lzma = 0;
+    fd->trial_candidates = TRIAL_CANDIDATES;
+    fd->profile_out = NULL;
+    fd->idx_fp = NULL;
     fd->multi_seq = 0;
     fd->unsorted   = 0;
     fd->shared_ref = 0;
 
     fd->index       = NULL;
+    fd->index_blk   = NULL;
+    fd->name_idx    = NULL;
+    fd->iter        = NULL;
     fd->own_pool    = 0;
     fd->pool        = NULL;
     fd->rqueue      = NULL;
@@ -5422,7 +5806,7 @@ int cram_write_eof_block(cram_fd *fd) {
 int cram_close(cram_fd *fd) {
     spare_bams *bl, *next;
     int i;
-    int rclose = 0;
+    int rclose = 0, rprofile = 0;
 	
     if (!fd) {
 	fd = cram_io_close(fd,0);
@@ -5467,6 +5851,13 @@ int cram_close(cram_fd *fd) {
 	if (0 != cram_write_eof_block(fd))
 	    return -1;
 
+	if (fd->profile_out && 0 != cram_save_profile(fd, fd->profile_out))
+	    rprofile = -1;
+
+	if (fd->idx_fp && zfclose(fd->idx_fp) != 0)
+	    rprofile = -1;
+	fd->idx_fp = NULL;
+
 //	if (1 != fwrite("\x00\x00\x00\x00\xff\xff\xff\xff"
 //			"\xff\xe0\x45\x4f\x46\x00\x00\x00"
 //			"\x00\x00\x00", 19, 1, fd->fp))
@@ -5492,6 +5883,10 @@ int cram_close(cram_fd *fd) {
 	sam_hdr_free(fd->header);
 
     free(fd->prefix);
+    if (fd->profile_out)
+	free(fd->profile_out);
+    if (fd->idx_fp)
+	zfclose(fd->idx_fp);
 
     if (fd->ctr)
 	cram_free_container(fd->ctr);
@@ -5511,16 +5906,22 @@ int cram_close(cram_fd *fd) {
     if (fd->tags_used)
 	HashTableDestroy(fd->tags_used, 1);
 
+    if (fd->iter)
+	cram_iter_destroy(fd->iter);
+
     if (fd->index)
 	cram_index_free(fd);
 
+    if (fd->name_idx)
+	HashFileDestroy(fd->name_idx);
+
     if (fd->own_pool && fd->pool)
 	t_pool_destroy(fd->pool, 0);
 
     /* rclose == return value for flush and close in case of CRAM output */
     fd = cram_io_close(fd, &rclose);
 
-    return rclose;
+    return rprofile ? rprofile : rclose;
 }
 
 
@@ -5596,6 +5997,10 @@ int cram_set_voption(cram_fd *fd, enum cram_option opt, va_list args) {
 	fd->no_ref = va_arg(args, int);
 	break;
 
+    case CRAM_OPT_EMBED_CONS:
+	fd->embed_cons = va_arg(args, int);
+	break;
+
     case CRAM_OPT_IGNORE_MD5:
 	fd->ignore_md5 = va_arg(args, int);
 	break;
@@ -5629,6 +6034,33 @@ int cram_set_voption(cram_fd *fd, enum cram_option opt, va_list args) {
 	fd->use_lzma = va_arg(args, int);
 	break;
 
+    case CRAM_OPT_TRIAL_CANDIDATES:
+	fd->trial_candidates = va_arg(args, int);
+	break;
+
+    case CRAM_OPT_LOAD_PROFILE:
+	return cram_load_profile(fd, va_arg(args, char *));
+
+    case CRAM_OPT_SAVE_PROFILE:
+	if (fd->profile_out)
+	    free(fd->profile_out);
+	if (!(fd->profile_out = strdup(va_arg(args, char *))))
+	    return -1;
+	break;
+
+    case CRAM_OPT_WRITE_INDEX: {
+	char *fn = va_arg(args, char *);
+	if (fd->mode != 'w')
+	    return -1;
+	if (fd->idx_fp)
+	    zfclose(fd->idx_fp);
+	if (!(fd->idx_fp = zfopen(fn, "wz"))) {
+	    perror(fn);
+	    return -1;
+	}
+	break;
+    }
+
     case CRAM_OPT_SHARED_REF:
 	fd->shared_ref = 1;
 	refs = va_arg(args, refs_t *);
@@ -5649,6 +6081,25 @@ int cram_set_voption(cram_fd *fd, enum cram_option opt, va_list args) {
 	return r;
     }
 
+    case CRAM_OPT_REGIONS: {
+	cram_range *cr = va_arg(args, cram_range *);
+	int nr = va_arg(args, int);
+	if (fd->iter)
+	    cram_iter_destroy(fd->iter);
+	if (!(fd->iter = cram_iter_create(fd, cr, nr)))
+	    return -1;
+	fd->required_fields |= SAM_POS;
+	break;
+    }
+
+    case CRAM_OPT_READ_NAME:
+	if (fd->iter)
+	    cram_iter_destroy(fd->iter);
+	if (!(fd->iter = cram_iter_name_create(fd, va_arg(args, char *))))
+	    return -1;
+	fd->required_fields |= SAM_QNAME;
+	break;
+
     case CRAM_OPT_REFERENCE:
 	return cram_load_reference(fd, va_arg(args, char *));
 
@@ -5697,6 +6148,8 @@ int cram_set_voption(cram_fd *fd, enum cram_option opt, va_list args) {
 	    pthread_mutex_init(fd->bam_list_lock, NULL);
 	    fd->shared_ref = 1;
 	    fd->own_pool = 1;
+	    if (fd->refs)
+		fd->refs->nthreads = nthreads;
         }
 	break;
     }
@@ -5711,6 +6164,8 @@ int cram_set_voption(cram_fd *fd, enum cram_option opt, va_list args) {
 	    pthread_mutex_init(fd->metrics_lock, NULL);
 	    pthread_mutex_init(fd->ref_lock, NULL);
 	    pthread_mutex_init(fd->bam_list_lock, NULL);
+	    if (fd->refs)
+		fd->refs->nthreads = fd->pool->tsize;
 	}
 	fd->shared_ref = 1; // Needed to avoid clobbering ref between threads
 	fd->own_pool = 0;
@@ -5726,8 +6181,10 @@ int cram_set_voption(cram_fd *fd, enum cram_option opt, va_list args) {
 
     case CRAM_OPT_REQUIRED_FIELDS:
 	fd->required_fields = va_arg(args, int);
-	if (fd->range.refid != -2)
+	if (fd->range.refid != -2 || fd->iter)
 	    fd->required_fields |= SAM_POS;
+	if (fd->iter && fd->iter->name)
+	    fd->required_fields |= SAM_QNAME;
 	break;
 
     case CRAM_OPT_PRESERVE_AUX_ORDER:
@@ -423,6 +423,28 @@ int cram_compress_block(cram_fd *fd, cram_slice *slice,
 			int method, int level);
 
 cram_metrics *cram_new_metrics(void);
+
+/*! Saves learnt compression metrics to a profile file.
+ *
+ * The profile can be loaded by cram_load_profile() in a later run to
+ * start with the same compression methods, skipping the trial phase.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int cram_save_profile(cram_fd *fd, const char *fn);
+
+/*! Loads a compression profile saved by cram_save_profile().
+ *
+ * Must be called on a CRAM opened for write before data is written.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int cram_load_profile(cram_fd *fd, const char *fn);
+
 char *cram_block_method2str(enum cram_block_method m);
 char *cram_content_type2str(enum cram_content_type t);
 
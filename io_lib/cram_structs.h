@@ -59,6 +59,7 @@ extern "C" {
 #include "io_lib/thread_pool.h"
 #include "io_lib/mFILE.h"
 #include "io_lib/bgzip.h"
+#include "io_lib/zfio.h"
 
 #ifdef SAMTOOLS
 // From within samtools/HTSlib
@@ -242,6 +243,10 @@ typedef struct {
 
     double extra[CRAM_MAX_METHOD];
 
+    // Learnt ratio of actual to predicted compressed size per method.
+    // Zero means the method has not been tried yet.
+    double ratio[CRAM_MAX_METHOD];
+
     cram_stats *stats;
 } cram_metrics;
 
@@ -391,6 +396,7 @@ typedef struct {
     /* Copied from fd before encoding, to allow multi-threading */
     int64_t ref_start, first_base, last_base, ref_id, ref_end;
     char *ref;
+    char *cons;                  // de novo consensus used as ref if no_ref
     //struct ref_entry *ref;
 
     /* For multi-threading */
@@ -540,6 +546,16 @@ typedef struct {
  * is the logical unit for decoding a number of
  * sequences.
  */
+/*
+ * An integer data series decoded or encoded in bulk for a whole slice,
+ * for EXTERNAL codecs whose block holds nothing else.
+ */
+typedef struct cram_column {
+    int32_t *val;
+    int n, idx;
+    int alloc;                   // allocated size of val, when encoding
+} cram_column;
+
 typedef struct cram_slice {
     cram_block_slice_hdr *hdr;
     cram_block *hdr_block;
@@ -605,6 +621,9 @@ typedef struct cram_slice {
 
     // Cache of converted BAM structs
     bam_seq_t **bl;
+
+    // Pre-decoded data series, indexed by DS_ID; NULL if none
+    cram_column *cols;
 } cram_slice;
 
 /*-----------------------------------------------------------------------------
@@ -633,6 +652,7 @@ typedef struct {
 
     char *fn;              // current file opened
     bzi_FILE *fp;          // and the bzi_FILE* to go with it.
+    int nthreads;          // threads for inflating bgzipped references
 
     int count;             // how many cram_fd sharing this refs struct
 
@@ -801,6 +821,7 @@ typedef struct {
     int bases_per_slice;
     int slices_per_container;
     int embed_ref;
+    int embed_cons;
     int no_ref;
     int ignore_md5;
     int use_bz2;
@@ -808,6 +829,9 @@ typedef struct {
     int use_lzma;
     int use_bsc;
     int use_fqz;
+    int trial_candidates; // methods to trial per block; 0 => all
+    char *profile_out;    // compression profile to save on close
+    zfp *idx_fp;          // .crai written alongside the output, or NULL
     int shared_ref;
     enum quality_binning binning;
     unsigned int required_fields;
@@ -822,6 +846,9 @@ typedef struct {
 
     int         index_sz;
     cram_index *index;                  // array, sizeof index_sz
+    cram_index *index_blk;              // entries loaded from a .crai.bin
+    struct cram_iter *iter;             // multi-region query, or NULL
+    HashFile *name_idx;                 // read name index, see .nai files
     off_t first_container;
     int eof;
     int last_slice;                     // number of recs encoded in last slice
@@ -846,6 +873,27 @@ typedef struct {
     int preserve_aux_size;              // does not replace 'i' with 'c' etc in aux.
 } cram_fd;
 
+/*
+ * Iterates over a list of regions, visiting each overlapping slice
+ * once in file order. See cram_iter_create().
+ */
+typedef struct cram_iter {
+    cram_fd *fd;
+    int nregion;
+    cram_range *region;       // regions sorted by refid and start
+    int *order;               // region[i] was the order[i]th one supplied
+    int nslice;
+    cram_index **slice;       // index entries to decode, in file order
+    int curr_slice;           // next entry in slice[]
+    cram_container *c;        // container holding the current slice
+    cram_slice *s;            // current decoded slice
+    int lo;                   // first region still able to match a record
+    int *match, nmatch;       // regions matching the last record returned
+    char *name;               // read name wanted instead of regions, or NULL
+    int name_len;
+    cram_index *name_slice;   // slices holding name, pointed to by slice[]
+} cram_iter;
+
 #if defined(CRAM_IO_CUSTOM_BUFFERING)
 extern size_t cram_io_input_buffer_read(void *ptr, size_t size, size_t nmemb, cram_fd * fd);
 extern int cram_io_input_buffer_seek(cram_fd * fd, off_t offset, int whence);
@@ -863,6 +911,7 @@ extern int cram_io_flush_output_buffer(cram_fd *fd);
 #define CRAM_IO_PUTC(c,fd) cram_io_output_buffer_putc(c,fd)
 #define CRAM_IO_WRITE(ptr, size, nmemb, fd) cram_io_output_buffer_write(ptr,size,nmemb,fd)
 #define CRAM_IO_FLUSH(fd) cram_io_flush_output_buffer((fd))
+#define CRAM_IO_TELLO_OUT(fd) (fd->fp_out_buffer->fp_out_buf_start +(fd->fp_out_buffer->fp_out_buf_pc-fd->fp_out_buffer->fp_out_buf_pa))
 
 #else // ! CRAM_IO_CUSTOM_BUFFERING
 #define CRAM_IO_GETC(fd) getc(fd->fp_in)
@@ -873,6 +922,7 @@ extern int cram_io_flush_output_buffer(cram_fd *fd);
 #define CRAM_IO_PUTC(c,fd) putc(c,fd->fp_out)
 #define CRAM_IO_WRITE(ptr, size, nmemb, fd) fwrite(ptr,size,nmemb,fd->fp_out)
 #define CRAM_IO_FLUSH(fd) (fd->fp_out ? fflush(fd->fp_out) : 0)
+#define CRAM_IO_TELLO_OUT(fd) ftello(fd->fp_out)
 
 #endif // end CRAM_IO_CUSTOM_BUFFERING
 
@@ -972,6 +1022,13 @@ enum cram_option {
     CRAM_OPT_OUTPUT_BGZIP_IDX,
     CRAM_OPT_USE_BSC,
     CRAM_OPT_USE_FQZ,
+    CRAM_OPT_TRIAL_CANDIDATES,
+    CRAM_OPT_LOAD_PROFILE,
+    CRAM_OPT_SAVE_PROFILE,
+    CRAM_OPT_EMBED_CONS,
+    CRAM_OPT_WRITE_INDEX,
+    CRAM_OPT_REGIONS,
+    CRAM_OPT_READ_NAME,
 };
 
 /* BF bitfields */
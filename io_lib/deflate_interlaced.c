@@ -72,6 +72,7 @@
 #include <unistd.h>
 #include <assert.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "io_lib/deflate_interlaced.h"
 
@@ -259,7 +260,12 @@ static huffman_code_t codes_english[] = {
     {252, 15}, {253, 15}, {254, 15}, {255, 15}, {SYM_EOF, 15},
 };
 
+/*
+ * Built on first use and shared by all callers, so creation (including
+ * the decode tables) is guarded to permit decoding from multiple threads.
+ */
 static huffman_codeset_t *static_codeset[NCODES_STATIC];
+static pthread_mutex_t static_codeset_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * ---------------------------------------------------------------------------
@@ -772,11 +778,14 @@ huffman_codeset_t *generate_code_set(int code_set, int ncodes,
 	}
 
 	/* If our global codeset hasn't been initialised yet, do so */
+	pthread_mutex_lock(&static_codeset_lock);
 	if (!static_codeset[code_set]) {
 	    huffman_codes_t *c = (huffman_codes_t *)malloc(sizeof(*c));
 
-	    if (NULL == (cs = (huffman_codeset_t *)malloc(sizeof(*cs))))
+	    if (NULL == (cs = (huffman_codeset_t *)malloc(sizeof(*cs)))) {
+		pthread_mutex_unlock(&static_codeset_lock);
 		return NULL;
+	    }
 
 	    cs->codes = (huffman_codes_t **)malloc(sizeof(*cs->codes));
 	    cs->codes[0] = c;
@@ -811,15 +820,18 @@ huffman_codeset_t *generate_code_set(int code_set, int ncodes,
 
 	    default:
 		fprintf(stderr, "Unknown huffman code set '%d'\n", code_set);
+		pthread_mutex_unlock(&static_codeset_lock);
 		return NULL;
 	    }
 
 	    canonical_codes(c);
+	    init_decode_tables(cs);
 
 	    static_codeset[code_set] = cs;
 	}
 
 	cs = static_codeset[code_set];
+	pthread_mutex_unlock(&static_codeset_lock);
     }
 
     return cs;
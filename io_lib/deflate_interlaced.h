@@ -127,6 +127,7 @@ int huffman_multi_encode(block_t *blk, huffman_codeset_t *cs,
 			 int code_set, unsigned char *data, int len);
 
 block_t *huffman_multi_decode(block_t *in, huffman_codeset_t *cs);
+int init_decode_tables(huffman_codeset_t *cs);
 
 huffman_codeset_t *codes2codeset(huffman_code_t *codes, int ncodes,
 				 int code_num);
@@ -38,10 +38,19 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include "io_lib/os.h"
 #include "io_lib/hash_table.h"
+#include "io_lib/tar_format.h"
 #include "io_lib/jenkins_lookup3.h"
 
+#ifdef HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 /* =========================================================================
  * TCL's hash function. Basically hash*9 + char.
  * =========================================================================
@@ -1139,6 +1148,46 @@ HashFile *HashFileLoad_old(FILE *fp) {
 }
 #endif
 
+/*
+ * Memory maps the on-disk hash index (header, buckets and item lists) so
+ * that queries can walk the buckets in place instead of issuing a seek and
+ * several reads per lookup. The archive contents themselves are not mapped.
+ *
+ * This is purely an optimisation. If the file cannot be mapped, eg a pipe
+ * or a truncated index, hf->index is left as NULL and HashFileQuery falls
+ * back to stdio.
+ */
+static void HashFileMap(HashFile *hf) {
+#ifdef HAVE_MMAP
+    struct stat sb;
+    off_t start;
+    size_t len;
+    long pgsize;
+    void *m;
+
+    if (!hf->hfp || hf->hh.size < hf->header_size + 4*hf->hh.nbuckets)
+	return;
+
+    if (fstat(fileno(hf->hfp), &sb) != 0 || !S_ISREG(sb.st_mode))
+	return;
+    if (hf->hf_start < 0 || hf->hf_start + hf->hh.size > sb.st_size)
+	return;
+
+    if ((pgsize = sysconf(_SC_PAGESIZE)) <= 0)
+	return;
+    start = hf->hf_start - hf->hf_start % pgsize;
+    len = hf->hf_start - start + hf->hh.size;
+
+    m = mmap(NULL, len, PROT_READ, MAP_SHARED, fileno(hf->hfp), start);
+    if (m == MAP_FAILED)
+	return;
+
+    hf->map = (unsigned char *)m;
+    hf->map_len = len;
+    hf->index = hf->map + (hf->hf_start - start);
+#endif
+}
+
 /*
  * Opens a stored hash table file. It also internally keeps an open file to
  * hash and the archive files.
@@ -1265,6 +1314,8 @@ HashFile *HashFileFopen(FILE *fp) {
 	hf->footers[i].cached_data = NULL;
     }
 
+    HashFileMap(hf);
+
     return hf;
 }
 
@@ -1423,60 +1474,192 @@ HashFile *HashFileLoad(FILE *fp) {
  *    0 on success (pos & size updated)
  *   -1 on failure
  */
-int HashFileQuery(HashFile *hf, uint8_t *key, int key_len,
-		  HashFileItem *item) {
-    uint64_t hval;
+static uint64_t HashFileBucket(HashFile *hf, uint8_t *key, int key_len) {
+    return hash64(hf->hh.hfunc, key, key_len) & (hf->hh.nbuckets-1);
+}
+
+/*
+ * HashFileQuery for a memory mapped index, given the bucket number.
+ * All offsets are checked against the index size so a corrupt file
+ * cannot walk us off the end of the mapping.
+ *
+ * Up to max matching items are stored in item[]. (Tables built with
+ * HASH_ALLOW_DUP_KEYS may hold several.)
+ *
+ * Returns the number of items stored.
+ */
+static int HashFileQueryMapped(HashFile *hf, uint64_t hval,
+			       uint8_t *key, int key_len,
+			       HashFileItem *item, int max) {
+    unsigned char *ip, *end = hf->index + hf->hh.size;
     uint32_t pos;
-    int klen;
+    int klen, n = 0;
+
+    ip = hf->index + hf->header_size + 4*hval;
+    pos = ((uint32_t)ip[0]<<24) | (ip[1]<<16) | (ip[2]<<8) | ip[3];
+    if (0 == pos || pos >= hf->hh.size)
+	return 0;
+
+    for (ip = hf->index + pos;
+	 n < max && ip < end && (klen = *ip++);
+	 ip += klen + 13) {
+	unsigned char *dp = ip + klen;
+	uint64_t ipos;
+	int i;
+
+	if (dp + 13 > end)
+	    break;
+
+	if (klen != key_len || 0 != memcmp(key, ip, key_len))
+	    continue;
+
+	item[n].header  = (dp[0] >> 4) & 0xf;
+	item[n].footer  = dp[0] & 0xf;
+	item[n].archive = dp[1];
+	for (ipos = 0, i = 2; i < 9; i++)
+	    ipos = (ipos << 8) | dp[i];
+	item[n].pos  = ipos + hf->hh.offset;
+	item[n].size = ((uint32_t)dp[9]<<24) | (dp[10]<<16) | (dp[11]<<8) | dp[12];
+	n++;
+    }
+
+    return n;
+}
+
+/*
+ * HashFileQuery given the bucket number, using the mapped index when
+ * available or stdio otherwise. Up to max matching items are stored in
+ * item[].
+ *
+ * Returns the number of items stored.
+ */
+static int HashFileQueryBucket(HashFile *hf, uint64_t hval,
+			       uint8_t *key, int key_len,
+			       HashFileItem *item, int max) {
+    uint32_t pos;
+    int klen, n = 0;
     int cur_offset = 0;
 
-    /* Hash 'key' to compute the bucket number */
-    hval = hash64(hf->hh.hfunc, key, key_len) & (hf->hh.nbuckets-1);
+    if (hf->index)
+	return HashFileQueryMapped(hf, hval, key, key_len, item, max);
 
     /* Read the bucket to find the first linked list item location */
     if (-1 == fseeko(hf->hfp, hf->hf_start + 4*hval + hf->header_size,SEEK_SET))
-	return -1;
+	return 0;
     if (4 != fread(&pos, 1, 4, hf->hfp))
-	return -1;
+	return 0;
     pos = be_int4(pos);
     cur_offset = 4*hval + 4 + hf->header_size;
 
     if (0 == pos)
 	/* No bucket pos => key not present */
-	return -1;
+	return 0;
 
     /* Jump to the HashItems list and look through for key */
     if (-1 == fseeko(hf->hfp, pos - cur_offset, SEEK_CUR))
-	return -1;
+	return 0;
 
-    for (klen = fgetc(hf->hfp); klen; klen = fgetc(hf->hfp)) {
+    for (klen = fgetc(hf->hfp); n < max && klen > 0; klen = fgetc(hf->hfp)) {
 	char k[256];
 	unsigned char headfoot;
 	uint64_t pos;
 	uint32_t size;
 
 	if (1 != fread(k, klen, 1, hf->hfp))
-	    return -1;
+	    break;
 	if (1 != fread(&headfoot, 1, 1, hf->hfp))
-	    return -1;
-	item->header = (headfoot >> 4) & 0xf;
-	item->footer = headfoot & 0xf;
+	    break;
+	item[n].header = (headfoot >> 4) & 0xf;
+	item[n].footer = headfoot & 0xf;
 	if (1 != fread(&pos, 8, 1, hf->hfp))
-	    return -1;
-	item->archive = *(char *)&pos;
+	    break;
+	item[n].archive = *(char *)&pos;
 	*(char *)&pos = 0;
 	pos = be_int8(pos) + hf->hh.offset;
 	if (1 != fread(&size, 4, 1, hf->hfp))
-	    return -1;
+	    break;
 	size = be_int4(size);
 	if (klen == key_len && 0 == memcmp(key, k, key_len)) {
-	    item->pos = pos;
-	    item->size = size;
-	    return 0;
+	    item[n].pos = pos;
+	    item[n].size = size;
+	    n++;
 	}
     }
 
-    return -1;
+    return n;
+}
+
+int HashFileQuery(HashFile *hf, uint8_t *key, int key_len,
+		  HashFileItem *item) {
+    return HashFileQueryBucket(hf, HashFileBucket(hf, key, key_len),
+			       key, key_len, item, 1) ? 0 : -1;
+}
+
+/*
+ * As HashFileQuery, but for tables holding duplicate keys. Up to max
+ * items matching key are stored in items[].
+ *
+ * Returns the number of items stored, 0 if the key is not present.
+ */
+int HashFileQueryAll(HashFile *hf, uint8_t *key, int key_len,
+		     HashFileItem *items, int max) {
+    return HashFileQueryBucket(hf, HashFileBucket(hf, key, key_len),
+			       key, key_len, items, max);
+}
+
+typedef struct {
+    uint64_t key;	/* bucket number or archive position */
+    int idx;		/* index into the caller's arrays */
+} hf_sort_t;
+
+static int hf_sort_cmp(const void *v1, const void *v2) {
+    const hf_sort_t *s1 = (const hf_sort_t *)v1;
+    const hf_sort_t *s2 = (const hf_sort_t *)v2;
+
+    if (s1->key != s2->key)
+	return s1->key < s2->key ? -1 : 1;
+    return s1->idx - s2->idx;
+}
+
+/*
+ * Queries a batch of keys at once. The keys are visited in bucket order,
+ * and as the buckets and their item lists are stored in the same order on
+ * disk this turns a group of random lookups into a single forward sweep
+ * through the index.
+ *
+ * items[i] and found[i] are filled out for each keys[i] of length
+ * key_lens[i]; found[i] is 1 if present and 0 otherwise.
+ *
+ * Returns the number of keys found on success
+ *        -1 on failure
+ */
+int HashFileQueryMany(HashFile *hf, int nkeys, uint8_t **keys, int *key_lens,
+		      HashFileItem *items, int *found) {
+    hf_sort_t *order;
+    int i, nfound = 0;
+
+    if (nkeys <= 0)
+	return 0;
+
+    if (NULL == (order = (hf_sort_t *)malloc(nkeys * sizeof(*order))))
+	return -1;
+
+    for (i = 0; i < nkeys; i++) {
+	order[i].key = HashFileBucket(hf, keys[i], key_lens[i]);
+	order[i].idx = i;
+    }
+    qsort(order, nkeys, sizeof(*order), hf_sort_cmp);
+
+    for (i = 0; i < nkeys; i++) {
+	int j = order[i].idx;
+	found[j] = HashFileQueryBucket(hf, order[i].key,
+				       keys[j], key_lens[j],
+				       &items[j], 1);
+	nfound += found[j];
+    }
+
+    free(order);
+    return nfound;
 }
 
 HashFile *HashFileCreate(int size, int options) {
@@ -1534,6 +1717,11 @@ void HashFileDestroy(HashFile *hf) {
 	    free(hf->afp);
     }
 
+#ifdef HAVE_MMAP
+    if (hf->map)
+	munmap(hf->map, hf->map_len);
+#endif
+
     if (hf->hfp)
 	fclose(hf->hfp);
 
@@ -1559,28 +1747,59 @@ static int HashFileOpenArchive(HashFile *hf, int archive_no) {
     return 0;
 }
 
+/*
+ * Returns the FILE holding a specific archive number, opening it first
+ * if required, or NULL on failure. The FILE belongs to the HashFile.
+ */
+FILE *HashFileArchive(HashFile *hf, int archive_no) {
+    if (-1 == HashFileOpenArchive(hf, archive_no))
+	return NULL;
+
+    return hf->afp[archive_no];
+}
+
 
 /*
- * Extracts the contents for a file out of the HashFile.
+ * Reads size bytes at pos from an archive into data, only seeking when
+ * we are not already at the correct location.
+ *
+ * Returns 0 on success,
+ *        -1 on failure
  */
-char *HashFileExtract(HashFile *hf, char *fname, size_t *len) {
-    HashFileItem hfi;
+static int HashFileRead(HashFile *hf, int archive_no, uint64_t pos,
+			uint32_t size, char *data) {
+    FILE *fp;
+
+    HashFileOpenArchive(hf, archive_no);
+    if (!(fp = hf->afp[archive_no]))
+	return -1;
+
+    if ((uint64_t)ftello(fp) != pos && -1 == fseeko(fp, pos, SEEK_SET))
+	return -1;
+
+    if (size && 1 != fread(data, size, 1, fp))
+	return -1;
+
+    return 0;
+}
+
+/*
+ * Extracts the contents for an item already located by HashFileQuery.
+ */
+static char *HashFileExtractItem(HashFile *hf, HashFileItem *hfi,
+				 size_t *len) {
     size_t sz, pos;
     char *data;
     HashFileSection *head = NULL, *foot = NULL;
 
-    /* Find out if and where the item is in the archive */
-    if (-1 == HashFileQuery(hf, (uint8_t *)fname, strlen(fname), &hfi))
-	return NULL;
-
     /* Work out the size including header/footer and allocate */
-    sz = hfi.size;
-    if (hfi.header) {
-	head = &hf->headers[hfi.header-1];
+    sz = hfi->size;
+    if (hfi->header) {
+	head = &hf->headers[hfi->header-1];
 	sz += head->size;
     }
-    if (hfi.footer) {
-	foot = &hf->footers[hfi.footer-1];
+    if (hfi->footer) {
+	foot = &hf->footers[hfi->footer-1];
 	sz += foot->size;
     }
     *len = sz;
@@ -1592,39 +1811,288 @@ char *HashFileExtract(HashFile *hf, char *fname, size_t *len) {
     /* Header */
     pos = 0;
     if (head) {
-	HashFileOpenArchive(hf, head->archive_no);
-	if (!hf->afp[head->archive_no])
-	    return NULL;
-
-	fseeko(hf->afp[head->archive_no], head->pos, SEEK_SET);
-	if (1 != fread(&data[pos], head->size, 1, hf->afp[head->archive_no]))
-	    return NULL;
+	if (-1 == HashFileRead(hf, head->archive_no, head->pos, head->size,
+			       &data[pos]))
+	    goto err;
 	pos += head->size;
     }
 
     /* Main file */
-    HashFileOpenArchive(hf, hfi.archive);
-    if (!hf->afp[hfi.archive])
-	return NULL;
-
-    fseeko(hf->afp[hfi.archive], hfi.pos, SEEK_SET);
-    if (1 != fread(&data[pos], hfi.size, 1, hf->afp[hfi.archive]))
-	return NULL;
-    pos += hfi.size;
+    if (-1 == HashFileRead(hf, hfi->archive, hfi->pos, hfi->size, &data[pos]))
+	goto err;
+    pos += hfi->size;
 
     /* Footer */
     if (foot) {
-	HashFileOpenArchive(hf, foot->archive_no);
-	if (!hf->afp[foot->archive_no])
-	    return NULL;
-
-	fseeko(hf->afp[foot->archive_no], foot->pos, SEEK_SET);
-	if (1 != fread(&data[pos], foot->size, 1, hf->afp[foot->archive_no]))
-	    return NULL;
+	if (-1 == HashFileRead(hf, foot->archive_no, foot->pos, foot->size,
+			       &data[pos]))
+	    goto err;
 	pos += foot->size;
     }
 
     return data;
+
+ err:
+    free(data);
+    return NULL;
+}
+
+/*
+ * Extracts the contents for a file out of the HashFile.
+ */
+char *HashFileExtract(HashFile *hf, char *fname, size_t *len) {
+    HashFileItem hfi;
+
+    /* Find out if and where the item is in the archive */
+    if (-1 == HashFileQuery(hf, (uint8_t *)fname, strlen(fname), &hfi))
+	return NULL;
+
+    return HashFileExtractItem(hf, &hfi, len);
+}
+
+/*
+ * Extracts a batch of files out of the HashFile. The names are looked up
+ * with HashFileQueryMany and the contents are then read in archive and
+ * position order, so a sorted archive is read with a single forward pass.
+ *
+ * data[i] and lens[i] are filled out for each fnames[i]. data[i] is NULL
+ * when the file is not present or could not be read; otherwise it is
+ * malloced and should be freed by the caller.
+ *
+ * Returns the number of files extracted on success
+ *        -1 on failure
+ */
+int HashFileExtractMany(HashFile *hf, int nfiles, char **fnames,
+			char **data, size_t *lens) {
+    HashFileItem *items = NULL;
+    uint8_t **keys = NULL;
+    int *key_lens = NULL, *found = NULL;
+    hf_sort_t *order = NULL;
+    int i, n, nextracted = -1;
+
+    if (nfiles <= 0)
+	return 0;
+
+    items    = (HashFileItem *)malloc(nfiles * sizeof(*items));
+    keys     = (uint8_t **)malloc(nfiles * sizeof(*keys));
+    key_lens = (int *)malloc(nfiles * sizeof(*key_lens));
+    found    = (int *)malloc(nfiles * sizeof(*found));
+    order    = (hf_sort_t *)malloc(nfiles * sizeof(*order));
+    if (!items || !keys || !key_lens || !found || !order)
+	goto err;
+
+    for (i = 0; i < nfiles; i++) {
+	keys[i] = (uint8_t *)fnames[i];
+	key_lens[i] = strlen(fnames[i]);
+	data[i] = NULL;
+	lens[i] = 0;
+    }
+
+    if (-1 == HashFileQueryMany(hf, nfiles, keys, key_lens, items, found))
+	goto err;
+
+    /* Archive numbers are 8-bit and positions 56-bit; see HashFileSave */
+    for (i = n = 0; i < nfiles; i++) {
+	if (!found[i])
+	    continue;
+	order[n].key = ((uint64_t)items[i].archive << 56) | items[i].pos;
+	order[n].idx = i;
+	n++;
+    }
+    qsort(order, n, sizeof(*order), hf_sort_cmp);
+
+    for (nextracted = i = 0; i < n; i++) {
+	int j = order[i].idx;
+	if ((data[j] = HashFileExtractItem(hf, &items[j], &lens[j])))
+	    nextracted++;
+    }
+
+ err:
+    free(items);
+    free(keys);
+    free(key_lens);
+    free(found);
+    free(order);
+
+    return nextracted;
+}
+
+/*
+ * Writes a ustar header for a member 'name' of 'size' bytes. Names longer
+ * than NAMSIZ are split into the prefix and name fields.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int hf_tar_header(FILE *fp, char *name, size_t size) {
+    tar_block blk;
+    size_t len = strlen(name);
+    unsigned int sum = 0;
+    char *split = NULL;
+    int i;
+
+    memset(&blk, 0, sizeof(blk));
+    if (len > NAMSIZ) {
+	for (i = len - NAMSIZ - 1; i < len && i <= 155; i++) {
+	    if (name[i] == '/') {
+		split = &name[i];
+		break;
+	    }
+	}
+	if (!split || split == name)
+	    return -1;
+	memcpy(blk.header.prefix, name, split - name);
+	memcpy(blk.header.name, split+1, len - (split+1 - name));
+    } else {
+	memcpy(blk.header.name, name, len);
+    }
+
+    sprintf(blk.header.mode,  "%07o", 0644);
+    sprintf(blk.header.uid,   "%07o", 0);
+    sprintf(blk.header.gid,   "%07o", 0);
+    sprintf(blk.header.size,  "%011lo", (unsigned long)size);
+    sprintf(blk.header.mtime, "%011lo", (unsigned long)time(NULL));
+    blk.header.typeflag = REGTYPE;
+    memcpy(blk.header.magic, "ustar", 6);
+    memcpy(blk.header.version, "00", 2);
+
+    /* The checksum is computed with the checksum field as spaces */
+    memset(blk.header.chksum, ' ', 8);
+    for (i = 0; i < TBLOCK; i++)
+	sum += (unsigned char)blk.data[i];
+    sprintf(blk.header.chksum, "%06o", sum);
+
+    return fwrite(&blk, sizeof(blk), 1, fp) == 1 ? 0 : -1;
+}
+
+/*
+ * Creates a new archive for writing with HashFileWriterAdd. The index is
+ * written to the file named 'index' by HashFileWriterClose, or appended
+ * to the archive itself (as with hash_tar -A) if index is NULL.
+ *
+ * Format is HASHFILE_ARCHIVE_TAR for a tar file, or HASHFILE_ARCHIVE_RAW
+ * for the file contents alone.
+ *
+ * Returns the HashFileWriter on success
+ *         NULL on failure
+ */
+HashFileWriter *HashFileWriterOpen(char *archive, char *index, int format) {
+    HashFileWriter *w;
+
+    if (NULL == (w = (HashFileWriter *)calloc(1, sizeof(*w))))
+	return NULL;
+    w->format = format;
+
+    if (NULL == (w->hf = HashFileCreate(0, HASH_DYNAMIC_SIZE)))
+	goto err;
+
+    if (index) {
+	if (NULL == (w->hf->archives = (char **)malloc(sizeof(char *))) ||
+	    NULL == (w->hf->archives[0] = strdup(archive)))
+	    goto err;
+	w->hf->narchives = 1;
+    }
+
+    if (NULL == (w->afp = fopen(archive, "wb")))
+	goto err;
+    if (index && NULL == (w->hfp = fopen(index, "wb")))
+	goto err;
+
+    return w;
+
+ err:
+    if (w->afp)
+	fclose(w->afp);
+    HashFileDestroy(w->hf);
+    free(w);
+    return NULL;
+}
+
+/*
+ * Appends a file to the archive and adds it to the index. Names must be
+ * unique and at most 255 bytes long.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int HashFileWriterAdd(HashFileWriter *w, char *name, char *data,
+		      size_t size) {
+    static char zero[TBLOCK];
+    HashFileItem *hfi;
+    HashData hd;
+    int len = strlen(name), added;
+    size_t extra = 0;
+
+    if (len < 1 || len > 255 || size > UINT32_MAX)
+	return -1;
+
+    if (HashTableSearch(w->hf->h, name, len)) {
+	fprintf(stderr, "Duplicate archive entry '%s'\n", name);
+	return -1;
+    }
+
+    if (w->format == HASHFILE_ARCHIVE_TAR) {
+	if (-1 == hf_tar_header(w->afp, name, size))
+	    return -1;
+	w->pos += TBLOCK;
+	extra = TBLOCK*((size+TBLOCK-1)/TBLOCK) - size;
+    }
+
+    if (NULL == (hfi = (HashFileItem *)calloc(1, sizeof(*hfi))))
+	return -1;
+    hfi->pos     = w->pos;
+    hfi->size    = size;
+    hfi->archive = 0;
+    hd.p = hfi;
+
+    if (size != fwrite(data, 1, size, w->afp) ||
+	extra != fwrite(zero, 1, extra, w->afp)) {
+	free(hfi);
+	return -1;
+    }
+    w->pos += size + extra;
+
+    if (!HashTableAdd(w->hf->h, name, len, hd, &added)) {
+	free(hfi);
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Finishes the archive, writes its index and closes both files.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int HashFileWriterClose(HashFileWriter *w) {
+    FILE *ifp;
+    int ret = 0;
+
+    if (!w)
+	return -1;
+
+    if (w->format == HASHFILE_ARCHIVE_TAR) {
+	/* End of archive marker */
+	static char zero[2*TBLOCK];
+	if (1 != fwrite(zero, sizeof(zero), 1, w->afp))
+	    ret = -1;
+    }
+
+    /* HashFileSave doesn't check its writes, so test the stream too */
+    ifp = w->hfp ? w->hfp : w->afp;
+    if (HashFileSave(w->hf, ifp, 0) == (uint64_t)-1 || ferror(ifp))
+	ret = -1;
+
+    if (w->hfp && fclose(w->hfp))
+	ret = -1;
+    if (fclose(w->afp))
+	ret = -1;
+    HashFileDestroy(w->hf);
+    free(w);
+
+    return ret;
 }
 
 /*
@@ -141,8 +141,27 @@ typedef struct {
     FILE **afp;			/* archive FILE(s) */
     int header_size;		/* size of header + filename + N(head/feet) */
     off_t hf_start;		/* location of HashFile header in file */
+    unsigned char *map;		/* mmapped hash index, NULL if not mapped */
+    size_t map_len;		/* length of map, from a page boundary */
+    unsigned char *index;	/* HashFile header within map */
 } HashFile;
 
+/* Archive formats for HashFileWriterOpen */
+#define HASHFILE_ARCHIVE_RAW 0	/* contents concatenated together */
+#define HASHFILE_ARCHIVE_TAR 1	/* a ustar archive */
+
+/*
+ * Writes an archive sequentially while building its HashFile index in
+ * memory, so no second pass over the archive is needed to index it.
+ */
+typedef struct {
+    HashFile *hf;		/* the index being built */
+    FILE *afp;			/* archive FILE */
+    FILE *hfp;			/* index FILE, NULL if appended to archive */
+    int format;			/* HASHFILE_ARCHIVE_RAW or _TAR */
+    uint64_t pos;		/* current offset in the archive */
+} HashFileWriter;
+
 /* Functions to to use HashTable.options */
 #define HASH_FUNC_HSIEH       0
 #define HASH_FUNC_TCL         1
@@ -190,7 +209,14 @@ void HashTableIterReset(HashIter *iter);
 uint64_t HashFileSave(HashFile *hf, FILE *fp, int64_t offset);
 HashFile *HashFileLoad(FILE *fp);
 int HashFileQuery(HashFile *hf, uint8_t *key, int key_len, HashFileItem *item);
+int HashFileQueryAll(HashFile *hf, uint8_t *key, int key_len,
+		     HashFileItem *items, int max);
 char *HashFileExtract(HashFile *hf, char *fname, size_t *len);
+FILE *HashFileArchive(HashFile *hf, int archive_no);
+int HashFileQueryMany(HashFile *hf, int nkeys, uint8_t **keys, int *key_lens,
+		      HashFileItem *items, int *found);
+int HashFileExtractMany(HashFile *hf, int nfiles, char **fnames,
+			char **data, size_t *lens);
 
 
 HashFile *HashFileCreate(int size, int options);
@@ -198,6 +224,10 @@ void HashFileDestroy(HashFile *hf);
 HashFile *HashFileOpen(char *fname);
 HashFile *HashFileFopen(FILE *fp);
 
+HashFileWriter *HashFileWriterOpen(char *archive, char *index, int format);
+int HashFileWriterAdd(HashFileWriter *w, char *name, char *data, size_t size);
+int HashFileWriterClose(HashFileWriter *w);
+
 #ifdef __cplusplus
 }
 #endif
@@ -56,6 +56,9 @@
 #ifdef HAVE_MMAP
 #include <sys/mman.h>
 #endif
+#ifndef NO_THREADS
+#include <pthread.h>
+#endif
 
 //Moved from mFILE.h to avoid conflicting with WinUser.h
 #define MF_READ    1
@@ -151,6 +154,133 @@ int mfmmap(mFILE *mf, FILE *fp, const char *fn) {
 }
 #endif
 
+struct mfmap_t {
+    char *data;
+    size_t size;
+    int ref;
+#ifndef NO_THREADS
+    pthread_mutex_t lock;
+#endif
+};
+
+/*
+ * Maps the whole of the file open on fd, read-only. fd may be closed
+ * afterwards.
+ *
+ * Returns the mapping with one reference held on success
+ *         NULL on failure, or when mmap is unavailable
+ */
+mfmap_t *mfmap_create(int fd) {
+#ifdef HAVE_MMAP
+    struct stat sb;
+    mfmap_t *m;
+
+    if (fstat(fd, &sb) != 0 || sb.st_size == 0 ||
+	sb.st_size != (off_t)(size_t)sb.st_size)
+	return NULL;
+
+    if (NULL == (m = (mfmap_t *)malloc(sizeof(*m))))
+	return NULL;
+
+    m->size = sb.st_size;
+    m->data = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (m->data == MAP_FAILED) {
+	free(m);
+	return NULL;
+    }
+    m->ref = 1;
+#ifndef NO_THREADS
+    pthread_mutex_init(&m->lock, NULL);
+#endif
+
+    return m;
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * Drops a reference to a mapping, unmapping it when no longer in use.
+ */
+void mfmap_destroy(mfmap_t *m) {
+    int ref;
+
+    if (!m)
+	return;
+
+#ifndef NO_THREADS
+    pthread_mutex_lock(&m->lock);
+#endif
+    ref = --m->ref;
+#ifndef NO_THREADS
+    pthread_mutex_unlock(&m->lock);
+#endif
+    if (ref)
+	return;
+
+#ifdef HAVE_MMAP
+    munmap(m->data, m->size);
+#endif
+#ifndef NO_THREADS
+    pthread_mutex_destroy(&m->lock);
+#endif
+    free(m);
+}
+
+/*
+ * Creates an mFILE holding size bytes at offset in the mapping, without
+ * copying them. The view holds its own reference on the mapping.
+ *
+ * Returns the mFILE on success
+ *         NULL on failure
+ */
+mFILE *mfview(mfmap_t *m, size_t offset, size_t size) {
+    mFILE *mf;
+
+    if (!m || offset > m->size || size > m->size - offset)
+	return NULL;
+
+    if (NULL == (mf = mfcreate(m->data + offset, size)))
+	return NULL;
+    mf->alloced = 0;
+    mf->map = m;
+
+#ifndef NO_THREADS
+    pthread_mutex_lock(&m->lock);
+#endif
+    m->ref++;
+#ifndef NO_THREADS
+    pthread_mutex_unlock(&m->lock);
+#endif
+
+    return mf;
+}
+
+/*
+ * Replaces the data of a view with a private copy, so that it may be
+ * modified or freed. The mapping is read-only, so every function that
+ * writes to mf->data must call this first.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int mfunshare(mFILE *mf) {
+    char *data;
+
+    if (!mf->map)
+	return 0;
+
+    if (NULL == (data = (char *)malloc(mf->size ? mf->size : 1)))
+	return -1;
+    memcpy(data, mf->data, mf->size);
+    mfmap_destroy(mf->map);
+    mf->map = NULL;
+    mf->data = data;
+    mf->alloced = mf->size;
+
+    return 0;
+}
+
 
 /*
  * Creates and returns m_channel[0].
@@ -224,6 +354,7 @@ mFILE *mfcreate(char *data, int size) {
     mf->offset = 0;
     mf->flush_pos = 0;
     mf->mode = MF_READ | MF_WRITE;
+    mf->map = NULL;
     return mf;
 }
 
@@ -232,7 +363,10 @@ mFILE *mfcreate(char *data, int size) {
  * It also rewinds the file.
  */
 void mfrecreate(mFILE *mf, char *data, int size) {
-    if (mf->data)
+    if (mf->map) {
+	mfmap_destroy(mf->map);
+	mf->map = NULL;
+    } else if (mf->data)
 	free(mf->data);
     mf->data = data;
     mf->size = size;
@@ -426,7 +560,9 @@ int mfdestroy(mFILE *mf) {
     if (!mf)
 	return -1;
 
-    if (mf->data)
+    if (mf->map)
+	mfmap_destroy(mf->map);
+    else if (mf->data)
 	free(mf->data);
     free(mf);
 
@@ -447,6 +583,9 @@ void *mfsteal(mFILE *mf, size_t *size_out) {
 
     if (!mf) return NULL;
 
+    if (mfunshare(mf) != 0)
+	return NULL;
+
     data = mf->data;
     
     if (NULL != size_out) *size_out = mf->size;
@@ -545,6 +684,10 @@ size_t mfwrite(void *ptr, size_t size, size_t nmemb, mFILE *mf) {
     if (!(mf->mode & MF_WRITE))
 	return 0;
 
+    /* Views are copied on write */
+    if (mf->map && mfunshare(mf) != 0)
+	return 0;
+
     /* Append mode => forced all writes to end of file */
     if (mf->mode & MF_APPEND)
 	mf->offset = mf->size;
@@ -583,7 +726,13 @@ int mfgetc(mFILE *mf) {
 
 int mungetc(int c, mFILE *mf) {
     if (mf->offset > 0) {
-	mf->data[--mf->offset] = c;
+	/* Pushing back the character just read needs no write */
+	if ((unsigned char)mf->data[mf->offset-1] != (unsigned char)c) {
+	    if (mf->map && mfunshare(mf) != 0)
+		return -1;
+	    mf->data[mf->offset-1] = c;
+	}
+	mf->offset--;
 	return c;
     }
     
@@ -670,6 +819,10 @@ int mfprintf(mFILE *mf, char *fmt, ...) {
     size_t est_length;
     va_list args;
 
+    /* Views are copied on write */
+    if (mf->map && mfunshare(mf) != 0)
+	return -1;
+
     va_start(args, fmt);
     est_length = vflen(fmt, args);
     va_end(args);
@@ -712,6 +865,9 @@ int mfprintf(mFILE *mf, char *fmt, ...) {
 void mfascii(mFILE *mf) {
     size_t p1, p2;
 
+    if (mf->map && mfunshare(mf) != 0)
+	return;
+
     for (p1 = p2 = 1; p1 < mf->size; p1++, p2++) {
 	if (mf->data[p1] == '\n' && mf->data[p1-1] == '\r') {
 	    p2--; /* delete the \r */
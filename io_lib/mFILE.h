@@ -40,6 +40,9 @@
 extern "C" {
 #endif
 
+/* A shared read-only mapping of a file; see mfmap_create */
+typedef struct mfmap_t mfmap_t;
+
 typedef struct {
     FILE *fp;
     char *data;
@@ -49,6 +52,7 @@ typedef struct {
     size_t size;
     size_t offset;
     size_t flush_pos;
+    mfmap_t *map; /* non-NULL if data is a view onto a shared mapping */
 } mFILE;
 
 mFILE *mfreopen(const char *path, const char *mode, FILE *fp);
@@ -77,6 +81,16 @@ mFILE *mstdout(void);
 mFILE *mstderr(void);
 void mfascii(mFILE *mf);
 
+/*
+ * Read-only windows onto a shared mmapped file, so that members of large
+ * archives can be handed out as mFILEs without copying. The mapping is
+ * reference counted and is unmapped when it and all of its views have
+ * been closed. Writing to a view first takes a private copy.
+ */
+mfmap_t *mfmap_create(int fd);
+void mfmap_destroy(mfmap_t *m);
+mFILE *mfview(mfmap_t *m, size_t offset, size_t size);
+
 #ifdef __cplusplus
 }
 #endif
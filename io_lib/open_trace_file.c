@@ -83,6 +83,14 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <limits.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#  include <dirent.h>
+#endif
 #include "io_lib/os.h"
 #include "io_lib/xalloc.h"
 #ifdef TRACE_ARCHIVE
@@ -101,6 +109,9 @@
 #ifdef HAVE_LIBCURL
 #  include <curl/curl.h>
 #endif
+#if !defined(SAMTOOLS) && (defined(USE_WGET) || defined(HAVE_LIBCURL))
+#  define URL_SEARCH
+#endif
 
 #include "io_lib/open_trace_file.h"
 #include "io_lib/misc.h"
@@ -118,6 +129,410 @@
  */
 static char *magics[] = {"", ".bz", ".gz", ".Z", ".z", ".bz2", ".sz"};
 
+/*
+ * A process-wide cache of search path resolution state, shared by
+ * open_trace_mfile, open_exp_mfile and any other caller of open_path_mfile.
+ *
+ * Entries are keyed on the pathname of a search path directory or of an
+ * archive. Directories hold a listing of their contents so the compression
+ * suffixes may be tested without a stat() per candidate; archives hold
+ * their open HashFile or srf_t handle. Both hold a table of names already
+ * known to be absent.
+ *
+ * Each entry is revalidated against stat() of its path at most once per
+ * open_path_mfile call, discarding the cached contents if the path has
+ * changed. So a search path element costs one stat() per lookup rather
+ * than one per compression suffix. A directory listing taken during the
+ * same second as the directory was last modified is not trusted, as
+ * further changes within that second would not be visible in st_mtime; we
+ * fall back to stat() until it is reread.
+ *
+ * path_cache_lock protects the table and its entries only. It is never
+ * held over reading a directory or archive, so lookups from several
+ * threads only serialise on the cache bookkeeping and on use of the same
+ * archive handle.
+ */
+
+/*
+ * The open handles of an archive. These are reference counted so a lookup
+ * may keep using them without path_cache_lock held, even if meanwhile the
+ * entry is reset or the cache flushed. HashFile and srf_t are not thread
+ * safe, so 'lock' is held while using them or replacing 'map'; views
+ * already handed out from 'map' hold their own reference to it.
+ */
+typedef struct {
+    int        ref;	/* protected by path_cache_lock */
+    pthread_mutex_t lock;
+    HashFile  *hf;	/* HASH archive handle */
+    mfmap_t   *map;	/* TAR or HASH archive mapping, for mfview */
+    int        map_no;	/* HASH archive number held in 'map' */
+#ifndef SAMTOOLS
+    srf_t     *srf;	/* SRF archive handle, with index loaded */
+#endif
+} path_arc_t;
+
+typedef struct {
+    unsigned   checked;	/* path_cache_gen of last validation by stat() */
+    int        exists;	/* path existed when last checked */
+    mode_t     mode;	/* st_mode, st_ino, st_size and st_mtime... */
+    ino_t      ino;	/* ...as of loading the cached contents */
+    off_t      size;
+    time_t     mtime;
+    int        listed;	/* 1 => 'names' is complete and trusted */
+    int        arc_type;/* archive type from find_file_dir magic checks */
+    HashTable *names;	/* directory listing */
+    HashTable *miss;	/* negative lookups */
+    path_arc_t *arc;	/* archive handles, if opened */
+} path_cache_t;
+
+enum archive_type_t {
+    ARC_UNKNOWN = -1, ARC_NONE, ARC_HASH, ARC_TAR, ARC_SFF, ARC_SRF
+};
+
+/* Bounds on memory usage; exceeding these simply flushes the table */
+#define PATH_CACHE_MAX 256
+#define PATH_MISS_MAX  65536
+
+static HashTable *path_cache = NULL;
+static unsigned path_cache_gen = 0;   /* incremented per open_path_mfile */
+static pthread_mutex_t path_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static dev_t path_cache_cwd_dev = 0;  /* Relative keys are only valid for */
+static ino_t path_cache_cwd_ino = 0;  /* this working directory */
+
+static void path_arc_destroy(path_arc_t *arc) {
+    if (arc->hf)
+	HashFileDestroy(arc->hf);
+    if (arc->map)
+	mfmap_destroy(arc->map);
+#ifndef SAMTOOLS
+    if (arc->srf)
+	srf_destroy(arc->srf, 1);
+#endif
+    pthread_mutex_destroy(&arc->lock);
+    free(arc);
+}
+
+/*
+ * Drops a reference to an archive's handles, closing them on the last one.
+ * Must be called with path_cache_lock held.
+ */
+static void path_arc_unref(path_arc_t *arc) {
+    if (--arc->ref == 0)
+	path_arc_destroy(arc);
+}
+
+/*
+ * Discards the cached contents of a path_cache_t, but not the entry itself.
+ */
+static void path_cache_reset(path_cache_t *pc) {
+    if (pc->names)
+	HashTableDestroy(pc->names, 0);
+    if (pc->miss)
+	HashTableDestroy(pc->miss, 0);
+    if (pc->arc)
+	path_arc_unref(pc->arc);
+    pc->names = pc->miss = NULL;
+    pc->arc = NULL;
+    pc->listed = 0;
+    pc->arc_type = ARC_UNKNOWN;
+}
+
+static void path_cache_free(path_cache_t *pc) {
+    path_cache_reset(pc);
+    free(pc);
+}
+
+/* Frees the entire cache. Must be called with path_cache_lock held. */
+static void path_cache_flush(void) {
+    HashIter *iter;
+    HashItem *hi;
+
+    if (!path_cache)
+	return;
+
+    if ((iter = HashTableIterCreate())) {
+	while ((hi = HashTableIterNext(path_cache, iter)))
+	    path_cache_free((path_cache_t *)hi->data.p);
+	HashTableIterDestroy(iter);
+    }
+    HashTableDestroy(path_cache, 0);
+    path_cache = NULL;
+}
+
+/*
+ * Returns the cache entry for 'path', creating it or revalidating it as
+ * required. Must be called with path_cache_lock held; the lock is dropped
+ * while calling stat(), so any entry pointers held previously must be
+ * looked up again afterwards.
+ *
+ * Returns path_cache_t pointer on success (check pc->exists);
+ *         NULL on failure.
+ */
+static path_cache_t *path_cache_get(char *path) {
+    HashItem *hi;
+    HashData hd;
+    path_cache_t *pc;
+    struct stat sb;
+    int len = strlen(path), exists;
+
+    if (path_cache && (hi = HashTableSearch(path_cache, path, len))) {
+	pc = (path_cache_t *)hi->data.p;
+	if (pc->checked == path_cache_gen)
+	    return pc;
+    }
+
+    pthread_mutex_unlock(&path_cache_lock);
+    exists = (stat(path, &sb) == 0);
+    pthread_mutex_lock(&path_cache_lock);
+
+    if (path_cache && path_cache->nused >= PATH_CACHE_MAX &&
+	!HashTableSearch(path_cache, path, len))
+	path_cache_flush();
+
+    if (!path_cache) {
+	if (!(path_cache = HashTableCreate(64, HASH_DYNAMIC_SIZE |
+					   HASH_FUNC_HSIEH)))
+	    return NULL;
+    }
+
+    if ((hi = HashTableSearch(path_cache, path, len))) {
+	pc = (path_cache_t *)hi->data.p;
+    } else {
+	if (!(pc = calloc(1, sizeof(*pc))))
+	    return NULL;
+	pc->arc_type = ARC_UNKNOWN;
+	hd.p = pc;
+	if (!HashTableAdd(path_cache, path, len, hd, NULL)) {
+	    free(pc);
+	    return NULL;
+	}
+    }
+
+    pc->checked = path_cache_gen;
+    if (!exists) {
+	if (pc->exists)
+	    path_cache_reset(pc);
+	pc->exists = 0;
+	return pc;
+    }
+
+    if (!pc->exists || pc->mode != sb.st_mode || pc->ino != sb.st_ino ||
+	pc->size != sb.st_size || pc->mtime != sb.st_mtime) {
+	path_cache_reset(pc);
+    } else if (!pc->listed && pc->names) {
+	/* Stale or untrusted listing; reread when next needed */
+	HashTableDestroy(pc->names, 0);
+	pc->names = NULL;
+    }
+
+    pc->exists = 1;
+    pc->mode   = sb.st_mode;
+    pc->ino    = sb.st_ino;
+    pc->size   = sb.st_size;
+    pc->mtime  = sb.st_mtime;
+
+    return pc;
+}
+
+#ifndef _WIN32
+/*
+ * Reads the names in directory 'dir' into a new HashTable.
+ *
+ * Returns HashTable pointer on success;
+ *         NULL on failure.
+ */
+static HashTable *path_dir_list(char *dir) {
+    HashTable *names;
+    HashData hd;
+    DIR *d;
+    struct dirent *de;
+
+    if (!(d = opendir(dir)))
+	return NULL;
+    if (!(names = HashTableCreate(256, HASH_DYNAMIC_SIZE | HASH_FUNC_HSIEH))) {
+	closedir(d);
+	return NULL;
+    }
+    hd.i = 0;
+    while ((de = readdir(d))) {
+	if (!HashTableAdd(names, de->d_name, strlen(de->d_name), hd, NULL)) {
+	    HashTableDestroy(names, 0);
+	    closedir(d);
+	    return NULL;
+	}
+    }
+    closedir(d);
+
+    return names;
+}
+#endif
+
+/*
+ * Checks whether 'name' is a known entry in directory 'dir', without
+ * needing to stat() it. The directory is read without path_cache_lock
+ * held.
+ *
+ * Returns 1 if present (although possibly not a regular file);
+ *         0 if known to be absent;
+ *        -1 if unknown, in which case the caller should check by hand.
+ */
+static int path_cache_dir_has(char *dir, char *name) {
+#ifdef _WIN32
+    return -1;
+#else
+    path_cache_t *pc;
+    HashTable *names;
+    time_t mtime;
+    int r = -1;
+
+    if (!*dir)
+	dir = "/";
+
+    pthread_mutex_lock(&path_cache_lock);
+    if (!(pc = path_cache_get(dir)))
+	goto out;
+    if (!pc->exists) {
+	r = 0;
+	goto out;
+    }
+    if (!S_ISDIR(pc->mode))
+	goto out;
+
+    if (!pc->names) {
+	mtime = pc->mtime;
+	pthread_mutex_unlock(&path_cache_lock);
+	names = path_dir_list(dir);
+	pthread_mutex_lock(&path_cache_lock);
+	if (!names)
+	    goto out;
+
+	/* Only keep it if the directory is unchanged since we stat()ed it */
+	if ((pc = path_cache_get(dir)) && pc->exists && !pc->names &&
+	    pc->mtime == mtime) {
+	    pc->names = names;
+
+	    /* Changes made in the same second as listing may be missing */
+	    pc->listed = mtime < time(NULL);
+	} else {
+	    HashTableDestroy(names, 0);
+	    if (!pc || !pc->names)
+		goto out;
+	}
+    }
+
+    if (pc->listed)
+	r = HashTableSearch(pc->names, name, strlen(name)) ? 1 : 0;
+
+ out:
+    pthread_mutex_unlock(&path_cache_lock);
+    return r;
+#endif
+}
+
+/*
+ * Negative lookup cache queries on a path_cache_t.
+ * Must be called with path_cache_lock held.
+ */
+static int path_cache_missing(path_cache_t *pc, char *name) {
+    return pc && pc->miss && HashTableSearch(pc->miss, name, strlen(name));
+}
+
+static void path_cache_add_miss(path_cache_t *pc, char *name) {
+    HashData hd;
+
+    if (!pc)
+	return;
+
+    if (pc->miss && pc->miss->nused >= PATH_MISS_MAX) {
+	HashTableDestroy(pc->miss, 0);
+	pc->miss = NULL;
+    }
+
+    if (!pc->miss &&
+	!(pc->miss = HashTableCreate(256, HASH_DYNAMIC_SIZE |
+				     HASH_FUNC_HSIEH)))
+	return;
+
+    hd.i = 0;
+    HashTableAdd(pc->miss, name, strlen(name), hd, NULL);
+}
+
+/*
+ * Looks up archive 'path' in the cache, taking a reference to its handles
+ * (opened later by the caller, with arc->lock held).
+ *
+ * Returns path_arc_t pointer, to be released with path_arc_release();
+ *         NULL if the archive is absent or 'name' is known to be missing
+ *         from it.
+ */
+static path_arc_t *path_arc_lookup(char *path, char *name) {
+    path_cache_t *pc;
+    path_arc_t *arc = NULL;
+
+    pthread_mutex_lock(&path_cache_lock);
+    if (!(pc = path_cache_get(path)) || !pc->exists ||
+	path_cache_missing(pc, name))
+	goto out;
+
+    if (!pc->arc) {
+	if (!(pc->arc = calloc(1, sizeof(*pc->arc))))
+	    goto out;
+	pthread_mutex_init(&pc->arc->lock, NULL);
+	pc->arc->map_no = -1;
+	pc->arc->ref = 1; /* the cache entry's own reference */
+    }
+    arc = pc->arc;
+    arc->ref++;
+
+ out:
+    pthread_mutex_unlock(&path_cache_lock);
+    return arc;
+}
+
+/*
+ * Releases a reference taken by path_arc_lookup. If 'miss' is non-NULL it
+ * is recorded as absent from the archive, provided the cache entry still
+ * refers to the same handles.
+ */
+static void path_arc_release(char *path, path_arc_t *arc, char *miss) {
+    HashItem *hi;
+    path_cache_t *pc;
+
+    pthread_mutex_lock(&path_cache_lock);
+    if (miss && path_cache &&
+	(hi = HashTableSearch(path_cache, path, strlen(path)))) {
+	pc = (path_cache_t *)hi->data.p;
+	if (pc->arc == arc)
+	    path_cache_add_miss(pc, miss);
+    }
+    path_arc_unref(arc);
+    pthread_mutex_unlock(&path_cache_lock);
+}
+
+/*
+ * Checks whether 'path' is a regular file, using the cached directory
+ * listing of its parent where possible to avoid the stat() for files that
+ * are absent.
+ *
+ * Returns 1 if it is, 0 if not.
+ */
+static int path_cache_is_file(char *path) {
+    char dir[PATH_MAX+1], *cp;
+    int r;
+
+    if ((cp = strrchr(path, '/'))) {
+	if (cp - path > PATH_MAX)
+	    return is_file(path);
+	memcpy(dir, path, cp - path);
+	dir[cp - path] = 0;
+	r = path_cache_dir_has(dir, cp+1);
+    } else {
+	r = path_cache_dir_has(".", path);
+    }
+
+    return r == 0 ? 0 : is_file(path);
+}
+
 /*
  * Tokenises the search path splitting on colons (unix) or semicolons
  * (windows).
@@ -225,11 +640,18 @@ static mFILE *find_file_tar(char *file, char *tarname, size_t offset) {
     tar_block blk;
     int size;
     int name_len = strlen(file);
+    path_arc_t *arc;
+    mFILE *mf = NULL;
+    char *miss = NULL;
 
     /* Maximum name length for a tar file */
     if (name_len > 100)
 	return NULL;
 
+    /* Known to be absent from an unchanged tar file? */
+    if (!(arc = path_arc_lookup(tarname, file)))
+	return NULL;
+
     /* Search the .index file */
     sprintf(path, "%s.index", tarname);
     if (file_exists(path)) {
@@ -261,13 +683,15 @@ static mFILE *find_file_tar(char *file, char *tarname, size_t offset) {
 	    fclose(fpind);
 
 	    /* Not in index */
-	    if (!found)
-		return NULL;
+	    if (!found) {
+		miss = file;
+		goto out;
+	    }
 	}
     }
 
     if (NULL == (fp = fopen(tarname, "rb")))
-	return NULL;
+	goto out;
 
     /*
      * Search through the tar file (starting from index position) looking
@@ -295,21 +719,36 @@ static mFILE *find_file_tar(char *file, char *tarname, size_t offset) {
 	    if (i == num_magics)
 		continue;
 
-	    /* Found it - copy out the data to an mFILE */
-	    if (NULL == (data = (char *)malloc(size)))
-		return NULL;
-	    if (size != fread(data, 1, size, fp)) {
-		free(data);
-		return NULL;
+	    /*
+	     * Found it - hand out a view onto the mapped tar file, or
+	     * failing that copy out the data to an mFILE.
+	     */
+	    pthread_mutex_lock(&arc->lock);
+	    if (!arc->map)
+		arc->map = mfmap_create(fileno(fp));
+	    if (arc->map)
+		mf = mfview(arc->map, ftell(fp), size);
+	    pthread_mutex_unlock(&arc->lock);
+
+	    if (!mf && (data = (char *)malloc(size))) {
+		if (size == fread(data, 1, size, fp))
+		    mf = mfcreate(data, size);
+		else
+		    free(data);
 	    }
-	    return mfcreate(data, size);
+	    fclose(fp);
+	    goto out;
 	}
 
 	fseek(fp, TBLOCK*((size+TBLOCK-1)/TBLOCK), SEEK_CUR);
     }
 
     fclose(fp);
-    return NULL;
+    miss = file;
+
+ out:
+    path_arc_release(tarname, arc, miss);
+    return mf;
 }
 
 /*
@@ -324,27 +763,51 @@ static mFILE *find_file_tar(char *file, char *tarname, size_t offset) {
  */
 static mFILE *find_file_hash(char *file, char *hashfile) {
     size_t size;
-    static HashFile *hf = NULL;
-    static char hf_name[1024];
-    char *data;
+    path_arc_t *arc;
+    HashFileItem hfi;
+    FILE *afp;
+    mFILE *mf = NULL;
+    char *data, *miss = NULL;
 
-    /* Cache an open HashFile for fast accesing */
-    if (strcmp(hashfile, hf_name) != 0) {
-	if (hf)
-	    HashFileDestroy(hf);
-	hf = HashFileOpen(hashfile);
+    /* Use the cached open HashFile for fast accessing */
+    if (!(arc = path_arc_lookup(hashfile, file)))
+	return NULL;
 
-	if (!hf)
-	    return NULL;
-	strcpy(hf_name, hashfile);
-    }
+    pthread_mutex_lock(&arc->lock);
+    if (!arc->hf && !(arc->hf = HashFileOpen(hashfile)))
+	goto out;
 
     /* Search */
-    if (NULL == (data = HashFileExtract(hf, file, &size)))
-	return NULL;
+    if (-1 == HashFileQuery(arc->hf, (uint8_t *)file, strlen(file), &hfi)) {
+	miss = file;
+	goto out;
+    }
+
+    /*
+     * Plain items are handed out as views onto the mapped archive. Those
+     * with header or footer sections need assembling, so are copied.
+     */
+    if (!hfi.header && !hfi.footer) {
+	if (arc->map && arc->map_no != hfi.archive) {
+	    mfmap_destroy(arc->map);
+	    arc->map = NULL;
+	}
+	if (!arc->map && (afp = HashFileArchive(arc->hf, hfi.archive))) {
+	    arc->map = mfmap_create(fileno(afp));
+	    arc->map_no = hfi.archive;
+	}
+	if (arc->map && (mf = mfview(arc->map, hfi.pos, hfi.size)))
+	    goto out;
+    }
 
     /* Found, so copy the contents to a fake FILE pointer */
-    return mfcreate(data, size);
+    if ((data = HashFileExtract(arc->hf, file, &size)))
+	mf = mfcreate(data, size);
+
+ out:
+    pthread_mutex_unlock(&arc->lock);
+    path_arc_release(hashfile, arc, miss);
+    return mf;
 }
 
 #ifndef SAMTOOLS
@@ -355,30 +818,45 @@ static mFILE *find_file_hash(char *file, char *hashfile) {
  *        NULL if not
  */
 static mFILE *find_file_srf(char *tname, char *srffile) {
+    path_arc_t *arc;
     srf_t *srf;
     uint64_t cpos, hpos, dpos;
     mFILE *mf = NULL;
-    char *cp;
-
-    if (NULL == (srf = srf_open(srffile, "r")))
-	return NULL;
+    char *cp, *miss = NULL;
+    int r;
 
     if (NULL != (cp = strrchr(tname, '/')))
     	tname = cp+1;
 
-    if (0 == srf_find_trace(srf, tname, &cpos, &hpos, &dpos)) {
+    /* Use the cached open SRF and its in-memory index for fast accessing */
+    if (!(arc = path_arc_lookup(srffile, tname)))
+	return NULL;
+
+    pthread_mutex_lock(&arc->lock);
+    if (!arc->srf) {
+	if (NULL == (arc->srf = srf_open(srffile, "r")))
+	    goto out;
+
+	/* Optional; srf_find_trace falls back to the on-disk index */
+	srf_load_index(arc->srf);
+    }
+    srf = arc->srf;
+
+    if (0 == (r = srf_find_trace(srf, tname, &cpos, &hpos, &dpos))) {
 	char *data = malloc(srf->th.trace_hdr_size + srf->tb.trace_size);
-	if (!data) {
-	    srf_destroy(srf, 1);
-	    return NULL;
-	}
+	if (!data)
+	    goto out;
 	memcpy(data, srf->th.trace_hdr, srf->th.trace_hdr_size);
 	memcpy(data + srf->th.trace_hdr_size,
 	       srf->tb.trace, srf->tb.trace_size);
 	mf = mfcreate(data, srf->th.trace_hdr_size + srf->tb.trace_size);
+    } else if (r == -2) {
+	miss = tname;
     }
 
-    srf_destroy(srf, 1);
+ out:
+    pthread_mutex_unlock(&arc->lock);
+    path_arc_release(srffile, arc, miss);
     return mf;
 }
 #endif
@@ -517,125 +995,329 @@ mFILE *find_file_url(char *file, char *url) {
 }
 #endif
 
-#define STATIC_CURL
-
 #ifdef HAVE_LIBCURL
-mFILE *find_file_url(char *file, char *url) {
-    char buf[8192], *cp;
-    mFILE *mf = NULL, *headers = NULL;
-    int maxlen = 8190 - strlen(file);
-#ifdef STATIC_CURL
-    static CURL *handle = NULL;
-    static int curl_init = 0;
-#else
-    CURL *handle = NULL;
-    static int curl_init = 0;
-#endif
-    char errbuf[CURL_ERROR_SIZE];
-
-    *errbuf = 0;
-
-#ifdef STATIC_CURL
-    if (!curl_init) {
-	if (curl_global_init(CURL_GLOBAL_ALL))
-	    return NULL;
-
-	if (NULL == (handle = curl_easy_init()))
-	    goto error;
+/*
+ * URL fetching is performed via the curl multi interface. A single
+ * persistent multi handle keeps its connection cache between calls, and
+ * batches of URLs are fetched concurrently over at most URL_MAX_CONNECTIONS
+ * connections per host. Where the server supports HTTP/2 requests are
+ * multiplexed over a single connection instead.
+ *
+ * If the URL_CACHE environment variable names a directory then successful
+ * responses are also cached on disk there, keyed on a hash of the URL.
+ */
+#define URL_MAX_CONNECTIONS 8
 
-	curl_init = 1;
-    }
-#else
-    if (!curl_init) {
-	if (curl_global_init(CURL_GLOBAL_ALL))
-	    return NULL;
+typedef struct {
+    CURL  *handle;
+    mFILE *mf;
+    int    idx;		/* index into the caller's file/mFILE arrays */
+    char   url[8192];
+    char   errbuf[CURL_ERROR_SIZE];
+} url_xfer_t;
 
-	curl_init = 1;
-    }
-    if (NULL == (handle = curl_easy_init()))
-	goto error;
+static CURLM *url_multi = NULL;
+static url_xfer_t url_xfer[URL_MAX_CONNECTIONS];
+static pthread_mutex_t url_lock = PTHREAD_MUTEX_INITIALIZER;
 
-#endif
+/*
+ * Expands %s in 'url' to 'file', storing the result in buf of size 'len'.
+ *
+ * Returns 0 on success;
+ *        -1 if the result does not fit.
+ */
+static int url_expand(char *buf, size_t len, char *file, char *url) {
+    char *cp = buf, *end = buf + len - 1;
+    size_t flen = strlen(file);
 
-    /* Expand %s for the trace name */
-    for (cp = buf; *url && cp - buf < maxlen; url++) {
+    for (; *url; url++) {
 	if (*url == '%' && *(url+1) == 's') {
 	    url++;
-	    cp += strlen(strcpy(cp, file));
+	    if (cp + flen > end)
+		return -1;
+	    memcpy(cp, file, flen);
+	    cp += flen;
 	} else {
+	    if (cp >= end)
+		return -1;
 	    *cp++ = *url;
 	}
     }
-    *cp++ = 0;
+    *cp = 0;
+
+    return 0;
+}
+
+/*
+ * The on-disk response cache. Each file holds the URL and a newline
+ * followed by the response body, to guard against hash collisions.
+ */
+static int url_cache_path(char *path, size_t len, char *url) {
+    char *dir = getenv("URL_CACHE");
+    uint64_t h;
 
-    /* Setup the curl */
-    if (NULL == (mf = mfcreate(NULL, 0)) ||
-	NULL == (headers = mfcreate(NULL, 0)))
+    if (!dir || !*dir)
+	return -1;
+
+    h = hash64(HASH_FUNC_JENKINS, (uint8_t *)url, strlen(url));
+    if (snprintf(path, len, "%s/%016"PRIx64, dir, h) >= len)
+	return -1;
+
+    return 0;
+}
+
+static mFILE *url_cache_load(char *url) {
+    char path[PATH_MAX+1];
+    size_t ulen = strlen(url), size;
+    mFILE *mf;
+    char *data;
+
+    if (url_cache_path(path, PATH_MAX+1, url) != 0)
 	return NULL;
 
-    if (0 != curl_easy_setopt(handle, CURLOPT_URL, buf))
-	goto error;
-    if (0 != curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, 60L))
-	goto error;
-    if (0 != curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION,
-			      (curl_write_callback)mfwrite))
-	goto error;
-    if (0 != curl_easy_setopt(handle, CURLOPT_WRITEDATA, mf))
-	goto error;
-    if (0 != curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION,
-			      (curl_write_callback)mfwrite))
-	goto error;
-    if (0 != curl_easy_setopt(handle, CURLOPT_WRITEHEADER, headers))
-	goto error;
-    if (0 != curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, errbuf))
-	goto error;
-    
-    /* Fetch! */
-    if (0 != curl_easy_perform(handle))
-	goto error;
-    
-    /* Report errors is approproate. 404 is silent as it may have just been
-     * a search via RAWDATA path, everything else is worth reporting.
-     */
-    {
-	float version;
-	int response;
-	char nul = 0;
-	mfwrite(&nul, 1, 1, headers);
-	if (2 == sscanf(headers->data, "HTTP/%f %d", &version, &response)) {
-	    if (response != 200) {
-		if (response != 404)
-		    fprintf(stderr, "%.*s\n",
-			    (int)headers->size, headers->data);
-		goto error;
-	    }
-	}
+    if (!(mf = mfopen(path, "rb")))
+	return NULL;
+
+    if (mf->size <= ulen || memcmp(mf->data, url, ulen) != 0 ||
+	mf->data[ulen] != '\n') {
+	mfclose(mf);
+	return NULL;
     }
 
-    if (mftell(mf) == 0)
-	goto error;
+    size = mf->size - ulen - 1;
+    if (!(data = malloc(size))) {
+	mfclose(mf);
+	return NULL;
+    }
+    memcpy(data, mf->data + ulen + 1, size);
+    mfclose(mf);
 
-    mfdestroy(headers);
+    return mfcreate(data, size);
+}
+
+static void url_cache_save(char *url, mFILE *mf) {
+    char path[PATH_MAX+1], tmp[PATH_MAX+30];
+    FILE *fp;
 
-#ifndef STATIC_CURL
-    curl_easy_cleanup(handle);
+    if (url_cache_path(path, PATH_MAX+1, url) != 0)
+	return;
+
+    /* Write to a temporary and rename, so concurrent readers are safe */
+    sprintf(tmp, "%s.tmp.%d", path, (int)getpid());
+    if (!(fp = fopen(tmp, "wb")))
+	return;
+
+    if (fprintf(fp, "%s\n", url) < 0 ||
+	fwrite(mf->data, 1, mf->size, fp) != mf->size) {
+	fclose(fp);
+	remove(tmp);
+	return;
+    }
+
+    if (fclose(fp) != 0 || rename(tmp, path) != 0)
+	remove(tmp);
+}
+
+static size_t url_write(char *ptr, size_t size, size_t nmemb, void *mf) {
+    return mfwrite(ptr, size, nmemb, (mFILE *)mf);
+}
+
+/* Initialises url_multi. Must be called with url_lock held. */
+static int url_init(void) {
+    if (url_multi)
+	return 0;
+
+    if (curl_global_init(CURL_GLOBAL_ALL))
+	return -1;
+
+    if (NULL == (url_multi = curl_multi_init()))
+	return -1;
+
+#if LIBCURL_VERSION_NUM >= 0x071e00
+    curl_multi_setopt(url_multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+		      (long)URL_MAX_CONNECTIONS);
+    curl_multi_setopt(url_multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+		      (long)URL_MAX_CONNECTIONS);
 #endif
+#ifdef CURLPIPE_MULTIPLEX
+    curl_multi_setopt(url_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+
+    return 0;
+}
+
+/*
+ * Starts a transfer of 'url' into slot 'x'.
+ * Returns 0 on success, -1 on failure.
+ */
+static int url_xfer_start(url_xfer_t *x, int idx, char *url) {
+    x->idx = idx;
+    *x->errbuf = 0;
+    strcpy(x->url, url);
+
+    if (!x->handle) {
+	if (NULL == (x->handle = curl_easy_init()))
+	    return -1;
+    } else {
+	curl_easy_reset(x->handle);
+    }
+
+    if (NULL == (x->mf = mfcreate(NULL, 0)))
+	return -1;
+
+    if (0 != curl_easy_setopt(x->handle, CURLOPT_URL, x->url) ||
+	0 != curl_easy_setopt(x->handle, CURLOPT_CONNECTTIMEOUT, 60L) ||
+	0 != curl_easy_setopt(x->handle, CURLOPT_WRITEFUNCTION, url_write) ||
+	0 != curl_easy_setopt(x->handle, CURLOPT_WRITEDATA, x->mf) ||
+	0 != curl_easy_setopt(x->handle, CURLOPT_ERRORBUFFER, x->errbuf) ||
+	0 != curl_easy_setopt(x->handle, CURLOPT_PRIVATE, x) ||
+	0 != curl_multi_add_handle(url_multi, x->handle)) {
+	mfdestroy(x->mf);
+	x->mf = NULL;
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Completes a transfer, returning the fetched data or NULL on failure.
+ * 404s and their ftp and file equivalents are silent as they may just be
+ * misses from a RAWDATA search path, everything else is worth reporting.
+ */
+static mFILE *url_xfer_finish(url_xfer_t *x, CURLcode res) {
+    mFILE *mf = x->mf;
+    long response = 0;
+
+    curl_multi_remove_handle(url_multi, x->handle);
+    x->mf = NULL;
+
+    curl_easy_getinfo(x->handle, CURLINFO_RESPONSE_CODE, &response);
 
+    if (res != CURLE_OK) {
+	if (res != CURLE_REMOTE_FILE_NOT_FOUND &&
+	    res != CURLE_FILE_COULDNT_READ_FILE)
+	    fprintf(stderr, "CURL ERROR: %s: %s\n", x->url,
+		    *x->errbuf ? x->errbuf : curl_easy_strerror(res));
+	mfdestroy(mf);
+	return NULL;
+    }
+
+    if (strncmp(x->url, "http", 4) == 0 && response != 200) {
+	if (response != 404)
+	    fprintf(stderr, "%s: HTTP response %ld\n", x->url, response);
+	mfdestroy(mf);
+	return NULL;
+    }
+
+    if (mftell(mf) == 0) {
+	mfdestroy(mf);
+	return NULL;
+    }
+
+    url_cache_save(x->url, mf);
     mrewind(mf);
+
     return mf;
+}
+
+/*
+ * Fetches several files from a single URL template, with %s in 'url'
+ * replaced by each file name in turn. Up to URL_MAX_CONNECTIONS transfers
+ * are in flight at once, reusing connections between batches.
+ *
+ * On return mf[i] holds the contents of files[i], or NULL if not found.
+ *
+ * Returns the number of files found.
+ */
+int find_file_url_many(int nfiles, char **files, char *url, mFILE **mf) {
+    int next = 0, active = 0, found = 0, i;
+
+    for (i = 0; i < nfiles; i++)
+	mf[i] = NULL;
+
+    pthread_mutex_lock(&url_lock);
+    if (url_init() != 0) {
+	pthread_mutex_unlock(&url_lock);
+	return 0;
+    }
+
+    while (next < nfiles || active) {
+	CURLMsg *msg;
+	int running, left;
 
- error:
-#ifndef STATIC_CURL
-    if (handle)
-	curl_easy_cleanup(handle);
+	/* Fill the free transfer slots */
+	for (i = 0; i < URL_MAX_CONNECTIONS; i++) {
+	    if (url_xfer[i].mf)
+		continue;
+
+	    while (next < nfiles) {
+		char buf[8192];
+		int idx = next++;
+
+		if (url_expand(buf, 8192, files[idx], url) != 0)
+		    continue;
+
+		if ((mf[idx] = url_cache_load(buf))) {
+		    found++;
+		    continue;
+		}
+
+		if (url_xfer_start(&url_xfer[i], idx, buf) == 0) {
+		    active++;
+		    break;
+		}
+		fprintf(stderr, "Failed to initiate fetch of %s\n", buf);
+	    }
+	}
+
+	if (!active)
+	    continue;
+
+	if (curl_multi_perform(url_multi, &running) != CURLM_OK)
+	    break;
+
+	while ((msg = curl_multi_info_read(url_multi, &left))) {
+	    url_xfer_t *x;
+
+	    if (msg->msg != CURLMSG_DONE)
+		continue;
+
+	    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&x);
+	    if ((mf[x->idx] = url_xfer_finish(x, msg->data.result)))
+		found++;
+	    active--;
+	}
+
+	if (active && running) {
+#if LIBCURL_VERSION_NUM >= 0x074200
+	    curl_multi_poll(url_multi, NULL, 0, 1000, NULL);
+#else
+	    curl_multi_wait(url_multi, NULL, 0, 1000, NULL);
 #endif
-    if (mf)
-	mfdestroy(mf);
-    if (headers)
-	mfdestroy(headers);
-    if (*errbuf)
-	fprintf(stderr, "CURL ERROR: %s\n", errbuf);
-    return NULL;
+	}
+    }
+
+    /* Only reached with transfers active on a curl_multi_perform error */
+    for (i = 0; i < URL_MAX_CONNECTIONS; i++) {
+	if (url_xfer[i].mf) {
+	    curl_multi_remove_handle(url_multi, url_xfer[i].handle);
+	    mfdestroy(url_xfer[i].mf);
+	    url_xfer[i].mf = NULL;
+	}
+    }
+
+    pthread_mutex_unlock(&url_lock);
+
+    return found;
+}
+
+mFILE *find_file_url(char *file, char *url) {
+    mFILE *mf;
+
+    find_file_url_many(1, &file, url, &mf);
+
+    return mf;
 }
 #endif
 
@@ -645,6 +1327,19 @@ mFILE *find_file_url(char *file, char *url) {
 }
 #endif
 
+#ifndef HAVE_LIBCURL
+/* Without curl, batches are simply fetched one at a time */
+int find_file_url_many(int nfiles, char **files, char *url, mFILE **mf) {
+    int i, found = 0;
+
+    for (i = 0; i < nfiles; i++)
+	if ((mf[i] = find_file_url(files[i], url)))
+	    found++;
+
+    return found;
+}
+#endif
+
 
 /*
  * Takes an SFF file in 'data' and edits the header to ensure
@@ -881,8 +1576,13 @@ static mFILE *sff_sorted_query(char *sff, char *accno, FILE *fp,
  * as an mFILE. In essence it produces a single-read SFF archive. This
  * is then decoded by the normal sff parsing code representing a small
  * amount of redundancy, but one which is swamped by the I/O time.
+ *
+ * The open file and index are kept in static variables, so callers must
+ * hold sff_lock; see find_file_sff.
  */
-static mFILE *find_file_sff(char *entry, char *sff) {
+static pthread_mutex_t sff_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static mFILE *find_file_sff_locked(char *entry, char *sff) {
     static FILE *fp = NULL;
     static char sff_copy[1024];
     union {
@@ -1027,6 +1727,16 @@ static mFILE *find_file_sff(char *entry, char *sff) {
     /* Convert to an mFILE and return */
     return sff_single(fake_file, chdrlen+rhdrlen+dlen);
 }
+
+static mFILE *find_file_sff(char *entry, char *sff) {
+    mFILE *mf;
+
+    pthread_mutex_lock(&sff_lock);
+    mf = find_file_sff_locked(entry, sff);
+    pthread_mutex_unlock(&sff_lock);
+
+    return mf;
+}
 #endif
 
 /*
@@ -1087,7 +1797,7 @@ static mFILE *find_file_dir(char *file, char *dirname) {
 	//fprintf(stderr, "*PATH=\"%s\"\n", path);
     }
 
-    if (is_file(path)) {
+    if (path_cache_is_file(path)) {
 	return mfopen(path, "rbm");
     }
 
@@ -1098,68 +1808,98 @@ static mFILE *find_file_dir(char *file, char *dirname) {
      * bits of the file.
      */
     if ((cp = strrchr(file, '/'))) {
+	path_cache_t *pc;
+	int type = ARC_UNKNOWN, cached;
+	ino_t ino = 0;
+	time_t mtime = 0;
+
 	strcpy(path2, path); /* path contains / too as it's from file */
 	*strrchr(path2, '/') = 0;
 
-	if (is_file(path2)) {
+	/* Archive type is cached along with the unchanged file's stat */
+	pthread_mutex_lock(&path_cache_lock);
+	if ((cached = (NULL != (pc = path_cache_get(path2))))) {
+	    if (pc->exists && S_ISREG(pc->mode)) {
+		type  = pc->arc_type;
+		ino   = pc->ino;
+		mtime = pc->mtime;
+	    } else {
+		type = ARC_NONE;
+	    }
+	}
+	pthread_mutex_unlock(&path_cache_lock);
+	if (!cached && !is_file(path2))
+	    type = ARC_NONE;
+
+	if (type == ARC_UNKNOWN) {
 	    /* Open the archive to test for magic numbers */
 	    char magic[8];
 	    FILE *fp;
-	    enum archive_type_t {
-		NONE, HASH, TAR, SFF, SRF
-	    } type = NONE;
 
+	    type = ARC_NONE;
 	    if (NULL == (fp = fopen(path2, "rb")))
 		return NULL;
 	    memcpy(magic, "\0\0\0\0\0\0", 4);
-	    if (4 != fread(magic, 1, 4, fp))
+	    if (4 != fread(magic, 1, 4, fp)) {
+		fclose(fp);
 		return NULL;
+	    }
 
 	    /* .hsh or .sff at start */
 	    if (memcmp(magic, ".hsh", 4) == 0)
-		type = HASH;
+		type = ARC_HASH;
 	    else if (memcmp(magic, ".sff", 4) == 0)
-		type = SFF;
+		type = ARC_SFF;
 
 	    /* Or .hsh or Ihsh at the end */
-	    if (NONE == type) {
+	    if (ARC_NONE == type) {
 		fseek(fp, -16, SEEK_END);
-		if (8 != fread(magic, 1, 8, fp))
+		if (8 != fread(magic, 1, 8, fp)) {
+		    fclose(fp);
 		    return NULL;
+		}
 		if (memcmp(magic+4, ".hsh", 4) == 0)
-		    type = HASH;
+		    type = ARC_HASH;
 		else if (memcmp(magic, "Ihsh", 4) == 0)
-		    type = SRF;
+		    type = ARC_SRF;
 	    }
 
 	    /* or ustar 257 bytes in to indicate un-hashed tar */
-	    if (NONE == type) {
+	    if (ARC_NONE == type) {
 		fseek(fp, 257, SEEK_SET);
-		if (5 != fread(magic, 1, 5, fp))
+		if (5 != fread(magic, 1, 5, fp)) {
+		    fclose(fp);
 		    return NULL;
+		}
 		if (memcmp(magic, "ustar", 5) == 0)
-		    type = TAR;
+		    type = ARC_TAR;
 	    }
 	    fclose(fp);
 
-	    switch (type) {
-	    case HASH:
-		return find_file_hash(cp+1, path2);
-	    case TAR:
-		return find_file_tar(cp+1, path2, 0);
+	    pthread_mutex_lock(&path_cache_lock);
+	    if (cached && (pc = path_cache_get(path2)) && pc->exists &&
+		pc->ino == ino && pc->mtime == mtime)
+		pc->arc_type = type;
+	    pthread_mutex_unlock(&path_cache_lock);
+	}
+
+	switch (type) {
+	case ARC_HASH:
+	    return find_file_hash(cp+1, path2);
+	case ARC_TAR:
+	    return find_file_tar(cp+1, path2, 0);
 #ifndef SAMTOOLS
-	    case SFF:
-		return find_file_sff(cp+1, path2);
-	    case SRF:
-		return find_file_srf(cp+1, path2);
+	case ARC_SFF:
+	    return find_file_sff(cp+1, path2);
+	case ARC_SRF:
+	    return find_file_srf(cp+1, path2);
 #endif
-	    default:
-	    case NONE:
-		break;
-	    }
-
-	    return NULL;
+	default:
+	case ARC_NONE:
+	    break;
 	}
+
+	return NULL;
     }
 
     return NULL;
@@ -1171,127 +1911,286 @@ static mFILE *find_file_dir(char *file, char *dirname) {
  */
 
 /*
- * Opens a trace file named 'file'. This is initially looked for as a
- * pathname relative to a file named "relative_to". This may (for
- * example) be the name of an experiment file referencing the trace
- * file. In this case by passing relative_to as the experiment file
- * filename the trace file will be picked up in the same directory as
- * the experiment file. Relative_to may be supplied as NULL.
+ * Compression suffixes tried on each search path element, unless it is
+ * prefixed by '|'.
+ */
+static char *path_suffix[] = {"", ".gz", ".bz2", ".sz", ".Z", ".bz2"};
+#define NPATH_SUFFIX (sizeof(path_suffix)/sizeof(*path_suffix))
+
+/*
+ * Searches for 'file' in a single (non-URL) search path element, trying
+ * each of the compression suffixes in turn.
  *
- * 'file' is looked for at relative_to, then the current directory, and then
- * all of the locations listed in 'path' (which is a colon separated list).
- * If 'path' is NULL it uses the RAWDATA environment variable instead.
+ * Returns mFILE pointer if found
+ *         NULL if not
+ */
+static mFILE *find_file_element(char *file, char *ele) {
+    int i;
+    mFILE *fp;
+
+    for (i = 0; i < NPATH_SUFFIX; i++) {
+	char file2[1024];
+	char *ele2;
+
+	/*
+	 * '|' prefixing a path component indicates that we do not
+	 * wish to perform the compression extension searching in that
+	 * location.
+	 */
+	if (*ele == '|') {
+	    ele2 = ele+1;
+	} else {
+	    ele2 = ele;
+	}
+
+	sprintf(file2, "%s%s", file, path_suffix[i]);
+
+	if (0 == strncmp(ele2, "TAR=", 4)) {
+	    if ((fp = find_file_tar(file2, ele2+4, 0)))
+		return fp;
+
+	} else if (0 == strncmp(ele2, "HASH=", 5)) {
+	    if ((fp = find_file_hash(file2, ele2+5)))
+		return fp;
+#ifdef TRACE_ARCHIVE
+	} else if (0 == strncmp(ele2, "ARC=", 4)) {
+	    if ((fp = find_file_archive(file2, ele2+4)))
+		return fp;
+#endif
+#ifndef SAMTOOLS
+	} else if (0 == strncmp(ele2, "SFF=", 4)) {
+	    if ((fp = find_file_sff(file2, ele2+4)))
+		return fp;
+
+	} else if (0 == strncmp(ele2, "SRF=", 4)) {
+	    if ((fp = find_file_srf(file2, ele2+4)))
+		return fp;
+#endif
+	} else {
+	    if ((fp = find_file_dir(file2, ele2)))
+		return fp;
+	}
+
+	if (*ele == '|')
+	    break;
+    }
+
+    return NULL;
+}
+
+#ifdef URL_SEARCH
+/*
+ * Identifies URL search path elements.
  *
- * Returns a mFILE pointer when found.
- *           NULL otherwise.
+ * Returns the URL template, setting *nsuffix to the number of compression
+ * suffixes to try;
+ *         NULL if 'ele' is not a URL element.
  */
-mFILE *open_path_mfile(char *file, char *path, char *relative_to) {
+static char *url_element(char *ele, int *nsuffix) {
+    int no_suffix = (*ele == '|');
+
+    if (no_suffix)
+	ele++;
+
+    if (0 == strncmp(ele, "URL=", 4)) {
+	*nsuffix = no_suffix ? 1 : NPATH_SUFFIX;
+	return ele+4;
+    }
+
+    if (!strncmp(ele, "http:", 5) || !strncmp(ele, "ftp:", 4)) {
+	/* ftp/http compression best done via other means */
+	*nsuffix = 1;
+	return ele;
+    }
+
+    return NULL;
+}
+
+/*
+ * Fetches all files not yet found (mf[i] == NULL) from a URL search path
+ * element as a single concurrent batch per compression suffix.
+ *
+ * Returns the number of additional files found.
+ */
+static int find_url_element_many(int nfiles, char **files, char *url,
+				 int nsuffix, mFILE **mf) {
+    char **names = malloc(nfiles * sizeof(*names));
+    mFILE **got  = malloc(nfiles * sizeof(*got));
+    int *idx     = malloc(nfiles * sizeof(*idx));
+    int found = 0, s, i, n;
+
+    if (!names || !got || !idx)
+	goto err;
+
+    for (s = 0; s < nsuffix; s++) {
+	size_t slen = strlen(path_suffix[s]);
+
+	for (i = n = 0; i < nfiles; i++) {
+	    size_t flen;
+
+	    if (mf[i])
+		continue;
+
+	    flen = strlen(files[i]);
+	    if (NULL == (names[n] = malloc(flen + slen + 1)))
+		break;
+	    memcpy(names[n], files[i], flen);
+	    memcpy(names[n] + flen, path_suffix[s], slen+1);
+	    idx[n++] = i;
+	}
+
+	if (n)
+	    found += find_file_url_many(n, names, url, got);
+
+	for (i = 0; i < n; i++) {
+	    mf[idx[i]] = got[i];
+	    free(names[i]);
+	}
+    }
+
+ err:
+    free(names);
+    free(got);
+    free(idx);
+
+    return found;
+}
+#endif /* URL_SEARCH */
+
+/*
+ * The body of open_path_mfile_many, searching each element of the path.
+ */
+static int open_path_search_many(int nfiles, char **files, char *path,
+				 char *relative_to, mFILE **mf) {
     char *newsearch;
     char *ele;
-    mFILE *fp;
+    int i, found = 0;
+
+    for (i = 0; i < nfiles; i++)
+	mf[i] = NULL;
 
     /* Use path first */
     if (!path)
 	path = getenv("RAWDATA");
     if (NULL == (newsearch = tokenise_search_path(path)))
-	return NULL;
+	return 0;
     
     /*
      * Step through the search path testing out each component.
      * We now look through each path element treating some prefixes as
      * special, otherwise we treat the element as a directory.
+     * URL elements are fetched as a single batch for all outstanding files.
      */
-    for (ele = newsearch; *ele; ele += strlen(ele)+1) {
-	int i;
-	char *suffix[6] = {"", ".gz", ".bz2", ".sz", ".Z", ".bz2"};
-	for (i = 0; i < 6; i++) {
-	    char file2[1024];
-	    char *ele2;
-
-	    /*
-	     * '|' prefixing a path component indicates that we do not
-	     * wish to perform the compression extension searching in that
-	     * location.
-	     */
-	    if (*ele == '|') {
-		ele2 = ele+1;
-	    } else {
-		ele2 = ele;
-	    }
-
-	    sprintf(file2, "%s%s", file, suffix[i]);
-
-	    if (0 == strncmp(ele2, "TAR=", 4)) {
-		if ((fp = find_file_tar(file2, ele2+4, 0))) {
-		    free(newsearch);
-		    return fp;
-		}
+    for (ele = newsearch; *ele && found < nfiles; ele += strlen(ele)+1) {
+#ifdef URL_SEARCH
+	char *url;
+	int nsuffix;
 
-	    } else if (0 == strncmp(ele2, "HASH=", 5)) {
-		if ((fp = find_file_hash(file2, ele2+5))) {
-		    free(newsearch);
-		    return fp;
-		}
-#ifdef TRACE_ARCHIVE
-	    } else if (0 == strncmp(ele2, "ARC=", 4)) {
-		if ((fp = find_file_archive(file2, ele2+4))) {
-		    free(newsearch);
-		    return fp;
-		}
-#endif
-#ifndef SAMTOOLS
-#if defined(USE_WGET) || defined(HAVE_LIBCURL)
-	    } else if (0 == strncmp(ele2, "URL=", 4)) {
-		if ((fp = find_file_url(file2, ele2+4))) {
-		    free(newsearch);
-		    return fp;
-		}
-	    } else if (!strncmp(ele2, "http:", 5) ||
-		       !strncmp(ele2, "ftp:", 4)) {
-		/* ftp/http compression best done via other means */
-		if (i == 0 && (fp = find_file_url(file2, ele2))) {
-		    free(newsearch);
-		    return fp;
-		}
-#endif
-	    } else if (0 == strncmp(ele2, "SFF=", 4)) {
-		if ((fp = find_file_sff(file2, ele2+4))) {
-		    free(newsearch);
-		    return fp;
-		}
-
-	    } else if (0 == strncmp(ele2, "SRF=", 4)) {
-		if ((fp = find_file_srf(file2, ele2+4))) {
-		    free(newsearch);
-		    return fp;
-		}
+	if ((url = url_element(ele, &nsuffix))) {
+	    found += find_url_element_many(nfiles, files, url, nsuffix, mf);
+	    continue;
+	}
 #endif
-	    } else {
-		if ((fp = find_file_dir(file2, ele2))) {
-		    free(newsearch);
-		    return fp;
-		}
-	    }
 
-	    if (*ele == '|')
-		break;
+	for (i = 0; i < nfiles; i++) {
+	    if (!mf[i] && (mf[i] = find_file_element(files[i], ele)))
+		found++;
 	}
     }
 
     free(newsearch);
 
     /* Look in the same location as the incoming 'relative_to' filename */
-    if (relative_to) {
+    if (relative_to && found < nfiles) {
 	char *cp;
 	char relative_path[PATH_MAX+1];
 	strcpy(relative_path, relative_to);
 	if ((cp = strrchr(relative_path, '/')))
 	    *cp = 0;
-	if ((fp = find_file_dir(file, relative_path)))
-	    return fp;
+	for (i = 0; i < nfiles; i++) {
+	    if (!mf[i] && (mf[i] = find_file_dir(files[i], relative_path)))
+		found++;
+	}
     }
 
-    return NULL;
+    return found;
+}
+
+/*
+ * Revalidates the search path cache prior to a lookup.
+ */
+static void path_cache_begin(void) {
+    struct stat sb;
+    int cwd_ok = (stat(".", &sb) == 0);
+
+    pthread_mutex_lock(&path_cache_lock);
+    if (++path_cache_gen == 0)
+	path_cache_gen = 1; /* 0 is used for new entries */
+
+    /* A chdir() invalidates cached relative paths */
+    if (!cwd_ok) {
+	path_cache_flush();
+    } else if (sb.st_dev != path_cache_cwd_dev ||
+	       sb.st_ino != path_cache_cwd_ino) {
+	path_cache_flush();
+	path_cache_cwd_dev = sb.st_dev;
+	path_cache_cwd_ino = sb.st_ino;
+    }
+    pthread_mutex_unlock(&path_cache_lock);
+}
+
+/*
+ * Opens a trace file named 'file'. This is initially looked for as a
+ * pathname relative to a file named "relative_to". This may (for
+ * example) be the name of an experiment file referencing the trace
+ * file. In this case by passing relative_to as the experiment file
+ * filename the trace file will be picked up in the same directory as
+ * the experiment file. Relative_to may be supplied as NULL.
+ *
+ * 'file' is looked for at relative_to, then the current directory, and then
+ * all of the locations listed in 'path' (which is a colon separated list).
+ * If 'path' is NULL it uses the RAWDATA environment variable instead.
+ *
+ * Returns a mFILE pointer when found.
+ *           NULL otherwise.
+ */
+mFILE *open_path_mfile(char *file, char *path, char *relative_to) {
+    mFILE *mf;
+
+    path_cache_begin();
+    open_path_search_many(1, &file, path, relative_to, &mf);
+
+    return mf;
+}
+
+/*
+ * As open_path_mfile, but for an array of nfiles names. Each search path
+ * element is tried for all outstanding files before moving on to the
+ * next, so that URL elements may fetch them concurrently.
+ *
+ * On return mf[i] holds files[i], or NULL if not found.
+ *
+ * Returns the number of files found.
+ */
+int open_path_mfile_many(int nfiles, char **files, char *path,
+			 char *relative_to, mFILE **mf) {
+    int found;
+
+    path_cache_begin();
+    found = open_path_search_many(nfiles, files, path, relative_to, mf);
+
+    return found;
+}
+
+/*
+ * Discards all cached search path state: directory listings, open archive
+ * handles and negative lookups. Only necessary if an archive may have been
+ * rewritten in place without changing its size or modification time.
+ */
+void open_path_cache_clear(void) {
+    pthread_mutex_lock(&path_cache_lock);
+    path_cache_flush();
+    pthread_mutex_unlock(&path_cache_lock);
 }
 
 FILE *open_path_file(char *file, char *path, char *relative_to) {
@@ -1336,6 +2235,12 @@ mFILE *open_trace_mfile(char *file, char *rel_to) {
 			                    : getenv("TRACE_PATH"), rel_to);
 }
 
+int open_trace_mfile_many(int nfiles, char **files, char *rel_to,
+			  mFILE **mf) {
+    return open_path_mfile_many(nfiles, files, trace_path ? trace_path
+				: getenv("TRACE_PATH"), rel_to, mf);
+}
+
 FILE *open_trace_file(char *file, char *rel_to) {
     return open_path_file(file, trace_path ? trace_path
 			                   : getenv("TRACE_PATH"), rel_to);
@@ -1349,6 +2254,12 @@ mFILE *open_exp_mfile(char *file, char *relative_to) {
 			                  : getenv("EXP_PATH"), relative_to);
 }
 
+int open_exp_mfile_many(int nfiles, char **files, char *relative_to,
+			mFILE **mf) {
+    return open_path_mfile_many(nfiles, files, exp_path ? exp_path
+				: getenv("EXP_PATH"), relative_to, mf);
+}
+
 FILE *open_exp_file(char *file, char *relative_to) {
     return open_path_file(file, exp_path ? exp_path
 			                 : getenv("EXP_PATH"), relative_to);
@@ -106,12 +106,44 @@ char *tokenise_search_path(char *searchpath);
  */
 mFILE *open_path_mfile(char *file, char *path, char *relative_to);
 
+/*
+ * As open_path_mfile, but for an array of nfiles names. Each search path
+ * element is tried for all outstanding files before moving on to the
+ * next, so that URL elements may fetch them concurrently.
+ *
+ * On return mf[i] holds files[i], or NULL if not found.
+ *
+ * Returns the number of files found.
+ */
+int open_path_mfile_many(int nfiles, char **files, char *path,
+			 char *relative_to, mFILE **mf);
+
+/*
+ * open_path_mfile caches directory listings, open HASH and SRF archives and
+ * failed lookups between calls, revalidating them with stat() once per call.
+ * This discards all of that cached state.
+ */
+void open_path_cache_clear(void);
+
 /*
  * Returns a mFILE containing the entire contents of the url;
  *         NULL on failure.
  */
 mFILE *find_file_url(char *file, char *url);
 
+/*
+ * Fetches several files from a single URL template, with %s in 'url'
+ * replaced by each file name in turn. With libcurl these are fetched
+ * concurrently over a bounded pool of reused connections. If the
+ * URL_CACHE environment variable names a directory then responses are
+ * also cached on disk there.
+ *
+ * On return mf[i] holds the contents of files[i], or NULL if not found.
+ *
+ * Returns the number of files found.
+ */
+int find_file_url_many(int nfiles, char **files, char *url, mFILE **mf);
+
 
 /*
  * Opens a trace file named 'file'. This is initially looked for as a
@@ -132,6 +164,15 @@ FILE *open_trace_file(char *file, char *relative_to);
 mFILE *open_exp_mfile(char *file, char *relative_to);
 FILE *open_exp_file(char *file, char *relative_to);
 
+/*
+ * Batched versions of open_trace_mfile and open_exp_mfile; see
+ * open_path_mfile_many.
+ */
+int open_trace_mfile_many(int nfiles, char **files, char *relative_to,
+			  mFILE **mf);
+int open_exp_mfile_many(int nfiles, char **files, char *relative_to,
+			mFILE **mf);
+
 void  iolib_set_trace_path(char *path);
 char *iolib_get_trace_path(void);
 void  iolib_set_exp_path  (char *path);
@@ -423,6 +423,12 @@ int scram_set_option(scram_fd *fd, enum cram_option opt, ...) {
         char *idx_fn = va_arg(args, char *);
         if (fd->is_bam)
 	    return bam_set_option (fd->b,  BAM_OPT_OUTPUT_BGZIP_IDX, idx_fn);
+    } else if (opt == CRAM_OPT_WRITE_INDEX) {
+	char *idx_fn = va_arg(args, char *);
+
+	return fd->is_bam
+	    ? bam_set_option (fd->b,  BAM_OPT_WRITE_INDEX, idx_fn)
+	    : cram_set_option(fd->c, CRAM_OPT_WRITE_INDEX, idx_fn);
     }
 
     if (!fd->is_bam) {
@@ -434,6 +440,29 @@ int scram_set_option(scram_fd *fd, enum cram_option opt, ...) {
     return r;
 }
 
+/*! Restricts reading to the records with a given read name.
+ *
+ * The read name index fn.nai for file fn, as written by "cram_index -n",
+ * is loaded and only the slices it lists are decoded. Subsequent calls
+ * to scram_get_seq() return just the matching records. This is only
+ * supported for CRAM files currently.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int scram_name_query(scram_fd *fd, const char *fn, const char *name) {
+    if (fd->is_bam) {
+	fprintf(stderr, "Read name queries are only implemented for CRAM\n");
+	return -1;
+    }
+
+    if (cram_name_index_load(fd->c, fn) != 0)
+	return -1;
+
+    return cram_set_option(fd->c, CRAM_OPT_READ_NAME, name);
+}
+
 /*! Returns the line number when processing a SAM file
  *
  * @return
@@ -250,6 +250,19 @@ int scram_put_seq(scram_fd *fd, bam_seq_t *s);
  */
 int scram_set_option(scram_fd *fd, enum cram_option opt, ...);
 
+/*! Restricts reading to the records with a given read name.
+ *
+ * The read name index fn.nai for file fn, as written by "cram_index -n",
+ * is loaded and only the slices it lists are decoded. Subsequent calls
+ * to scram_get_seq() return just the matching records. This is only
+ * supported for CRAM files currently.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int scram_name_query(scram_fd *fd, const char *fn, const char *name);
+
 /*! Returns the line number when processing a SAM file
  *
  * @return
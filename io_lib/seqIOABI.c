@@ -170,7 +170,23 @@
 
 #define baseIndex(B) ((B)=='C'?0:(B)=='A'?1:(B)=='G'?2:3)
 
-static int header_fudge = 0;
+/*
+ * Returns the offset of the ABI data within fp. This is usually zero, but
+ * maybe we've transfered a file in MacBinary format in which case we'll
+ * have an extra 128 bytes to add to all our fseeks.
+ *
+ * This is taken from the file itself rather than a global so that ABI
+ * files may be parsed in several threads at once.
+ */
+static int header_fudge(FILE *fp) {
+    unsigned char *d = (unsigned char *)fp->data;
+    int_4 magic;
+
+    if (fp->size < 4)
+	return 128;
+    magic = ((uint_4)d[0]<<24) | (d[1]<<16) | (d[2]<<8) | d[3];
+    return magic == ABI_MAGIC ? 0 : 128;
+}
 
 /* DATA block numbers for traces, in order of FWO_ */
 static int DataCount[4] = {9, 10, 11, 12};
@@ -182,7 +198,7 @@ int dump_labels(FILE *fp, off_t indexO) {
     do {
 	entryNum++;
 
-	if (fseek(fp, header_fudge+indexO+(entryNum*IndexEntryLength), 0) != 0)
+	if (fseek(fp, header_fudge(fp)+indexO+(entryNum*IndexEntryLength), 0) != 0)
 	    return 0;
 
 	if (!be_read_int_4(fp, &entryLabel))
@@ -225,7 +241,7 @@ int getABIIndexEntryLW(FILE *fp, off_t indexO,
     do {
 	entryNum++;
 
-	if (fseek(fp, header_fudge+indexO+(entryNum*IndexEntryLength), 0) != 0)
+	if (fseek(fp, header_fudge(fp)+indexO+(entryNum*IndexEntryLength), 0) != 0)
 	    return 0;
 
 	if (!be_read_int_4(fp, &entryLabel))
@@ -258,7 +274,7 @@ int getABIIndexEntrySW(FILE *fp, off_t indexO,
     do {
 	entryNum++;
 
-	if (fseek(fp, header_fudge+indexO+(entryNum*IndexEntryLength), 0) != 0)
+	if (fseek(fp, header_fudge(fp)+indexO+(entryNum*IndexEntryLength), 0) != 0)
 	    return 0;
 
 	if (!be_read_int_4(fp, &entryLabel))
@@ -283,18 +299,11 @@ int getABIIndexEntrySW(FILE *fp, off_t indexO,
 int getABIIndexOffset(FILE *fp, uint_4 *indexO) {
     uint_4 magic;
 
-    /*
-     * Initialise header_fudge.
-     *
-     * This is usually zero, but maybe we've transfered a file in MacBinary
-     * format in which case we'll have an extra 128 bytes to add to all
-     * our fseeks.
-     */
+    /* Reading the magic number also loads fp when it is stdin */
     rewind(fp);
     be_read_int_4(fp, &magic);
-    header_fudge = (magic == ABI_MAGIC ? 0 : 128);
 
-    if ((fseek(fp, header_fudge + IndexPO, 0) != 0) ||
+    if ((fseek(fp, header_fudge(fp) + IndexPO, 0) != 0) ||
 	(!be_read_int_4(fp, indexO)))
 	return -1;
     else
@@ -338,7 +347,7 @@ int getABIString(FILE *fp, off_t indexO, uint_4 label, uint_4 count,
 
 	/* Read length byte */
 	if (type == 0x12) {
-	    fseek(fp, header_fudge + off, 0);
+	    fseek(fp, header_fudge(fp) + off, 0);
 	    be_read_int_1(fp, &len2);
 	} else {
 	    len2 = len;
@@ -394,7 +403,7 @@ int getABIint1(FILE *fp, off_t indexO, uint_4 label, uint_4 count,
     
 	len2 = MIN((uint_4)max_data_len, len);
 
-	fseek(fp, header_fudge + off, 0);
+	fseek(fp, header_fudge(fp) + off, 0);
     } else {
 	len = len2 = max_data_len;
     }
@@ -572,19 +581,19 @@ Read *fread_abi(FILE *fp) {
 
     if (sections & READ_SAMPLES) {
 	/* Read in the C trace */
-	if (fseek(fp, header_fudge + (off_t)dataCO, 0) == -1) goto bail_out;
+	if (fseek(fp, header_fudge(fp) + (off_t)dataCO, 0) == -1) goto bail_out;
 	getABIint2(fp, 0, 0, 0, read->traceC, read->NPoints);
 	
 	/* Read in the A trace */
-	if (fseek(fp, header_fudge + (off_t)dataAO, 0) == -1) goto bail_out;
+	if (fseek(fp, header_fudge(fp) + (off_t)dataAO, 0) == -1) goto bail_out;
 	getABIint2(fp, 0, 0, 0, read->traceA, read->NPoints);
 	
 	/* Read in the G trace */
-	if (fseek(fp, header_fudge + (off_t)dataGO, 0) == -1) goto bail_out;
+	if (fseek(fp, header_fudge(fp) + (off_t)dataGO, 0) == -1) goto bail_out;
 	getABIint2(fp, 0, 0, 0, read->traceG, read->NPoints);
 	
 	/* Read in the T trace */
-	if (fseek(fp, header_fudge + (off_t)dataTO, 0) == -1) goto bail_out;
+	if (fseek(fp, header_fudge(fp) + (off_t)dataTO, 0) == -1) goto bail_out;
 	getABIint2(fp, 0, 0, 0, read->traceT, read->NPoints);
 	
 	/* Compute highest trace peak */
@@ -610,7 +619,7 @@ Read *fread_abi(FILE *fp) {
 
     /* Read in the bases */
     if (!(getABIIndexEntryLW(fp, (off_t)indexO, BaseEntryLabel, 1, 5, &baseO)
-	  && (fseek(fp, header_fudge + (off_t)baseO, 0) == 0) ))
+	  && (fseek(fp, header_fudge(fp) + (off_t)baseO, 0) == 0) ))
 	goto bail_out;
 
     for (i = 0; i < (read->NBases); i++) {
@@ -754,7 +763,7 @@ Read *fread_abi(FILE *fp) {
 	    base[2] = &G;
 	    base[3] = &T;
 
-	    if (fseek(fp, header_fudge + (off_t)signalO, 0) != -1 &&
+	    if (fseek(fp, header_fudge(fp) + (off_t)signalO, 0) != -1 &&
 		be_read_int_2(fp, (uint_2 *)
 			      base[baseIndex((char)(fwo_>>24&255))]) &&
 		be_read_int_2(fp, (uint_2 *)
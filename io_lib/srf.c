@@ -117,6 +117,16 @@ void srf_destroy(srf_t *srf, int auto_close) {
     if (srf->ztr)
 	delete_ztr(srf->ztr);
 
+    if (srf->tb.trace)
+	free(srf->tb.trace);
+
+    if (srf->midx) {
+	free(srf->midx->data);
+	free(srf->midx->ch_pos);
+	free(srf->midx->th_pos);
+	free(srf->midx);
+    }
+
     free(srf);
 }
 
@@ -445,6 +455,10 @@ void srf_destroy_trace_hdr(srf_trace_hdr_t *th) {
 int srf_read_trace_hdr(srf_t *srf, srf_trace_hdr_t *th) {
     int z;
 
+    /* srf_find_trace caches which header srf->th holds */
+    if (srf->midx && th == &srf->th)
+	srf->midx->th_loaded = 0;
+
     /* Check block type */
     if (EOF == (th->block_type = fgetc(srf->fp)))
 	return -1;
@@ -1847,6 +1861,91 @@ ztr_t *srf_next_ztr(srf_t *srf, char *name, int filter_mask) {
     return srf_next_ztr_flags(srf, name, filter_mask, NULL);
 }
 
+/*
+ * Reads the next trace body from an SRF container without decoding it,
+ * for callers that wish to decode traces elsewhere (eg in other threads).
+ *
+ * Container, XML and index blocks are consumed along the way. Trace
+ * header blocks are loaded into srf->th and *new_hdr, if non-NULL, is
+ * set to indicate the header has changed since the previous call.
+ * Traces with any flags matching filter_mask are skipped, as with
+ * srf_next_ztr.
+ *
+ * Returns 0 on success, filling out tb. tb->trace is malloced and now
+ *           owned by the caller.
+ *        -1 on EOF or failure.
+ */
+int srf_next_trace_body(srf_t *srf, srf_trace_body_t *tb, int filter_mask,
+			int *new_hdr) {
+    if (new_hdr)
+	*new_hdr = 0;
+
+    do {
+	int type;
+
+	switch(type = srf_next_block_type(srf)) {
+	case -1:
+	    /* EOF */
+	    return -1;
+
+	case SRFB_NULL_INDEX: {
+	    uint64_t ilen;
+	    if (1 != fread(&ilen, 8, 1, srf->fp))
+		return -1;
+	    if (ilen != 0)
+		return -1;
+	    break;
+	}
+
+	case SRFB_CONTAINER:
+	    if (0 != srf_read_cont_hdr(srf, &srf->ch))
+		return -1;
+	    break;
+
+	case SRFB_XML:
+	    if (0 != srf_read_xml(srf, &srf->xml))
+		return -1;
+	    break;
+
+	case SRFB_TRACE_HEADER:
+	    if (0 != srf_read_trace_hdr(srf, &srf->th))
+		return -1;
+	    if (new_hdr)
+		*new_hdr = 1;
+	    break;
+
+	case SRFB_TRACE_BODY:
+	    if (0 != srf_read_trace_body(srf, tb, 0))
+		return -1;
+
+	    if (tb->flags & filter_mask) {
+		/* Filtered, so skip it */
+		if (tb->trace)
+		    free(tb->trace);
+		tb->trace = NULL;
+		break;
+	    }
+
+	    return 0;
+
+	case SRFB_INDEX: {
+	    off_t pos = ftello(srf->fp);
+	    srf_read_index_hdr(srf, &srf->hdr, 1);
+
+	    /* Skip the index body */
+	    fseeko(srf->fp, pos + srf->hdr.size, SEEK_SET);
+	    break;
+	}
+
+	default:
+	    fprintf(stderr, "Block of unknown type '%c'. Aborting\n", type);
+	    return -1;
+	}
+    } while (1);
+
+    return -1;
+}
+
 /*
  * Returns the type of the next block.
  * -1 for none (EOF)
@@ -1990,13 +2089,194 @@ static int binary_scan(srf_t *srf, int nitems, uint64_t start, uint64_t query,
     return 0;
 }
 
+/*
+ * Loads the SRF index into memory, for use by subsequent srf_find_trace
+ * calls. This replaces the ~8 seeks per lookup with a single read of the
+ * trace body, plus the data block header if it differs from the previous
+ * lookup.
+ *
+ * Returns 0 on success
+ *        -1 on failure (eg no index)
+ */
+int srf_load_index(srf_t *srf) {
+    srf_mem_index_t *mi;
+    uint64_t i, n;
+    off_t start;
+
+    if (srf->midx)
+	return 0;
+
+    if (NULL == (mi = calloc(1, sizeof(*mi))))
+	return -1;
+
+    if (0 != srf_read_index_hdr(srf, &mi->hdr, 0))
+	goto err;
+    start = ftello(srf->fp) - mi->hdr.index_hdr_sz;
+
+    /* Sanity check the tables fit, and the buckets are a power of 2 */
+    n = (uint64_t)mi->hdr.n_container + mi->hdr.n_data_block_hdr;
+    if (mi->hdr.n_buckets == 0 ||
+	(mi->hdr.n_buckets & (mi->hdr.n_buckets-1)) ||
+	mi->hdr.size < mi->hdr.index_hdr_sz + 8*(n + mi->hdr.n_buckets) ||
+	mi->hdr.size != (size_t)mi->hdr.size)
+	goto err;
+
+    if (NULL == (mi->data = malloc(mi->hdr.size)))
+	goto err;
+    if (-1 == fseeko(srf->fp, start, SEEK_SET))
+	goto err;
+    if (mi->hdr.size != fread(mi->data, 1, mi->hdr.size, srf->fp))
+	goto err;
+
+    mi->ch_pos = malloc((mi->hdr.n_container+1) * sizeof(uint64_t));
+    mi->th_pos = malloc((mi->hdr.n_data_block_hdr+1) * sizeof(uint64_t));
+    if (!mi->ch_pos || !mi->th_pos)
+	goto err;
+
+    for (i = 0; i < mi->hdr.n_container; i++) {
+	memcpy(&mi->ch_pos[i], mi->data + mi->hdr.index_hdr_sz + i*8, 8);
+	mi->ch_pos[i] = be_int8(mi->ch_pos[i]);
+    }
+    for (i = 0; i < mi->hdr.n_data_block_hdr; i++) {
+	memcpy(&mi->th_pos[i], mi->data + mi->hdr.index_hdr_sz
+	       + (mi->hdr.n_container + i)*8, 8);
+	mi->th_pos[i] = be_int8(mi->th_pos[i]);
+    }
+
+    srf->midx = mi;
+    return 0;
+
+ err:
+    free(mi->data);
+    free(mi->ch_pos);
+    free(mi->th_pos);
+    free(mi);
+    return -1;
+}
+
+/*
+ * As binary_scan, but on an in-memory sorted array.
+ */
+static int mem_scan(uint64_t *pos, int nitems, uint64_t query,
+		    uint64_t *res) {
+    int min = 0, max = nitems;
+
+    if (nitems <= 0)
+	return -1;
+
+    /* Find the first item > query */
+    while (min < max) {
+	int guess = min + (max - min) / 2;
+	if (pos[guess] > query)
+	    max = guess;
+	else
+	    min = guess+1;
+    }
+
+    *res = min ? pos[min-1] : 0;
+    return 0;
+}
+
+/*
+ * srf_find_trace using the in-memory index.
+ */
+static int srf_find_trace_mem(srf_t *srf, char *tname,
+			      uint64_t *cpos, uint64_t *hpos, uint64_t *dpos) {
+    srf_mem_index_t *mi = srf->midx;
+    srf_index_hdr_t *hdr = &mi->hdr;
+    unsigned char *cp, *end = mi->data + hdr->size;
+    uint64_t hval, bnum, bucket_pos;
+    int item_sz = 1 + 8 + (hdr->dbh_pos_stored_sep ? 4 : 0);
+
+    /* Hash and load the bucket */
+    hval = hash64(HASH_FUNC_JENKINS3, (unsigned char *)tname, strlen(tname));
+    bnum = hval & (hdr->n_buckets - 1);
+    memcpy(&bucket_pos, mi->data + hdr->index_hdr_sz
+	   + (hdr->n_container + hdr->n_data_block_hdr + bnum) * 8, 8);
+    bucket_pos = be_int8(bucket_pos);
+    if (!bucket_pos)
+	return -2;
+    if (bucket_pos >= hdr->size)
+	return -1;
+
+    /* Secondary hash is the top 7-bits */
+    hval >>= 57;
+
+    for (cp = mi->data + bucket_pos; cp + item_sz <= end; cp += item_sz) {
+	char name[1024];
+	int h = *cp;
+
+	if ((h & 0x7f) != hval) {
+	    if (h & 0x80)
+		return -2; /* end of list and not found */
+	    continue;
+	}
+
+	/* Potential hit - fetch the trace body and header to check */
+	memcpy(dpos, cp+1, 8);
+	*dpos = be_int8(*dpos);
+
+	if (hdr->dbh_pos_stored_sep) {
+	    uint32_t dbh_ind;
+	    memcpy(&dbh_ind, cp+9, 4);
+	    dbh_ind = be_int4(dbh_ind);
+	    if (dbh_ind >= hdr->n_data_block_hdr)
+		return -1;
+	    *hpos = mi->th_pos[dbh_ind] <= *dpos ? mi->th_pos[dbh_ind] : 0;
+	} else {
+	    if (0 != mem_scan(mi->th_pos, hdr->n_data_block_hdr, *dpos, hpos))
+		return -1;
+	}
+
+	if (-1 == fseeko(srf->fp, (off_t)*dpos, SEEK_SET))
+	    return -1;
+	if (srf->tb.trace) {
+	    free(srf->tb.trace);
+	    srf->tb.trace = NULL;
+	}
+	if (0 != srf_read_trace_body(srf, &srf->tb, 0))
+	    return -1;
+
+	if (mi->th_loaded != *hpos) {
+	    if (-1 == fseeko(srf->fp, *hpos, SEEK_SET))
+		return -1;
+	    if (0 != srf_read_trace_hdr(srf, &srf->th))
+		return -1;
+	    mi->th_loaded = *hpos;
+	}
+
+	if (-1 == construct_trace_name(srf->th.id_prefix,
+				       (unsigned char *)srf->tb.read_id,
+				       srf->tb.read_id_length,
+				       name, 1024))
+	    return -1;
+
+	if (strcmp(name, tname)) {
+	    /* Not found, continue with next item in list */
+	    if (h & 0x80)
+		return -2;
+	    continue;
+	}
+
+	/* Matches, so fetch the container position */
+	if (0 != mem_scan(mi->ch_pos, hdr->n_container, *dpos, cpos))
+	    return -1;
+
+	return 0;
+    }
+
+    return -1;
+}
+
 /*
  * Searches in an SRF index for a trace of a given name.
  * If found it sets the file offsets for the container (cpos), data block
  * header (hpos) and data block (dpos).
  *
  * On a test with 2 containers and 12 headers this averaged at 6.1 reads per
- * trace fetch and 8.0 seeks.
+ * trace fetch and 8.0 seeks. If the index has been loaded into memory with
+ * srf_load_index() then only the trace body and, when changed, its data
+ * block header are read.
  *
  * Returns 0 on success
  *        -1 on failure (eg no index)
@@ -2010,6 +2290,9 @@ int srf_find_trace(srf_t *srf, char *tname,
     off_t ipos, skip;
     int item_sz = 8;
 
+    if (srf->midx)
+	return srf_find_trace_mem(srf, tname, cpos, hpos, dpos);
+
     /* Check for valid index */
     if (0 != srf_read_index_hdr(srf, &hdr, 0)) {
 	return -1;
@@ -2038,6 +2321,7 @@ int srf_find_trace(srf_t *srf, char *tname,
 	return -1;
     for (;;) {
 	char name[1024];
+	unsigned char skip_buf[12];
 	int h = fgetc(srf->fp);
 	off_t saved_pos;
 	uint64_t dbh_ind = 0;
@@ -2050,7 +2334,7 @@ int srf_find_trace(srf_t *srf, char *tname,
 	     * Use fread instead as it's likely already cached and linux
 	     * fseeko involves a real system call (lseek).
 	     */
-	    if (item_sz != fread(dpos, 1, item_sz, srf->fp))
+	    if (item_sz != fread(skip_buf, 1, item_sz, srf->fp))
 		return -1;
 	    continue;
 	}
@@ -2060,12 +2344,18 @@ int srf_find_trace(srf_t *srf, char *tname,
 	if (0 != srf_read_uint64(srf, dpos))
 	    return -1;
 	if (hdr.dbh_pos_stored_sep) {
-	    if (0 != srf_read_uint64(srf, &dbh_ind))
+	    uint32_t ind;
+	    if (0 != srf_read_uint32(srf, &ind))
 		return -1;
+	    dbh_ind = ind;
 	}
 	saved_pos = ftello(srf->fp);
 	if (-1 == fseeko(srf->fp, (off_t)*dpos, SEEK_SET))
 	    return -1;
+	if (srf->tb.trace) {
+	    free(srf->tb.trace);
+	    srf->tb.trace = NULL;
+	}
 	if (0 != srf_read_trace_body(srf, &srf->tb, 0))
 	    return -1;
 
@@ -124,6 +124,18 @@ typedef struct {
     HashTable *db_hash;
 } srf_index_t;
 
+/*
+ * A copy of an on-disk index held in memory, loaded by srf_load_index(), so
+ * srf_find_trace doesn't need to seek and read through the index on disk.
+ */
+typedef struct {
+    srf_index_hdr_t hdr;
+    unsigned char *data;	/* the entire index, hdr.size bytes */
+    uint64_t *ch_pos;		/* decoded container positions */
+    uint64_t *th_pos;		/* decoded data block header positions */
+    uint64_t th_loaded;		/* position of block held in srf->th, or 0 */
+} srf_mem_index_t;
+
 /* Master SRF object */
 typedef struct {
     FILE *fp;
@@ -139,6 +151,9 @@ typedef struct {
     ztr_t *ztr;
     mFILE *mf;
     long mf_pos, mf_end;
+
+    /* Private: in-memory index for use by srf_find_trace */
+    srf_mem_index_t *midx;
 } srf_t;
 
 #define SRF_INDEX_MAGIC    "Ihsh"
@@ -206,6 +221,8 @@ int srf_index_write(srf_t *srf, srf_index_t *idx);
 mFILE *srf_next_trace(srf_t *srf, char *name);
 ztr_t *srf_next_ztr_flags(srf_t *srf, char *name, int filter_mask, int *flags);
 ztr_t *srf_next_ztr(srf_t *srf, char *name, int filter_mask);
+int srf_next_trace_body(srf_t *srf, srf_trace_body_t *tb, int filter_mask,
+			int *new_hdr);
 
 ztr_t *partial_decode_ztr(srf_t *srf, mFILE *mf, ztr_t *z);
 ztr_t *ztr_dup(ztr_t *src);
@@ -213,6 +230,7 @@ ztr_t *ztr_dup(ztr_t *src);
 int srf_next_block_type(srf_t *srf); /* peek ahead */
 int srf_next_block_details(srf_t *srf, uint64_t *pos, char *name);
 
+int srf_load_index(srf_t *srf);
 int srf_find_trace(srf_t *srf, char *trace,
 		   uint64_t *cpos, uint64_t *hpos, uint64_t *dpos);
 
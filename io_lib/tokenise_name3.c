@@ -31,7 +31,7 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-// cc -I.. -g -O3 tokenise_name3.c rANS_static4x16pr.c pooled_alloc.c -pthread -DTEST_TOKENISER
+// cc -I.. -g -O3 tokenise_name3.c rANS_static4x16pr.c thread_pool.c -pthread -DTEST_TOKENISER
 
 // As per tokenise_name2 but has the entropy encoder built in already,
 // so we just have a single encode and decode binary.  (WIP; mainly TODO)
@@ -96,8 +96,9 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
 
-#include "io_lib/pooled_alloc.h"
+#include "io_lib/thread_pool.h"
 #include "io_lib/rANS_static4x16.h"
 #include "io_lib/tokenise_name3.h"
 
@@ -142,9 +143,10 @@ typedef struct {
     // For finding entire line dups
     int counter;
 
-    // Trie used in encoder only
-    trie_t *t_head;
-    pool_alloc_t *pool;
+    // Trie used in encoder only.  Nodes live in one flat array and
+    // link to each other by index, with node 0 being the root.
+    trie_t *trie;
+    uint32_t trie_n, trie_a;
 
     // token blocks
     descriptor desc[MAX_TBLOCKS];
@@ -158,25 +160,22 @@ name_context *create_context(int max_names) {
     if (!ctx) return NULL;
 
     ctx->counter = 0;
-    ctx->t_head = NULL;
+    ctx->trie = NULL;
+    ctx->trie_n = ctx->trie_a = 0;
 
     ctx->lc = (last_context *)(((char *)ctx) + sizeof(*ctx));
-    ctx->pool = NULL;
 
     memset(&ctx->desc[0], 0, MAX_TBLOCKS * sizeof(ctx->desc[0]));
 
     return ctx;
 }
 
-void free_trie(trie_t *t);
 void free_context(name_context *ctx) {
     if (!ctx)
 	return;
 
-    if (ctx->t_head)
-	free(ctx->t_head);
-    if (ctx->pool)
-	pool_destroy(ctx->pool);
+    if (ctx->trie)
+	free(ctx->trie);
 
     free(ctx);
 }
@@ -457,40 +456,56 @@ static int encode_token_diff(name_context *ctx, uint32_t val) {
 
 //-----------------------------------------------------------------------------
 // Trie implementation for tracking common name prefixes.
+//
+// Nodes are held in a single array and refer to children and siblings
+// by index rather than pointer.  This keeps the nodes small and mostly
+// allocated in the order they are visited, which is considerably kinder
+// to the cache than one heap object per node.  Index 0 is the root,
+// which can never be a child, so it doubles up as the NULL link.
 typedef struct trie {
     char c;
     int count;
-    //struct trie *next[128];
-    struct trie *next, *sibling;
+    uint32_t next, sibling;
     int n; // Nth line
 } trie_t;
 
-//static trie_t *t_head = NULL;
-
-void free_trie(trie_t *t) {
-    trie_t *x, *n;
-    for (x = t->next; x; x = n) {
-	n = x->sibling;
-	free_trie(x);
+// Returns the index of a new zeroed trie node, or 0 on failure.
+static uint32_t trie_node_new(name_context *ctx) {
+    if (ctx->trie_n >= ctx->trie_a) {
+	uint32_t trie_a = ctx->trie_a ? ctx->trie_a*2 : 4096;
+	trie_t *trie = realloc(ctx->trie, trie_a * sizeof(*trie));
+	if (!trie)
+	    return 0;
+	ctx->trie = trie;
+	ctx->trie_a = trie_a;
     }
-    free(t);
+
+    memset(&ctx->trie[ctx->trie_n], 0, sizeof(*ctx->trie));
+    return ctx->trie_n++;
+}
+
+// Ensures the root node exists.  Returns 0 on success, -1 on failure.
+static int trie_init(name_context *ctx) {
+    if (ctx->trie_n)
+	return 0;
+
+    // The root is allocated as node 0, so the 0 return is expected here.
+    trie_node_new(ctx);
+    return ctx->trie_n ? 0 : -1;
 }
 
 int build_trie(name_context *ctx, char *data, size_t len, int n) {
     int nlines = 0;
     size_t i;
-    trie_t *t;
+    uint32_t t;
 
-    if (!ctx->t_head) {
-	ctx->t_head = calloc(1, sizeof(*ctx->t_head));
-	if (!ctx->t_head)
-	    return -1;
-    }
+    if (trie_init(ctx) < 0)
+	return -1;
 
     // Build our trie, also counting input lines
     for (nlines = i = 0; i < len; i++, nlines++) {
-	t = ctx->t_head;
-	t->count++;
+	t = 0;
+	ctx->trie[t].count++;
 	while (i < len && data[i] > '\n') {
 	    unsigned char c = data[i++];
 	    if (c & 0x80)
@@ -499,26 +514,22 @@ int build_trie(name_context *ctx, char *data, size_t len, int n) {
 	    c &= 127;
 
 
-	    trie_t *x = t->next, *l = NULL;
-	    while (x && x->c != c) {
-		l = x; x = x->sibling;
+	    uint32_t x = ctx->trie[t].next, l = 0;
+	    while (x && ctx->trie[x].c != c) {
+		l = x; x = ctx->trie[x].sibling;
 	    }
 	    if (!x) {
-		if (!ctx->pool)
-		    ctx->pool = pool_create(sizeof(trie_t));
-		if (!(x = (trie_t *)pool_alloc(ctx->pool)))
+		if (!(x = trie_node_new(ctx)))
 		    return -1;
-		memset(x, 0, sizeof(*x));
 		if (!l)
-		    x = t->next    = x;
+		    ctx->trie[t].next    = x;
 		else
-		    x = l->sibling = x;
-		x->n = n;
-		x->c = c;
+		    ctx->trie[l].sibling = x;
+		ctx->trie[x].n = n;
+		ctx->trie[x].c = c;
 	    }
 	    t = x;
-	    t->c = c;
-	    t->count++;
+	    ctx->trie[t].count++;
 	}
     }
 
@@ -623,15 +634,12 @@ int search_trie(name_context *ctx, char *data, size_t len, int n, int *exact, in
     }
     //prefix_len = INT_MAX;
 
-    if (!ctx->t_head) {
-	ctx->t_head = calloc(1, sizeof(*ctx->t_head));
-	if (!ctx->t_head)
-	    return -1;
-    }
+    if (trie_init(ctx) < 0)
+	return -1;
 
     // Find an item in the trie
     for (nlines = i = 0; i < len; i++, nlines++) {
-	t = ctx->t_head;
+	t = ctx->trie;
 	while (i < len && data[i] > '\n') {
 	    unsigned char c = data[i++];
 	    if (c & 0x80)
@@ -639,10 +647,10 @@ int search_trie(name_context *ctx, char *data, size_t len, int n, int *exact, in
 		abort();
 	    c &= 127;
 
-	    trie_t *x = t->next;
-	    while (x && x->c != c)
-		x = x->sibling;
-	    t = x;
+	    uint32_t x = t->next;
+	    while (x && ctx->trie[x].c != c)
+		x = ctx->trie[x].sibling;
+	    t = &ctx->trie[x];
 
 //	    t = t->next[c];
 
@@ -1128,7 +1136,6 @@ static int64_t rans_decode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t
 
 static int compress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len) {
     uint64_t best_sz = UINT64_MAX;
-    int best = 0;
     uint64_t olen = *out_len;
 
     //fprintf(stderr, "=== try %d ===\n", (int)in_len);
@@ -1144,18 +1151,31 @@ static int compress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_le
     //int rmethods[] = {0,1,128,129,64,65,192,193, 193+8, 0+4, 128+4}, m;
     // DO_DICT doesn't yet work in conjunction with DO_PACK.
     int rmethods[] = {0,1,128,129,64,65,192,193, 193+8, 0+4}, m;
+
+    // Ping-pong between out and a scratch buffer so the best trial is
+    // kept rather than recompressed once the winner is known.
+    uint8_t *tmp = malloc(olen), *best_out = NULL;
+    if (!tmp)
+	return -1;
+
     for (m = 0; m < sizeof(rmethods)/sizeof(*rmethods); m++) {
+	uint8_t *o = best_out == out ? tmp : out;
 	*out_len = olen;
-	if (rans_encode(in, in_len, out, out_len, rmethods[m]) < 0) return -1;
+	if (rans_encode(in, in_len, o, out_len, rmethods[m]) < 0) {
+	    free(tmp);
+	    return -1;
+	}
 
 	if (best_sz > *out_len) {
 	    best_sz = *out_len;
-	    best = rmethods[m];
+	    best_out = o;
 	}
     }
 
-    *out_len = olen;
-    if (rans_encode(in, in_len, out, out_len, best) < 0) return -1;
+    if (best_out != out)
+	memcpy(out, best_out, best_sz);
+    *out_len = best_sz;
+    free(tmp);
 
     assert(*out_len > 2);
 
@@ -1193,6 +1213,139 @@ static int uncompress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_
     return rans_decode(in, in_len, out, out_len);
 }
 
+//-----------------------------------------------------------------------------
+// Descriptor compression.
+//
+// Each token descriptor is compressed independently, so these can be farmed
+// out to a thread pool.  As encode_names is itself typically running inside
+// a worker of that same pool (via cram_encode_container), we must never
+// block waiting on jobs that may not get a thread.  Instead the calling
+// thread works through the descriptor list itself and any helper jobs that
+// manage to start steal items from the same list.  Helpers that start too
+// late simply find nothing left to do.
+
+typedef struct {
+    name_context *ctx;
+    int idx[MAX_TBLOCKS], nidx;
+    int next;    // next item in idx[] to compress
+    int active;  // items currently being compressed
+    int refs;    // caller + dispatched helpers still referencing us
+    int err;
+    pthread_mutex_t lock;
+    pthread_cond_t  done_c;
+} desc_job;
+
+// Compresses descriptor i in place.  Returns 0 on success, -1 on failure.
+static int compress_descriptor(name_context *ctx, int i) {
+    uint64_t out_len = 1.5 * rans_compress_bound_4x16(ctx->desc[i].buf_l, 1); // guesswork
+    uint8_t *out = malloc(out_len);
+    if (!out)
+	return -1;
+
+    if (compress(ctx->desc[i].buf, ctx->desc[i].buf_l, out, &out_len) < 0) {
+	free(out);
+	return -1;
+    }
+
+    free(ctx->desc[i].buf);
+    ctx->desc[i].buf = out;
+    ctx->desc[i].buf_l = out_len;
+    ctx->desc[i].tnum = i>>4;
+    ctx->desc[i].ttype = i&15;
+
+    return 0;
+}
+
+static void desc_job_run(desc_job *j) {
+    pthread_mutex_lock(&j->lock);
+    while (j->next < j->nidx && !j->err) {
+	int i = j->idx[j->next++];
+	j->active++;
+	pthread_mutex_unlock(&j->lock);
+
+	int r = compress_descriptor(j->ctx, i);
+
+	pthread_mutex_lock(&j->lock);
+	if (r < 0)
+	    j->err = 1;
+	if (--j->active == 0)
+	    pthread_cond_signal(&j->done_c);
+    }
+    pthread_mutex_unlock(&j->lock);
+}
+
+static void desc_job_release(desc_job *j) {
+    pthread_mutex_lock(&j->lock);
+    int last = --j->refs == 0;
+    pthread_mutex_unlock(&j->lock);
+
+    if (last) {
+	pthread_mutex_destroy(&j->lock);
+	pthread_cond_destroy(&j->done_c);
+	free(j);
+    }
+}
+
+static void *desc_job_thread(void *arg) {
+    desc_job *j = (desc_job *)arg;
+    desc_job_run(j);
+    desc_job_release(j);
+    return NULL;
+}
+
+/*
+ * Compresses all non-empty descriptors, using thread pool p to help
+ * if non-NULL.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int compress_descriptors(name_context *ctx, t_pool *p) {
+    int i, err;
+    desc_job *j = malloc(sizeof(*j));
+    if (!j)
+	return -1;
+
+    j->ctx = ctx;
+    j->nidx = j->next = j->active = j->err = 0;
+    j->refs = 1;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->done_c, NULL);
+
+    for (i = 0; i < MAX_TBLOCKS; i++)
+	if (ctx->desc[i].buf_l)
+	    j->idx[j->nidx++] = i;
+
+    // Never block on a full queue; we'll just do more of the work ourselves.
+    if (p) {
+	int n;
+	for (n = 0; n < j->nidx-1 && n < p->tsize; n++) {
+	    pthread_mutex_lock(&j->lock);
+	    j->refs++;
+	    pthread_mutex_unlock(&j->lock);
+	    if (t_pool_dispatch2(p, NULL, desc_job_thread, j, 1) < 0) {
+		pthread_mutex_lock(&j->lock);
+		j->refs--;
+		pthread_mutex_unlock(&j->lock);
+		break;
+	    }
+	}
+    }
+
+    desc_job_run(j);
+
+    // Wait for any helpers still part way through an item.
+    pthread_mutex_lock(&j->lock);
+    while (j->active)
+	pthread_cond_wait(&j->done_c, &j->lock);
+    err = j->err;
+    pthread_mutex_unlock(&j->lock);
+
+    desc_job_release(j);
+
+    return err ? -1 : 0;
+}
+
 //-----------------------------------------------------------------------------
 
 /*
@@ -1205,6 +1358,15 @@ static int uncompress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_
  *         or NULL on failure
  */
 uint8_t *encode_names(char *blk, int len, int *out_len, int *last_start_p) {
+    return encode_names_mt(blk, len, out_len, last_start_p, NULL);
+}
+
+/*
+ * As encode_names, but with the token descriptors compressed in parallel
+ * on thread pool p.  A NULL pool runs everything on the calling thread.
+ */
+uint8_t *encode_names_mt(char *blk, int len, int *out_len, int *last_start_p,
+			 t_pool *p) {
     int last_start = 0, i, j, nreads;
     
     // Count lines
@@ -1294,9 +1456,18 @@ uint8_t *encode_names(char *blk, int len, int *out_len, int *last_start_p) {
 
 	    ctx->desc[i].buf_l = 0;
 	    free(ctx->desc[i].buf);
+	    ctx->desc[i].buf = NULL;
 	}
     }
 
+    // Compress descriptors
+    if (compress_descriptors(ctx, p) < 0) {
+	for (i = 0; i < MAX_TBLOCKS; i++)
+	    free(ctx->desc[i].buf);
+	free_context(ctx);
+	return NULL;
+    }
+
     // Serialise descriptors
     uint32_t tot_size = 8;
     int ndesc = 0;
@@ -1305,27 +1476,6 @@ uint8_t *encode_names(char *blk, int len, int *out_len, int *last_start_p) {
 
 	ndesc++;
 
-	int tnum = i>>4;
-	int ttype = i&15;
-
-	uint64_t out_len = 1.5 * rans_compress_bound_4x16(ctx->desc[i].buf_l, 1); // guesswork
-	uint8_t *out = malloc(out_len);
-	if (!out) {
-	    free_context(ctx);
-	    return NULL;
-	}
-
-	if (compress(ctx->desc[i].buf, ctx->desc[i].buf_l, out, &out_len) < 0) {
-	    free_context(ctx);
-	    return NULL;
-	}
-
-	free(ctx->desc[i].buf);
-	ctx->desc[i].buf = out;
-	ctx->desc[i].buf_l = out_len;
-	ctx->desc[i].tnum = tnum;
-	ctx->desc[i].ttype = ttype;
-
 	// Find dups
 	int j;
 	for (j = 0; j < i; j++) {
@@ -1341,7 +1491,7 @@ uint8_t *encode_names(char *blk, int len, int *out_len, int *last_start_p) {
 	    tot_size += 4; // flag, dup_from, ttype
 	} else {
 	    ctx->desc[i].dup_from = 0;
-	    tot_size += out_len + 1; // ttype
+	    tot_size += ctx->desc[i].buf_l + 1; // ttype
 	}
     }
 
@@ -1569,7 +1719,7 @@ uint8_t *decode_names(uint8_t *in, uint32_t sz, int *out_len) {
 #endif
 static char blk[BLK_SIZE*2]; // temporary fix for decoder, which needs more space
 
-static int encode(int argc, char **argv) {
+static int encode(int argc, char **argv, t_pool *p) {
     FILE *fp;
     int len, i, j;
     name_context *ctx;
@@ -1595,7 +1745,7 @@ static int encode(int argc, char **argv) {
 	len += blk_offset;
 
 	int out_len;
-	uint8_t *out = encode_names(blk, len, &out_len, &last_start);
+	uint8_t *out = encode_names_mt(blk, len, &out_len, &last_start, p);
 	write(1, &out_len, 4);
 	write(1, out, out_len);   // encoded data
 	free(out);
@@ -1641,11 +1791,27 @@ static int decode(int argc, char **argv) {
 }
 
 int main(int argc, char **argv) {
+    t_pool *p = NULL;
+    int ret;
+
+    if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+	int nthreads = atoi(argv[2]);
+	if (nthreads > 0)
+	    p = t_pool_init(nthreads*2, nthreads);
+	argc -= 2; argv += 2;
+    }
 
     if (argc > 1 && strcmp(argv[1], "-d") == 0)
-	return decode(argc-1, argv+1);
+	ret = decode(argc-1, argv+1);
     else
-	return encode(argc, argv);
+	ret = encode(argc, argv, p);
+
+    if (p) {
+	t_pool_flush(p);
+	t_pool_destroy(p, 0);
+    }
+
+    return ret;
 }
 
 #endif // TEST_TOKENISER
@@ -34,6 +34,8 @@
 #ifndef _TOKENISE_NAME3_H_
 #define _TOKENISE_NAME3_H_
 
+#include "io_lib/thread_pool.h"
+
 /*
  * Converts a line or \0 separated block of reading names to a compressed buffer.
  * The code can only encode whole lines and will not attempt a partial line.
@@ -45,6 +47,17 @@
  */
 uint8_t *encode_names(char *blk, int len, int *out_len, int *last_start_p);
 
+/*
+ * As encode_names, but the per-token descriptors are compressed in
+ * parallel using thread pool p.  This is safe to call from within a job
+ * already running on p.  If p is NULL it is identical to encode_names.
+ *
+ * Returns a malloced buffer holding compressed data of size *out_len,
+ *         or NULL on failure
+ */
+uint8_t *encode_names_mt(char *blk, int len, int *out_len, int *last_start_p,
+			 t_pool *p);
+
 /*
  * Decodes a compressed block of read names into \0 separated names.
  * The size of the data returned (malloced) is in *out_len.
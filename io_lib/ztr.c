@@ -71,8 +71,12 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
+#include <pthread.h>
+#include <zlib.h>
 
 /* #include <fcntl.h> */
 
@@ -1220,6 +1224,344 @@ int compress_ztr(ztr_t *ztr, int level) {
     return 0;
 }
 
+/*
+ * ---------------------------------------------------------------------------
+ * Trial based compression.
+ *
+ * compress_ztr uses a fixed recipe per chunk type. Here we also try some
+ * alternative recipes and pick the smallest, in the same manner as CRAM's
+ * cram_compress_block: each chunk type is trialled on ZTR_NTRIALS chunks
+ * and the best on average is used for the next ZTR_TRIAL_SPAN chunks,
+ * before trialling again.
+ * ---------------------------------------------------------------------------
+ */
+#define ZTR_NTRIALS 3
+#define ZTR_TRIAL_SPAN 100
+#define ZTR_MAX_STEPS 3
+#define ZTR_MAX_RECIPES 4
+
+typedef struct {
+    int format, option, option2;
+} ztr_step_t;
+
+typedef struct {
+    uint4 type;
+    ztr_step_t step[ZTR_MAX_STEPS]; /* ZTR_FORM_RAW terminates */
+} ztr_recipe_t;
+
+/*
+ * Alternatives to the compress_ztr recipes, which are always trialled too.
+ * Only formats that are self contained (not needing ztr hcodes) are used.
+ */
+static ztr_recipe_t ztr_recipes[] = {
+    {ZTR_TYPE_SAMP, {{ZTR_FORM_DELTA2, 2, 0}, {ZTR_FORM_16TO8, 0, 0},
+		     {ZTR_FORM_ZLIB, Z_DEFAULT_STRATEGY, 0}}},
+    {ZTR_TYPE_SAMP, {{ZTR_FORM_DELTA1, 1, 0}, {ZTR_FORM_16TO8, 0, 0},
+		     {ZTR_FORM_ZLIB, Z_DEFAULT_STRATEGY, 0}}},
+    {ZTR_TYPE_SMP4, {{ZTR_FORM_DELTA2, 2, 0}, {ZTR_FORM_16TO8, 0, 0},
+		     {ZTR_FORM_ZLIB, Z_DEFAULT_STRATEGY, 0}}},
+    {ZTR_TYPE_SMP4, {{ZTR_FORM_DELTA1, 1, 0}, {ZTR_FORM_16TO8, 0, 0},
+		     {ZTR_FORM_ZLIB, Z_DEFAULT_STRATEGY, 0}}},
+    {ZTR_TYPE_BASE, {{ZTR_FORM_STHUFF, CODE_DNA, 0}}},
+    {ZTR_TYPE_BASE, {{ZTR_FORM_ZLIB, Z_DEFAULT_STRATEGY, 0}}},
+    {ZTR_TYPE_CNF1, {{ZTR_FORM_DELTA1, 1, 0},
+		     {ZTR_FORM_ZLIB, Z_DEFAULT_STRATEGY, 0}}},
+    {ZTR_TYPE_CNF1, {{ZTR_FORM_ZLIB, Z_HUFFMAN_ONLY, 0}}},
+    {ZTR_TYPE_CNF4, {{ZTR_FORM_DELTA1, 1, 0},
+		     {ZTR_FORM_ZLIB, Z_DEFAULT_STRATEGY, 0}}},
+    {ZTR_TYPE_CNF4, {{ZTR_FORM_ZLIB, Z_HUFFMAN_ONLY, 0}}},
+    {ZTR_TYPE_BPOS, {{ZTR_FORM_DELTA4, 1, 0}, {ZTR_FORM_32TO8, 0, 0},
+		     {ZTR_FORM_ZLIB, Z_DEFAULT_STRATEGY, 0}}},
+    {ZTR_TYPE_TEXT, {{ZTR_FORM_ZLIB, Z_DEFAULT_STRATEGY, 0}}},
+    {ZTR_TYPE_TEXT, {{ZTR_FORM_STHUFF, CODE_ENGLISH, 0}}},
+};
+#define ZTR_NRECIPES (sizeof(ztr_recipes)/sizeof(*ztr_recipes))
+
+/* Per chunk-type trial statistics */
+typedef struct {
+    uint4 type;
+    int trial;		/* trials left in this round */
+    int next_trial;	/* chunks until the next round of trials */
+    int best;		/* index into recipe[], 0 being compress_ztr's */
+    int64_t sz[ZTR_MAX_RECIPES+1];
+} ztr_type_metrics_t;
+
+struct ztr_metrics_t {
+    pthread_mutex_t lock;
+    ztr_type_metrics_t *m;
+    int nm;
+};
+
+ztr_metrics_t *ztr_metrics_create(void) {
+    ztr_metrics_t *m = calloc(1, sizeof(*m));
+    if (!m)
+	return NULL;
+    pthread_mutex_init(&m->lock, NULL);
+    return m;
+}
+
+void ztr_metrics_destroy(ztr_metrics_t *m) {
+    if (!m)
+	return;
+    pthread_mutex_destroy(&m->lock);
+    free(m->m);
+    free(m);
+}
+
+/*
+ * Finds the metrics for a chunk type, creating if needed.
+ * Call with m->lock held.
+ */
+static ztr_type_metrics_t *ztr_type_metrics(ztr_metrics_t *m, uint4 type) {
+    ztr_type_metrics_t *tm;
+    int i;
+
+    for (i = 0; i < m->nm; i++)
+	if (m->m[i].type == type)
+	    return &m->m[i];
+
+    if (!(tm = realloc(m->m, (m->nm+1) * sizeof(*m->m))))
+	return NULL;
+    m->m = tm;
+    tm = &m->m[m->nm++];
+    memset(tm, 0, sizeof(*tm));
+    tm->type = type;
+
+    return tm;
+}
+
+/*
+ * Compresses a copy of 'chunk' using recipe 'r', or the compress_ztr
+ * recipe if r is NULL.
+ *
+ * Returns the compressed data on success, with its length in *len
+ *         NULL on failure
+ */
+static char *compress_chunk_copy(ztr_t *ztr, ztr_chunk_t *chunk,
+				 ztr_recipe_t *r, int level, uint4 *len) {
+    ztr_chunk_t tmp = *chunk;
+    int i;
+
+    if (NULL == (tmp.data = xmalloc(chunk->dlength)))
+	return NULL;
+    memcpy(tmp.data, chunk->data, chunk->dlength);
+
+    if (r) {
+	for (i = 0; i < ZTR_MAX_STEPS && r->step[i].format; i++) {
+	    if (0 != compress_chunk(ztr, &tmp, r->step[i].format,
+				    r->step[i].option, r->step[i].option2)) {
+		xfree(tmp.data);
+		return NULL;
+	    }
+	}
+    } else {
+	/* A single chunk view of ztr for compress_ztr */
+	ztr_t z1 = *ztr;
+	z1.chunk = &tmp;
+	z1.nchunks = 1;
+	if (0 != compress_ztr(&z1, level)) {
+	    xfree(tmp.data);
+	    return NULL;
+	}
+    }
+
+    *len = tmp.dlength;
+    return tmp.data;
+}
+
+/*
+ * As compress_ztr, but for levels above 1 it also trials alternative
+ * recipes and picks the smallest. 'm' holds the statistics used to decide
+ * when to trial and which recipe to use otherwise; it may be shared between
+ * threads compressing ztrs of the same type.
+ *
+ * The resulting ztr is decoded by uncompress_ztr as usual.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int compress_ztr_trial(ztr_t *ztr, int level, ztr_metrics_t *m) {
+    int i, j;
+
+    if (level <= 1 || !m)
+	return compress_ztr(ztr, level);
+
+    for (i = 0; i < ztr->nchunks; i++) {
+	ztr_chunk_t *chunk = &ztr->chunk[i];
+	ztr_recipe_t *recipe[ZTR_MAX_RECIPES+1];
+	ztr_type_metrics_t *tm;
+	int nr = 1, best, trial = 0;
+	char *type;
+
+	/* Compress_ztr's recipe is recipe[0], followed by alternatives */
+	recipe[0] = NULL;
+	for (j = 0; j < ZTR_NRECIPES && nr <= ZTR_MAX_RECIPES; j++)
+	    if (ztr_recipes[j].type == chunk->type)
+		recipe[nr++] = &ztr_recipes[j];
+
+	/* Raw and normalised pyrosequencing traces are special cases */
+	type = ztr_lookup_mdata_value(ztr, chunk, "TYPE");
+	if ((chunk->type == ZTR_TYPE_SAMP || chunk->type == ZTR_TYPE_SMP4) &&
+	    type && (!strcmp(type, "PYRW") || !strcmp(type, "PYNO")))
+	    nr = 1;
+
+	if (nr == 1 || chunk->dlength == 0 ||
+	    (chunk->dlength > 0 && chunk->data[0] != ZTR_FORM_RAW)) {
+	    ztr_t z1 = *ztr;
+	    z1.chunk = chunk;
+	    z1.nchunks = 1;
+	    if (0 != compress_ztr(&z1, level))
+		return -1;
+	    continue;
+	}
+
+	pthread_mutex_lock(&m->lock);
+	if (!(tm = ztr_type_metrics(m, chunk->type))) {
+	    pthread_mutex_unlock(&m->lock);
+	    return -1;
+	}
+	if (tm->trial > 0 || --tm->next_trial <= 0) {
+	    if (tm->next_trial <= 0) {
+		tm->next_trial = ZTR_TRIAL_SPAN;
+		tm->trial = ZTR_NTRIALS;
+		memset(tm->sz, 0, sizeof(tm->sz));
+	    }
+	    trial = 1;
+	}
+	best = tm->best < nr ? tm->best : 0;
+	pthread_mutex_unlock(&m->lock);
+
+	if (trial) {
+	    char *data[ZTR_MAX_RECIPES+1];
+	    uint4 len[ZTR_MAX_RECIPES+1];
+	    int64_t sz[ZTR_MAX_RECIPES+1];
+
+	    best = 0;
+	    for (j = 0; j < nr; j++) {
+		data[j] = compress_chunk_copy(ztr, chunk, recipe[j], level,
+					      &len[j]);
+		if (!data[j] && j == 0)
+		    return -1;
+		sz[j] = data[j] ? len[j] : INT_MAX;
+		if (sz[j] < sz[best])
+		    best = j;
+	    }
+
+	    xfree(chunk->data);
+	    chunk->data = data[best];
+	    chunk->dlength = len[best];
+	    for (j = 0; j < nr; j++)
+		if (j != best && data[j])
+		    xfree(data[j]);
+
+	    /* When enough trials performed, find the best on average */
+	    pthread_mutex_lock(&m->lock);
+	    for (j = 0; j < nr; j++)
+		tm->sz[j] += sz[j];
+	    if (tm->trial > 0 && --tm->trial == 0) {
+		for (tm->best = 0, j = 1; j < nr; j++)
+		    if (tm->sz[j] < tm->sz[tm->best])
+			tm->best = j;
+	    }
+	    pthread_mutex_unlock(&m->lock);
+	} else {
+	    uint4 len;
+	    char *data = compress_chunk_copy(ztr, chunk, recipe[best], level,
+					     &len);
+	    if (!data)
+		return -1;
+	    xfree(chunk->data);
+	    chunk->data = data;
+	    chunk->dlength = len;
+	}
+    }
+
+    return 0;
+}
+
+#define ZTR_BATCH 64
+
+typedef struct {
+    ztr_t **ztr;
+    int nztr;
+    int level;
+    ztr_metrics_t *m;
+} ztr_job_t;
+
+static void *compress_ztr_job(void *arg) {
+    ztr_job_t *j = (ztr_job_t *)arg;
+    int i;
+
+    for (i = 0; i < j->nztr; i++)
+	if (0 != compress_ztr_trial(j->ztr[i], j->level, j->m))
+	    return NULL;
+
+    return j;
+}
+
+/*
+ * Compresses an array of ztrs using compress_ztr_trial, sharing metrics
+ * 'm' between them. Callers compressing in several calls should keep
+ * one ztr_metrics_t for them all so the recipe choice carries over; if
+ * 'm' is NULL a fresh one is used for this call alone. If 'p' is
+ * non-NULL the work is spread over the thread pool in batches of
+ * ZTR_BATCH ztrs.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int compress_ztr_many(ztr_t **ztr, int nztr, int level, ztr_metrics_t *m,
+		      t_pool *p) {
+    ztr_metrics_t *own_m = NULL;
+    t_results_queue *q = NULL;
+    ztr_job_t *jobs;
+    int i, njobs, ret = 0;
+
+    if (nztr <= 0 || level == 0)
+	return 0;
+
+    if (!m && NULL == (m = own_m = ztr_metrics_create()))
+	return -1;
+
+    njobs = (nztr + ZTR_BATCH-1) / ZTR_BATCH;
+    if (NULL == (jobs = malloc(njobs * sizeof(*jobs)))) {
+	ztr_metrics_destroy(own_m);
+	return -1;
+    }
+    for (i = 0; i < njobs; i++) {
+	jobs[i].ztr = &ztr[i*ZTR_BATCH];
+	jobs[i].nztr = nztr - i*ZTR_BATCH < ZTR_BATCH
+	    ? nztr - i*ZTR_BATCH : ZTR_BATCH;
+	jobs[i].level = level;
+	jobs[i].m = m;
+    }
+
+    if (p && njobs > 1 && (q = t_results_queue_init())) {
+	for (i = 0; i < njobs; i++) {
+	    if (-1 == t_pool_dispatch(p, q, compress_ztr_job, &jobs[i])) {
+		ret = -1;
+		break;
+	    }
+	}
+	for (njobs = i, i = 0; i < njobs; i++) {
+	    t_pool_result *r = t_pool_next_result_wait(q);
+	    if (!r->data)
+		ret = -1;
+	    t_pool_delete_result(r, 0);
+	}
+	t_results_queue_destroy(q);
+    } else {
+	for (i = 0; i < njobs; i++)
+	    if (!compress_ztr_job(&jobs[i]))
+		ret = -1;
+    }
+
+    free(jobs);
+    ztr_metrics_destroy(own_m);
+
+    return ret;
+}
+
 /*
  * Uncompresses a ztr (in memory).
  */
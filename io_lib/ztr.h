@@ -71,6 +71,7 @@
 
 #include "io_lib/Read.h"
 #include "io_lib/deflate_interlaced.h"
+#include "io_lib/thread_pool.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -198,6 +199,14 @@ Read *ztr2read(ztr_t *ztr);
 ztr_t *read2ztr(Read *r);
 int compress_ztr(ztr_t *ztr, int level);
 int uncompress_ztr(ztr_t *ztr);
+
+/* Trial based compression; see compress_ztr_trial */
+typedef struct ztr_metrics_t ztr_metrics_t;
+ztr_metrics_t *ztr_metrics_create(void);
+void ztr_metrics_destroy(ztr_metrics_t *m);
+int compress_ztr_trial(ztr_t *ztr, int level, ztr_metrics_t *m);
+int compress_ztr_many(ztr_t **ztr, int nztr, int level, ztr_metrics_t *m,
+		      t_pool *p);
 ztr_t *new_ztr(void);
 void delete_ztr(ztr_t *ztr);
 ztr_chunk_t **ztr_find_chunks(ztr_t *ztr, uint4 type, int *nchunks_p);
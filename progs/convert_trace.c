@@ -80,6 +80,10 @@
 #include <io_lib/traceType.h>
 #include <io_lib/seqIOABI.h>
 #include <io_lib/open_trace_file.h>
+#include <io_lib/hash_table.h>
+#include <io_lib/tar_format.h>
+#include <io_lib/thread_pool.h>
+#include <io_lib/ztr.h>
 #include <io_lib/misc.h> /* defines MAX and __UNUSED__ */
 
 static char const rcsid[] __UNUSED__ = "$Id: convert_trace.c,v 1.12 2008-02-20 16:07:44 jkbonfield Exp $";
@@ -104,6 +108,10 @@ struct opts {
     int skipx;
     int start;
     int end;
+    int nthreads;
+    char *archive;
+    char *tar;
+    char *hash;
 };
 
 /*
@@ -495,13 +503,22 @@ void clip_range(Read *r, int left, int right) {
 }
 
 
-int convert(mFILE *infp, mFILE *outfp, char *infname, char *outfname,
-	    struct opts *opts) {
+/*
+ * Reads a trace and applies the requested edits to it. The compression
+ * method of the input is returned in *method, leaving the global last
+ * used method alone so this may run in several threads at once.
+ *
+ * Returns the Read on success
+ *         NULL on failure
+ */
+static Read *convert_read(mFILE *infp, char *infname, char *outfname,
+			  struct opts *opts, int *method) {
     Read *r;
 
-    if (NULL == (r = mfread_reading(infp, infname, opts->in_format))) {
+    if (NULL == (r = mfread_reading_method(infp, infname, opts->in_format,
+					   method))) {
 	fprintf(stderr, "failed to read file %s\n", infname);
-	return 1;
+	return NULL;
     }
 
     if (opts->start != -1 || opts->end != -1)
@@ -560,8 +577,19 @@ int convert(mFILE *infp, mFILE *outfp, char *infname, char *outfname,
     else
 	r->ident = strdup(outfname);
 
-    if (opts->compress_mode != -1)
-	set_compression_method(opts->compress_mode);
+    return r;
+}
+
+int convert(mFILE *infp, mFILE *outfp, char *infname, char *outfname,
+	    struct opts *opts) {
+    Read *r;
+    int method;
+
+    if (NULL == (r = convert_read(infp, infname, outfname, opts, &method)))
+	return 1;
+
+    set_compression_method(opts->compress_mode != -1
+			   ? opts->compress_mode : method);
 
     if (0 != (mfwrite_reading(outfp, r, opts->out_format))) {
 	fprintf(stderr, "failed to write file %s\n", outfname);
@@ -574,13 +602,608 @@ int convert(mFILE *infp, mFILE *outfp, char *infname, char *outfname,
 }
 
 
+/* ------------------------------------------------------------------------ */
+/*
+ * Batch conversion. Inputs are read sequentially in the main thread, in
+ * batches of BATCH_SIZE, converted to in-memory files by a pool of worker
+ * threads and then written out in input order, either to individual files
+ * or to an indexed archive. Only a bounded number of batches are in flight
+ * at any one time.
+ */
+
+#define BATCH_SIZE 64
+
+typedef struct {
+    int ntraces;
+    char *in_name[BATCH_SIZE];
+    char *out_name[BATCH_SIZE];	/* NULL for stdout; else file or member */
+    mFILE *in[BATCH_SIZE];	/* NULL if the input could not be opened */
+    mFILE *out[BATCH_SIZE];
+    int method[BATCH_SIZE];	/* compression method for each output */
+    int ret[BATCH_SIZE];
+    struct opts *opts;
+    ztr_metrics_t *ztr_m;	/* shared by all batches */
+} conv_batch;
+
+/* Where the inputs come from: a fofn, a tar file or a hash file */
+typedef struct {
+    FILE *fofn_fp;
+    FILE *tar_fp;
+    HashFile *hf;
+    char **names;		/* hash file members, in archive order */
+    int nnames, next;
+} conv_input;
+
+/*
+ * Splits a fofn line into input and output names, unescaping spaces. The
+ * names are written to buf, which must be as large as line.
+ *
+ * Returns the input name; *outfname is NULL when no output is given.
+ */
+static char *fofn_names(char *line, char *buf, char **outfname) {
+    int i, j, len = strlen(line);
+
+    *outfname = NULL;
+    for (i = j = 0; i < len; i++) {
+	if (line[i] == '\\' && i != len-1) {
+	    buf[j++] = line[++i];
+	} else if (line[i] == ' ') {
+	    buf[j++] = 0;
+	    *outfname = &buf[j];
+	} else if (line[i] != '\n') {
+	    buf[j++] = line[i];
+	}
+    }
+    buf[j] = 0;
+
+    return buf;
+}
+
+/*
+ * Reads the next regular file from a tar archive, storing its name in
+ * member (of size member_len).
+ *
+ * Returns the contents on success
+ *         NULL at the end of the archive or on error
+ */
+static mFILE *tar_next(FILE *fp, char *member, size_t member_len) {
+    tar_block blk;
+    int LongLink = 0;
+
+    while (fread(&blk, sizeof(blk), 1, fp) == 1) {
+	size_t size, extra;
+	char *data;
+
+	if (!blk.header.name[0] && !blk.header.prefix[0])
+	    break;
+
+	size = strtoul(blk.header.size, NULL, 8);
+	extra = TBLOCK*((size+TBLOCK-1)/TBLOCK) - size;
+
+	/* GNU tar ././@LongLink: the name of the next member */
+	if (blk.header.typeflag == 'L') {
+	    size_t l = size < member_len ? size : member_len-1;
+	    if (l != fread(member, 1, l, fp))
+		return NULL;
+	    member[l] = 0;
+	    if (fseeko(fp, size - l + extra, SEEK_CUR))
+		return NULL;
+	    LongLink = 1;
+	    continue;
+	}
+
+	if (blk.header.typeflag != REGTYPE &&
+	    blk.header.typeflag != AREGTYPE) {
+	    if (fseeko(fp, size + extra, SEEK_CUR))
+		return NULL;
+	    LongLink = 0;
+	    continue;
+	}
+
+	if (!LongLink) {
+	    if (blk.header.prefix[0])
+		snprintf(member, member_len, "%.155s/%.100s",
+			 blk.header.prefix, blk.header.name);
+	    else
+		snprintf(member, member_len, "%.100s", blk.header.name);
+	}
+
+	if (NULL == (data = malloc(size ? size : 1)))
+	    return NULL;
+	if (size != fread(data, 1, size, fp) ||
+	    fseeko(fp, extra, SEEK_CUR)) {
+	    free(data);
+	    return NULL;
+	}
+
+	return mfcreate(data, size);
+    }
+
+    return NULL;
+}
+
+static void batch_destroy(conv_batch *b) {
+    int i;
+
+    for (i = 0; i < b->ntraces; i++) {
+	free(b->in_name[i]);
+	if (b->out_name[i])
+	    free(b->out_name[i]);
+	if (b->in[i])
+	    mfclose(b->in[i]);
+	if (b->out[i])
+	    mfclose(b->out[i]);
+    }
+    free(b);
+}
+
+/*
+ * Reads the next batch of inputs.
+ *
+ * Returns the batch on success
+ *         NULL when there is no more input or on error
+ */
+static conv_batch *batch_read(conv_input *ci, struct opts *opts) {
+    conv_batch *b;
+    char line[8192], line2[8192];
+    int i;
+
+    if (NULL == (b = calloc(1, sizeof(*b))))
+	return NULL;
+    b->opts = opts;
+
+    if (ci->fofn_fp) {
+	while (b->ntraces < BATCH_SIZE &&
+	       fgets(line, 8192, ci->fofn_fp) != NULL) {
+	    char *infname, *outfname;
+
+	    infname = fofn_names(line, line2, &outfname);
+	    if (!*infname)
+		continue;
+
+	    b->in_name[b->ntraces] = strdup(infname);
+	    if (outfname)
+		b->out_name[b->ntraces] = strdup(outfname);
+	    else if (opts->tar || opts->hash)
+		b->out_name[b->ntraces] = strdup(infname);
+	    b->ntraces++;
+	}
+
+	if (opts->in_format == TT_EXP)
+	    open_exp_mfile_many(b->ntraces, b->in_name, NULL, b->in);
+	else
+	    open_trace_mfile_many(b->ntraces, b->in_name, NULL, b->in);
+
+	for (i = 0; i < b->ntraces; i++) {
+	    /* Don't clobber input */
+	    if (b->out_name[i] && !opts->tar && !opts->hash &&
+		!strcmp(b->in_name[i], b->out_name[i])) {
+		fprintf(stderr,"* Inputfn %s == Outputfn %s ...skipping\n",
+			b->in_name[i], b->out_name[i]);
+		if (b->in[i])
+		    mfclose(b->in[i]);
+		b->in[i] = NULL;
+	    } else if (!b->in[i]) {
+		char buf[8192+10];
+		sprintf(buf, "ERROR %.8192s", b->in_name[i]);
+		perror(buf);
+	    }
+	}
+
+    } else if (ci->tar_fp) {
+	while (b->ntraces < BATCH_SIZE) {
+	    mFILE *mf = tar_next(ci->tar_fp, line, 8192);
+	    if (!mf)
+		break;
+	    b->in_name[b->ntraces] = strdup(line);
+	    b->out_name[b->ntraces] = strdup(line);
+	    b->in[b->ntraces++] = mf;
+	}
+
+    } else if (ci->hf) {
+	char *data[BATCH_SIZE];
+	size_t len[BATCH_SIZE];
+
+	while (b->ntraces < BATCH_SIZE && ci->next < ci->nnames) {
+	    b->in_name[b->ntraces] = strdup(ci->names[ci->next]);
+	    b->out_name[b->ntraces] = strdup(ci->names[ci->next]);
+	    b->ntraces++;
+	    ci->next++;
+	}
+
+	HashFileExtractMany(ci->hf, b->ntraces, b->in_name, data, len);
+	for (i = 0; i < b->ntraces; i++) {
+	    if (data[i])
+		b->in[i] = mfcreate(data[i], len[i]);
+	    else
+		fprintf(stderr, "ERROR %s: could not extract from %s\n",
+			b->in_name[i], opts->archive);
+	}
+    }
+
+    if (!b->ntraces) {
+	free(b);
+	return NULL;
+    }
+
+    return b;
+}
+
+/*
+ * Returns the compress_ztr level used by mfwrite_reading for a ZTR
+ * format, or 0 for other formats.
+ */
+static int ztr_format_level(int format) {
+    switch (format) {
+    case TT_ZTR:
+    case TT_ZTR2: return 2;
+    case TT_ZTR1: return 1;
+    case TT_ZTR3: return 3;
+    default:      return 0;
+    }
+}
+
+/*
+ * Converts all traces in a batch to in-memory output files. Runs in a
+ * worker thread.
+ *
+ * As with convert() the output is compressed with either -compress or
+ * the input's method, but that is recorded in the batch rather than in
+ * the global last used compression method.
+ *
+ * ZTR output is compressed for the whole batch at once with
+ * compress_ztr_many. Its metrics are shared by every batch, so the
+ * choice of chunk compression recipes is learnt across the whole run.
+ * The batches themselves are already spread over the thread pool, so
+ * no pool is given to it.
+ */
+static void *batch_convert(void *arg) {
+    conv_batch *b = (conv_batch *)arg;
+    struct opts *opts = b->opts;
+    int level = ztr_format_level(opts->out_format);
+    ztr_t *ztr[BATCH_SIZE];
+    int i, nztr = 0, idx[BATCH_SIZE];
+
+    for (i = 0; i < b->ntraces; i++) {
+	char *outfname = b->out_name[i] ? b->out_name[i] : "(stdout)";
+	Read *r;
+
+	b->ret[i] = 1;
+	if (!b->in[i] || !(b->out[i] = mfcreate(NULL, 0)))
+	    continue;
+
+	if ((r = convert_read(b->in[i], b->in_name[i], outfname, opts,
+			      &b->method[i]))) {
+	    if (opts->compress_mode != -1)
+		b->method[i] = opts->compress_mode;
+	    if (level) {
+		if ((ztr[nztr] = read2ztr(r)))
+		    idx[nztr++] = i;
+		else
+		    fprintf(stderr, "failed to convert %s to ZTR\n", outfname);
+	    } else if (0 != mfwrite_reading_method(b->out[i], r,
+						   opts->out_format,
+						   b->method[i])) {
+		fprintf(stderr, "failed to write file %s\n", outfname);
+	    } else {
+		b->ret[i] = 0;
+	    }
+	    read_deallocate(r);
+	}
+
+	mfclose(b->in[i]);
+	b->in[i] = NULL;
+    }
+
+    if (nztr) {
+	int err = compress_ztr_many(ztr, nztr, level, b->ztr_m, NULL);
+
+	for (i = 0; i < nztr; i++) {
+	    mFILE *out = b->out[idx[i]];
+
+	    /* As mfwrite_reading, only ZTR1 gets compressed further */
+	    if (err || 0 != mfwrite_ztr(out, ztr[i])) {
+		fprintf(stderr, "failed to write file %s\n",
+			b->out_name[idx[i]] ? b->out_name[idx[i]]
+			                    : "(stdout)");
+	    } else {
+		mftruncate(out, -1);
+		if (opts->out_format == TT_ZTR1)
+		    fcompress_file_method(out, b->method[idx[i]]);
+		b->ret[idx[i]] = 0;
+	    }
+	    delete_ztr(ztr[i]);
+	}
+    }
+
+    return b;
+}
+
+/*
+ * Writes the converted traces in a batch to their output files, the
+ * archive or stdout.
+ *
+ * Returns 0 if all traces were converted and written
+ *         1 otherwise
+ */
+static int batch_write(conv_batch *b, HashFileWriter *w,
+		       FILE *fppassed, FILE *fpfailed) {
+    struct opts *opts = b->opts;
+    int i, ret_all = 0;
+
+    for (i = 0; i < b->ntraces; i++) {
+	int ret = b->ret[i];
+
+	if (!ret) {
+	    mFILE *out = b->out[i];
+
+	    if (w) {
+		if (HashFileWriterAdd(w, b->out_name[i], out->data, out->size)) {
+		    fprintf(stderr, "ERROR %s: failed to add to archive\n",
+			    b->out_name[i]);
+		    ret = 1;
+		}
+	    } else if (b->out_name[i]) {
+		mFILE *fpout;
+		if (NULL == (fpout = mfopen(b->out_name[i], "wb+"))) {
+		    char buf[8192+10];
+		    sprintf(buf, "ERROR %.8192s", b->out_name[i]);
+		    perror(buf);
+		    ret = 1;
+		} else {
+		    mfwrite(out->data, 1, out->size, fpout);
+		    mfclose(fpout);
+		}
+	    } else {
+		mfwrite(out->data, 1, out->size, mstdout());
+		mfflush(mstdout());
+	    }
+	}
+
+	ret_all |= ret;
+	if (opts->dots) {
+	    fputc(ret ? '!' : '.', stdout);
+	    fflush(stdout);
+	}
+	if (ret) {
+	    if (fpfailed)
+		fprintf(fpfailed, "%s\n", b->in_name[i]);
+	} else {
+	    if (fppassed)
+		fprintf(fppassed, "%s\n", b->in_name[i]);
+	}
+    }
+
+    return ret_all;
+}
+
+/*
+ * Writes out any finished batches, in order. While more than max_flight
+ * batches remain in flight (counted by *nflight) we wait for the next,
+ * so finished batches stuck behind a slow one cannot accumulate.
+ */
+static int batch_output(t_results_queue *q, int *nflight, int max_flight,
+			HashFileWriter *w, FILE *fppassed, FILE *fpfailed) {
+    t_pool_result *r;
+    int ret = 0;
+
+    while ((r = *nflight > max_flight
+	    ? t_pool_next_result_wait(q)
+	    : t_pool_next_result(q))) {
+	conv_batch *b = (conv_batch *)r->data;
+	ret |= batch_write(b, w, fppassed, fpfailed);
+	batch_destroy(b);
+	t_pool_delete_result(r, 0);
+	(*nflight)--;
+    }
+
+    return ret;
+}
+
+typedef struct {
+    char *name;
+    uint64_t pos;
+} hash_member;
+
+static int hash_member_cmp(const void *v1, const void *v2) {
+    const hash_member *m1 = (const hash_member *)v1;
+    const hash_member *m2 = (const hash_member *)v2;
+    return (m1->pos > m2->pos) - (m1->pos < m2->pos);
+}
+
+/*
+ * Lists the members of a hash file in archive order.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int hash_members(conv_input *ci, char *fn) {
+    HashFile *hf;
+    HashIter *iter;
+    HashItem *hi;
+    hash_member *m;
+    FILE *fp;
+    int i, n = 0;
+
+    if (NULL == (fp = fopen(fn, "rb")) ||
+	NULL == (hf = HashFileLoad(fp)))
+	return -1;
+
+    if (NULL == (m = malloc(hf->h->nused * sizeof(*m))) ||
+	NULL == (iter = HashTableIterCreate())) {
+	HashFileDestroy(hf);
+	return -1;
+    }
+
+    while ((hi = HashTableIterNext(hf->h, iter))) {
+	HashFileItem *hfi = (HashFileItem *)hi->data.p;
+	if (NULL == (m[n].name = malloc(hi->key_len+1)))
+	    break;
+	memcpy(m[n].name, hi->key, hi->key_len);
+	m[n].name[hi->key_len] = 0;
+	/* Archive numbers are 8-bit and positions 56-bit */
+	m[n].pos = ((uint64_t)hfi->archive << 56) | hfi->pos;
+	n++;
+    }
+    HashTableIterDestroy(iter);
+    HashFileDestroy(hf);
+
+    qsort(m, n, sizeof(*m), hash_member_cmp);
+    if (NULL == (ci->names = malloc((n ? n : 1) * sizeof(char *)))) {
+	for (i = 0; i < n; i++)
+	    free(m[i].name);
+	free(m);
+	return -1;
+    }
+    for (i = 0; i < n; i++)
+	ci->names[i] = m[i].name;
+    ci->nnames = n;
+    free(m);
+
+    return 0;
+}
+
+/*
+ * Converts all traces listed in opts->fofn or held in opts->archive
+ * using opts->nthreads threads, writing to the files listed in the fofn,
+ * to stdout, or to the tar archive opts->tar and/or the hash file
+ * opts->hash. With only one of these the index is appended to the
+ * archive.
+ *
+ * Returns 0 on success
+ *         1 if any trace failed
+ *        -1 on a fatal error
+ */
+static int convert_many(struct opts *opts) {
+    conv_input ci;
+    conv_batch *b;
+    t_pool *pool = NULL;
+    t_results_queue *rqueue = NULL;
+    FILE *fppassed = NULL, *fpfailed = NULL;
+    HashFileWriter *w = NULL;
+    ztr_metrics_t *ztr_m = NULL;
+    int i, ret = 0, nflight = 0;
+
+    memset(&ci, 0, sizeof(ci));
+    if (opts->fofn) {
+	if (NULL == (ci.fofn_fp = fopen(opts->fofn, "r"))) {
+	    perror(opts->fofn);
+	    return -1;
+	}
+    } else if ((ci.hf = HashFileOpen(opts->archive))) {
+	if (-1 == hash_members(&ci, opts->archive)) {
+	    fprintf(stderr, "Failed to read hash file %s\n", opts->archive);
+	    ret = -1;
+	    goto out;
+	}
+    } else if (NULL == (ci.tar_fp = fopen(opts->archive, "rb"))) {
+	perror(opts->archive);
+	return -1;
+    }
+
+    if (opts->passed && NULL == (fppassed = fopen(opts->passed, "w"))) {
+	perror(opts->passed);
+	ret = -1;
+	goto out;
+    }
+
+    if (opts->failed && NULL == (fpfailed = fopen(opts->failed, "w"))) {
+	perror(opts->failed);
+	ret = -1;
+	goto out;
+    }
+
+    if (opts->tar)
+	w = HashFileWriterOpen(opts->tar, opts->hash, HASHFILE_ARCHIVE_TAR);
+    else if (opts->hash)
+	w = HashFileWriterOpen(opts->hash, NULL, HASHFILE_ARCHIVE_RAW);
+    if ((opts->tar || opts->hash) && !w) {
+	perror(opts->tar ? opts->tar : opts->hash);
+	ret = -1;
+	goto out;
+    }
+
+    if (opts->nthreads > 1) {
+	if (!(pool = t_pool_init(opts->nthreads*2, opts->nthreads)) ||
+	    !(rqueue = t_results_queue_init())) {
+	    fprintf(stderr, "Failed to create thread pool\n");
+	    ret = -1;
+	    goto out;
+	}
+    }
+
+    if (ztr_format_level(opts->out_format) &&
+	!(ztr_m = ztr_metrics_create())) {
+	fprintf(stderr, "Failed to create ZTR metrics\n");
+	ret = -1;
+	goto out;
+    }
+
+    while ((b = batch_read(&ci, opts))) {
+	b->ztr_m = ztr_m;
+	if (pool) {
+	    if (t_pool_dispatch(pool, rqueue, batch_convert, b) < 0) {
+		fprintf(stderr, "Failed to dispatch conversion job\n");
+		batch_destroy(b);
+		ret = -1;
+		break;
+	    }
+	    nflight++;
+	    ret |= batch_output(rqueue, &nflight, 2*opts->nthreads,
+				w, fppassed, fpfailed);
+	} else {
+	    ret |= batch_write(batch_convert(b), w, fppassed, fpfailed);
+	    batch_destroy(b);
+	}
+    }
+
+ out:
+    /* Batches already dispatched are still written, and indexed below */
+    if (rqueue) {
+	ret |= batch_output(rqueue, &nflight, 0, w, fppassed, fpfailed);
+	t_results_queue_destroy(rqueue);
+    }
+    if (pool)
+	t_pool_destroy(pool, 0);
+    ztr_metrics_destroy(ztr_m);
+
+    if (w && HashFileWriterClose(w)) {
+	perror(opts->tar ? opts->tar : opts->hash);
+	ret = -1;
+    }
+
+    if (ci.fofn_fp)
+	fclose(ci.fofn_fp);
+    if (ci.tar_fp)
+	fclose(ci.tar_fp);
+    if (ci.hf) {
+	for (i = 0; i < ci.nnames; i++)
+	    free(ci.names[i]);
+	free(ci.names);
+	HashFileDestroy(ci.hf);
+    }
+    if (fppassed)
+	fclose(fppassed);
+    if (fpfailed)
+	fclose(fpfailed);
+
+    return ret;
+}
+
+
 void usage(void) {
     puts("Usage: convert_trace [options] [informat outformat] < in > out");
     puts("Or     convert_trace [options] -fofn file_of_filenames");
+    puts("Or     convert_trace [options] -archive tar_or_hash -hash out.hash");
     puts("\nOptions are:");
     puts("    -in_format format         Format for input (defaults to any");
     puts("    -out_format format        Format for output (default ztr)");
     puts("    -fofn file_of_filenames   Get \"Input Output\" names from a fofn");
+    puts("    -archive file             Convert all traces in a tar or hash file");
+    puts("    -tar file                 Write the output traces to a tar archive");
+    puts("    -hash file                Write a hash index (with -tar) or an");
+    puts("                              indexed archive (without -tar)");
+    puts("    -t nthreads               Convert traces using nthreads threads");
     puts("    -passed fofn              Output fofn of passed names");  
     puts("    -error errs               Redirect stderr to file \"errs\"");
     puts("    -failed fofn              Output fofn of failed names");  
@@ -620,6 +1243,10 @@ int main(int argc, char **argv) {
     opts.skipx = 0;
     opts.start = -1;
     opts.end = -1;
+    opts.nthreads = 1;
+    opts.archive = NULL;
+    opts.tar = NULL;
+    opts.hash = NULL;
     
     for (argc--, argv++; argc > 0; argc--, argv++) {
 	if (**argv != '-')
@@ -641,6 +1268,23 @@ int main(int argc, char **argv) {
 	    opts.fofn = *++argv;
 	    argc--;
 
+	} else if (strcmp(*argv, "-archive") == 0) {
+	    opts.archive = *++argv;
+	    argc--;
+
+	} else if (strcmp(*argv, "-tar") == 0) {
+	    opts.tar = *++argv;
+	    argc--;
+
+	} else if (strcmp(*argv, "-hash") == 0) {
+	    opts.hash = *++argv;
+	    argc--;
+
+	} else if (strcmp(*argv, "-t") == 0) {
+	    if ((opts.nthreads = atoi(*++argv)) < 1)
+		usage();
+	    argc--;
+
 	} else if (strcmp(*argv, "-passed") == 0) {
 	    opts.passed = *++argv;
 	    argc--;
@@ -744,6 +1388,15 @@ int main(int argc, char **argv) {
 	}
     }
 
+    if (opts.archive && (opts.fofn || !(opts.tar || opts.hash)))
+	usage();
+
+    if (opts.archive || opts.tar || opts.hash || opts.nthreads > 1) {
+	if (!opts.fofn && !opts.archive)
+	    usage();
+	return convert_many(&opts);
+    }
+
     if (!opts.fofn) {
 	return convert(mstdin(), mstdout(), "(stdin)", "(stdout)", &opts);
     }
@@ -773,26 +1426,11 @@ int main(int argc, char **argv) {
 	}
 
 	while (fgets(line, 8192, fofn_fp) != NULL) {
-	    int i, j, len;
-	    
 	    /* Find input and output name, escaping spaces as needed */
-	    len = strlen(line);
-	    outfname = NULL;
-	    for (i = j = 0; i < len; i++) {
-		if (line[i] == '\\' && i != len-1) {
-		    line2[j++] = line[++i];
-		} else if (line[i] == ' ') {
-		    line2[j++] = 0;
-		    outfname = &line2[j];
-		} else if (line[i] != '\n') {
-		    line2[j++] = line[i];
-		}
-	    }
-	    line2[j] = 0;
-	    infname = line2;
+	    infname = fofn_names(line, line2, &outfname);
 
 	    /* Don't clobber input */
-	    if (!strcmp(infname, outfname)) {
+	    if (outfname && !strcmp(infname, outfname)) {
 		fprintf(stderr,"* Inputfn %s == Outputfn %s ...skipping\n",
 			infname, outfname);
 		if (fpfailed)
@@ -35,6 +35,9 @@
  * A tool to slice-n-dice cram files at the container / block level,
  * for efficient production of a subset without needing to uncompress
  * and recompress.
+ *
+ * It can also transcode, recompressing each block with different
+ * methods without decoding the records themselves.
  */
 
 #include "io_lib_config.h"
@@ -509,6 +512,211 @@ void update_slice_offsets(cram_fd *fd_out, cram_container *c) {
     c->length += slice_offset; // just past the final slice
 }
 
+/*
+ * -----------------------------------------------------------------------------
+ * Transcoding: recompressing the external blocks with the methods
+ * permitted by the output file, without decoding any records.
+ */
+
+/* Content id of an external data series codec, or -1 if none */
+static int codec_content_id(cram_codec *co, int *stop) {
+    if (!co)
+	return -1;
+
+    switch (co->codec) {
+    case E_EXTERNAL:
+	return co->e_external.content_id;
+    case E_BYTE_ARRAY_STOP:
+	if (stop) *stop = co->e_byte_array_stop.stop;
+	return co->e_byte_array_stop.content_id;
+    default:
+	return -1;
+    }
+}
+
+/*
+ * Picks the per-content-id metrics for every external block in the
+ * container.  This is done by the main thread, as the hash table
+ * itself isn't thread safe.
+ *
+ * Returns 0 on success;
+ *        -1 on failure.
+ */
+static int transcode_metrics(HashTable *m_h, cram_container *c) {
+    int i, j;
+
+    for (i = 0; i < c->curr_slice; i++) {
+	cram_slice *s = c->slices[i];
+	for (j = 0; j < s->hdr->num_blocks; j++) {
+	    cram_block *b = s->block[j];
+	    uintptr_t k = b->content_id;
+	    HashData hd;
+	    HashItem *hi;
+
+	    if (b->content_type != EXTERNAL)
+		continue;
+
+	    hd.p = NULL;
+	    if (!(hi = HashTableAdd(m_h, (char *)k, sizeof(k), hd, NULL)))
+		return -1;
+	    if (!hi->data.p && !(hi->data.p = cram_new_metrics()))
+		return -1;
+	    b->m = hi->data.p;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Uncompresses and recompresses all blocks in a container.
+ * The method choices mirror cram_compress_slice(), except that fqzcomp
+ * needs the decoded records and so is not available.
+ *
+ * Returns 0 on success;
+ *        -1 on failure.
+ */
+static int transcode_container(cram_fd *fd, cram_container *c) {
+    int level = fd->level, i, j;
+    int method = 1<<GZIP | 1<<GZIP_RLE, method_rn;
+    int qs_id, rn_id, rn_stop = -1;
+
+    if (fd->use_bz2)
+	method |= 1<<BZIP2;
+#ifdef HAVE_LIBBSC
+    if (fd->use_bsc)
+	method |= 1<<BSC;
+#endif
+    if (fd->use_lzma)
+	method |= 1<<LZMA;
+    if (fd->use_rans)
+	method |= CRAM_MAJOR_VERS(fd->version) >= 4
+	    ? (1<<RANS_PR0)   | (1<<RANS_PR1)
+	    | (1<<RANS_PR64)  | (1<<RANS_PR65)
+	    | (1<<RANS_PR128) | (1<<RANS_PR129)
+	    | (1<<RANS_PR192) | (1<<RANS_PR193)
+	    : (1<<RANS0) | (1<<RANS1);
+    if (level >= 6)
+	method |= 1<<GZIP_1;
+
+    // Read names only gain from the tokeniser when stored as nul
+    // terminated strings, as we produce.
+    qs_id = codec_content_id(c->comp_hdr->codecs[DS_QS], NULL);
+    rn_id = codec_content_id(c->comp_hdr->codecs[DS_RN], &rn_stop);
+    method_rn = method & ~(1<<GZIP_RLE | 1<<RANS0 | 1<<RANS1);
+    if (level > 4 && fd->version >= (3<<8)+1 && rn_stop == 0)
+	method_rn |= 1<<NAME_TOK3;
+
+    for (i = 0; i < c->curr_slice; i++) {
+	cram_slice *s = c->slices[i];
+
+	for (j = 0; j < s->hdr->num_blocks; j++) {
+	    cram_block *b = s->block[j];
+	    int m = method;
+
+	    if (cram_uncompress_block(b) != 0)
+		return -1;
+	    b->comp_size = b->uncomp_size;
+	    b->crc32 = 0;
+
+	    if (b->content_type == CORE) {
+		if (level > 5 && b->uncomp_size > 500)
+		    if (cram_compress_block(fd, s, b, NULL, 1<<GZIP, 1))
+			return -1;
+		continue;
+	    }
+
+	    if (b->content_id == rn_id && b->content_id != qs_id)
+		m = method_rn;
+
+	    if (cram_compress_block(fd, s, b, b->m, m, level))
+		return -1;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Rebuilds the compression header and slice offsets for any edits
+ * made, writes the container and frees it, whether or not the write
+ * succeeded.
+ *
+ * Returns 0 on success;
+ *        -1 on failure.
+ */
+static int write_container(cram_fd *fd_out, cram_container *c, int drop_qs) {
+    int ret = 0;
+
+    // Compute new compression header
+    correct_compression_header(fd_out, c, drop_qs);
+
+    // New slice offsets.
+    update_slice_offsets(fd_out, c);
+
+    // Write out the container and all slices.
+    if (cram_flush_container2(fd_out, c) != 0)
+	ret = -1;
+
+    HashTableDestroy(c->tags_used, 1);
+    c->tags_used = NULL; // Avoids freeing codecs twice.
+    cram_free_container(c);
+
+    return ret;
+}
+
+typedef struct {
+    cram_fd *fd;
+    cram_container *c;
+    int drop_qs;
+    int failed;
+} transcode_job;
+
+/*
+ * Failures are flagged in the job rather than by returning NULL, so
+ * transcode_results still gets the container to free.
+ */
+static void *transcode_thread(void *arg) {
+    transcode_job *j = (transcode_job *)arg;
+
+    if (transcode_container(j->fd, j->c) != 0) {
+	fprintf(stderr, "Failed to transcode container\n");
+	j->failed = 1;
+    }
+
+    return arg;
+}
+
+/*
+ * Writes any transcoded containers returned by the thread pool, in
+ * their original order.  If wait is true we block until all are done.
+ *
+ * Returns 0 on success;
+ *        -1 on failure.
+ */
+static int transcode_results(cram_fd *fd_out, t_results_queue *q, int wait) {
+    t_pool_result *r;
+    int ret = 0;
+
+    if (wait)
+	t_pool_flush(fd_out->pool);
+
+    while ((r = t_pool_next_result(q))) {
+	transcode_job *j = (transcode_job *)r->data;
+	if (j->failed) {
+	    HashTableDestroy(j->c->tags_used, 1);
+	    j->c->tags_used = NULL; // Avoids freeing codecs twice.
+	    cram_free_container(j->c);
+	    ret = -1;
+	} else if (write_container(fd_out, j->c, j->drop_qs) != 0) {
+	    ret = -1;
+	}
+	t_pool_delete_result(r, 1);
+    }
+
+    return ret;
+}
+
 /*
  * The heart of the CRAM block filtering algorithm.
  *
@@ -516,21 +724,37 @@ void update_slice_offsets(cram_fd *fd_out, cram_container *c) {
  * 2. Load compression header into c->comp_hdr
  * 3. Load all slices for this container into c->slices[i]
  * 4.    Filter slice blocks and edit slice header.
- * 5. Edit compression header
- * 6. Edit container num_blocks and size.
- * 7. Write container
- * 8. Write compression header
- * 9. Write slices.
+ * 5. Recompress blocks, if transcoding
+ * 6. Edit compression header
+ * 7. Edit container num_blocks and size.
+ * 8. Write container
+ * 9. Write compression header
+ * 10. Write slices.
+ *
+ * When transcoding with a thread pool steps 5 onwards are run as a
+ * job per container.
  *
  * Returns 0 on success;
  *        -1 on failure
  */
 int filter_blocks(cram_fd *fd_in, cram_fd *fd_out, HashTable *ds_h,
-		  int drop_qs, char *keep_aux, int n_containers) {
+		  int drop_qs, char *keep_aux, int n_containers,
+		  int transcode) {
     cram_container *c;
     char tag_to_del[128][128] = {{0}};
     char tag_to_keep[128][128] = {{0}};
-    HashTable *ci_h = NULL;
+    HashTable *ci_h = NULL, *m_h = NULL;
+    t_results_queue *q = NULL;
+    int ret = 0;
+
+    if (transcode) {
+	if (!(m_h = HashTableCreate(128, HASH_DYNAMIC_SIZE|
+				    HASH_NONVOLATILE_KEYS |
+				    HASH_INT_KEYS)))
+	    return -1;
+	if (fd_out->pool && !(q = t_results_queue_init()))
+	    return -1;
+    }
 
     if (keep_aux) {
 	while (*keep_aux) {
@@ -645,36 +869,60 @@ int filter_blocks(cram_fd *fd_in, cram_fd *fd_out, HashTable *ds_h,
 	if (eor == 1)
 	    goto tidy;
 
-	// Compute new compression header
-	correct_compression_header(fd_out, c, drop_qs);
+	HashTableDestroy(ci_h, 0); ci_h = NULL;
 
-	// New slice offsets.
-	update_slice_offsets(fd_out, c);
+	if (transcode) {
+	    if (transcode_metrics(m_h, c))
+		return -1;
 
-	// Write out the container and all slices.
-	if (cram_flush_container2(fd_out, c) != 0)
-	    return -1;
-	    
-	HashTableDestroy(c->tags_used, 1);
-	c->tags_used = NULL; // Avoids freeing codecs twice.
-	cram_free_container(c);
+	    if (q) {
+		transcode_job *j = malloc(sizeof(*j));
+		if (!j)
+		    return -1;
+		j->fd = fd_out;
+		j->c = c;
+		j->drop_qs = drop_qs;
+		j->failed = 0;
+		t_pool_dispatch(fd_out->pool, q, transcode_thread, j);
+		if (transcode_results(fd_out, q, 0)) {
+		    // Tidy still drains the jobs in flight
+		    ret = -1;
+		    c = NULL;
+		    goto tidy;
+		}
+		goto next;
+	    }
 
-	HashTableDestroy(ci_h, 0); ci_h = NULL;
+	    if (transcode_container(fd_out, c))
+		return -1;
+	}
+
+	if (write_container(fd_out, c, drop_qs))
+	    return -1;
 
+    next:
 	if (n_containers && --n_containers <= 0)
 	    break;
     }
-
-    return cram_write_eof_block(fd_out);
+    c = NULL;
 
  tidy:
-    HashTableDestroy(c->tags_used, 1);
-    c->tags_used = NULL; // Avoids freeing codecs twice.
-    cram_free_container(c);
+    if (c) {
+	HashTableDestroy(c->tags_used, 1);
+	c->tags_used = NULL; // Avoids freeing codecs twice.
+	cram_free_container(c);
+    }
     if (ci_h)
 	HashTableDestroy(ci_h, 0);
 
-    return cram_write_eof_block(fd_out);
+    if (q) {
+	ret |= transcode_results(fd_out, q, 1);
+	t_results_queue_destroy(q);
+    }
+    if (m_h)
+	HashTableDestroy(m_h, 1);
+
+    return ret | cram_write_eof_block(fd_out);
 }
 
 
@@ -763,6 +1011,16 @@ void usage(int err) {
 	"    -t tag-list       Discard comma separated list of tag types.\n"
 	"    -T tag-list       Keep only aux. tag types in the specified list.\n"
 	"    -!                Disable all checking of checksums.\n"
+	"\n"
+	"Transcoding options:\n"
+	"    -c                Recompress all blocks, without decoding records.\n"
+	"    -0 to -9          Compression level; implies -c.\n"
+	"    -V version        Output CRAM version (same major version as input);\n"
+	"                      implies -c.\n"
+	"    -j                Also compress using bzip2; implies -c.\n"
+	"    -Z                Also compress using lzma; implies -c.\n"
+	"    -J                Also compress using libbsc (V3.1+); implies -c.\n"
+	"    -p N              Use N threads when recompressing.\n"
 	"    -h                Show this help.\n"
 	);
     exit(err);
@@ -774,6 +1032,9 @@ int main(int argc, char **argv) {
     int drop_qs = 0, ignore_md5 = 0;
     char *keep_aux = NULL, *range = NULL;
     int c, c_start = 0, c_end = -1, require_index = 0;
+    int transcode = 0, level = 5, nthreads = 1;
+    int use_bz2 = 0, use_lzma = 0, use_bsc = 0;
+    char *version = NULL, omode[10];
 
     // Map of data series 2 or 3 byte code to content_id(s).
     HashTable *ds_h = HashTableCreate(128, HASH_DYNAMIC_SIZE|
@@ -783,7 +1044,7 @@ int main(int argc, char **argv) {
 	return 1;
 
     // Parse arguments
-    while ((c = getopt(argc, argv, "hqt:T:!n:r:")) != -1) {
+    while ((c = getopt(argc, argv, "hqt:T:!n:r:c0123456789V:jZJp:")) != -1) {
 	switch (c) {
 	case 't': {
 	    while (*optarg) {
@@ -817,6 +1078,27 @@ int main(int argc, char **argv) {
 	    require_index = 2;
 	    break;
 
+	case 'c': transcode = 1; break;
+
+	case '0': case '1': case '2': case '3': case '4':
+	case '5': case '6': case '7': case '8': case '9':
+	    level = c - '0';
+	    transcode = 1;
+	    break;
+
+	case 'V':
+	    version = optarg;
+	    transcode = 1;
+	    break;
+
+	case 'j': use_bz2  = 1; transcode = 1; break;
+	case 'Z': use_lzma = 1; transcode = 1; break;
+	case 'J': use_bsc  = 1; transcode = 1; break;
+
+	case 'p':
+	    nthreads = atoi(optarg);
+	    break;
+
 	case 'h': usage(0);
 	default:  usage(1);
 	}
@@ -879,11 +1161,35 @@ int main(int argc, char **argv) {
 	}
     }
 
-    if (NULL == (fd_out = cram_open(argv[optind+1], "wb"))) {
+    // Changing the major version needs the records to be re-encoded.
+    if (version) {
+	if (cram_set_option(NULL, CRAM_OPT_VERSION, version))
+	    return 1;
+	if (atoi(version) != CRAM_MAJOR_VERS(fd_in->version)) {
+	    fprintf(stderr, "Transcoding cannot change the major version; "
+		    "use scramble instead.\n");
+	    return 1;
+	}
+    }
+
+    sprintf(omode, "wb%d", level);
+    if (NULL == (fd_out = cram_open(argv[optind+1], omode))) {
 	fprintf(stderr, "Error opening CRAM file '%s'.\n", argv[optind+1]);
 	return 1;
     }
 
+    if (transcode) {
+	if (use_bz2 && cram_set_option(fd_out, CRAM_OPT_USE_BZIP2, use_bz2))
+	    return 1;
+	if (use_lzma && cram_set_option(fd_out, CRAM_OPT_USE_LZMA, use_lzma))
+	    return 1;
+	if (use_bsc && cram_set_option(fd_out, CRAM_OPT_USE_BSC, use_bsc))
+	    return 1;
+	if (nthreads > 1 &&
+	    cram_set_option(fd_out, CRAM_OPT_NTHREADS, nthreads))
+	    return 1;
+    }
+
     if (ignore_md5) {
 	if (cram_set_option(fd_in, CRAM_OPT_IGNORE_MD5, ignore_md5))
 	    return 1;
@@ -906,7 +1212,7 @@ int main(int argc, char **argv) {
     }
 
     if (0 != filter_blocks(fd_in, fd_out, ds_h, drop_qs, keep_aux,
-			   c_end - c_start+1)) {
+			   c_end - c_start+1, transcode)) {
 	fprintf(stderr, "Filter blocks failed\n");
 	return 1;
     }
@@ -43,31 +43,88 @@
 #include <ctype.h>
 #include <string.h>
 #include <limits.h>
+#include <unistd.h>
 
 #include <io_lib/cram.h>
 #include <io_lib/zfio.h>
 
+static void usage(FILE *fp) {
+    fprintf(fp, "Usage: cram_index [-b] [-n] filename.cram [filename.cram.crai]\n\n");
+    fprintf(fp, "Options:\n");
+    fprintf(fp, "    -b             Also write a binary filename.cram.crai.bin cache\n");
+    fprintf(fp, "                   (only with the default index filename)\n");
+    fprintf(fp, "    -n             Also write a read name index, filename.cram.nai\n");
+}
+
 int main(int argc, char **argv) {
     cram_fd *fd;
+    int c, bin = 0, names = 0;
+    char *fn, fn_names[PATH_MAX];
+
+    while ((c = getopt(argc, argv, "bnh")) != -1) {
+	switch (c) {
+	case 'b':
+	    bin = 1;
+	    break;
+
+	case 'n':
+	    names = 1;
+	    break;
+
+	case 'h':
+	    usage(stdout);
+	    return 0;
+
+	default:
+	    usage(stderr);
+	    return 1;
+	}
+    }
 
-    if (argc != 2 && argc != 3) {
-	fprintf(stderr, "Usage: cram_index filename.cram [filename.cram.crai]\n");
+    if (argc - optind != 1 && argc - optind != 2) {
+	usage(stderr);
 	return 1;
     }
+    fn = argv[optind];
+
+    /* The cache is only used alongside, and checked against, fn.crai */
+    if (bin && argc - optind == 2) {
+	snprintf(fn_names, PATH_MAX, "%s.crai", fn);
+	if (strcmp(argv[argc-1], fn_names) != 0) {
+	    fprintf(stderr, "cram_index: -b requires the index to be "
+		    "named %s\n", fn_names);
+	    return 1;
+	}
+    }
 
-    if (NULL == (fd = cram_open(argv[1], "rb"))) {
-	fprintf(stderr, "Error opening CRAM file '%s'.\n", argv[1]);
+    if (NULL == (fd = cram_open(fn, "rb"))) {
+	fprintf(stderr, "Error opening CRAM file '%s'.\n", fn);
 	return 1;
     }
 
     cram_set_option(fd, CRAM_OPT_REQUIRED_FIELDS,
 		    SAM_RNAME | SAM_POS | SAM_CIGAR);
 
-    if (cram_index_build(fd, argv[argc-1]) == -1) {
+    snprintf(fn_names, PATH_MAX, "%s.nai", fn);
+    if (cram_index_build_names(fd, argv[argc-1],
+			       names ? fn_names : NULL) == -1) {
 	cram_close(fd);
 	return 1;
     }
 
+    /* The cache is converted from the text index just written */
+    if (bin) {
+	char fn2[PATH_MAX];
+
+	snprintf(fn2, PATH_MAX, "%s.crai.bin", fn);
+	unlink(fn2);
+	if (cram_index_load(fd, fn) != 0 ||
+	    cram_index_save_bin(fd, fn) != 0) {
+	    cram_close(fd);
+	    return 1;
+	}
+    }
+
     cram_close(fd);
 
     return 0;
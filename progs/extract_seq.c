@@ -99,6 +99,9 @@
 
 #define LINE_LENGTH 60
 
+/* Number of input names to locate at once */
+#define BATCH_SIZE 256
+
 static int do_trans(mFILE *infp, char *in_file, FILE *outfp, int format,
 		    int good_only, int clip_cosmid, int fasta_out) {
     Read *r;
@@ -189,6 +192,35 @@ static int do_trans(mFILE *infp, char *in_file, FILE *outfp, int format,
     return 0;
 }
 
+/*
+ * Opens and translates a batch of named inputs. These are located together
+ * so that any URL search path elements can fetch them concurrently.
+ */
+static int do_batch(char **names, int nnames, FILE *outfp, int format,
+		    int good_only, int clip_cosmid, int fasta_out) {
+    mFILE *mf[BATCH_SIZE];
+    int i, ret = 0;
+
+    if (format == TT_EXP) {
+	open_exp_mfile_many(nnames, names, NULL, mf);
+    } else {
+	open_trace_mfile_many(nnames, names, NULL, mf);
+    }
+
+    for (i = 0; i < nnames; i++) {
+	if (NULL == mf[i]) {
+	    perror(names[i]);
+	    ret = 1;
+	} else {
+	    ret |= do_trans(mf[i], names[i], outfp, format, good_only,
+			    clip_cosmid, fasta_out);
+	    mfclose(mf[i]);
+	}
+    }
+
+    return ret;
+}
+
 static void usage(void) {
     fprintf(stderr, "Usage: extract_seq [-r] [-(abi|alf|scf|exp|pln|ztr)]\n"
 	    "                   [-good_only] [-clip_cosmid] [-fasta_out]\n"
@@ -260,41 +292,41 @@ int main(int argc, char **argv) {
 		fofn_fp = fopen(fofn, "r");
 
 	    if (fofn_fp) {
-		while (fgets(line, 8192, fofn_fp) != NULL) {
-		    char *cp;
-		    if ((cp = strchr(line, '\n')))
-			*cp = 0;
-		    if (format == TT_EXP) {
-			infp = open_exp_mfile(line, NULL);
-		    } else {
-			infp = open_trace_mfile(line, NULL);
+		char *names[BATCH_SIZE];
+		int i, nnames = 0;
+
+		for (;;) {
+		    char *cp = fgets(line, 8192, fofn_fp);
+
+		    if (cp) {
+			if ((cp = strchr(line, '\n')))
+			    *cp = 0;
+			if (NULL == (names[nnames++] = strdup(line))) {
+			    perror("strdup");
+			    return 1;
+			}
 		    }
-		    if (NULL == infp) {
-			perror(line);
-			ret = 1;
-		    } else {
-			ret |= do_trans(infp, line, outfp, format, good_only,
-					clip_cosmid, fasta_out);
-			mfclose(infp);
+
+		    if (nnames == BATCH_SIZE || (!cp && nnames)) {
+			ret |= do_batch(names, nnames, outfp, format,
+					good_only, clip_cosmid, fasta_out);
+			for (i = 0; i < nnames; i++)
+			    free(names[i]);
+			nnames = 0;
 		    }
+
+		    if (!cp)
+			break;
 		}
 		fclose(fofn_fp);
 	    }
 	}
-	for (;argc > 0; argc--, argv++) {
-	    if (format == TT_EXP) {
-		infp = open_exp_mfile(*argv, NULL);
-	    } else {
-		infp = open_trace_mfile(*argv, NULL);
-	    }
-	    if (NULL == infp) {
-		perror(*argv);
-		ret = 1;
-	    } else {
-		ret |= do_trans(infp, *argv, outfp, format, good_only,
-				clip_cosmid, fasta_out);
-		mfclose(infp);
-	    }
+	while (argc > 0) {
+	    int nnames = argc < BATCH_SIZE ? argc : BATCH_SIZE;
+	    ret |= do_batch(argv, nnames, outfp, format, good_only,
+			    clip_cosmid, fasta_out);
+	    argc -= nnames;
+	    argv += nnames;
 	}
     } else {
 	ret = do_trans(infp, "<stdin>", outfp, format, good_only, clip_cosmid,
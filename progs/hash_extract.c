@@ -41,21 +41,37 @@
 #include <fcntl.h>
 #include <io_lib/hash_table.h>
 
+#define BATCH_SIZE 1024
+
 /*
- * Copies a single named file to stdout.
+ * Copies a batch of named files to stdout, in the order given. The
+ * lookups and reads are done together via HashFileExtractMany so the
+ * index and archive are swept in order rather than seeked per file.
+ *
  * Returns 0 on success
  *         1 on failure
  */
-int extract(HashFile *hf, char *file) {
-    size_t len;
-    char *data;
+int extract(HashFile *hf, int nfiles, char **files) {
+    char *data[BATCH_SIZE];
+    size_t len[BATCH_SIZE];
+    int i, ret = 0;
 
-    if ((data = HashFileExtract(hf, file, &len))) {
-	fwrite(data, len, 1, stdout);
-	free(data);
+    if (nfiles <= 0)
 	return 0;
+
+    if (-1 == HashFileExtractMany(hf, nfiles, files, data, len))
+	return 1;
+
+    for (i = 0; i < nfiles; i++) {
+	if (data[i]) {
+	    fwrite(data[i], len[i], 1, stdout);
+	    free(data[i]);
+	} else {
+	    ret = 1;
+	}
     }
-    return 1;
+
+    return ret;
 }
 
 int main(int argc, char **argv) {
@@ -89,9 +105,15 @@ int main(int argc, char **argv) {
 	return 1;
     }
 
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
     if (fofn) {
 	FILE *fofnfp;
 	char file[256];
+	char *files[BATCH_SIZE];
+	int i, nfiles = 0;
 
 	if (strcmp(fofn, "-") == 0) {
 	    fofnfp = stdin;
@@ -107,17 +129,28 @@ int main(int argc, char **argv) {
 	    if ((c = strchr(file, '\n')))
 		*c = 0;
 
-	    ret |= extract(hf, file);
+	    if (NULL == (files[nfiles++] = strdup(file))) {
+		perror("strdup");
+		return 1;
+	    }
+
+	    if (nfiles == BATCH_SIZE) {
+		ret |= extract(hf, nfiles, files);
+		for (i = 0; i < nfiles; i++)
+		    free(files[i]);
+		nfiles = 0;
+	    }
 	}
 
+	ret |= extract(hf, nfiles, files);
+	for (i = 0; i < nfiles; i++)
+	    free(files[i]);
+
 	fclose(fofnfp);
     }
 
-#ifdef _WIN32
-    _setmode(_fileno(stdout), _O_BINARY);
-#endif
-    for (; argc; argc--, argv++) {
-	ret |= extract(hf, *argv);
+    for (; argc > 0; argc -= BATCH_SIZE, argv += BATCH_SIZE) {
+	ret |= extract(hf, argc < BATCH_SIZE ? argc : BATCH_SIZE, argv);
     }
 
     HashFileDestroy(hf);
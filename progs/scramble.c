@@ -90,6 +90,45 @@ static char *detect_format(char *fn) {
     return "";
 }
 
+/*
+ * Parses a refseq:start-end range string against the header of the
+ * CRAM file, filling out r.  "*" selects the unmapped reads.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int parse_range(SAM_hdr *hdr, char *str, cram_range *r) {
+    char *cp = strchr(str, ':');
+    int start, end;
+
+    if (cp) {
+	*cp = 0;
+	switch (sscanf(cp+1, "%d-%d", &start, &end)) {
+	case 1:
+	    end = start;
+	    break;
+	case 2:
+	    break;
+	default:
+	    fprintf(stderr, "Malformed range format\n");
+	    return -1;
+	}
+    } else {
+	start = INT_MIN;
+	end   = INT_MAX;
+    }
+
+    r->refid = sam_hdr_name2ref(hdr, str);
+    if (r->refid == -1 && *str != '*') {
+	fprintf(stderr, "Unknown reference name '%s'\n", str);
+	return -1;
+    }
+    r->start = start;
+    r->end = end;
+
+    return 0;
+}
+
 static void usage(FILE *fp) {
     fprintf(fp, "  -=- sCRAMble -=-     version %s\n", PACKAGE_VERSION);
     fprintf(fp, "Author: James Bonfield, Wellcome Trust Sanger Institute. 2013-2015\n\n");
@@ -103,7 +142,10 @@ static void usage(FILE *fp) {
     fprintf(fp, "    -0 or -u       No compression.\n");
     //fprintf(fp, "    -v             Verbose output.\n");
     fprintf(fp, "    -H             [SAM] Do not print header\n");
-    fprintf(fp, "    -R range       [Cram] Specifies the refseq:start-end range\n");
+    fprintf(fp, "    -R range       [Cram] Specifies the refseq:start-end range.\n");
+    fprintf(fp, "                   May be given multiple times.\n");
+    fprintf(fp, "    -Q name        [Cram] Only output reads called 'name', using the\n");
+    fprintf(fp, "                   read name index (see cram_index -n)\n");
     fprintf(fp, "    -r ref.fa      [Cram] Specifies the reference file.\n");
     fprintf(fp, "    -b integer     [Cram] Max. bases per slice, default %d.\n",
 	    BASES_PER_SLICE);
@@ -114,6 +156,7 @@ static void usage(FILE *fp) {
     fprintf(fp, "    -V version     [Cram] Specify the file format version to write (eg 1.1, 2.0)\n");
     fprintf(fp, "    -e             [Cram] Embed reference sequence.\n");
     fprintf(fp, "    -x             [Cram] Non-reference based encoding.\n");
+    fprintf(fp, "    -E             [Cram] As -x, but encode against an embedded consensus.\n");
     fprintf(fp, "    -M             [Cram] Use multiple references per slice.\n");
     fprintf(fp, "    -m             [Cram] Generate MD and NM tags.\n");
 #ifdef HAVE_LIBBZ2
@@ -136,6 +179,12 @@ static void usage(FILE *fp) {
     fprintf(fp, "    -!             Disable all checking of checksums\n");
     fprintf(fp, "    -g FILE        Convert to Bam using index (file.gzi)\n");
     fprintf(fp, "    -G FILE        Output Bam index when bam input(file.gzi)\n");
+    fprintf(fp, "    -l FILE        [Cram] Load compression profile from FILE\n");
+    fprintf(fp, "    -L FILE        [Cram] Save compression profile to FILE\n");
+    fprintf(fp, "    -T N           [Cram] Compress with only the N most promising codecs\n");
+    fprintf(fp, "                   per trial, 0 for all.  Default 2.\n");
+    fprintf(fp, "    -i FILE        Write an index to FILE while encoding; .crai for\n");
+    fprintf(fp, "                   Cram, .bai or .csi (by suffix) for Bam\n");
 }
 
 int main(int argc, char **argv) {
@@ -146,9 +195,11 @@ int main(int argc, char **argv) {
     int c, verbose = 0;
     int s_opt = 0, S_opt = 0, embed_ref = 0, ignore_md5 = 0, decode_md = 0;
     char *ref_fn = NULL;
-    int start, end, multi_seq = -1, no_ref = 0;
+    int multi_seq = -1, no_ref = 0, embed_cons = 0;
     int use_bz2 = 0, use_bsc = 0, use_lzma = 0, use_fqz = 0;
-    char ref_name[1024] = {0};
+    char **ranges = NULL;
+    int nranges = 0;
+    char *read_name = NULL;
     refs_t *refs;
     int nthreads = 1;
     t_pool *p = NULL;
@@ -162,11 +213,14 @@ int main(int argc, char **argv) {
     int preserve_aux_order = 0;
     int preserve_aux_size = 0; 
     int add_pg = 1;   
+    char *profile_in = NULL, *profile_out = NULL;
+    char *idx_out = NULL;
+    int trial_candidates = -1;
 
     scram_init();
 
     /* Parse command line arguments */
-    while ((c = getopt(argc, argv, "u0123456789hvs:S:V:r:xXeI:O:R:!MmjJZt:BN:F:Hb:nPpqg:G:f")) != -1) {
+    while ((c = getopt(argc, argv, "u0123456789hvs:S:V:r:xXeI:O:R:!MmjJZt:T:BN:F:Hb:nPpqg:G:fl:L:Ei:Q:")) != -1) {
 	switch (c) {
 	case 'F':
 	    sam_fields = strtol(optarg, NULL, 0); // undocumented for testing
@@ -229,6 +283,11 @@ int main(int argc, char **argv) {
 	    no_ref = 1;
 	    break;
 
+	case 'E':
+	    no_ref = 1;
+	    embed_cons = 1;
+	    break;
+
 	case 'I':
 	    in_f = parse_format(optarg);
 	    break;
@@ -237,27 +296,15 @@ int main(int argc, char **argv) {
 	    out_f = parse_format(optarg);
 	    break;
 
-	case 'R': {
-	    char *cp = strchr(optarg, ':');
-	    if (cp) {
-		*cp = 0;
-		switch (sscanf(cp+1, "%d-%d", &start, &end)) {
-		case 1:
-		    end = start;
-		    break;
-		case 2:
-		    break;
-		default:
-		    fprintf(stderr, "Malformed range format\n");
-		    return 1;
-		}
-	    } else {
-		start = INT_MIN;
-		end   = INT_MAX;
-	    }
-	    strncpy(ref_name, optarg, 1023);
+	case 'Q':
+	    read_name = optarg;
+	    break;
+
+	case 'R':
+	    if (!(ranges = realloc(ranges, (nranges+1) * sizeof(*ranges))))
+		return 1;
+	    ranges[nranges++] = optarg;
 	    break;
-	}
 
 	case '!':
 	    ignore_md5 = 1;
@@ -343,6 +390,22 @@ int main(int argc, char **argv) {
 	    index_out_fn = optarg;
 	    break;
 
+	case 'l':
+	    profile_in = optarg;
+	    break;
+
+	case 'L':
+	    profile_out = optarg;
+	    break;
+
+	case 'i':
+	    idx_out = optarg;
+	    break;
+
+	case 'T':
+	    trial_candidates = atoi(optarg);
+	    break;
+
 	case '?':
 	    fprintf(stderr, "Unrecognised option: -%c\n", optopt);
 	    usage(stderr);
@@ -468,6 +531,10 @@ int main(int argc, char **argv) {
 	if (scram_set_option(out, CRAM_OPT_NO_REF, no_ref))
 	    return 1;
 
+    if (embed_cons)
+	if (scram_set_option(out, CRAM_OPT_EMBED_CONS, embed_cons))
+	    return 1;
+
     if (multi_seq)
 	if (scram_set_option(out, CRAM_OPT_MULTI_SEQ_PER_SLICE, multi_seq))
 	    return 1;
@@ -505,6 +572,22 @@ int main(int argc, char **argv) {
 	    return 1;
     }
 
+    if (profile_in)
+	if (scram_set_option(out, CRAM_OPT_LOAD_PROFILE, profile_in))
+	    return 1;
+
+    if (profile_out)
+	if (scram_set_option(out, CRAM_OPT_SAVE_PROFILE, profile_out))
+	    return 1;
+
+    if (idx_out)
+	if (scram_set_option(out, CRAM_OPT_WRITE_INDEX, idx_out))
+	    return 1;
+
+    if (trial_candidates >= 0)
+	if (scram_set_option(out, CRAM_OPT_TRIAL_CANDIDATES, trial_candidates))
+	    return 1;
+
     if (ignore_md5) {
 	if (scram_set_option(in, CRAM_OPT_IGNORE_MD5, ignore_md5))
 	    return 1;
@@ -564,9 +647,9 @@ int main(int argc, char **argv) {
 
 
     /* Support for sub-range queries, currently implemented for CRAM only */
-    if (*ref_name != 0) {
-	cram_range r;
-	int refid;
+    if (nranges) {
+	cram_range *r;
+	int i;
 
 	if (in->is_bam) {
 	    fprintf(stderr, "Currently the -R option is only implemented for CRAM indices\n");
@@ -575,16 +658,32 @@ int main(int argc, char **argv) {
 	    
 	cram_index_load(in->c, argv[optind]);
 
-	refid = sam_hdr_name2ref(in->c->header, ref_name);
+	if (!(r = malloc(nranges * sizeof(*r))))
+	    return 1;
+	for (i = 0; i < nranges; i++)
+	    if (parse_range(in->c->header, ranges[i], &r[i]))
+		return 1;
+
+	/* A single range uses the plain seek; several need the iterator */
+	if (nranges == 1
+	    ? scram_set_option(in, CRAM_OPT_RANGE, &r[0])
+	    : scram_set_option(in, CRAM_OPT_REGIONS, r, nranges))
+	    return 1;
+
+	free(r);
+	free(ranges);
+    }
 
-	if (refid == -1 && *ref_name != '*') {
-	    fprintf(stderr, "Unknown reference name '%s'\n", ref_name);
+    if (read_name) {
+	if (nranges) {
+	    fprintf(stderr, "The -Q and -R options are mutually exclusive\n");
+	    return 1;
+	}
+	if (optind >= argc) {
+	    fprintf(stderr, "The -Q option needs an input filename\n");
 	    return 1;
 	}
-	r.refid = refid;
-	r.start = start;
-	r.end = end;
-	if (scram_set_option(in, CRAM_OPT_RANGE, &r))
+	if (scram_name_query(in, argv[optind], read_name))
 	    return 1;
     }
 
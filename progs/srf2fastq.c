@@ -52,6 +52,7 @@
 #include <io_lib/ztr.h>
 #include <io_lib/srf.h>
 #include <io_lib/hash_table.h>
+#include <io_lib/thread_pool.h>
 
 #define MAX_REGIONS   40
 
@@ -550,12 +551,164 @@ void ztr2fastq(ztr_t *z, char *name, int calibrated, int sequential,
     free(chunks);
 }
 
+/* ------------------------------------------------------------------------ */
+/*
+ * Multi-threaded decoding.
+ *
+ * The main thread reads trace bodies, without decoding them, and gathers
+ * them into batches sharing a single trace header. Each batch is then
+ * decoded (ZTR parsing and uncompressing the chunks used here) by a worker
+ * thread with its own copy of the header, so no ZTR state is shared
+ * between threads. Results are collected in the order dispatched, and
+ * ztr2fastq is called on them from the main thread so the REGN hash and
+ * output files are only touched by one thread.
+ */
+#define BATCH_SIZE 256
+
+typedef struct {
+    unsigned char *hdr;		/* trace header blob */
+    uint32_t hdr_size;
+    ztr_t *hdr_ztr;		/* decoded hdr; owns data shared by ztr[] */
+    int ntraces;
+    char *name[BATCH_SIZE];
+    unsigned char *trace[BATCH_SIZE];
+    uint32_t trace_size[BATCH_SIZE];
+    ztr_t *ztr[BATCH_SIZE];
+} srf_batch;
+
+static srf_batch *batch_create(srf_t *srf) {
+    srf_batch *b = calloc(1, sizeof(*b));
+    if (!b)
+	return NULL;
+
+    if ((b->hdr_size = srf->th.trace_hdr_size)) {
+	if (NULL == (b->hdr = malloc(b->hdr_size))) {
+	    free(b);
+	    return NULL;
+	}
+	memcpy(b->hdr, srf->th.trace_hdr, b->hdr_size);
+    }
+
+    return b;
+}
+
+static void batch_destroy(srf_batch *b) {
+    int i;
+
+    for (i = 0; i < b->ntraces; i++) {
+	if (b->ztr[i])
+	    delete_ztr(b->ztr[i]);
+	free(b->name[i]);
+	if (b->trace[i])
+	    free(b->trace[i]);
+    }
+    if (b->hdr_ztr)
+	delete_ztr(b->hdr_ztr);
+    if (b->hdr)
+	free(b->hdr);
+    free(b);
+}
+
+/*
+ * Decodes and uncompresses all traces in a batch, mirroring
+ * srf_next_ztr. Runs in a worker thread.
+ */
+static void *batch_decode(void *arg) {
+    srf_batch *b = (srf_batch *)arg;
+    mFILE *mf;
+    long mf_pos = 0;
+    int i, j;
+
+    /* Decode ZTR chunks in the header, if complete */
+    if (NULL == (mf = mfcreate(NULL, 0)))
+	return NULL;
+    if (b->hdr_size)
+	mfwrite(b->hdr, 1, b->hdr_size, mf);
+    mrewind(mf);
+    if ((b->hdr_ztr = partial_decode_ztr(NULL, mf, NULL)))
+	mf_pos = mftell(mf);
+
+    for (i = 0; i < b->ntraces; i++) {
+	ztr_t *z;
+
+	mfseek(mf, b->hdr_size, SEEK_SET);
+	if (b->trace_size[i])
+	    mfwrite(b->trace[i], 1, b->trace_size[i], mf);
+	mftruncate(mf, mftell(mf));
+	mfseek(mf, mf_pos, SEEK_SET);
+
+	z = partial_decode_ztr(NULL, mf, b->hdr_ztr
+			       ? ztr_dup(b->hdr_ztr) : NULL);
+	if (!z)
+	    break;
+
+	/* Only the chunks ztr2fastq looks at; skip eg SMP4 */
+	for (j = 0; j < z->nchunks; j++) {
+	    switch (z->chunk[j].type) {
+	    case ZTR_TYPE_BASE:
+	    case ZTR_TYPE_CNF1:
+	    case ZTR_TYPE_CNF4:
+	    case ZTR_TYPE_REGN:
+		uncompress_chunk(z, &z->chunk[j]);
+	    }
+	}
+	b->ztr[i] = z;
+
+	free(b->trace[i]);
+	b->trace[i] = NULL;
+    }
+
+    mfdestroy(mf);
+    return b;
+}
+
+/*
+ * Outputs any finished batches, in order.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int batch_output(t_results_queue *q,
+			int calibrated, int sequential, int split, char *root,
+			int numeric, int append, int explicit,
+			HashTable *regn_hash, int *nfiles_open,
+			char **filenames, FILE **files, int *reverse) {
+    t_pool_result *r;
+    int ret = 0;
+
+    while ((r = t_pool_next_result(q))) {
+	srf_batch *b = (srf_batch *)r->data;
+	int i;
+
+	if (!b) {
+	    ret = -1;
+	} else {
+	    for (i = 0; i < b->ntraces && !ret; i++) {
+		if (!b->ztr[i]) {
+		    fprintf(stderr, "Failed to decode trace %s\n",
+			    b->name[i]);
+		    ret = -1;
+		    break;
+		}
+		ztr2fastq(b->ztr[i], b->name[i], calibrated, sequential,
+			  split, root, numeric, append, explicit, regn_hash,
+			  nfiles_open, filenames, files, reverse);
+	    }
+	    batch_destroy(b);
+	}
+	t_pool_delete_result(r, 0);
+    }
+
+    return ret;
+}
+
 /* ------------------------------------------------------------------------ */
 void usage(void) {
-    fprintf(stderr, "Usage: srf2fastq [-c] [-C] [-s root] [-n] [-p] archive_name ...\n");
+    fprintf(stderr, "Usage: srf2fastq [-c] [-C] [-s root] [-n] [-p] [-t nthreads] archive_name ...\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "       -c       Use calibrated quality values (CNF1)\n");
     fprintf(stderr, "       -C       Ignore bad reads\n");
+    fprintf(stderr, "       -t N     Decode traces using N threads\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "       -s root  Split the fastq files, one for each region in the REGN chunk.\n");
     fprintf(stderr, "                The files are named root_ + the name of the region.\n");
@@ -587,6 +740,9 @@ int main(int argc, char **argv) {
     char *filenames[MAX_REGIONS];
     FILE *files[MAX_REGIONS];
     int reverse[MAX_REGIONS], reverse_set = 0;
+    int nthreads = 1;
+    t_pool *pool = NULL;
+    t_results_queue *rqueue = NULL;
 
     memset(reverse, 0, MAX_REGIONS * sizeof(int));
 
@@ -609,6 +765,11 @@ int main(int argc, char **argv) {
             append = 1;
 	} else if (!strcmp(argv[i], "-e")) {
             explicit = 1;
+	} else if (!strcmp(argv[i], "-t")) {
+	    if (++i == argc)
+		usage();
+	    if ((nthreads = atoi(argv[i])) < 1)
+		usage();
         } else if (!strcmp(argv[i], "-r")) {
 	    char *cp, *cpend;
 
@@ -652,6 +813,14 @@ int main(int argc, char **argv) {
     _setmode(_fileno(stdout), _O_BINARY);
 #endif
 
+    if (nthreads > 1) {
+	if (!(pool = t_pool_init(nthreads*2, nthreads)) ||
+	    !(rqueue = t_results_queue_init())) {
+	    fprintf(stderr, "Failed to create thread pool\n");
+	    return 1;
+	}
+    }
+
     for (; i < argc; i++) {
 	char *ar_name;
 	srf_t *srf;
@@ -670,15 +839,66 @@ int main(int argc, char **argv) {
 	    return 1;
         }
     
-	while (NULL != (ztr = srf_next_ztr(srf, name, mask))) {
-            ztr2fastq(ztr, name, calibrated, sequential, split, root, numeric,
-		      append, explicit, regn_hash, &nfiles_open, filenames,
-		      files, reverse);
-	    delete_ztr(ztr);
+	if (pool) {
+	    srf_trace_body_t tb;
+	    srf_batch *b = NULL;
+	    int new_hdr, ret = 0;
+
+	    while (!ret && 0 == srf_next_trace_body(srf, &tb, mask,
+						    &new_hdr)) {
+		if (b && (new_hdr || b->ntraces == BATCH_SIZE)) {
+		    if (t_pool_dispatch(pool, rqueue, batch_decode, b) < 0)
+			return 1;
+		    b = NULL;
+		    ret = batch_output(rqueue, calibrated, sequential, split,
+				       root, numeric, append, explicit,
+				       regn_hash, &nfiles_open, filenames,
+				       files, reverse);
+		}
+		if (!b && !(b = batch_create(srf)))
+		    return 1;
+
+		if (-1 == construct_trace_name(srf->th.id_prefix,
+					       (unsigned char *)tb.read_id,
+					       tb.read_id_length,
+					       name, 512) ||
+		    !(b->name[b->ntraces] = strdup(name))) {
+		    if (tb.trace)
+			free(tb.trace);
+		    break;
+		}
+		b->trace[b->ntraces] = tb.trace;
+		b->trace_size[b->ntraces] = tb.trace_size;
+		b->ntraces++;
+	    }
+
+	    if (b) {
+		if (t_pool_dispatch(pool, rqueue, batch_decode, b) < 0)
+		    return 1;
+	    }
+	    t_pool_flush(pool);
+	    ret |= batch_output(rqueue, calibrated, sequential, split,
+				root, numeric, append, explicit,
+				regn_hash, &nfiles_open, filenames,
+				files, reverse);
+	    if (ret)
+		return 1;
+	} else {
+	    while (NULL != (ztr = srf_next_ztr(srf, name, mask))) {
+		ztr2fastq(ztr, name, calibrated, sequential, split, root,
+			  numeric, append, explicit, regn_hash, &nfiles_open,
+			  filenames, files, reverse);
+		delete_ztr(ztr);
+	    }
 	}
 
 	srf_destroy(srf, 1);
     }
 
+    if (pool) {
+	t_results_queue_destroy(rqueue);
+	t_pool_destroy(pool, 0);
+    }
+
     return 0;
 }
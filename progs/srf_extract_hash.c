@@ -150,9 +150,6 @@ int main(int argc, char **argv) {
     }
     srf = srf_create(fp);
 
-    /* the trace */
-    trace = argv[i];
-
     if( fastq ){
         read_sections(READ_BASES);
         init_qlookup();
@@ -162,34 +159,48 @@ int main(int argc, char **argv) {
 #endif
     }
 
-    /* Search index */
-    switch (srf_find_trace(srf, trace, &cpos, &hpos, &dpos)) {
-    case -1:
+    /* Multiple lookups; load the index once rather than seeking through it */
+    if (argc - i > 1 && 0 != srf_load_index(srf)) {
         fprintf(stderr, "Malformed or missing index hash. "
                 "Consider running srf_index_hash\n");
         return 1;
+    }
 
-    case -2:
-        fprintf(stderr, "%s: not found\n", trace);
-        break;
-
-    default:
-        /* The srf object holds the latest data and trace header blocks */
-        if( fastq ){
-            mFILE *mf = mfcreate(NULL, 0);
-            mfwrite(srf->th.trace_hdr, 1, srf->th.trace_hdr_size, mf);
-            mfwrite(srf->tb.trace,     1, srf->tb.trace_size,     mf);
-            mfseek(mf, 0, SEEK_SET);
-            ztr_t *ztr = partial_decode_ztr(srf, mf, NULL);
-            ztr2fastq(ztr, trace, calibrated);
-            delete_ztr(ztr);
-            mfdestroy(mf);
-        } else {
-            fwrite(srf->th.trace_hdr, 1, srf->th.trace_hdr_size, stdout);
-            fwrite(srf->tb.trace,     1, srf->tb.trace_size,     stdout);
+    for (; i < argc; i++) {
+        /* the trace */
+        trace = argv[i];
+
+        /* Search index */
+        switch (srf_find_trace(srf, trace, &cpos, &hpos, &dpos)) {
+        case -1:
+            fprintf(stderr, "Malformed or missing index hash. "
+                    "Consider running srf_index_hash\n");
+            return 1;
+
+        case -2:
+            fprintf(stderr, "%s: not found\n", trace);
+            break;
+
+        default:
+            /* The srf object holds the latest data and trace header blocks */
+            if( fastq ){
+                mFILE *mf = mfcreate(NULL, 0);
+                mfwrite(srf->th.trace_hdr, 1, srf->th.trace_hdr_size, mf);
+                mfwrite(srf->tb.trace,     1, srf->tb.trace_size,     mf);
+                mfseek(mf, 0, SEEK_SET);
+                ztr_t *ztr = partial_decode_ztr(srf, mf, NULL);
+                ztr2fastq(ztr, trace, calibrated);
+                delete_ztr(ztr);
+                mfdestroy(mf);
+            } else {
+                fwrite(srf->th.trace_hdr, 1, srf->th.trace_hdr_size, stdout);
+                fwrite(srf->tb.trace,     1, srf->tb.trace_size,     stdout);
+            }
+            break;
         }
-        break;
     }
+
+    srf_destroy(srf, 1);
 	
     return 0;
 }